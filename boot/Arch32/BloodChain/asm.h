@@ -26,6 +26,7 @@
 .equ BCBP_SECURE_BOOT_OFFSET, 72
 .equ BCBP_TPM_AVAILABLE_OFFSET, 73
 .equ BCBP_UEFI_64BIT_OFFSET, 74
+.equ BCBP_MODULE_INDEX_OFFSET, 144  // Version 1.1 headers and later
 
 // Module type constants
 .equ BCBP_MODTYPE_KERNEL, 0x01
@@ -36,6 +37,8 @@
 .equ BCBP_MODTYPE_EFI, 0x06
 .equ BCBP_MODTYPE_CONFIG, 0x07
 .equ BCBP_MODTYPE_DRIVER, 0x08
+.equ BCBP_MODTYPE_NETSTATS, 0x09
+.equ BCBP_MODTYPE_TCGLOG, 0x0A
 
 // Magic number for BCBP header
 .equ BCBP_MAGIC, 0x424C4348  // 'BLCH'
@@ -7,30 +7,69 @@
 
 #include "bloodchain.h"
 #include <string.h>
+#include <stddef.h>
 
-// Internal function to calculate required memory for modules and strings
-static size_t calculate_required_memory(const struct bcbp_header *hdr) {
-    if (!hdr || hdr->magic != BCBP_MAGIC) return 0;
-    
-    size_t total = sizeof(struct bcbp_header);
-    total += hdr->module_count * sizeof(struct bcbp_module);
-    
-    // Add space for module names and command lines
-    const struct bcbp_module *mod = (const struct bcbp_module *)hdr->modules;
+// Copy str to the arena cursor; returns its address, or NULL if it does not fit
+static const char *bcbp_string(struct bcbp_builder *b, const char *str, size_t max) {
+    size_t len = strnlen(str, max);
+    if (len == max || len + 1 > (size_t)(b->limit - b->cursor)) return NULL;
+    char *copy = b->cursor;
+    memcpy(copy, str, len + 1);
+    b->cursor += len + 1;
+    return copy;
+}
+
+// Version 1.0 headers end before module_index
+static uint64_t bcbp_header_size(const struct bcbp_header *hdr) {
+    if (hdr->version < BCBP_VERSION_MODULE_INDEX) return offsetof(struct bcbp_header, module_index);
+    return sizeof(struct bcbp_header);
+}
+
+// Module types a header of this version may carry
+static uint8_t bcbp_max_modtype(const struct bcbp_header *hdr) {
+    if (hdr->version < BCBP_VERSION_MODTYPES_EXT) return BCBP_MODTYPE_DRIVER;
+    return BCBP_MODTYPE_TCGLOG;
+}
+
+static const struct bcbp_module_index *bcbp_index(const struct bcbp_header *hdr) {
+    if (hdr->version < BCBP_VERSION_MODULE_INDEX || !hdr->module_index) return NULL;
+    return (const struct bcbp_module_index *)(uintptr_t)hdr->module_index;
+}
+
+// Twice as many slots as modules keeps probe runs short
+static void bcbp_build_index(struct bcbp_builder *b) {
+    struct bcbp_header *hdr = b->hdr;
+    const struct bcbp_module *mods = (const struct bcbp_module *)(uintptr_t)hdr->modules;
+    hdr->module_index = 0;
+    if (hdr->module_count == 0) return;
+
+    uint32_t slot_count = 2;
+    while (slot_count < 2 * hdr->module_count) slot_count <<= 1;
+    char *at = (char *)(((uintptr_t)b->cursor + 7) & ~(uintptr_t)7);
+    size_t size = sizeof(struct bcbp_module_index) + slot_count * sizeof(struct bcbp_index_slot);
+    if (at > b->limit || size > (size_t)(b->limit - at)) return;     // The index is optional
+
+    struct bcbp_module_index *index = (struct bcbp_module_index *)at;
+    memset(index, 0, size);
+    index->slot_count = slot_count;
     for (uint64_t i = 0; i < hdr->module_count; i++) {
-        if (mod[i].name) {
-            total += strlen((const char *)mod[i].name) + 1;
-        }
-        if (mod[i].cmdline) {
-            total += strlen((const char *)mod[i].cmdline) + 1;
-        }
+        if (!mods[i].name) continue;
+        uint32_t hash = bcbp_hash((const char *)(uintptr_t)mods[i].name);
+        uint32_t slot = hash & (slot_count - 1);
+        while (index->slots[slot].module) slot = (slot + 1) & (slot_count - 1);
+        index->slots[slot].hash = hash;
+        index->slots[slot].module = (uint32_t)i + 1;
     }
-    
-    return total;
+    b->cursor = at + size;
+    hdr->module_index = (uint64_t)(uintptr_t)index;
 }
 
-void bcbp_init(struct bcbp_header *hdr, uint64_t entry_point, uint64_t boot_device) {
-    if (!hdr) return;
+int bcbp_init(struct bcbp_builder *b, void *buffer, size_t size, uint64_t max_modules,
+              uint64_t entry_point, uint64_t boot_device) {
+    if (!b || !buffer || max_modules > BCBP_MAX_MODULES) return -1;
+    if (size < sizeof(struct bcbp_header) + max_modules * sizeof(struct bcbp_module)) return -1;
+    
+    struct bcbp_header *hdr = (struct bcbp_header *)buffer;
     
     // Clear the entire header
     memset(hdr, 0, sizeof(struct bcbp_header));
@@ -43,65 +82,68 @@ void bcbp_init(struct bcbp_header *hdr, uint64_t entry_point, uint64_t boot_devi
     hdr->entry_point = entry_point;
     hdr->boot_device = boot_device;
     
-    // Initialize module list (starts right after the header)
-    hdr->modules = (uint64_t)(hdr + 1);
+    // Module table starts right after the header, strings after its slots
+    hdr->modules = (uint64_t)(uintptr_t)(hdr + 1);
     hdr->module_count = 0;
     
-    // Initialize security features (to be set by bootloader)
-    hdr->secure_boot = 0;
-    hdr->tpm_available = 0;
-    hdr->uefi_64bit = 0;
+    b->hdr = hdr;
+    b->capacity = max_modules;
+    b->strings = (char *)((struct bcbp_module *)(hdr + 1) + max_modules);
+    b->cursor = b->strings;
+    b->limit = (char *)buffer + size;
+    return 0;
 }
 
-void bcbp_add_module(struct bcbp_header *hdr, uint64_t start, uint64_t size,
+int bcbp_add_module(struct bcbp_builder *b, uint64_t start, uint64_t size,
                     const char *name, uint8_t type, const char *cmdline) {
-    if (!hdr || hdr->magic != BCBP_MAGIC || !name || size == 0) return;
-    
-    // Get module array
-    struct bcbp_module *mods = (struct bcbp_module *)hdr->modules;
+    if (!b || !b->hdr || !name || size == 0) return -1;
+    struct bcbp_header *hdr = b->hdr;
+    if (hdr->module_count >= b->capacity) return -1;
     
-    // Calculate where the string data starts (after all module structures)
-    char *str_ptr = (char *)(mods + hdr->module_count + 1);
-    
-    // Find the end of the current string data
-    for (uint64_t i = 0; i < hdr->module_count; i++) {
-        if (mods[i].name) {
-            const char *name_str = (const char *)mods[i].name;
-            size_t len = strlen(name_str) + 1;
-            if ((char *)name_str + len > str_ptr) {
-                str_ptr = (char *)name_str + len;
-            }
-        }
-        if (mods[i].cmdline) {
-            const char *cmd_str = (const char *)mods[i].cmdline;
-            size_t len = strlen(cmd_str) + 1;
-            if ((char *)cmd_str + len > str_ptr) {
-                str_ptr = (char *)cmd_str + len;
-            }
-        }
+    // Strings are copied first so a module that does not fit leaves no trace
+    char *mark = b->cursor;
+    const char *name_copy = bcbp_string(b, name, BCBP_MAX_NAME);
+    const char *cmdline_copy = NULL;
+    if (name_copy && cmdline && *cmdline) {
+        cmdline_copy = bcbp_string(b, cmdline, BCBP_MAX_CMDLINE);
+        if (!cmdline_copy) name_copy = NULL;
+    }
+    if (!name_copy) {
+        b->cursor = mark;
+        return -1;
     }
     
-    // Add new module
-    struct bcbp_module *mod = &mods[hdr->module_count++];
-    
-    // Set module fields
+    struct bcbp_module *mod = (struct bcbp_module *)(uintptr_t)hdr->modules + hdr->module_count++;
+    memset(mod, 0, sizeof(*mod));
     mod->start = start;
     mod->size = size;
     mod->type = type;
+    mod->name = (uint64_t)(uintptr_t)name_copy;
+    mod->cmdline = (uint64_t)(uintptr_t)cmdline_copy;
+    return 0;
+}
+
+struct bcbp_header *bcbp_finish(struct bcbp_builder *b) {
+    if (!b || !b->hdr) return NULL;
+    struct bcbp_header *hdr = b->hdr;
+    struct bcbp_module *mods = (struct bcbp_module *)(uintptr_t)hdr->modules;
+    char *packed = (char *)(mods + hdr->module_count);
     
-    // Store name
-    mod->name = (uint64_t)str_ptr;
-    strcpy(str_ptr, name);
-    str_ptr += strlen(name) + 1;
-    
-    // Store command line if provided
-    if (cmdline && *cmdline) {
-        mod->cmdline = (uint64_t)str_ptr;
-        strcpy(str_ptr, cmdline);
-        str_ptr += strlen(cmdline) + 1;
-    } else {
-        mod->cmdline = 0;
+    // Close the gap left by unused slots, so the strings follow the table
+    // as the kernel expects
+    if (packed != b->strings) {
+        uint64_t shift = (uint64_t)(b->strings - packed);
+        memmove(packed, b->strings, (size_t)(b->cursor - b->strings));
+        for (uint64_t i = 0; i < hdr->module_count; i++) {
+            mods[i].name -= shift;
+            if (mods[i].cmdline) mods[i].cmdline -= shift;
+        }
+        b->cursor -= shift;
+        b->strings = packed;
+        b->capacity = hdr->module_count;
     }
+    bcbp_build_index(b);
+    return hdr;
 }
 
 struct bcbp_module *bcbp_find_module(struct bcbp_header *hdr, const char *name) {
@@ -109,6 +151,22 @@ struct bcbp_module *bcbp_find_module(struct bcbp_header *hdr, const char *name)
     
     struct bcbp_module *mod = (struct bcbp_module *)hdr->modules;
     
+    const struct bcbp_module_index *index = bcbp_index(hdr);
+    if (index) {
+        uint32_t hash = bcbp_hash(name);
+        uint32_t mask = index->slot_count - 1;
+        for (uint32_t n = 0, slot = hash & mask; n < index->slot_count; n++, slot = (slot + 1) & mask) {
+            const struct bcbp_index_slot *s = &index->slots[slot];
+            if (!s->module) return NULL;
+            if (s->hash == hash && s->module <= hdr->module_count &&
+                strcmp((const char *)mod[s->module - 1].name, name) == 0) {
+                return &mod[s->module - 1];
+            }
+        }
+        return NULL;
+    }
+    
+    // Older producers have no index
     for (uint64_t i = 0; i < hdr->module_count; i++) {
         if (mod[i].name && strcmp((const char *)mod[i].name, name) == 0) {
             return &mod[i];
@@ -131,44 +189,88 @@ int bcbp_validate(const struct bcbp_header *hdr) {
     }
     
     // Check for reasonable module count
-    if (hdr->module_count > 1024) return -4;
+    if (hdr->module_count > BCBP_MAX_MODULES) return -4;
     
-    // If we have modules, verify the modules pointer is valid
+    // Modules must start after the header. Strings must lie after the
+    // table and, taken together, span no more than their own lengths, which
+    // is checked once at the end so the modules are walked a single time.
     if (hdr->module_count > 0) {
-        // Modules must start after the header
-        if (hdr->modules <= (uint64_t)hdr || 
-            hdr->modules >= (uint64_t)hdr + calculate_required_memory(hdr)) {
+        if (hdr->modules < (uint64_t)(uintptr_t)hdr + bcbp_header_size(hdr)) {
             return -5; // Invalid modules pointer
         }
         
-        // Verify each module
-        const struct bcbp_module *mod = (const struct bcbp_module *)hdr->modules;
+        const struct bcbp_module *mod = (const struct bcbp_module *)(uintptr_t)hdr->modules;
+        uint64_t strings = hdr->modules + hdr->module_count * sizeof(struct bcbp_module);
+        uint64_t strings_end = strings;
+        uint64_t string_bytes = 0;
+        uint64_t named = 0;
+        uint8_t max_type = bcbp_max_modtype(hdr);
         for (uint64_t i = 0; i < hdr->module_count; i++) {
             // Check module type is valid
-            if (mod[i].type < BCBP_MODTYPE_KERNEL || mod[i].type > BCBP_MODTYPE_DRIVER) {
+            if (mod[i].type < BCBP_MODTYPE_KERNEL || mod[i].type > max_type) {
                 return -6; // Invalid module type
             }
             
             // Check name pointer is valid
             if (mod[i].name) {
-                if (mod[i].name < (uint64_t)hdr || 
-                    mod[i].name >= (uint64_t)hdr + calculate_required_memory(hdr)) {
+                if (mod[i].name < strings) {
                     return -7; // Invalid name pointer
                 }
-                if (strnlen((const char *)mod[i].name, 256) == 256) {
+                size_t len = strnlen((const char *)(uintptr_t)mod[i].name, BCBP_MAX_NAME);
+                if (len == BCBP_MAX_NAME) {
                     return -8; // Name too long or not null-terminated
                 }
+                string_bytes += len + 1;
+                named++;
+                if (mod[i].name + len + 1 > strings_end) strings_end = mod[i].name + len + 1;
             }
             
             // Check command line pointer if present
             if (mod[i].cmdline) {
-                if (mod[i].cmdline < (uint64_t)hdr || 
-                    mod[i].cmdline >= (uint64_t)hdr + calculate_required_memory(hdr)) {
+                if (mod[i].cmdline < strings) {
                     return -9; // Invalid command line pointer
                 }
-                if (strnlen((const char *)mod[i].cmdline, 4096) == 4096) {
+                size_t len = strnlen((const char *)(uintptr_t)mod[i].cmdline, BCBP_MAX_CMDLINE);
+                if (len == BCBP_MAX_CMDLINE) {
                     return -10; // Command line too long or not null-terminated
                 }
+                string_bytes += len + 1;
+                if (mod[i].cmdline + len + 1 > strings_end) strings_end = mod[i].cmdline + len + 1;
+            }
+        }
+        
+        if (strings_end - strings > string_bytes) {
+            return -7; // A string lies past the end of the structure
+        }
+        
+        // The index follows the strings and must lead every named module
+        // to itself: together with the slot count matching, that makes it
+        // exactly one slot per module
+        const struct bcbp_module_index *index = bcbp_index(hdr);
+        if (index) {
+            uint32_t slot_count = index->slot_count;
+            if (hdr->module_index < strings_end || slot_count <= hdr->module_count ||
+                slot_count > 4 * BCBP_MAX_MODULES || (slot_count & (slot_count - 1))) {
+                return -11; // Invalid module index
+            }
+            uint64_t used = 0;
+            for (uint32_t slot = 0; slot < slot_count; slot++) {
+                if (index->slots[slot].module) used++;
+            }
+            if (used != named) return -11;
+            
+            for (uint64_t i = 0; i < hdr->module_count; i++) {
+                if (!mod[i].name) continue;
+                uint32_t hash = bcbp_hash((const char *)(uintptr_t)mod[i].name);
+                uint32_t slot = hash & (slot_count - 1);
+                uint32_t n = 0;
+                while (n < slot_count && index->slots[slot].module && index->slots[slot].module != i + 1) {
+                    slot = (slot + 1) & (slot_count - 1);
+                    n++;
+                }
+                if (n == slot_count || index->slots[slot].module != i + 1 || index->slots[slot].hash != hash) {
+                    return -11; // Module missing from the index
+                }
             }
         }
     }
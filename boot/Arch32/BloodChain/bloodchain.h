@@ -5,23 +5,133 @@
  * See the root of the repository for license details.
  */
 
-void bcbp_init(struct bcbp_header *hdr, uint64_t entry_point, uint64_t boot_device);
+#ifndef BLOODCHAIN_H
+#define BLOODCHAIN_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Boot information handed to the kernel in RDI. The module table follows
+// the header, and the module names and command lines follow the table.
+// Version 1.1 (BCBP_VERSION_MODULE_INDEX) adds module_index; 1.0 headers end
+// at signature.
+struct bcbp_header {
+    uint32_t magic;          // BCBP_MAGIC
+    uint32_t version;        // BCBP_VERSION
+    uint64_t entry_point;
+    uint64_t flags;
+    uint64_t boot_device;
+    uint64_t acpi_rsdp;      // 0 if not available
+    uint64_t smbios;         // 0 if not available
+    uint64_t framebuffer;    // 0 if not available
+    uint64_t module_count;
+    uint64_t modules;        // Physical address of the module table
+    uint8_t  secure_boot;
+    uint8_t  tpm_available;
+    uint8_t  uefi_64bit;
+    uint8_t  reserved[5];
+    uint8_t  signature[64];
+    uint64_t module_index;   // struct bcbp_module_index after the strings, or 0 (1.1+)
+} __attribute__((packed));
+
+struct bcbp_module {
+    uint64_t start;
+    uint64_t size;
+    uint64_t cmdline;        // 0 if none
+    uint64_t name;
+    uint8_t  type;           // BCBP_MODTYPE_*
+    uint8_t  reserved[7];
+} __attribute__((packed));
+
+// Open-addressed table of module names for lookups without a scan. Slots
+// are probed linearly from hash & (slot_count - 1); an empty slot ends the
+// probe. Modules with the same name keep their table order.
+struct bcbp_index_slot {
+    uint32_t hash;           // bcbp_hash() of the module's name
+    uint32_t module;         // Index into the module table plus one; 0 if empty
+} __attribute__((packed));
+
+struct bcbp_module_index {
+    uint32_t slot_count;     // Power of two, more than module_count
+    uint32_t reserved;
+    struct bcbp_index_slot slots[];
+} __attribute__((packed));
+
+#define BCBP_MODTYPE_KERNEL     0x01
+#define BCBP_MODTYPE_INITRD     0x02
+#define BCBP_MODTYPE_ACPI       0x03
+#define BCBP_MODTYPE_SMBIOS     0x04
+#define BCBP_MODTYPE_DEVICETREE 0x05
+#define BCBP_MODTYPE_EFI        0x06
+#define BCBP_MODTYPE_CONFIG     0x07
+#define BCBP_MODTYPE_DRIVER     0x08
+#define BCBP_MODTYPE_NETSTATS   0x09    // Network boot statistics (struct net_stats), 1.2+
+#define BCBP_MODTYPE_TCGLOG     0x0A    // TCG crypto-agile event log, 1.2+
+
+#define BCBP_MAX_MODULES        1024
+#define BCBP_MAX_NAME           256     // Name length limit, terminator included
+#define BCBP_MAX_CMDLINE        4096
+
+// Bootloader Interface
 
 /**
- * Add a module to the BCBP structure
+ * Builds a BCBP structure in one buffer: the header, then a module table
+ * with a fixed number of slots, then a string arena filled from a cursor,
+ * so adding a module never rescans the ones already added.
+ */
+struct bcbp_builder {
+    struct bcbp_header *hdr;
+    uint64_t capacity;       // Module slots reserved after the header
+    char *strings;           // Start of the string arena
+    char *cursor;            // Next free byte in it
+    char *limit;             // End of the buffer
+};
+
+/**
+ * Initialize a BCBP structure in a buffer
  * 
- * @param hdr      Pointer to the BCBP header
+ * @param b            Builder to set up
+ * @param buffer       Memory for the whole structure, 8-byte aligned
+ * @param size         Size of buffer in bytes
+ * @param max_modules  Module slots to reserve (at most BCBP_MAX_MODULES)
+ * @param entry_point  Kernel entry point
+ * @param boot_device  Boot device identifier
+ * @return             0 on success, -1 if the slots do not fit in buffer
+ */
+int bcbp_init(struct bcbp_builder *b, void *buffer, size_t size, uint64_t max_modules,
+              uint64_t entry_point, uint64_t boot_device);
+
+/**
+ * Add a module to the BCBP structure in constant time
+ * 
+ * @param b        Builder from bcbp_init()
  * @param start    Physical start address of the module
  * @param size     Size of the module in bytes
  * @param name     Name of the module (will be copied)
  * @param type     Module type (BCBP_MODTYPE_*)
  * @param cmdline  Command line string for the module (optional, can be NULL)
+ * @return         0 on success, -1 if the slots or the string arena are full
  */
-void bcbp_add_module(struct bcbp_header *hdr, uint64_t start, uint64_t size,
+int bcbp_add_module(struct bcbp_builder *b, uint64_t start, uint64_t size,
                     const char *name, uint8_t type, const char *cmdline);
 
 /**
- * Find a module by name
+ * Close the structure for handoff: unused module slots are dropped by
+ * moving the string arena down to the end of the table, and the module
+ * index is built after the strings if the buffer has room for it.
+ * 
+ * @param b  Builder from bcbp_init()
+ * @return   Pointer to the finished header
+ */
+struct bcbp_header *bcbp_finish(struct bcbp_builder *b);
+
+/**
+ * Find a module by name, through the module index when the producer built
+ * one and by scanning the table otherwise
  * 
  * @param hdr   Pointer to the BCBP header
  * @param name  Name of the module to find
@@ -30,7 +140,8 @@ void bcbp_add_module(struct bcbp_header *hdr, uint64_t start, uint64_t size,
 struct bcbp_module *bcbp_find_module(struct bcbp_header *hdr, const char *name);
 
 /**
- * Validate the BCBP structure
+ * Validate the BCBP structure, as bcbp_finish() leaves it, in one pass
+ * over the modules
  * 
  * @param hdr  Pointer to the BCBP header
  * @return     0 if valid, negative error code otherwise
@@ -70,6 +181,18 @@ void bcbp_set_framebuffer(struct bcbp_header *hdr, uint64_t framebuffer);
 extern "C" {
 #endif
 
+/**
+ * FNV-1a hash of a module name, as stored in the module index
+ */
+static inline uint32_t bcbp_hash(const char *name) {
+    uint32_t hash = 0x811C9DC5;
+    while (*name) {
+        hash ^= (uint8_t)*name++;
+        hash *= 0x01000193;
+    }
+    return hash;
+}
+
 /**
  * Get the boot information structure
  * 
@@ -99,7 +222,9 @@ static inline struct bcbp_module *bcbp_get_module(struct bcbp_header *hdr, uint6
 
 // Constants for bootloader use
 #define BCBP_MAGIC     0x424C4348  // "BLCH"
-#define BCBP_VERSION   0x00010000  // 1.0
+#define BCBP_VERSION   0x00010002  // 1.2
+#define BCBP_VERSION_MODULE_INDEX 0x00010001  // First minor version with module_index
+#define BCBP_VERSION_MODTYPES_EXT 0x00010002  // First minor version with NETSTATS and TCGLOG modules
 #define BCBP_HEADER_SIZE  sizeof(struct bcbp_header)
 #define BCBP_MODULE_SIZE  sizeof(struct bcbp_module)
 
@@ -8,10 +8,16 @@
 #include <stdint.h>
 #include "compat.h"
 #include <string.h>
+#include <stdlib.h>
 #include "aarch64.h"
+#include "placement.h"
+#include "compress/load.h"
 
 extern void* allocate_memory(uint32_t size);
-extern int load_file(const char* path, uint8_t** data, uint32_t* size);
+extern int tpm2_flush_measurements(void);
+
+#define AARCH64_KERNEL_ALIGN 0x200000    // Image base, text_offset below the entry
+#define AARCH64_DTB_SIZE     0x200000    // Largest FDT the kernel maps
 
 struct aarch64_boot_params {
     uint64_t dtb_addr;
@@ -53,91 +59,147 @@ int aarch64_load_kernel(const char* kernel_path, const char* initrd_path, const
     uint8_t* kernel_data = NULL;
     uint64_t kernel_size = 0;
     
-    if (load_file(kernel_path, &kernel_data, (uint32_t*)&kernel_size) != 0) {
+    if (decomp_load_file(kernel_path, &kernel_data, (uint32_t*)&kernel_size, NULL) != 0) {
         return -1;
     }
     
     struct aarch64_linux_header* header = (struct aarch64_linux_header*)kernel_data;
     
+    int r = -1;
     if (header->magic == 0x644d5241) {
-        return aarch64_boot_linux(kernel_data, kernel_size, initrd_path, cmdline);
+        r = aarch64_boot_linux(kernel_data, kernel_size, initrd_path, cmdline);
     }
     
-    return -1;
+    free(kernel_data);
+    return r;
+}
+
+// Kernel image, DTB space, and the parameter block with the command line
+// behind it, each wherever the memory map has room
+struct aarch64_placement {
+    uint8_t* kernel_base;
+    uint64_t kernel_span;
+    uint8_t* dtb;
+    struct aarch64_boot_params* params;
+    uint64_t params_size;
+};
+
+static void aarch64_release(struct aarch64_placement* p) {
+    if (p->kernel_base) place_free(p->kernel_base, p->kernel_span);
+    if (p->dtb) place_free(p->dtb, AARCH64_DTB_SIZE);
+    if (p->params) place_free(p->params, p->params_size);
+}
+
+static int aarch64_place(struct aarch64_placement* p, uint64_t text_offset, uint64_t image_size, uint64_t cmdline_size) {
+    memset(p, 0, sizeof(*p));
+    struct place_request kernel_req = { text_offset + image_size, AARCH64_KERNEL_ALIGN, 0, 0, PLACE_FIRST_FIT };
+    struct place_request dtb_req = { AARCH64_DTB_SIZE, PLACE_PAGE_SIZE, 0, 0, PLACE_FIRST_FIT };
+    p->kernel_span = kernel_req.size;
+    p->params_size = sizeof(struct aarch64_boot_params) + cmdline_size;
+    p->kernel_base = (uint8_t*)place_alloc(&kernel_req);
+    p->dtb = (uint8_t*)place_alloc(&dtb_req);
+    p->params = (struct aarch64_boot_params*)place_below(~0ULL, p->params_size, 8);
+    if (!p->kernel_base || !p->dtb || !p->params) {
+        aarch64_release(p);
+        return -1;
+    }
+    memset(p->params, 0, sizeof(struct aarch64_boot_params));
+    return 0;
+}
+
+struct aarch64_initrd {
+    uint8_t* data;
+    uint64_t size;              // Bytes placed
+};
+
+static uint8_t* aarch64_place_initrd(void* ctx, uint32_t size) {
+    struct aarch64_initrd* initrd = (struct aarch64_initrd*)ctx;
+    struct place_request req = { size ? size : 1, PLACE_PAGE_SIZE, 0, 0, PLACE_BEST_FIT };
+    initrd->data = (uint8_t*)place_alloc(&req);
+    initrd->size = req.size;
+    return initrd->data;
+}
+
+static void aarch64_fill_params(struct aarch64_boot_params* params, uint64_t dtb_addr, uint64_t kernel_addr,
+                                uint64_t kernel_size, const char* cmdline, uint64_t cmdline_size) {
+    params->dtb_addr = dtb_addr;
+    params->kernel_addr = kernel_addr;
+    params->kernel_size = kernel_size;
+    if (cmdline_size) {
+        char* line = (char*)(params + 1);
+        memcpy(line, cmdline, cmdline_size);
+        params->cmdline_addr = (uint64_t)(uintptr_t)line;
+        params->cmdline_size = cmdline_size;
+    }
+    uint64_t mem_end;
+    place_ram_bounds(&params->mem_start, &mem_end);
+    params->mem_size = mem_end - params->mem_start;
 }
 
 int aarch64_boot_linux(uint8_t* kernel_data, uint64_t kernel_size, const char* initrd_path, const char* cmdline) {
     struct aarch64_linux_header* header = (struct aarch64_linux_header*)kernel_data;
+    uint64_t image_size = header->image_size > kernel_size ? header->image_size : kernel_size;
+    uint64_t cmdline_size = cmdline && strlen(cmdline) > 0 ? strlen(cmdline) + 1 : 0;
     
-    uint64_t kernel_load_addr = 0x40000000;
-    uint64_t dtb_addr = 0x40000000 + kernel_size;
-    uint64_t initrd_addr = 0;
-    uint64_t initrd_size = 0;
+    struct aarch64_placement place;
+    if (aarch64_place(&place, header->text_offset, image_size, cmdline_size) != 0) {
+        return -1;
+    }
+    uint64_t kernel_load_addr = (uint64_t)(uintptr_t)place.kernel_base + header->text_offset;
+    uint64_t dtb_addr = (uint64_t)(uintptr_t)place.dtb;
     
+    struct aarch64_boot_params* params = place.params;
+    aarch64_fill_params(params, dtb_addr, kernel_load_addr, kernel_size, cmdline, cmdline_size);
+    
+    // Read straight into its placement, as on x86, never into a heap copy
+    struct aarch64_initrd initrd = { NULL, 0 };
     if (initrd_path && strlen(initrd_path) > 0) {
         uint8_t* initrd_data = NULL;
-        uint32_t initrd_size32 = 0;
-        if (load_file(initrd_path, &initrd_data, &initrd_size32) == 0) {
-            initrd_size = initrd_size32;
-            initrd_addr = dtb_addr + 0x10000;
-            memcpy((void*)initrd_addr, initrd_data, initrd_size);
+        uint32_t initrd_size = 0;
+        if (decomp_load_initrd_at(initrd_path, aarch64_place_initrd, &initrd, &initrd_data, &initrd_size) != 0) {
+            if (initrd.data) place_free(initrd.data, initrd.size);
+            aarch64_release(&place);
+            return -1;
         }
+        params->initrd_addr = (uint64_t)(uintptr_t)initrd_data;
+        params->initrd_size = initrd_size;
     }
     
-    uint64_t cmdline_addr = 0;
-    uint64_t cmdline_size = 0;
-    if (cmdline && strlen(cmdline) > 0) {
-        cmdline_addr = initrd_addr + initrd_size + 0x1000;
-        cmdline_size = strlen(cmdline) + 1;
-        strcpy((char*)cmdline_addr, cmdline);
+    // Extend what was measured while loading; the kernel can't do it for us
+    if (tpm2_flush_measurements() != 0) {
+        if (initrd.data) place_free(initrd.data, initrd.size);
+        aarch64_release(&place);
+        return -1;
     }
     
     memcpy((void*)kernel_load_addr, kernel_data, kernel_size);
     
-    struct aarch64_boot_params* params = (struct aarch64_boot_params*)0x40000000 - 0x1000;
-    memset(params, 0, sizeof(struct aarch64_boot_params));
-    
-    params->dtb_addr = dtb_addr;
-    params->initrd_addr = initrd_addr;
-    params->initrd_size = initrd_size;
-    params->cmdline_addr = cmdline_addr;
-    params->cmdline_size = cmdline_size;
-    params->kernel_addr = kernel_load_addr;
-    params->kernel_size = kernel_size;
-    params->mem_start = 0x40000000;
-    params->mem_size = 0x80000000;
-    
-    uint64_t entry_point = kernel_load_addr + header->text_offset;
-    void (*kernel_entry)(uint64_t, uint64_t, uint64_t) = (void*)entry_point;
+    void (*kernel_entry)(uint64_t, uint64_t, uint64_t) = (void*)kernel_load_addr;
     kernel_entry(0, dtb_addr, (uint64_t)params);
     
     return 0;
 }
 
 int aarch64_boot_uefi(uint8_t* kernel_data, uint64_t kernel_size, const char* cmdline) {
-    uint64_t kernel_load_addr = 0x40000000;
-    uint64_t dtb_addr = 0x40000000 + kernel_size;
-    
-    uint64_t cmdline_addr = 0;
-    uint64_t cmdline_size = 0;
-    if (cmdline && strlen(cmdline) > 0) {
-        cmdline_addr = dtb_addr + 0x10000;
-        cmdline_size = strlen(cmdline) + 1;
-        strcpy((char*)cmdline_addr, cmdline);
+    uint64_t cmdline_size = cmdline && strlen(cmdline) > 0 ? strlen(cmdline) + 1 : 0;
+    
+    struct aarch64_placement place;
+    if (aarch64_place(&place, 0, kernel_size, cmdline_size) != 0) {
+        return -1;
     }
+    uint64_t kernel_load_addr = (uint64_t)(uintptr_t)place.kernel_base;
+    uint64_t dtb_addr = (uint64_t)(uintptr_t)place.dtb;
     
-    memcpy((void*)kernel_load_addr, kernel_data, kernel_size);
+    struct aarch64_boot_params* params = place.params;
+    aarch64_fill_params(params, dtb_addr, kernel_load_addr, kernel_size, cmdline, cmdline_size);
     
-    struct aarch64_boot_params* params = (struct aarch64_boot_params*)0x40000000 - 0x1000;
-    memset(params, 0, sizeof(struct aarch64_boot_params));
+    // Extend what was measured while loading; the kernel can't do it for us
+    if (tpm2_flush_measurements() != 0) {
+        aarch64_release(&place);
+        return -1;
+    }
     
-    params->dtb_addr = dtb_addr;
-    params->cmdline_addr = cmdline_addr;
-    params->cmdline_size = cmdline_size;
-    params->kernel_addr = kernel_load_addr;
-    params->kernel_size = kernel_size;
-    params->mem_start = 0x40000000;
-    params->mem_size = 0x80000000;
+    memcpy((void*)kernel_load_addr, kernel_data, kernel_size);
     
     void (*kernel_entry)(uint64_t, uint64_t, uint64_t) = (void*)kernel_load_addr;
     kernel_entry(0, dtb_addr, (uint64_t)params);
@@ -149,7 +211,7 @@ int aarch64_verify_kernel(const char* kernel_path) {
     uint8_t* kernel_data = NULL;
     uint32_t kernel_size = 0;
     
-    if (load_file(kernel_path, &kernel_data, &kernel_size) != 0) {
+    if (decomp_load_file(kernel_path, &kernel_data, &kernel_size, NULL) != 0) {
         return -1;
     }
     
@@ -0,0 +1,347 @@
+/*
+ * elf_loader.c
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#include <stdint.h>
+#include "compat.h"
+#include <string.h>
+#include <stdlib.h>
+#include "elf_loader.h"
+#include "placement.h"
+#include "compress/load.h"
+#include "fs/fs_common.h"
+#include "security/payload.h"
+
+extern void firmware_run_on_all_cpus(void (*fn)(void* arg), void* arg);
+
+#define ELF_SOURCE_PROBE    16          // Enough for every compression and payload magic
+#define ELF_LOAD_MIN        0x100000    // Moved blocks stay clear of low memory
+
+int elf_source_open(struct elf_source* src, const char* path) {
+    fs_file_info_t info;
+    uint8_t head[ELF_SOURCE_PROBE];
+
+    memset(src, 0, sizeof(*src));
+    if (!path || fs_get_info(path, &info) != 0 || info.size > DECOMP_LOAD_MAX) return -1;
+    uint32_t head_len = info.size < ELF_SOURCE_PROBE ? (uint32_t)info.size : ELF_SOURCE_PROBE;
+    if (fs_read_file(path, head, head_len, 0) != (int)head_len) return -1;
+
+    if (decomp_detect(head, head_len) == DECOMP_FORMAT_NONE && !payload_detect(head, head_len)) {
+        src->path = path;
+        src->size = info.size;
+        return 0;
+    }
+
+    uint8_t* data = NULL;
+    uint32_t size = 0;
+    if (decomp_load_file(path, &data, &size, NULL) != 0) return -1;
+    src->data = data;
+    src->owned = data;
+    src->size = size;
+    return 0;
+}
+
+void elf_source_buffer(struct elf_source* src, const uint8_t* data, uint64_t size) {
+    memset(src, 0, sizeof(*src));
+    src->data = data;
+    src->size = size;
+}
+
+int elf_source_read(const struct elf_source* src, void* dst, uint64_t offset, uint64_t len) {
+    if (offset > src->size || len > src->size - offset) return -1;
+    if (src->data) {
+        memcpy(dst, src->data + offset, (size_t)len);
+        return 0;
+    }
+    // The size was checked against DECOMP_LOAD_MAX, so offsets fit the fs layer
+    uint8_t* out = (uint8_t*)dst;
+    while (len) {
+        uint32_t n = len < ELF_READ_CHUNK ? (uint32_t)len : ELF_READ_CHUNK;
+        if (fs_read_file(src->path, out, n, (uint32_t)offset) != (int)n) return -1;
+        out += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+void elf_source_close(struct elf_source* src) {
+    free(src->owned);
+    memset(src, 0, sizeof(*src));
+}
+
+// Zeroing through the cache would evict everything for lines that are not
+// read again before the kernel runs, so big fills go straight to memory
+static void elf_zero_stream(uint8_t* p, uint64_t len) {
+#if defined(__x86_64__) || defined(__i386__)
+    uint8_t* end = p + len;
+    uintptr_t head = (uintptr_t)(-(intptr_t)p) & (sizeof(uintptr_t) - 1);
+    if (head > len) head = len;
+    memset(p, 0, head);
+
+    uintptr_t* w = (uintptr_t*)(p + head);
+    uint64_t words = (uint64_t)(end - (uint8_t*)w) / sizeof(uintptr_t);
+    uintptr_t zero = 0;
+    for (; words >= 4; words -= 4, w += 4) {
+        asm volatile ("movnti %4, %0\n\tmovnti %4, %1\n\tmovnti %4, %2\n\tmovnti %4, %3"
+                      : "=m"(w[0]), "=m"(w[1]), "=m"(w[2]), "=m"(w[3]) : "r"(zero));
+    }
+    for (; words; words--, w++) {
+        asm volatile ("movnti %1, %0" : "=m"(*w) : "r"(zero));
+    }
+    memset(w, 0, (size_t)(end - (uint8_t*)w));
+    asm volatile ("sfence" ::: "memory");
+#else
+    memset(p, 0, (size_t)len);
+#endif
+}
+
+static void elf_zero_local(uint8_t* p, uint64_t len) {
+    if (len < ELF_ZERO_STREAM_MIN) memset(p, 0, (size_t)len);
+    else elf_zero_stream(p, len);
+}
+
+struct elf_zero_work {
+    const struct elf_claim* fills;
+    uint32_t fill_count;
+    uint32_t first[ELF_MAX_SEGMENTS + 1];   // Index of each fill's first chunk
+    uint32_t chunk_count;
+    uint32_t next;                          // Next chunk to claim, atomically
+};
+
+// Every CPU claims chunks until none are left, as the manifest hashing does
+static void elf_zero_worker(void* arg) {
+    struct elf_zero_work* w = (struct elf_zero_work*)arg;
+
+    for (;;) {
+        uint32_t i = __atomic_fetch_add(&w->next, 1, __ATOMIC_RELAXED);
+        if (i >= w->chunk_count) break;
+
+        uint32_t f = 0;
+        while (f + 1 < w->fill_count && w->first[f + 1] <= i) f++;
+        uint64_t start = (uint64_t)(i - w->first[f]) * ELF_ZERO_CHUNK;
+        uint64_t left = w->fills[f].size - start;
+        elf_zero_stream((uint8_t*)(uintptr_t)w->fills[f].base + start, left < ELF_ZERO_CHUNK ? left : ELF_ZERO_CHUNK);
+    }
+}
+
+static void elf_zero_fills(const struct elf_claim* fills, uint32_t count) {
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < count; i++) total += fills[i].size;
+
+    if (total < ELF_ZERO_PARALLEL_MIN) {
+        for (uint32_t i = 0; i < count; i++) {
+            elf_zero_local((uint8_t*)(uintptr_t)fills[i].base, fills[i].size);
+        }
+        return;
+    }
+
+    struct elf_zero_work w;
+    memset(&w, 0, sizeof(w));
+    w.fills = fills;
+    w.fill_count = count;
+    for (uint32_t i = 0; i < count; i++) {
+        w.first[i] = w.chunk_count;
+        w.chunk_count += (uint32_t)((fills[i].size + ELF_ZERO_CHUNK - 1) / ELF_ZERO_CHUNK);
+    }
+    firmware_run_on_all_cpus(elf_zero_worker, &w);
+
+    // Firmware without MP services, or an AP that never ran: finish here
+    elf_zero_worker(&w);
+}
+
+void elf_zero(void* dst, uint64_t len) {
+    struct elf_claim fill = { (uint64_t)(uintptr_t)dst, len };
+    if (dst && len) elf_zero_fills(&fill, 1);
+}
+
+static uint64_t elf_round_up(uint64_t v, uint64_t align) {
+    return (v + align - 1) & ~(align - 1);
+}
+
+static int elf_overlap(uint64_t a, uint64_t a_size, uint64_t b, uint64_t b_size) {
+    return a < b + b_size && b < a + a_size;
+}
+
+static int elf_read_segments(const struct elf_source* src, const struct elf64_header* eh, struct elf_image* img) {
+    uint64_t table = (uint64_t)eh->e_phnum * sizeof(struct elf64_phdr);
+    struct elf64_phdr* ph = (struct elf64_phdr*)malloc((size_t)(table ? table : 1));
+    if (!ph) return -1;
+    if (elf_source_read(src, ph, eh->e_phoff, table) != 0) {
+        free(ph);
+        return -1;
+    }
+
+    int r = 0;
+    for (uint32_t i = 0; i < eh->e_phnum && r == 0; i++) {
+        if (ph[i].p_type != PT_LOAD || ph[i].p_memsz == 0) continue;
+        if (ph[i].p_filesz > ph[i].p_memsz || ph[i].p_offset > src->size ||
+            ph[i].p_filesz > src->size - ph[i].p_offset || ph[i].p_vaddr + ph[i].p_memsz < ph[i].p_vaddr ||
+            ph[i].p_paddr + ph[i].p_memsz < ph[i].p_paddr || img->segment_count == ELF_MAX_SEGMENTS) {
+            r = -1;
+            break;
+        }
+
+        // Insertion sort by vaddr; there are only a handful
+        uint32_t at = img->segment_count++;
+        while (at > 0 && img->segments[at - 1].vaddr > ph[i].p_vaddr) {
+            img->segments[at] = img->segments[at - 1];
+            at--;
+        }
+        struct elf_segment* s = &img->segments[at];
+        s->vaddr = ph[i].p_vaddr;
+        s->paddr = ph[i].p_paddr;       // Replaced once placed
+        s->offset = ph[i].p_offset;
+        s->filesz = ph[i].p_filesz;
+        s->memsz = ph[i].p_memsz;
+        s->flags = ph[i].p_flags;
+    }
+    free(ph);
+
+    for (uint32_t i = 1; i < img->segment_count && r == 0; i++) {
+        const struct elf_segment* a = &img->segments[i - 1];
+        if (a->vaddr + a->memsz > img->segments[i].vaddr) r = -1;
+    }
+    return img->segment_count ? r : -1;
+}
+
+static int elf_claim_add(struct elf_image* img, uint64_t base, uint64_t end) {
+    base &= ~(PLACE_PAGE_SIZE - 1);
+    end = elf_round_up(end, PLACE_PAGE_SIZE);
+
+    // Runs that touch are merged, since two segments may share a page
+    uint32_t at = 0;
+    while (at < img->claim_count && img->claims[at].base + img->claims[at].size < base) at++;
+    if (at < img->claim_count && img->claims[at].base <= end) {
+        struct elf_claim* c = &img->claims[at];
+        uint64_t c_end = c->base + c->size;
+        if (base < c->base) c->base = base;
+        c->size = (end > c_end ? end : c_end) - c->base;
+        while (at + 1 < img->claim_count && img->claims[at + 1].base <= c->base + c->size) {
+            uint64_t n_end = img->claims[at + 1].base + img->claims[at + 1].size;
+            if (n_end > c->base + c->size) c->size = n_end - c->base;
+            memmove(&img->claims[at + 1], &img->claims[at + 2], (img->claim_count - at - 2) * sizeof(struct elf_claim));
+            img->claim_count--;
+        }
+        return 0;
+    }
+    if (img->claim_count == ELF_MAX_SEGMENTS) return -1;
+    memmove(&img->claims[at + 1], &img->claims[at], (img->claim_count - at) * sizeof(struct elf_claim));
+    img->claims[at].base = base;
+    img->claims[at].size = end - base;
+    img->claim_count++;
+    return 0;
+}
+
+// Pick every segment's physical address and take those pages from the map
+static int elf_place(struct elf_image* img, const struct elf_load_policy* policy) {
+    uint64_t align = policy->high_align ? policy->high_align : PLACE_PAGE_SIZE;
+    uint64_t high_end = 0;
+
+    img->high_virt = ~0ULL;
+    for (uint32_t i = 0; i < img->segment_count; i++) {
+        struct elf_segment* s = &img->segments[i];
+        if (policy->high_base && s->vaddr >= policy->high_base) {
+            if (s->vaddr < img->high_virt) img->high_virt = s->vaddr & ~(align - 1);
+            if (s->vaddr + s->memsz > high_end) high_end = s->vaddr + s->memsz;
+        } else {
+            if (!policy->by_paddr) s->paddr = s->vaddr;
+            if (policy->limit && (s->paddr + s->memsz - 1 > policy->limit)) return -1;
+            if (elf_claim_add(img, s->paddr, s->paddr + s->memsz) != 0) return -1;
+        }
+    }
+
+    // Fixed segments first, so the moved block cannot take their pages
+    for (uint32_t i = 0; i < img->claim_count; i++) {
+        if (!place_at(img->claims[i].base, img->claims[i].size)) {
+            img->claim_count = i;
+            return -1;
+        }
+    }
+
+    if (high_end) {
+        img->high_span = elf_round_up(high_end - img->high_virt, PLACE_PAGE_SIZE);
+        struct place_request req = { img->high_span, align, ELF_LOAD_MIN, policy->limit, PLACE_FIRST_FIT };
+        uint8_t* base = (uint8_t*)place_alloc(&req);
+        if (!base) return -1;
+        img->high_phys = (uint64_t)(uintptr_t)base;
+        for (uint32_t i = 0; i < img->segment_count; i++) {
+            struct elf_segment* s = &img->segments[i];
+            if (policy->high_base && s->vaddr >= policy->high_base) s->paddr = img->high_phys + (s->vaddr - img->high_virt);
+        }
+    } else {
+        img->high_virt = 0;
+    }
+
+    // Virtual ranges were checked when sorting; with p_paddr honoured the
+    // physical ones may still collide
+    for (uint32_t i = 0; i < img->segment_count; i++) {
+        for (uint32_t j = i + 1; j < img->segment_count; j++) {
+            const struct elf_segment* a = &img->segments[i];
+            const struct elf_segment* b = &img->segments[j];
+            if (elf_overlap(a->paddr, a->memsz, b->paddr, b->memsz)) return -1;
+        }
+    }
+    return 0;
+}
+
+int elf_load(const struct elf_source* src, const struct elf_load_policy* policy, struct elf_image* img) {
+    struct elf64_header eh;
+
+    if (!src || !policy || !img) return -1;
+    memset(img, 0, sizeof(*img));
+    if (elf_source_read(src, &eh, 0, sizeof(eh)) != 0) return -1;
+    if (memcmp(eh.e_ident, ELF_MAGIC, 4) != 0 || eh.e_ident[EI_CLASS] != ELFCLASS64 ||
+        eh.e_ident[EI_DATA] != ELFDATA2LSB || eh.e_phentsize != sizeof(struct elf64_phdr)) {
+        return -1;
+    }
+    if (elf_read_segments(src, &eh, img) != 0) return -1;
+
+    if (elf_place(img, policy) != 0) {
+        elf_release(img);
+        return -1;
+    }
+
+    // Stream each segment to where it runs, then clear what the file omits
+    struct elf_claim fills[ELF_MAX_SEGMENTS];
+    uint32_t fill_count = 0;
+    for (uint32_t i = 0; i < img->segment_count; i++) {
+        const struct elf_segment* s = &img->segments[i];
+        uint8_t* dst = (uint8_t*)(uintptr_t)s->paddr;
+        if (s->filesz && elf_source_read(src, dst, s->offset, s->filesz) != 0) {
+            elf_release(img);
+            return -1;
+        }
+        if (s->memsz > s->filesz) {
+            fills[fill_count].base = s->paddr + s->filesz;
+            fills[fill_count].size = s->memsz - s->filesz;
+            fill_count++;
+        }
+    }
+    if (fill_count) elf_zero_fills(fills, fill_count);
+
+    img->machine = eh.e_machine;
+    img->entry = eh.e_entry;
+    return 0;
+}
+
+void elf_release(struct elf_image* img) {
+    if (!img) return;
+    for (uint32_t i = 0; i < img->claim_count; i++) {
+        place_free((void*)(uintptr_t)img->claims[i].base, img->claims[i].size);
+    }
+    if (img->high_phys) place_free((void*)(uintptr_t)img->high_phys, img->high_span);
+    img->claim_count = 0;
+    img->high_phys = 0;
+}
+
+uint64_t elf_virt_to_phys(const struct elf_image* img, uint64_t vaddr) {
+    for (uint32_t i = 0; i < img->segment_count; i++) {
+        const struct elf_segment* s = &img->segments[i];
+        if (vaddr >= s->vaddr && vaddr - s->vaddr < s->memsz) return s->paddr + (vaddr - s->vaddr);
+    }
+    return 0;
+}
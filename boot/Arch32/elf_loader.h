@@ -0,0 +1,134 @@
+/*
+ * elf_loader.h
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#ifndef BLOODHORN_ELF_LOADER_H
+#define BLOODHORN_ELF_LOADER_H
+#include <stdint.h>
+#include "compat.h"
+
+// ELF64 executables for the protocols that boot them (Limine, Multiboot 2).
+// The ELF and program headers are read first; every PT_LOAD segment is then
+// read from storage straight to its physical destination, so the file is
+// never held in memory as a whole. Zero fill (.bss, and anything else past
+// p_filesz) uses non-temporal stores and is split across the APs when
+// there is a lot of it, as there is for kernels with static page tables.
+
+#define ELF_MAGIC   "\x7f\x45\x4c\x46"
+#define ELFCLASS64  2
+#define ELFDATA2LSB 1
+#define EM_X86_64   62
+#define EM_AARCH64  183
+#define EM_RISCV    243
+#define PT_LOAD     1
+
+#define EI_CLASS    4
+#define EI_DATA     5
+
+#define PF_X        0x1
+#define PF_W        0x2
+#define PF_R        0x4
+
+#define ELF_MAX_SEGMENTS        32
+#define ELF_READ_CHUNK          (16 * 1024 * 1024)  // Bytes per fs_read_file() call
+#define ELF_ZERO_STREAM_MIN     (256 * 1024)        // Smaller fills stay in the cache
+#define ELF_ZERO_PARALLEL_MIN   (8 * 1024 * 1024)   // Total fill worth waking the APs for
+#define ELF_ZERO_CHUNK          (1024 * 1024)       // Unit the CPUs claim
+
+struct elf64_header {
+    uint8_t e_ident[16];
+    uint16_t e_type;
+    uint16_t e_machine;
+    uint32_t e_version;
+    uint64_t e_entry;
+    uint64_t e_phoff;
+    uint64_t e_shoff;
+    uint32_t e_flags;
+    uint16_t e_ehsize;
+    uint16_t e_phentsize;
+    uint16_t e_phnum;
+    uint16_t e_shentsize;
+    uint16_t e_shnum;
+    uint16_t e_shstrndx;
+};
+
+struct elf64_phdr {
+    uint32_t p_type;
+    uint32_t p_flags;
+    uint64_t p_offset;
+    uint64_t p_vaddr;
+    uint64_t p_paddr;
+    uint64_t p_filesz;
+    uint64_t p_memsz;
+    uint64_t p_align;
+};
+
+// Where the bytes of an image come from. Plain files are streamed through
+// the fs layer; compressed or encrypted ones are unpacked to memory first,
+// since their offsets mean nothing until then.
+struct elf_source {
+    const char* path;           // Read through fs_read_file() when data is NULL
+    const uint8_t* data;
+    uint8_t* owned;             // data, when it was unpacked here
+    uint64_t size;
+};
+
+int elf_source_open(struct elf_source* src, const char* path);
+void elf_source_buffer(struct elf_source* src, const uint8_t* data, uint64_t size);
+int elf_source_read(const struct elf_source* src, void* dst, uint64_t offset, uint64_t len);
+void elf_source_close(struct elf_source* src);
+
+struct elf_load_policy {
+    uint64_t high_base;         // Segments linked at or above this move as one block
+                                // to wherever the map has room; 0 means none do
+    uint64_t high_align;        // Alignment of that block, and of its virtual base
+    uint64_t limit;             // Last byte any segment may occupy; 0 means none
+    int by_paddr;               // Load at p_paddr rather than p_vaddr (Multiboot)
+};
+
+// One PT_LOAD segment as loaded, sorted by vaddr; enough for page tables
+// and relocations to be built without the program headers
+struct elf_segment {
+    uint64_t vaddr;             // As linked
+    uint64_t paddr;             // Where it was loaded
+    uint64_t offset;            // Of its bytes in the file
+    uint64_t filesz;
+    uint64_t memsz;
+    uint32_t flags;             // PF_*
+};
+
+struct elf_claim {
+    uint64_t base;
+    uint64_t size;
+};
+
+struct elf_image {
+    uint16_t machine;
+    uint64_t entry;             // e_entry, as linked
+    uint32_t segment_count;
+    struct elf_segment segments[ELF_MAX_SEGMENTS];
+    uint64_t high_virt;         // Virtual and physical base of the moved block,
+    uint64_t high_phys;         // both 0 when nothing was moved
+    uint64_t high_span;
+    uint32_t claim_count;       // Page runs taken from the placement map
+    struct elf_claim claims[ELF_MAX_SEGMENTS];
+};
+
+// Parse, check and place the image, stream its segments in and zero what
+// the file leaves out. Segments must not overlap, virtually or physically.
+int elf_load(const struct elf_source* src, const struct elf_load_policy* policy, struct elf_image* img);
+
+// Give back the memory elf_load() placed the image in
+void elf_release(struct elf_image* img);
+
+// Physical address a linked address was loaded at, or 0 if no segment has it
+uint64_t elf_virt_to_phys(const struct elf_image* img, uint64_t vaddr);
+
+// Zero len bytes at dst, streaming past the cache and across all CPUs when
+// it is large enough to be worth it
+void elf_zero(void* dst, uint64_t len);
+
+#endif
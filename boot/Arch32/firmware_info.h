@@ -0,0 +1,67 @@
+/*
+ * firmware_info.h
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#ifndef BLOODHORN_FIRMWARE_INFO_H
+#define BLOODHORN_FIRMWARE_INFO_H
+#include <stdint.h>
+#include "compat.h"
+
+// What the boot protocols pass on about the machine, gathered by main.c from
+// UEFI (or coreboot's tables when it is there). Everything here must be
+// asked for before firmware_exit_boot_services().
+
+#define FIRMWARE_MAX_FRAMEBUFFERS   4
+#define FIRMWARE_MAX_CPUS           256
+
+struct firmware_framebuffer {
+    uint64_t base;
+    uint64_t size;
+    uint32_t width;
+    uint32_t height;
+    uint32_t pitch;             // Bytes per scanline
+    uint16_t bpp;
+    uint8_t red_size;
+    uint8_t red_shift;
+    uint8_t green_size;
+    uint8_t green_shift;
+    uint8_t blue_size;
+    uint8_t blue_shift;
+};
+
+// Linear framebuffers, GOP first; returns how many were written to fb
+uint32_t firmware_framebuffers(struct firmware_framebuffer* fb, uint32_t max);
+
+// Configuration tables, NULL when the firmware has none
+void* firmware_acpi_rsdp(void);
+void* firmware_smbios_entry32(void);
+void* firmware_smbios_entry64(void);
+void* firmware_system_table(void);
+
+// Local APIC IDs of the enabled CPUs; *bsp is the BSP's index in ids
+uint32_t firmware_cpu_ids(uint32_t* ids, uint32_t max, uint32_t* bsp);
+
+void* firmware_image_handle(void);
+
+// The UEFI memory map as it stands when boot services are left, for
+// protocols that pass it on. buffer and capacity are set by the caller.
+struct firmware_memory_map {
+    void* buffer;
+    uint32_t capacity;
+    uint32_t size;
+    uint32_t descriptor_size;
+    uint32_t descriptor_version;
+};
+
+// Bytes the UEFI memory map takes right now, and the size of one descriptor
+uint32_t firmware_memory_map_size(uint32_t* descriptor_size);
+
+// Flush pending measurements and leave boot services, retrying when the
+// memory map changes under us; the final map goes to map when it is not
+// NULL. Nothing firmware_* works afterwards.
+int firmware_exit_boot_services(struct firmware_memory_map* map);
+
+#endif
@@ -6,265 +6,1005 @@
  */
 
 #include <stdint.h>
+#include <stddef.h>
 #include "compat.h"
 #include <string.h>
 #include "limine.h"
-// go to line 65
-extern void* allocate_memory(uint32_t size);
-extern int load_file(const char* path, uint8_t** data, uint32_t* size);
+#include "placement.h"
+#include "paging.h"
+#include "firmware_info.h"
+#include "compress/load.h"
 
-struct limine_memmap_request memmap_request = {
-    .id = LIMINE_MEMMAP_REQUEST,
-    .revision = 0
-};
+extern void firmware_stall(uint32_t microseconds);
 
-struct limine_kernel_address_request kernel_address_request = {
-    .id = LIMINE_KERNEL_ADDRESS_REQUEST,
-    .revision = 0
-};
+#define LIMINE_INFO_SIZE        0x40000     // Responses and everything they point to
+#define LIMINE_LOW_MEMORY       0x100000
+#define LIMINE_TRAMPOLINE_LIMIT 0xFFFFF     // A SIPI vector can only name a page below 1 MiB
+#define LIMINE_AP_TIMEOUT_US    100000
+#define LIMINE_LOADER_NAME      "BloodHorn"
+#define LIMINE_LOADER_VERSION   "1.0"
 
-struct limine_hhdm_request hhdm_request = {
-    .id = LIMINE_HHDM_REQUEST,
-    .revision = 0
-};
+// Selectors the protocol fixes for the GDT the kernel is entered with
+#define LIMINE_CODE32           0x18
+#define LIMINE_DATA32           0x20
+#define LIMINE_CODE64           0x28
+#define LIMINE_DATA64           0x30
 
-struct limine_framebuffer_request framebuffer_request = {
-    .id = LIMINE_FRAMEBUFFER_REQUEST,
-    .revision = 0
-};
+#define LIMINE_CR4_LA57         (1ULL << 12)
+#define LIMINE_CR4_PCIDE        (1ULL << 17)
 
-struct limine_module_request module_request = {
-    .id = LIMINE_MODULE_REQUEST,
-    .revision = 0
+static const uint64_t limine_gdt[] = {
+    0,
+    0x00009a000000ffffULL,      // 16-bit code
+    0x000092000000ffffULL,      // 16-bit data
+    0x00cf9a000000ffffULL,      // 32-bit code
+    0x00cf92000000ffffULL,      // 32-bit data
+    0x00af9a000000ffffULL,      // 64-bit code
+    0x00cf92000000ffffULL       // 64-bit data
 };
 
-struct limine_rsdp_request rsdp_request = {
-    .id = LIMINE_RSDP_REQUEST,
-    .revision = 0
-};
+struct limine_gdtr {
+    uint16_t limit;
+    uint64_t base;
+} __attribute__((packed));
 
-struct limine_smbios_request smbios_request = {
-    .id = LIMINE_SMBIOS_REQUEST,
-    .revision = 0
+// Modules are loaded as they are added, like Multiboot's, and described to
+// the kernel by whichever boot comes next
+struct limine_module_slot {
+    uint8_t* data;
+    uint32_t size;
+    char path[LIMINE_MODULE_STRING];
+    char cmdline[LIMINE_MODULE_STRING];
 };
 
-struct limine_efi_system_table_request efi_system_table_request = {
-    .id = LIMINE_EFI_SYSTEM_TABLE_REQUEST,
-    .revision = 0
-};
+static struct limine_module_slot modules[LIMINE_MAX_MODULES];
+static uint32_t module_count;
 
-struct limine_boot_time_request boot_time_request = {
-    .id = LIMINE_BOOT_TIME_REQUEST,
-    .revision = 0
-};
+static uint8_t* limine_place_module(void* ctx, uint32_t size) {
+    struct limine_module_slot* slot = (struct limine_module_slot*)ctx;
+    struct place_request req = { size ? size : 1, PLACE_PAGE_SIZE, LIMINE_LOW_MEMORY, 0, PLACE_BEST_FIT };
+    slot->data = (uint8_t*)place_alloc(&req);
+    slot->size = size;
+    return slot->data;
+}
 
-struct limine_kernel_file_request kernel_file_request = {
-    .id = LIMINE_KERNEL_FILE_REQUEST,
-    .revision = 0
-};
+int limine_load_module(const char* module_path, const char* cmdline) {
+    if (!module_path || module_count >= LIMINE_MAX_MODULES) {
+        return -1;
+    }
 
-struct limine_smp_request smp_request = {
-    .id = LIMINE_SMP_REQUEST,
-    .revision = 0
-};
+    struct limine_module_slot* slot = &modules[module_count];
+    uint8_t* data = NULL;
+    uint32_t size = 0;
+    memset(slot, 0, sizeof(*slot));
+    if (decomp_load_initrd_at(module_path, limine_place_module, slot, &data, &size) != 0) {
+        place_free(slot->data, slot->size);
+        slot->data = NULL;
+        return -1;
+    }
+    slot->data = data;
+    slot->size = size;
 
-struct limine_paging_mode_request paging_mode_request = {
-    .id = LIMINE_PAGING_MODE_REQUEST,
-    .revision = 0
-};
+    strncpy(slot->path, module_path, LIMINE_MODULE_STRING - 1);
+    if (cmdline) {
+        strncpy(slot->cmdline, cmdline, LIMINE_MODULE_STRING - 1);
+    }
 
-struct limine_5_level_paging_request level5_paging_request = {
-    .id = LIMINE_5_LEVEL_PAGING_REQUEST,
-    .revision = 0
-};
+    module_count++;
+    return 0;
+}
 
-struct limine_terminal_request terminal_request = {
-    .id = LIMINE_TERMINAL_REQUEST,
-    .revision = 0
-};
+int limine_add_module(const char* module_path, const uint8_t* module_data, uint32_t module_size,
+                      const char* cmdline) {
+    if (!module_path || !module_data || module_count >= LIMINE_MAX_MODULES) {
+        return -1;
+    }
 
-struct limine_stack_size_request stack_size_request = {
-    .id = LIMINE_STACK_SIZE_REQUEST,
-    .revision = 0
-};
+    struct limine_module_slot* slot = &modules[module_count];
+    memset(slot, 0, sizeof(*slot));
+    if (!limine_place_module(slot, module_size)) {
+        return -1;
+    }
+    memcpy(slot->data, module_data, module_size);
 
-struct limine_base_virtual_address_request base_virtual_address_request = {
-    .id = LIMINE_BASE_VIRTUAL_ADDRESS_REQUEST,
-    .revision = 0
+    strncpy(slot->path, module_path, LIMINE_MODULE_STRING - 1);
+    if (cmdline) {
+        strncpy(slot->cmdline, cmdline, LIMINE_MODULE_STRING - 1);
+    }
+
+    module_count++;
+    return 0;
+}
+
+#if defined(__x86_64__)
+
+// Every request the loader answers, as found in the loaded image
+struct limine_requests {
+    uint64_t* base_revision;
+    struct limine_memmap_request* memmap;
+    struct limine_framebuffer_request* framebuffer;
+    struct limine_hhdm_request* hhdm;
+    struct limine_rsdp_request* rsdp;
+    struct limine_smbios_request* smbios;
+    struct limine_efi_system_table_request* efi_system_table;
+    struct limine_kernel_address_request* kernel_address;
+    struct limine_kernel_file_request* kernel_file;
+    struct limine_module_request* module;
+    struct limine_smp_request* smp;
+    struct limine_stack_size_request* stack_size;
+    struct limine_paging_mode_request* paging_mode;
+    struct limine_5_level_paging_request* level5;
+    struct limine_loader_info_request* loader_info;
+    struct limine_entry_point_request* entry_point;
 };
 
-struct limine_kernel_address_virtual_request kernel_address_virtual_request = {
-    .id = LIMINE_KERNEL_ADDRESS_VIRTUAL_REQUEST,
-    .revision = 0
+static const struct {
+    uint64_t id[4];
+    size_t slot;
+} limine_known[] = {
+    { LIMINE_MEMMAP_REQUEST, offsetof(struct limine_requests, memmap) },
+    { LIMINE_FRAMEBUFFER_REQUEST, offsetof(struct limine_requests, framebuffer) },
+    { LIMINE_HHDM_REQUEST, offsetof(struct limine_requests, hhdm) },
+    { LIMINE_RSDP_REQUEST, offsetof(struct limine_requests, rsdp) },
+    { LIMINE_SMBIOS_REQUEST, offsetof(struct limine_requests, smbios) },
+    { LIMINE_EFI_SYSTEM_TABLE_REQUEST, offsetof(struct limine_requests, efi_system_table) },
+    { LIMINE_KERNEL_ADDRESS_REQUEST, offsetof(struct limine_requests, kernel_address) },
+    { LIMINE_KERNEL_FILE_REQUEST, offsetof(struct limine_requests, kernel_file) },
+    { LIMINE_MODULE_REQUEST, offsetof(struct limine_requests, module) },
+    { LIMINE_SMP_REQUEST, offsetof(struct limine_requests, smp) },
+    { LIMINE_STACK_SIZE_REQUEST, offsetof(struct limine_requests, stack_size) },
+    { LIMINE_PAGING_MODE_REQUEST, offsetof(struct limine_requests, paging_mode) },
+    { LIMINE_5_LEVEL_PAGING_REQUEST, offsetof(struct limine_requests, level5) },
+    { LIMINE_LOADER_INFO_REQUEST, offsetof(struct limine_requests, loader_info) },
+    { LIMINE_ENTRY_REQUEST, offsetof(struct limine_requests, entry_point) },
 };
 
-struct limine_dtb_request dtb_request = {
-    .id = LIMINE_DTB_REQUEST,
-    .revision = 0
+// Requests are 8-byte aligned and start with the common magic, so one pass
+// over the file-backed part of each segment, a word at a time, finds them
+// all. Memory past p_filesz was zeroed by the loader and cannot hold one.
+static void limine_scan(const struct elf_image* img, struct limine_requests* req) {
+    memset(req, 0, sizeof(*req));
+    for (uint32_t i = 0; i < img->segment_count; i++) {
+        const struct elf_segment* seg = &img->segments[i];
+        uint64_t skip = (8 - (seg->vaddr & 7)) & 7;
+        if (seg->filesz < skip + 4 * sizeof(uint64_t)) continue;
+
+        uint64_t* words = (uint64_t*)(uintptr_t)(seg->paddr + skip);
+        uint64_t count = (seg->filesz - skip) / sizeof(uint64_t);
+        for (uint64_t w = 0; w + 3 < count; w++) {
+            if (words[w] == LIMINE_BASE_REVISION_MAGIC_0 && words[w + 1] == LIMINE_BASE_REVISION_MAGIC_1) {
+                req->base_revision = &words[w];
+                continue;
+            }
+            if (words[w] != LIMINE_COMMON_MAGIC_0 || words[w + 1] != LIMINE_COMMON_MAGIC_1) continue;
+            for (uint32_t k = 0; k < sizeof(limine_known) / sizeof(limine_known[0]); k++) {
+                if (words[w + 2] != limine_known[k].id[2] || words[w + 3] != limine_known[k].id[3]) continue;
+                void** slot = (void**)((uint8_t*)req + limine_known[k].slot);
+                if (!*slot) *slot = &words[w];
+                break;
+            }
+        }
+    }
+}
+
+// Responses live in one zeroed, bootloader-reclaimable block and are
+// handed over as HHDM addresses, the way the kernel will see them
+struct limine_info {
+    uint8_t* base;
+    uint64_t used;
 };
 
-struct limine_vmap_request vmap_request = {
-    .id = LIMINE_VMAP_REQUEST,
-    .revision = 0
+static void* limine_info_alloc(struct limine_info* info, uint64_t size) {
+    uint64_t at = (info->used + 15) & ~15ULL;
+    if (at + size > LIMINE_INFO_SIZE) return NULL;
+    info->used = at + size;
+    return info->base + at;
+}
+
+static char* limine_info_string(struct limine_info* info, const char* s) {
+    uint64_t len = s ? strlen(s) : 0;
+    char* copy = (char*)limine_info_alloc(info, len + 1);
+    if (copy && len) memcpy(copy, s, len);
+    return copy;
+}
+
+// HHDM base for this boot; it moves down when there are five levels
+static uint64_t limine_hhdm_offset = LIMINE_HHDM_OFFSET;
+
+static void* limine_hhdm(const void* p) {
+    return p ? (void*)((uintptr_t)p + limine_hhdm_offset) : NULL;
+}
+
+static void* limine_reclaimable(uint64_t size, uint64_t limit) {
+    void* p;
+    if (limit) {
+        p = place_below(limit, size, PLACE_PAGE_SIZE);
+    } else {
+        struct place_request req = { size, PLACE_PAGE_SIZE, LIMINE_LOW_MEMORY, 0, PLACE_FIRST_FIT };
+        p = place_alloc(&req);
+    }
+    if (p) place_add((uint64_t)(uintptr_t)p, size, PLACE_RECLAIMABLE);
+    return p;
+}
+
+struct limine_memmap_ctx {
+    struct limine_memmap_response* response;
+    struct limine_memmap_entry* entries;
+    struct limine_memmap_entry** pointers;
+    uint32_t max;
 };
 
-struct limine_loader_info_request loader_info_request = {
-    .id = LIMINE_LOADER_INFO_REQUEST,
-    .revision = 0
+static void limine_add_memmap(void* ctx, uint64_t base, uint64_t size, enum place_type type) {
+    struct limine_memmap_ctx* memmap = (struct limine_memmap_ctx*)ctx;
+    if (memmap->response->entry_count >= memmap->max) return;
+    struct limine_memmap_entry* entry = &memmap->entries[memmap->response->entry_count];
+    memmap->pointers[memmap->response->entry_count++] = limine_hhdm(entry);
+    entry->base = base;
+    entry->length = size;
+    switch (type) {
+    case PLACE_FREE: entry->type = LIMINE_MEMMAP_USABLE; break;
+    case PLACE_LOADED: entry->type = LIMINE_MEMMAP_KERNEL_AND_MODULES; break;
+    case PLACE_RECLAIMABLE: entry->type = LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE; break;
+    case PLACE_ACPI: entry->type = LIMINE_MEMMAP_ACPI_RECLAIMABLE; break;
+    case PLACE_NVS: entry->type = LIMINE_MEMMAP_ACPI_NVS; break;
+    case PLACE_BAD: entry->type = LIMINE_MEMMAP_BAD_MEMORY; break;
+    default: entry->type = LIMINE_MEMMAP_RESERVED; break;
+    }
+}
+
+static struct limine_file* limine_describe_file(struct limine_info* info, const void* data, uint64_t size,
+                                                const char* path, const char* cmdline) {
+    struct limine_file* file = (struct limine_file*)limine_info_alloc(info, sizeof(*file));
+    char* path_copy = limine_info_string(info, path);
+    char* cmdline_copy = limine_info_string(info, cmdline);
+    if (!file || !path_copy || !cmdline_copy) return NULL;
+    file->address = limine_hhdm(data);
+    file->size = size;
+    file->path = (char*)limine_hhdm(path_copy);
+    file->cmdline = (char*)limine_hhdm(cmdline_copy);
+    file->media_type = LIMINE_MEDIA_TYPE_GENERIC;
+    return file;
+}
+
+// APs are started by the loader itself once boot services are gone: the
+// firmware's MP driver parks them in a loop of its own at that point. Each
+// one comes up in real mode at the trampoline, which is copied below 1 MiB,
+// switches to long mode on the kernel's page tables, takes the next stack
+// and calls limine_ap_park() with its top.
+//
+// The same page carries the BSP's way into the kernel when the paging
+// depth has to change: CR4.LA57 can only be written with paging off, so it
+// drops to 32-bit protected mode, loads CR4 and CR3 and comes back up.
+extern uint8_t limine_ap_trampoline[], limine_ap_trampoline_end[];
+extern uint8_t limine_ap_gdt[], limine_ap_gdtr[], limine_ap_pm[], limine_ap_lm[];
+extern uint8_t limine_ap_pm_target[], limine_ap_lm_target[];
+extern uint8_t limine_ap_cr3[], limine_ap_cr4[], limine_ap_stacks[], limine_ap_stack_size[];
+extern uint8_t limine_ap_entry[], limine_ap_arg[], limine_ap_max[];
+extern uint8_t limine_mode_switch[], limine_mode_cr4[], limine_mode_gdtr[];
+extern uint8_t limine_mode_stack[], limine_mode_entry[];
+
+asm (
+    ".pushsection .text\n"
+    ".code16\n"
+    "limine_ap_trampoline:\n"
+    "    cli\n"
+    "    cld\n"
+    "    movw %cs, %ax\n"
+    "    movw %ax, %ds\n"
+    "    movw %cs, %bx\n"
+    "    movzwl %bx, %ebx\n"
+    "    shll $4, %ebx\n"
+    "    lgdtl limine_ap_gdtr - limine_ap_trampoline\n"
+    "    movl %cr0, %eax\n"
+    "    orl $1, %eax\n"
+    "    movl %eax, %cr0\n"
+    "    ljmpl *(limine_ap_pm_target - limine_ap_trampoline)\n"
+    ".code32\n"
+    "limine_ap_pm:\n"
+    "    movw $0x20, %ax\n"
+    "    movw %ax, %ds\n"
+    "    movw %ax, %es\n"
+    "    movw %ax, %ss\n"
+    "    movl %cr4, %eax\n"
+    "    orl (limine_ap_cr4 - limine_ap_trampoline)(%ebx), %eax\n"
+    "    movl %eax, %cr4\n"
+    "    movl (limine_ap_cr3 - limine_ap_trampoline)(%ebx), %eax\n"
+    "    movl %eax, %cr3\n"
+    "    movl $0xC0000080, %ecx\n"
+    "    rdmsr\n"
+    "    orl $0x100, %eax\n"
+    "    wrmsr\n"
+    "    movl %cr0, %eax\n"
+    "    orl $0x80000000, %eax\n"
+    "    movl %eax, %cr0\n"
+    "    ljmpl *(limine_ap_lm_target - limine_ap_trampoline)(%ebx)\n"
+    ".code64\n"
+    "limine_ap_lm:\n"
+    "    movw $0x30, %ax\n"
+    "    movw %ax, %ds\n"
+    "    movw %ax, %es\n"
+    "    movw %ax, %ss\n"
+    "    movw %ax, %fs\n"
+    "    movw %ax, %gs\n"
+    "    movl $1, %eax\n"
+    "    lock xaddl %eax, limine_ap_next(%rip)\n"
+    "    cmpl limine_ap_max(%rip), %eax\n"
+    "    jae 2f\n"
+    "    incl %eax\n"
+    "    imulq limine_ap_stack_size(%rip), %rax\n"
+    "    addq limine_ap_stacks(%rip), %rax\n"
+    "    movq %rax, %rsp\n"
+    "    movq %rax, %rsi\n"
+    "    movq limine_ap_arg(%rip), %rdi\n"
+    "    callq *limine_ap_entry(%rip)\n"
+    "2:  cli\n"
+    "    hlt\n"
+    "    jmp 2b\n"
+    "limine_mode_switch:\n"
+    "    leaq limine_mode_stack_top(%rip), %rsp\n"
+    "    movw $0x20, %ax\n"
+    "    movw %ax, %ds\n"
+    "    movw %ax, %es\n"
+    "    movw %ax, %ss\n"
+    "    pushq $0x18\n"
+    "    leaq limine_mode_pm(%rip), %rax\n"
+    "    pushq %rax\n"
+    "    lretq\n"
+    ".code32\n"
+    "limine_mode_pm:\n"
+    "    movl %cr0, %eax\n"
+    "    andl $0x7FFFFFFF, %eax\n"
+    "    movl %eax, %cr0\n"
+    "    call limine_mode_here\n"
+    "limine_mode_here:\n"
+    "    popl %ebx\n"
+    "    movl (limine_mode_cr4 - limine_mode_here)(%ebx), %eax\n"
+    "    movl %eax, %cr4\n"
+    "    movl (limine_ap_cr3 - limine_mode_here)(%ebx), %eax\n"
+    "    movl %eax, %cr3\n"
+    "    movl %cr0, %eax\n"
+    "    orl $0x80000000, %eax\n"
+    "    movl %eax, %cr0\n"
+    "    leal (limine_mode_lm - limine_mode_here)(%ebx), %eax\n"
+    "    pushl $0x28\n"
+    "    pushl %eax\n"
+    "    lretl\n"
+    ".code64\n"
+    "limine_mode_lm:\n"
+    "    movq limine_mode_gdtr(%rip), %rax\n"
+    "    lgdt (%rax)\n"
+    "    movw $0x30, %ax\n"
+    "    movw %ax, %ds\n"
+    "    movw %ax, %es\n"
+    "    movw %ax, %ss\n"
+    "    movw %ax, %fs\n"
+    "    movw %ax, %gs\n"
+    "    movq limine_mode_stack(%rip), %rsp\n"
+    "    xorl %ebp, %ebp\n"
+    "    pushq $0\n"
+    "    jmpq *limine_mode_entry(%rip)\n"
+    "    .balign 8\n"
+    "limine_ap_gdt:\n"
+    "    .fill 7, 8, 0\n"
+    "limine_ap_gdtr:\n"
+    "    .word 0\n"
+    "    .quad 0\n"
+    "    .balign 4\n"
+    "limine_ap_pm_target:\n"
+    "    .long 0\n"
+    "    .word 0x18\n"
+    "limine_ap_lm_target:\n"
+    "    .long 0\n"
+    "    .word 0x28\n"
+    "    .balign 8\n"
+    "limine_ap_cr3:\n"
+    "    .quad 0\n"
+    "limine_ap_cr4:\n"
+    "    .quad 0\n"
+    "limine_ap_stacks:\n"
+    "    .quad 0\n"
+    "limine_ap_stack_size:\n"
+    "    .quad 0\n"
+    "limine_ap_entry:\n"
+    "    .quad 0\n"
+    "limine_ap_arg:\n"
+    "    .quad 0\n"
+    "limine_ap_next:\n"
+    "    .long 0\n"
+    "limine_ap_max:\n"
+    "    .long 0\n"
+    "limine_mode_cr4:\n"
+    "    .quad 0\n"
+    "limine_mode_gdtr:\n"
+    "    .quad 0\n"
+    "limine_mode_stack:\n"
+    "    .quad 0\n"
+    "limine_mode_entry:\n"
+    "    .quad 0\n"
+    "    .fill 64, 1, 0\n"
+    "limine_mode_stack_top:\n"
+    "limine_ap_trampoline_end:\n"
+    ".popsection\n"
+);
+
+// What the APs need from the BSP while they wait for the kernel
+struct limine_ap_park {
+    struct limine_smp_info* cpus;       // Identity addresses, cpu_count of them
+    uint64_t cpu_count;
+    uint64_t gdtr;                      // The GDT the BSP enters the kernel with
+    volatile uint32_t parked;
 };
 
-struct limine_framebuffer_request framebuffer_request = {
-    .id = LIMINE_FRAMEBUFFER_REQUEST,
-    .revision = 0
+static uint32_t limine_lapic_id(void) {
+    uint32_t eax = 0, ebx, ecx = 0, edx;
+    asm volatile ("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    if (eax >= 0xB) {
+        eax = 0xB;
+        ecx = 0;
+        asm volatile ("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+        if (ebx) return edx;
+    }
+    eax = 1;
+    asm volatile ("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    return ebx >> 24;
+}
+
+static __attribute__((sysv_abi, noreturn, used)) void limine_ap_park(struct limine_ap_park* park, uint64_t stack_top) {
+    uint32_t id = limine_lapic_id();
+    struct limine_smp_info* self = NULL;
+    for (uint64_t i = 0; i < park->cpu_count; i++) {
+        if (park->cpus[i].lapic_id == id) self = &park->cpus[i];
+    }
+    __atomic_fetch_add(&park->parked, 1, __ATOMIC_RELEASE);
+    if (!self) {
+        for (;;) asm volatile ("cli; hlt");
+    }
+
+    uint64_t go;
+    while (!(go = __atomic_load_n(&self->goto_address, __ATOMIC_ACQUIRE))) {
+        asm volatile ("pause");
+    }
+    asm volatile ("lgdt (%0)\n\t"
+                  "leaq (%1,%2), %%rsp\n\t"
+                  "movq %3, %%rdi\n\t"
+                  "xorl %%ebp, %%ebp\n\t"
+                  "pushq $0\n\t"
+                  "jmpq *%4"
+                  : : "r"(park->gdtr), "r"(stack_top), "r"(limine_hhdm_offset),
+                      "r"((uint64_t)(uintptr_t)limine_hhdm(self)), "r"(go)
+                  : "rdi", "memory");
+    __builtin_unreachable();
+}
+
+static uint64_t limine_tsc(void) {
+    uint32_t lo, hi;
+    asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static void limine_delay(uint64_t tsc_per_us, uint64_t us) {
+    uint64_t start = limine_tsc();
+    while (limine_tsc() - start < us * tsc_per_us) {
+        asm volatile ("pause");
+    }
+}
+
+// Send an IPI to every CPU but this one
+static void limine_ipi_others(uint32_t icr) {
+    uint32_t lo, hi;
+    asm volatile ("rdmsr" : "=a"(lo), "=d"(hi) : "c"(0x1B));
+    if (lo & (1u << 10)) {
+        asm volatile ("wrmsr" : : "c"(0x830), "a"(icr), "d"(0));
+        return;
+    }
+    volatile uint32_t* apic = (volatile uint32_t*)(uintptr_t)((((uint64_t)hi << 32) | lo) & ~0xFFFULL);
+    apic[0x310 / 4] = 0;
+    apic[0x300 / 4] = icr;
+    while (apic[0x300 / 4] & (1u << 12)) {
+        asm volatile ("pause");
+    }
+}
+
+struct limine_smp_boot {
+    uint8_t* trampoline;
+    struct limine_ap_park* park;
+    uint64_t tsc_per_us;
 };
 
-int limine_load_kernel(const char* kernel_path, const char* cmdline) {
-    uint8_t* kernel_data = NULL;
-    uint32_t kernel_size = 0;
-    
-    // Load kernel file
-    if (load_file(kernel_path, &kernel_data, &kernel_size) != 0) {
-        return -1;
+#define LIMINE_LOW(page, field) ((page) + ((field) - limine_ap_trampoline))
+
+// Copy the trampoline to its page below 1 MiB and fill in what every user
+// of it needs: the GDT, the far jump targets and the kernel's page tables
+static void limine_low_install(uint8_t* page, const struct paging* pt) {
+    uint32_t base = (uint32_t)(uintptr_t)page;
+    memcpy(page, limine_ap_trampoline, limine_ap_trampoline_end - limine_ap_trampoline);
+    memcpy(LIMINE_LOW(page, limine_ap_gdt), limine_gdt, sizeof(limine_gdt));
+
+    uint16_t gdt_limit = sizeof(limine_gdt) - 1;
+    uint64_t gdt_base = (uint64_t)(uintptr_t)LIMINE_LOW(page, limine_ap_gdt);
+    memcpy(LIMINE_LOW(page, limine_ap_gdtr), &gdt_limit, 2);
+    memcpy(LIMINE_LOW(page, limine_ap_gdtr) + 2, &gdt_base, 8);
+
+    uint32_t pm = base + (uint32_t)(limine_ap_pm - limine_ap_trampoline);
+    uint32_t lm = base + (uint32_t)(limine_ap_lm - limine_ap_trampoline);
+    memcpy(LIMINE_LOW(page, limine_ap_pm_target), &pm, 4);
+    memcpy(LIMINE_LOW(page, limine_ap_lm_target), &lm, 4);
+
+    uint64_t cr3 = paging_root(pt);
+    uint64_t cr4 = 0x20 | (pt->levels == 5 ? LIMINE_CR4_LA57 : 0);     // PAE, and LA57 with five levels
+    memcpy(LIMINE_LOW(page, limine_ap_cr3), &cr3, 8);
+    memcpy(LIMINE_LOW(page, limine_ap_cr4), &cr4, 8);
+}
+
+// Everything the APs need is laid out before boot services go away; they
+// are only woken after. Without an SMP request they are left where the
+// firmware put them, and without a low page they are left out.
+static int limine_smp_prepare(struct limine_info* info, struct limine_smp_request* request, uint8_t* low,
+                              const struct limine_gdtr* gdtr, uint64_t stack_size, struct limine_smp_boot* smp) {
+    uint32_t ids[FIRMWARE_MAX_CPUS];
+    uint32_t bsp = 0;
+    uint32_t count = firmware_cpu_ids(ids, FIRMWARE_MAX_CPUS, &bsp);
+    if (!count) return -1;
+    if (!low) {
+        ids[0] = ids[bsp];
+        bsp = 0;
+        count = 1;
     }
-    
-    // Parse ELF header
-    struct elf64_header* elf_header = (struct elf64_header*)kernel_data;
-    
-    // Verify ELF magic
-    if (memcmp(elf_header->e_ident, ELF_MAGIC, 4) != 0) {
-        return -1;
+
+    struct limine_smp_response* response = (struct limine_smp_response*)limine_info_alloc(info, sizeof(*response));
+    struct limine_smp_info* cpus = (struct limine_smp_info*)limine_info_alloc(info, count * sizeof(*cpus));
+    struct limine_smp_info** pointers = (struct limine_smp_info**)limine_info_alloc(info, count * sizeof(*pointers));
+    struct limine_ap_park* park = (struct limine_ap_park*)limine_info_alloc(info, sizeof(*park));
+    if (!response || !cpus || !pointers || !park) return -1;
+
+    for (uint32_t i = 0; i < count; i++) {
+        cpus[i].processor_id = i;
+        cpus[i].lapic_id = ids[i];
+        pointers[i] = (struct limine_smp_info*)limine_hhdm(&cpus[i]);
     }
-    
-    // Verify it's a 64-bit ELF
-    if (elf_header->e_ident[EI_CLASS] != ELFCLASS64) {
-        return -1;
+    park->cpus = cpus;
+    park->cpu_count = count;
+    park->gdtr = (uint64_t)(uintptr_t)gdtr;
+
+    memset(smp, 0, sizeof(*smp));
+    if (count > 1) {
+        uint8_t* stacks = (uint8_t*)limine_reclaimable((count - 1) * stack_size, PAGING_TABLE_LIMIT);
+        if (!stacks) return -1;
+
+        uint64_t stacks_base = (uint64_t)(uintptr_t)stacks;
+        uint64_t entry = (uint64_t)(uintptr_t)limine_ap_park;
+        uint64_t arg = (uint64_t)(uintptr_t)park;
+        uint32_t max = count - 1;
+        memcpy(LIMINE_LOW(low, limine_ap_stacks), &stacks_base, 8);
+        memcpy(LIMINE_LOW(low, limine_ap_stack_size), &stack_size, 8);
+        memcpy(LIMINE_LOW(low, limine_ap_entry), &entry, 8);
+        memcpy(LIMINE_LOW(low, limine_ap_arg), &arg, 8);
+        memcpy(LIMINE_LOW(low, limine_ap_max), &max, 4);
+
+        // The TSC is the only clock left once boot services are gone
+        uint64_t start = limine_tsc();
+        firmware_stall(1000);
+        smp->tsc_per_us = (limine_tsc() - start) / 1000;
+        if (!smp->tsc_per_us) smp->tsc_per_us = 1;
+        smp->trampoline = low;
     }
-    
-    // Load kernel to preferred address
-    uint64_t load_addr = 0x200000; // 2MB
-    if (elf_header->e_entry >= 0xffffffff80000000) {
-        load_addr = elf_header->e_entry;
-    }
-    
-    // Load ELF segments
-    struct elf64_phdr* phdr = (struct elf64_phdr*)(kernel_data + elf_header->e_phoff);
-    for (int i = 0; i < elf_header->e_phnum; i++) {
-        if (phdr[i].p_type == PT_LOAD) {
-            uint64_t vaddr = phdr[i].p_vaddr;
-            if (vaddr >= 0xffffffff80000000) {
-                vaddr -= 0xffffffff80000000;
-                vaddr += load_addr;
-            }
-            
-            memcpy((void*)vaddr, kernel_data + phdr[i].p_offset, phdr[i].p_filesz);
-            
-            // Zero out BSS
-            if (phdr[i].p_memsz > phdr[i].p_filesz) {
-                memset((void*)(vaddr + phdr[i].p_filesz), 0, phdr[i].p_memsz - phdr[i].p_filesz);
-            }
+    smp->park = park;
+
+    uint32_t lo, hi;
+    asm volatile ("rdmsr" : "=a"(lo), "=d"(hi) : "c"(0x1B));
+    response->flags = (lo & (1u << 10)) ? LIMINE_SMP_X2APIC : 0;
+    response->bsp_lapic_id = ids[bsp];
+    response->cpu_count = count;
+    response->cpus = (struct limine_smp_info**)limine_hhdm(pointers);
+    request->response = (struct limine_smp_response*)limine_hhdm(response);
+    return 0;
+}
+
+// INIT, then SIPI twice, to all but the BSP, and wait for them to park
+static void limine_smp_start(const struct limine_smp_boot* smp) {
+    if (!smp->trampoline) return;
+    uint32_t vector = (uint32_t)((uintptr_t)smp->trampoline >> 12);
+    limine_ipi_others(0x000C4500);
+    limine_delay(smp->tsc_per_us, 10000);
+    limine_ipi_others(0x000C4600 | vector);
+    limine_delay(smp->tsc_per_us, 200);
+    limine_ipi_others(0x000C4600 | vector);
+
+    uint64_t start = limine_tsc();
+    while (smp->park->parked + 1 < smp->park->cpu_count &&
+           limine_tsc() - start < LIMINE_AP_TIMEOUT_US * smp->tsc_per_us) {
+        asm volatile ("pause");
+    }
+}
+
+static __attribute__((noreturn)) void limine_enter(uint64_t cr3, const struct limine_gdtr* gdtr,
+                                                   uint64_t stack, uint64_t entry) {
+    asm volatile ("cli\n\t"
+                  "lgdt (%0)\n\t"
+                  "movq %1, %%cr3\n\t"
+                  "movq %2, %%rsp\n\t"
+                  "pushq %4\n\t"
+                  "leaq 1f(%%rip), %%rax\n\t"
+                  "pushq %%rax\n\t"
+                  "lretq\n"
+                  "1:\n\t"
+                  "movl %5, %%eax\n\t"
+                  "movw %%ax, %%ds\n\t"
+                  "movw %%ax, %%es\n\t"
+                  "movw %%ax, %%ss\n\t"
+                  "movw %%ax, %%fs\n\t"
+                  "movw %%ax, %%gs\n\t"
+                  "xorl %%ebp, %%ebp\n\t"
+                  "pushq $0\n\t"
+                  "jmpq *%3"
+                  : : "r"(gdtr), "r"(cr3), "r"(stack), "r"(entry), "i"(LIMINE_CODE64), "i"(LIMINE_DATA64)
+                  : "rax", "memory");
+    __builtin_unreachable();
+}
+
+// Enter with a different paging depth than the firmware's, through the
+// low page; its GDT is the one reachable under both sets of tables
+static __attribute__((noreturn)) void limine_enter_switch(uint8_t* low, int la57, const struct limine_gdtr* gdtr,
+                                                          uint64_t stack, uint64_t entry) {
+    uint64_t cr4;
+    asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+    cr4 &= ~LIMINE_CR4_PCIDE;       // Paging cannot be turned off with PCIDs on
+    asm volatile ("mov %0, %%cr4" : : "r"(cr4) : "memory");
+    cr4 = la57 ? (cr4 | LIMINE_CR4_LA57) : (cr4 & ~LIMINE_CR4_LA57);
+
+    uint64_t gdtr_addr = (uint64_t)(uintptr_t)gdtr;
+    memcpy(LIMINE_LOW(low, limine_mode_cr4), &cr4, 8);
+    memcpy(LIMINE_LOW(low, limine_mode_gdtr), &gdtr_addr, 8);
+    memcpy(LIMINE_LOW(low, limine_mode_stack), &stack, 8);
+    memcpy(LIMINE_LOW(low, limine_mode_entry), &entry, 8);
+
+    asm volatile ("cli\n\t"
+                  "lgdt (%0)\n\t"
+                  "jmpq *%1"
+                  : : "r"(LIMINE_LOW(low, limine_ap_gdtr)), "r"(LIMINE_LOW(low, limine_mode_switch))
+                  : "memory");
+    __builtin_unreachable();
+}
+
+// Identity and HHDM maps of the memory map and the framebuffers, plus the
+// kernel's higher-half block at the address it was linked for
+static int limine_map(struct paging* pt, int la57, const struct elf_image* img,
+                      const struct firmware_framebuffer* fb, uint32_t fb_count) {
+    uint64_t ram_start = 0, top = 0;
+    place_ram_bounds(&ram_start, &top);
+    if (top < PLACE_LIMIT_4G + 1) top = PLACE_LIMIT_4G + 1;
+    uint64_t span = 2 * top + img->high_span;
+    for (uint32_t i = 0; i < fb_count; i++) {
+        span += 2 * fb[i].size;
+    }
+
+    if (paging_init(pt, span, la57 ? PAGING_LA57 : 0) != 0) return -1;
+    limine_hhdm_offset = pt->levels == 5 ? LIMINE_HHDM_OFFSET_5LVL : LIMINE_HHDM_OFFSET;
+    if (paging_map_memory(pt, 0, PAGING_WRITE) != 0) goto fail;
+    if (paging_map_memory(pt, limine_hhdm_offset, PAGING_WRITE) != 0) goto fail;
+
+    // Framebuffers are usually reserved in the map, so they get their own
+    for (uint32_t i = 0; i < fb_count; i++) {
+        uint64_t base = fb[i].base & ~(PAGING_SIZE_4K - 1);
+        uint64_t end = (fb[i].base + fb[i].size + PAGING_SIZE_4K - 1) & ~(PAGING_SIZE_4K - 1);
+        if (end <= PLACE_LIMIT_4G + 1) continue;
+        if (base <= PLACE_LIMIT_4G) base = PLACE_LIMIT_4G + 1;
+        if (paging_map(pt, base, base, end - base, PAGING_WRITE | PAGING_PWT) != 0) goto fail;
+        if (paging_map(pt, base + limine_hhdm_offset, base, end - base, PAGING_WRITE | PAGING_PWT) != 0) goto fail;
+    }
+
+    if (img->high_span) {
+        uint64_t span_2m = (img->high_span + PAGING_SIZE_2M - 1) & ~(PAGING_SIZE_2M - 1);
+        if (paging_map(pt, img->high_virt, img->high_phys, span_2m, PAGING_WRITE) != 0) goto fail;
+    }
+    paging_trim(pt);
+    return 0;
+
+fail:
+    paging_release(pt);
+    return -1;
+}
+
+// Fill in every response the kernel asked for except the memory map,
+// which has to come after the last allocation
+static int limine_respond(struct limine_info* info, const struct limine_requests* req, int la57,
+                          const struct elf_image* img, const struct firmware_framebuffer* fb, uint32_t fb_count,
+                          const void* kernel_file, uint64_t kernel_size, const char* path, const char* cmdline) {
+    if (req->framebuffer && fb_count) {
+        struct limine_framebuffer_response* response = limine_info_alloc(info, sizeof(*response));
+        struct limine_framebuffer* fbs = limine_info_alloc(info, fb_count * sizeof(*fbs));
+        struct limine_framebuffer** pointers = limine_info_alloc(info, fb_count * sizeof(*pointers));
+        if (!response || !fbs || !pointers) return -1;
+        for (uint32_t i = 0; i < fb_count; i++) {
+            fbs[i].address = limine_hhdm((void*)(uintptr_t)fb[i].base);
+            fbs[i].width = fb[i].width;
+            fbs[i].height = fb[i].height;
+            fbs[i].pitch = fb[i].pitch;
+            fbs[i].bpp = fb[i].bpp;
+            fbs[i].memory_model = LIMINE_FRAMEBUFFER_RGB;
+            fbs[i].red_mask_size = fb[i].red_size;
+            fbs[i].red_mask_shift = fb[i].red_shift;
+            fbs[i].green_mask_size = fb[i].green_size;
+            fbs[i].green_mask_shift = fb[i].green_shift;
+            fbs[i].blue_mask_size = fb[i].blue_size;
+            fbs[i].blue_mask_shift = fb[i].blue_shift;
+            pointers[i] = limine_hhdm(&fbs[i]);
+        }
+        response->framebuffer_count = fb_count;
+        response->framebuffers = limine_hhdm(pointers);
+        req->framebuffer->response = limine_hhdm(response);
+    }
+
+    if (req->hhdm) {
+        struct limine_hhdm_response* response = limine_info_alloc(info, sizeof(*response));
+        if (!response) return -1;
+        response->offset = limine_hhdm_offset;
+        req->hhdm->response = limine_hhdm(response);
+    }
+
+    if (req->rsdp && firmware_acpi_rsdp()) {
+        struct limine_rsdp_response* response = limine_info_alloc(info, sizeof(*response));
+        if (!response) return -1;
+        response->address = limine_hhdm(firmware_acpi_rsdp());
+        req->rsdp->response = limine_hhdm(response);
+    }
+
+    if (req->smbios && (firmware_smbios_entry32() || firmware_smbios_entry64())) {
+        struct limine_smbios_response* response = limine_info_alloc(info, sizeof(*response));
+        if (!response) return -1;
+        response->entry_32 = limine_hhdm(firmware_smbios_entry32());
+        response->entry_64 = limine_hhdm(firmware_smbios_entry64());
+        req->smbios->response = limine_hhdm(response);
+    }
+
+    if (req->efi_system_table && firmware_system_table()) {
+        struct limine_efi_system_table_response* response = limine_info_alloc(info, sizeof(*response));
+        if (!response) return -1;
+        response->address = limine_hhdm(firmware_system_table());
+        req->efi_system_table->response = limine_hhdm(response);
+    }
+
+    if (req->kernel_address) {
+        struct limine_kernel_address_response* response = limine_info_alloc(info, sizeof(*response));
+        if (!response) return -1;
+        if (img->high_span) {
+            response->physical_base = img->high_phys;
+            response->virtual_base = img->high_virt;
+        } else {
+            response->physical_base = img->segments[0].paddr;
+            response->virtual_base = img->segments[0].vaddr;
+        }
+        req->kernel_address->response = limine_hhdm(response);
+    }
+
+    if (req->kernel_file && kernel_file) {
+        struct limine_kernel_file_response* response = limine_info_alloc(info, sizeof(*response));
+        struct limine_file* file = limine_describe_file(info, kernel_file, kernel_size, path ? path : "", cmdline);
+        if (!response || !file) return -1;
+        response->kernel_file = limine_hhdm(file);
+        req->kernel_file->response = limine_hhdm(response);
+    }
+
+    if (req->module) {
+        struct limine_module_response* response = limine_info_alloc(info, sizeof(*response));
+        struct limine_file** pointers = limine_info_alloc(info, (module_count ? module_count : 1) * sizeof(*pointers));
+        if (!response || !pointers) return -1;
+        for (uint32_t i = 0; i < module_count; i++) {
+            struct limine_file* file = limine_describe_file(info, modules[i].data, modules[i].size,
+                                                            modules[i].path, modules[i].cmdline);
+            if (!file) return -1;
+            pointers[i] = limine_hhdm(file);
         }
+        response->module_count = module_count;
+        response->modules = limine_hhdm(pointers);
+        req->module->response = limine_hhdm(response);
+    }
+
+    if (req->stack_size) {
+        struct limine_stack_size_response* response = limine_info_alloc(info, sizeof(*response));
+        if (!response) return -1;
+        req->stack_size->response = limine_hhdm(response);
+    }
+
+    if (req->paging_mode) {
+        struct limine_paging_mode_response* response = limine_info_alloc(info, sizeof(*response));
+        if (!response) return -1;
+        response->mode = la57 ? LIMINE_PAGING_MODE_X86_64_5LVL : LIMINE_PAGING_MODE_X86_64_4LVL;
+        req->paging_mode->response = limine_hhdm(response);
+    }
+
+    if (req->level5 && la57) {
+        struct limine_5_level_paging_response* response = limine_info_alloc(info, sizeof(*response));
+        if (!response) return -1;
+        req->level5->response = limine_hhdm(response);
+    }
+
+    if (req->loader_info) {
+        struct limine_loader_info_response* response = limine_info_alloc(info, sizeof(*response));
+        char* name = limine_info_string(info, LIMINE_LOADER_NAME);
+        char* version = limine_info_string(info, LIMINE_LOADER_VERSION);
+        if (!response || !name || !version) return -1;
+        response->name = limine_hhdm(name);
+        response->version = limine_hhdm(version);
+        req->loader_info->response = limine_hhdm(response);
+    }
+
+    if (req->entry_point && req->entry_point->entry) {
+        struct limine_entry_point_response* response = limine_info_alloc(info, sizeof(*response));
+        if (!response) return -1;
+        req->entry_point->response = limine_hhdm(response);
     }
-    
-    // Setup Limine requests
-    struct limine_memmap_response* memmap_response = allocate_memory(sizeof(struct limine_memmap_response));
-    memmap_response->entry_count = 1;
-    memmap_response->entries = allocate_memory(sizeof(struct limine_memmap_entry));
-    memmap_response->entries[0].base = 0;
-    memmap_response->entries[0].length = 0x100000000; // 4GB
-    memmap_response->entries[0].type = LIMINE_MEMMAP_USABLE;
-    
-    struct limine_kernel_address_response* kernel_address_response = allocate_memory(sizeof(struct limine_kernel_address_response));
-    kernel_address_response->physical_base = load_addr;
-    kernel_address_response->virtual_base = 0xffffffff80000000;
-    
-    struct limine_hhdm_response* hhdm_response = allocate_memory(sizeof(struct limine_hhdm_response));
-    hhdm_response->offset = 0xffff800000000000;
-    
-    struct limine_framebuffer_response* framebuffer_response = allocate_memory(sizeof(struct limine_framebuffer_response));
-    framebuffer_response->framebuffer_count = 1;
-    framebuffer_response->framebuffers = allocate_memory(sizeof(struct limine_framebuffer));
-    framebuffer_response->framebuffers[0].address = 0xb8000;
-    framebuffer_response->framebuffers[0].width = 80;
-    framebuffer_response->framebuffers[0].height = 25;
-    framebuffer_response->framebuffers[0].pitch = 160;
-    framebuffer_response->framebuffers[0].bpp = 16;
-    framebuffer_response->framebuffers[0].memory_model = 1;
-    framebuffer_response->framebuffers[0].red_mask_size = 5;
-    framebuffer_response->framebuffers[0].red_mask_shift = 11;
-    framebuffer_response->framebuffers[0].green_mask_size = 6;
-    framebuffer_response->framebuffers[0].green_mask_shift = 5;
-    framebuffer_response->framebuffers[0].blue_mask_size = 5;
-    framebuffer_response->framebuffers[0].blue_mask_shift = 0;
-    
-    // Jump to kernel
-    void (*kernel_entry)(void) = (void*)elf_header->e_entry;
-    kernel_entry();
-    
     return 0;
 }
 
-int limine_verify_kernel(const char* kernel_path) {
-    uint8_t* kernel_data = NULL;
-    uint32_t kernel_size = 0;
-    
-    if (load_file(kernel_path, &kernel_data, &kernel_size) != 0) {
+static int limine_respond_memmap(struct limine_info* info, struct limine_memmap_request* request) {
+    struct limine_memmap_ctx memmap;
+    memmap.max = place_count();
+    memmap.response = limine_info_alloc(info, sizeof(*memmap.response));
+    memmap.entries = limine_info_alloc(info, memmap.max * sizeof(*memmap.entries));
+    memmap.pointers = limine_info_alloc(info, memmap.max * sizeof(*memmap.pointers));
+    if (!memmap.response || !memmap.entries || !memmap.pointers) return -1;
+    place_walk(limine_add_memmap, &memmap);
+    memmap.response->entries = limine_hhdm(memmap.pointers);
+    request->response = limine_hhdm(memmap.response);
+    return 0;
+}
+
+// Load the kernel, answer the requests found in it and enter it the way the
+// protocol describes: long mode on the loader's page tables with the HHDM
+// and identity maps, the protocol GDT, and a stack in reclaimable memory
+static int limine_boot(const struct elf_source* src, const char* path, const char* cmdline) {
+    // Higher-half segments are moved as one block to wherever the map has
+    // room for it; identity-mapped ones must get exactly their address
+    struct elf_load_policy policy = { LIMINE_KERNEL_VIRTUAL_BASE, LIMINE_KERNEL_ALIGN, 0, 0 };
+    struct elf_image img;
+    struct limine_requests req;
+    struct limine_info info;
+    struct firmware_framebuffer fb[FIRMWARE_MAX_FRAMEBUFFERS];
+    struct limine_smp_boot smp;
+    struct paging pt;
+    uint8_t* stack = NULL;
+    uint8_t* kernel_file = NULL;
+    uint8_t* low = NULL;
+
+    if (elf_load(src, &policy, &img) != 0) {
         return -1;
     }
-    
-    struct elf64_header* elf_header = (struct elf64_header*)kernel_data;
-    
-    // Check ELF magic
-    if (memcmp(elf_header->e_ident, ELF_MAGIC, 4) != 0) {
+    if (img.machine != EM_X86_64 || !img.segment_count) {
+        elf_release(&img);
         return -1;
     }
-    
-    // Check architecture
-    if (elf_header->e_machine != EM_X86_64) {
+    limine_scan(&img, &req);
+
+    memset(&info, 0, sizeof(info));
+    memset(&smp, 0, sizeof(smp));
+    memset(&pt, 0, sizeof(pt));
+    info.base = (uint8_t*)limine_reclaimable(LIMINE_INFO_SIZE, 0);
+    if (!info.base) {
+        elf_release(&img);
         return -1;
     }
-    
-    return 0;
-} 
+    memset(info.base, 0, LIMINE_INFO_SIZE);
 
-int boot_limine_kernel(uint8_t* kernel_data, uint32_t kernel_size, const char* cmdline) {
-    struct elf64_header* elf_header = (struct elf64_header*)kernel_data;
-    
-    if (elf_header->e_ident[0] != 0x7F || elf_header->e_ident[1] != 'E' || 
-        elf_header->e_ident[2] != 'L' || elf_header->e_ident[3] != 'F') {
+    uint64_t stack_size = LIMINE_STACK_SIZE;
+    if (req.stack_size && req.stack_size->stack_size > stack_size) {
+        stack_size = (req.stack_size->stack_size + PLACE_PAGE_SIZE - 1) & ~(PLACE_PAGE_SIZE - 1);
+    }
+    stack = (uint8_t*)limine_reclaimable(stack_size, 0);
+    if (!stack) goto fail;
+
+    // Only read the whole file again when the kernel wants to see it
+    if (req.kernel_file) {
+        struct place_request file_req = { src->size, PLACE_PAGE_SIZE, LIMINE_LOW_MEMORY, 0, PLACE_BEST_FIT };
+        kernel_file = (uint8_t*)place_alloc(&file_req);
+        if (!kernel_file || elf_source_read(src, kernel_file, 0, src->size) != 0) goto fail;
+    }
+
+    // Five levels when the kernel asks and the CPU can. The low page holds
+    // the AP trampoline and, when the depth differs from the firmware's,
+    // the way into the kernel.
+    int want_la57 = ((req.paging_mode && req.paging_mode->mode == LIMINE_PAGING_MODE_X86_64_5LVL) ||
+                     req.level5) && paging_has_la57();
+    int firmware_la57 = paging_la57_active();
+    if (req.smp || want_la57 != firmware_la57) {
+        low = (uint8_t*)limine_reclaimable(PLACE_PAGE_SIZE, LIMINE_TRAMPOLINE_LIMIT);
+    }
+    if (!low) want_la57 = firmware_la57;
+
+    uint32_t fb_count = firmware_framebuffers(fb, FIRMWARE_MAX_FRAMEBUFFERS);
+    if (limine_map(&pt, want_la57, &img, fb, fb_count) != 0) goto fail;
+    int la57 = pt.levels == 5;
+    if (low) limine_low_install(low, &pt);
+
+    struct limine_gdtr* gdtr = limine_info_alloc(&info, sizeof(*gdtr));
+    uint64_t* gdt = limine_info_alloc(&info, sizeof(limine_gdt));
+    if (!gdtr || !gdt) goto fail;
+    memcpy(gdt, limine_gdt, sizeof(limine_gdt));
+    gdtr->limit = sizeof(limine_gdt) - 1;
+    gdtr->base = (uint64_t)(uintptr_t)limine_hhdm(gdt);
+
+    if (req.smp && limine_smp_prepare(&info, req.smp, low, gdtr, stack_size, &smp) != 0) {
+        memset(&smp, 0, sizeof(smp));
+    }
+    if (limine_respond(&info, &req, la57, &img, fb, fb_count, kernel_file, src->size, path, cmdline) != 0) goto fail;
+    if (req.memmap && limine_respond_memmap(&info, req.memmap) != 0) goto fail;
+
+    if (req.base_revision && req.base_revision[2] <= LIMINE_BASE_REVISION_SUPPORTED) {
+        req.base_revision[2] = 0;
+    }
+    uint64_t entry = (req.entry_point && req.entry_point->entry) ? req.entry_point->entry : img.entry;
+    uint64_t stack_top = (uint64_t)(uintptr_t)limine_hhdm(stack + stack_size);
+
+    if (firmware_exit_boot_services(NULL) != 0) goto fail;
+    limine_smp_start(&smp);
+    if (la57 != firmware_la57) {
+        limine_enter_switch(low, la57, gdtr, stack_top, entry);
+    }
+    limine_enter(paging_root(&pt), gdtr, stack_top, entry);
+
+fail:
+    paging_release(&pt);
+    place_free(low, PLACE_PAGE_SIZE);
+    place_free(kernel_file, src->size);
+    place_free(stack, stack_size);
+    place_free(info.base, LIMINE_INFO_SIZE);
+    elf_release(&img);
+    return -1;
+}
+
+#else
+
+// The protocol is only defined here for x86-64 kernels
+static int limine_boot(const struct elf_source* src, const char* path, const char* cmdline) {
+    (void)src;
+    (void)path;
+    (void)cmdline;
+    return -1;
+}
+
+#endif
+
+int limine_load_kernel(const char* kernel_path, const char* cmdline) {
+    struct elf_source src;
+
+    if (elf_source_open(&src, kernel_path) != 0) {
+        return -1;
+    }
+    int r = limine_boot(&src, kernel_path, cmdline);
+    elf_source_close(&src);
+    return r;
+}
+
+int limine_verify_kernel(const char* kernel_path) {
+    struct elf_source src;
+    struct elf64_header elf_header;
+
+    // The ELF header is all this needs, so nothing else is read
+    if (elf_source_open(&src, kernel_path) != 0) {
         return -1;
     }
-    
-    if (elf_header->e_type != 2) {
+    int r = elf_source_read(&src, &elf_header, 0, sizeof(elf_header));
+    elf_source_close(&src);
+    if (r != 0) {
         return -1;
     }
-    
-    uint64_t entry_point = elf_header->e_entry;
-    struct elf64_phdr* phdr = (struct elf64_phdr*)(kernel_data + elf_header->e_phoff);
-    
-    for (int i = 0; i < elf_header->e_phnum; i++) {
-        if (phdr[i].p_type == 1) {
-            memcpy((void*)phdr[i].p_vaddr, kernel_data + phdr[i].p_offset, phdr[i].p_filesz);
-            if (phdr[i].p_memsz > phdr[i].p_filesz) {
-                memset((void*)(phdr[i].p_vaddr + phdr[i].p_filesz), 0, phdr[i].p_memsz - phdr[i].p_filesz);
-            }
-        }
+
+    // Check ELF magic
+    if (memcmp(elf_header.e_ident, ELF_MAGIC, 4) != 0) {
+        return -1;
+    }
+
+    // Check architecture
+    if (elf_header.e_machine != EM_X86_64) {
+        return -1;
     }
-    
-    struct limine_kernel_file_response* kernel_response = (struct limine_kernel_file_response*)0x1000;
-    kernel_response->revision = 0;
-    kernel_response->kernel_file = (struct limine_file*)0x1100;
-    kernel_response->kernel_file->revision = 0;
-    kernel_response->kernel_file->address = (void*)0x100000;
-    kernel_response->kernel_file->size = kernel_size;
-    kernel_response->kernel_file->path = (char*)0x1200;
-    kernel_response->kernel_file->cmdline = (char*)0x1300;
-    
-    if (cmdline && strlen(cmdline) > 0) {
-        strcpy(kernel_response->kernel_file->cmdline, cmdline);
-    }
-    
-    void (*entry)(void) = (void*)entry_point;
-    entry();
-    
+
     return 0;
-} 
\ No newline at end of file
+}
+
+int boot_limine_kernel(uint8_t* kernel_data, uint32_t kernel_size, const char* cmdline) {
+    struct elf_source src;
+
+    elf_source_buffer(&src, kernel_data, kernel_size);
+    return limine_boot(&src, NULL, cmdline);
+}
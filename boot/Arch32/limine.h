@@ -10,29 +10,45 @@
 
 #include <stdint.h>
 #include "compat.h"
-
-// Limine protocol request IDs (fixed duplicate values)
-#define LIMINE_ENTRY_REQUEST                0x13a86c035aa1c6d5ULL
-#define LIMINE_FRAMEBUFFER_REQUEST          0x9d5827dcd881dd75ULL
-#define LIMINE_TERMINAL_REQUEST             0xc8ac59310c2b0844ULL
-#define LIMINE_5_LEVEL_PAGING_REQUEST       0x94469551da9b3192ULL
-#define LIMINE_SMP_REQUEST                  0x95a67b819a1b857eULL
-#define LIMINE_MEMMAP_REQUEST               0x67cf3d9d378a806fULL
-#define LIMINE_KERNEL_FILE_REQUEST          0xad97e90e83f1ed67ULL
-#define LIMINE_MODULE_REQUEST               0x3e7e279702be32afULL
-#define LIMINE_RSDP_REQUEST                 0xc5e77b6b397e7b43ULL
-#define LIMINE_SMBIOS_REQUEST               0x9a904e30eb8c97c9ULL
-#define LIMINE_EFI_SYSTEM_TABLE_REQUEST     0x5ceba5163eaaf6d6ULL
-#define LIMINE_BOOT_TIME_REQUEST            0x502746e184c088aaULL
-#define LIMINE_KERNEL_ADDRESS_REQUEST       0x71ba76863cc55f63ULL
-#define LIMINE_HHDM_REQUEST                 0x48dcf1cb8ad2b852ULL
-#define LIMINE_STACK_SIZE_REQUEST           0xebeef7ca23e25b4bULL
-#define LIMINE_BASE_VIRTUAL_ADDRESS_REQUEST 0x0c1e4a5c8f8c3941ULL
-#define LIMINE_KERNEL_ADDRESS_VIRT_REQUEST  0x3464ae692c2d8f36ULL
-#define LIMINE_DTB_REQUEST                  0xb40ddb48d54c097aULL
-#define LIMINE_VMAP_REQUEST                 0xb0fb35bf0c847f0fULL
-#define LIMINE_LOADER_INFO_REQUEST          0xf55038d8e2a1202fULL
-#define LIMINE_PAGING_MODE_REQUEST          0xc5e77c404f100d86ULL
+#include "elf_loader.h"
+
+// Limine protocol request IDs. A request is a structure anywhere in the
+// kernel's loaded image whose first two words are the common magic.
+#define LIMINE_COMMON_MAGIC_0               0xc7b1dd30df4c8b88ULL
+#define LIMINE_COMMON_MAGIC_1               0x0a82e883a194f07bULL
+#define LIMINE_COMMON_MAGIC                 LIMINE_COMMON_MAGIC_0, LIMINE_COMMON_MAGIC_1
+
+#define LIMINE_ENTRY_REQUEST                { LIMINE_COMMON_MAGIC, 0x13d86c035a1cd3e1ULL, 0x2b0caa89d8f3026aULL }
+#define LIMINE_FRAMEBUFFER_REQUEST          { LIMINE_COMMON_MAGIC, 0x9d5827dcd881dd75ULL, 0xa3148604f6fab11bULL }
+#define LIMINE_TERMINAL_REQUEST             { LIMINE_COMMON_MAGIC, 0xc8ac59310c2b0844ULL, 0xa68d0c7265d38878ULL }
+#define LIMINE_5_LEVEL_PAGING_REQUEST       { LIMINE_COMMON_MAGIC, 0x94469551da9b3192ULL, 0xebe5e86db7382888ULL }
+#define LIMINE_SMP_REQUEST                  { LIMINE_COMMON_MAGIC, 0x95a67b819a1b857eULL, 0xa0b61b723b6a73e0ULL }
+#define LIMINE_MEMMAP_REQUEST               { LIMINE_COMMON_MAGIC, 0x67cf3d9d378a806fULL, 0xe304acdfc50c3c62ULL }
+#define LIMINE_KERNEL_FILE_REQUEST          { LIMINE_COMMON_MAGIC, 0xad97e90e83f1ed67ULL, 0x31eb5d1c5ff23b69ULL }
+#define LIMINE_MODULE_REQUEST               { LIMINE_COMMON_MAGIC, 0x3e7e279702be32afULL, 0xca1c4f3bd1280ceeULL }
+#define LIMINE_RSDP_REQUEST                 { LIMINE_COMMON_MAGIC, 0xc5e77b6b397e7b43ULL, 0x27637845accdcf3cULL }
+#define LIMINE_SMBIOS_REQUEST               { LIMINE_COMMON_MAGIC, 0x9e9046f11e095391ULL, 0xaa4a520fefbde5eeULL }
+#define LIMINE_EFI_SYSTEM_TABLE_REQUEST     { LIMINE_COMMON_MAGIC, 0x5ceba5163eaaf6d6ULL, 0x0a6981610cf65fccULL }
+#define LIMINE_BOOT_TIME_REQUEST            { LIMINE_COMMON_MAGIC, 0x502746e184c088aaULL, 0xfbc5ec83e6327893ULL }
+#define LIMINE_KERNEL_ADDRESS_REQUEST       { LIMINE_COMMON_MAGIC, 0x71ba76863cc55f63ULL, 0xb2644a48c516a487ULL }
+#define LIMINE_HHDM_REQUEST                 { LIMINE_COMMON_MAGIC, 0x48dcf1cb8ad2b852ULL, 0x63984e959a98244bULL }
+#define LIMINE_STACK_SIZE_REQUEST           { LIMINE_COMMON_MAGIC, 0x224ef0460a8e8926ULL, 0xe1cb0fc25f46ea3dULL }
+#define LIMINE_DTB_REQUEST                  { LIMINE_COMMON_MAGIC, 0xb40ddb48fb54bac7ULL, 0x545081493f81ffb7ULL }
+#define LIMINE_LOADER_INFO_REQUEST          { LIMINE_COMMON_MAGIC, 0xf55038d8e2a1202fULL, 0x279426fcf5f59740ULL }
+#define LIMINE_PAGING_MODE_REQUEST          { LIMINE_COMMON_MAGIC, 0x95c1a0edab0944cbULL, 0xa4e5cb3842f7488aULL }
+
+// The kernel states the protocol revision it was written for; the loader
+// zeroes the last word when it can provide it
+#define LIMINE_BASE_REVISION_MAGIC_0        0xf9562b2d5c95a6c8ULL
+#define LIMINE_BASE_REVISION_MAGIC_1        0x6a7b384944536bdcULL
+#define LIMINE_BASE_REVISION_SUPPORTED      1
+
+#define LIMINE_PAGING_MODE_X86_64_4LVL      0
+#define LIMINE_PAGING_MODE_X86_64_5LVL      1
+
+#define LIMINE_SMP_X2APIC                   (1 << 0)
+#define LIMINE_FRAMEBUFFER_RGB              1
+#define LIMINE_MEDIA_TYPE_GENERIC           0
 
 // Limine memory map types
 #define LIMINE_MEMMAP_USABLE                0
@@ -44,46 +60,13 @@
 #define LIMINE_MEMMAP_KERNEL_AND_MODULES    6
 #define LIMINE_MEMMAP_FRAMEBUFFER           7
 
-// ELF constants
-#define ELF_MAGIC   "\x7f\x45\x4c\x46"
-#define ELFCLASS64  2
-#define EM_X86_64   62
-#define PT_LOAD     1
-
-// ...existing code...
-
-#define ELF_MAGIC "\x7f\x45\x4c\x46"
-#define ELFCLASS64 2
-#define EM_X86_64 62
-#define PT_LOAD 1
-
-struct elf64_header {
-    uint8_t e_ident[16];
-    uint16_t e_type;
-    uint16_t e_machine;
-    uint32_t e_version;
-    uint64_t e_entry;
-    uint64_t e_phoff;
-    uint64_t e_shoff;
-    uint32_t e_flags;
-    uint16_t e_ehsize;
-    uint16_t e_phentsize;
-    uint16_t e_phnum;
-    uint16_t e_shentsize;
-    uint16_t e_shnum;
-    uint16_t e_shstrndx;
-};
-
-struct elf64_phdr {
-    uint32_t p_type;
-    uint32_t p_flags;
-    uint64_t p_offset;
-    uint64_t p_vaddr;
-    uint64_t p_paddr;
-    uint64_t p_filesz;
-    uint64_t p_memsz;
-    uint64_t p_align;
-};
+#define LIMINE_KERNEL_VIRTUAL_BASE          0xffffffff80000000ULL
+#define LIMINE_KERNEL_ALIGN                 0x200000
+#define LIMINE_HHDM_OFFSET                  0xffff800000000000ULL
+#define LIMINE_HHDM_OFFSET_5LVL             0xff00000000000000ULL
+#define LIMINE_STACK_SIZE                   0x10000     // Unless the kernel asks for more
+#define LIMINE_MAX_MODULES                  32
+#define LIMINE_MODULE_STRING                128
 
 struct limine_memmap_entry {
     uint64_t base;
@@ -94,7 +77,7 @@ struct limine_memmap_entry {
 struct limine_memmap_response {
     uint64_t revision;
     uint64_t entry_count;
-    struct limine_memmap_entry* entries;
+    struct limine_memmap_entry** entries;
 };
 
 struct limine_memmap_request {
@@ -168,12 +151,28 @@ struct limine_module_request {
     struct limine_module_response* response;
 };
 
+struct limine_uuid {
+    uint32_t a;
+    uint16_t b;
+    uint16_t c;
+    uint8_t d[8];
+};
+
 struct limine_file {
     uint64_t revision;
     void* address;
     uint64_t size;
     char* path;
     char* cmdline;
+    uint32_t media_type;
+    uint32_t unused;
+    uint32_t tftp_ip;
+    uint32_t tftp_port;
+    uint32_t partition_index;
+    uint32_t mbr_disk_id;
+    struct limine_uuid gpt_disk_uuid;
+    struct limine_uuid gpt_part_uuid;
+    struct limine_uuid part_uuid;
 };
 
 struct limine_rsdp_response {
@@ -245,13 +244,14 @@ struct limine_smp_response {
     uint32_t flags;
     uint32_t bsp_lapic_id;
     uint64_t cpu_count;
-    struct limine_smp_info* cpus;
+    struct limine_smp_info** cpus;
 };
 
 struct limine_smp_request {
     uint64_t id[4];
     uint64_t revision;
     struct limine_smp_response* response;
+    uint64_t flags;
 };
 
 struct limine_paging_mode_response {
@@ -263,11 +263,11 @@ struct limine_paging_mode_request {
     uint64_t id[4];
     uint64_t revision;
     struct limine_paging_mode_response* response;
+    uint64_t mode;
 };
 
 struct limine_5_level_paging_response {
     uint64_t revision;
-    uint64_t mode;
 };
 
 struct limine_5_level_paging_request {
@@ -291,13 +291,24 @@ struct limine_terminal_request {
 
 struct limine_stack_size_response {
     uint64_t revision;
-    uint64_t stack_size;
 };
 
 struct limine_stack_size_request {
     uint64_t id[4];
     uint64_t revision;
     struct limine_stack_size_response* response;
+    uint64_t stack_size;
+};
+
+struct limine_entry_point_response {
+    uint64_t revision;
+};
+
+struct limine_entry_point_request {
+    uint64_t id[4];
+    uint64_t revision;
+    struct limine_entry_point_response* response;
+    uint64_t entry;
 };
 
 struct limine_base_virtual_address_response {
@@ -356,6 +367,12 @@ struct limine_loader_info_request {
     struct limine_loader_info_response* response;
 };
 
+// Modules are loaded when added and handed over by the next boot
+int limine_load_module(const char* module_path, const char* cmdline);
+// Same, for a module already in memory; the bytes are copied and module_path
+// is only the name the kernel sees
+int limine_add_module(const char* module_path, const uint8_t* module_data, uint32_t module_size,
+                      const char* cmdline);
 int limine_load_kernel(const char* kernel_path, const char* cmdline);
 int limine_verify_kernel(const char* kernel_path);
 int boot_limine_kernel(uint8_t* kernel_data, uint32_t kernel_size, const char* cmdline);
@@ -8,11 +8,19 @@
 #include <stdint.h>
 #include "compat.h"
 #include <string.h>
+#include <stdlib.h>
 #include "linux.h"
+#include "linux_efi.h"
+#include "firmware_info.h"
+#include "placement.h"
+#include "compress/load.h"
+#include "fs/fs_common.h"
 
 extern void read_sector(uint32_t lba, uint8_t* buf);
 extern void* allocate_memory(uint32_t size);
+extern int tpm2_flush_measurements(void);
 
+// The setup header, at LINUX_SETUP_HEADER_OFFSET in the file and in the zero page
 struct linux_kernel_header {
     uint8_t setup_sects;
     uint16_t root_flags;
@@ -52,137 +60,294 @@ struct linux_kernel_header {
     uint64_t pref_address;
     uint32_t init_size;
     uint32_t handover_offset;
+} __attribute__((packed));
+
+// Where the pieces of one boot went. Everything is allocated at its final
+// address, so nothing is copied once it is in place.
+struct linux_image {
+    struct linux_kernel_header hdr;
+    uint32_t header_len;            // Setup header bytes to copy into the zero page
+    uint32_t setup_size;            // Real-mode part at the start of the file
+    uint32_t kernel_size;           // Protected-mode part after it
+    uint8_t* kernel;
+    uint32_t kernel_pages;
+    uint8_t* zero_page;             // Followed by the command line
+    uint32_t zero_page_pages;
+    uint8_t* initrd;
+    uint32_t initrd_size;
+    uint32_t initrd_pages;
 };
 
-int linux_load_kernel(const char* kernel_path, const char* initrd_path, const char* cmdline) {
-    uint8_t* kernel_data = NULL;
-    uint32_t kernel_size = 0;
-    
-    // Load kernel file
-    if (load_file(kernel_path, &kernel_data, &kernel_size) != 0) {
-        return -1;
-    }
-    
-    // Parse kernel header
-    struct linux_kernel_header* header = (struct linux_kernel_header*)kernel_data;
-    
-    // Verify it's a Linux kernel
-    if (header->header != 0x53726448) { // "HdrS" magic
+static uint32_t linux_pages(uint64_t bytes) {
+    return (uint32_t)((bytes + LINUX_PAGE_SIZE - 1) / LINUX_PAGE_SIZE);
+}
+
+static void put32(uint8_t* p, uint32_t v) {
+    memcpy(p, &v, sizeof(v));
+}
+
+// Only the first LINUX_HEAD_SIZE bytes of the file are needed to know
+// where everything goes
+static int linux_parse_header(const uint8_t* head, uint32_t head_len, uint32_t file_size, struct linux_image* img) {
+    memset(img, 0, sizeof(*img));
+    if (head_len < LINUX_SETUP_HEADER_OFFSET + sizeof(img->hdr)) return -1;
+    memcpy(&img->hdr, head + LINUX_SETUP_HEADER_OFFSET, sizeof(img->hdr));
+
+    struct linux_kernel_header* h = &img->hdr;
+    if (h->header != LINUX_HDRS_MAGIC || h->boot_flag != LINUX_BOOT_FLAG || h->version < 0x0200) return -1;
+
+#if defined(__x86_64__)
+    // From long mode only the 64-bit entry is reachable; code32_start of a
+    // 32-bit kernel would run as 64-bit code
+    if (h->version < 0x020C || !(h->xloadflags & LINUX_XLF_KERNEL_64)) {
+        printf("Linux: kernel has no 64-bit entry point (32-bit kernel?); it cannot be booted from x86-64\n");
         return -1;
     }
-    
-    // Calculate setup size
-    uint32_t setup_size = (header->setup_sects + 1) * 512;
-    if (setup_size == 0) setup_size = 4 * 512; // Default 4 sectors
-    
-    // Load kernel to 0x100000 (1MB)
-    uint8_t* kernel_dest = (uint8_t*)0x100000;
-    memcpy(kernel_dest, kernel_data + setup_size, kernel_size - setup_size);
-    
-    // Load initrd if specified
-    uint32_t initrd_addr = 0;
-    uint32_t initrd_size = 0;
-    if (initrd_path && strlen(initrd_path) > 0) {
-        uint8_t* initrd_data = NULL;
-        if (load_file(initrd_path, &initrd_data, &initrd_size) == 0) {
-            // Place initrd after kernel
-            initrd_addr = 0x100000 + kernel_size - setup_size;
-            memcpy((void*)initrd_addr, initrd_data, initrd_size);
-        }
+#endif
+
+    // The header runs to the end of the jump at 0x200
+    img->header_len = 0x202 + head[0x201] - LINUX_SETUP_HEADER_OFFSET;
+    if (LINUX_SETUP_HEADER_OFFSET + img->header_len > head_len) return -1;
+
+    img->setup_size = ((h->setup_sects ? h->setup_sects : 4) + 1) * 512;
+    if (img->setup_size >= file_size) return -1;
+    img->kernel_size = file_size - img->setup_size;
+    return 0;
+}
+
+// The protected-mode part needs init_size bytes from its load address to
+// decompress in place; try the address it prefers, then the tightest
+// suitably aligned gap below 4 GiB if it is relocatable, which leaves the
+// big ones for the initrd
+static int linux_place_kernel(struct linux_image* img) {
+    struct linux_kernel_header* h = &img->hdr;
+    uint64_t span = img->kernel_size;
+    if (h->version >= 0x020A && h->init_size > span) span = h->init_size;
+    img->kernel_pages = linux_pages(span);
+
+    uint64_t pref = LINUX_DEFAULT_LOAD;
+    if (h->version >= 0x020A && h->pref_address) pref = h->pref_address;
+    img->kernel = (uint8_t*)place_at(pref, (uint64_t)img->kernel_pages * LINUX_PAGE_SIZE);
+
+    if (!img->kernel && h->version >= 0x0205 && h->relocatable_kernel) {
+        struct place_request req = {
+            (uint64_t)img->kernel_pages * LINUX_PAGE_SIZE, h->kernel_alignment, LINUX_DEFAULT_LOAD, LINUX_LOAD_LIMIT,
+            PLACE_BEST_FIT
+        };
+        if (req.align < LINUX_PAGE_SIZE || (req.align & (req.align - 1))) req.align = LINUX_DEFAULT_ALIGN;
+        img->kernel = (uint8_t*)place_alloc(&req);
     }
-    
-    // Setup boot parameters
-    struct linux_boot_params* params = (struct linux_boot_params*)0x90000;
-    memset(params, 0, sizeof(struct linux_boot_params));
-    
-    // Copy setup code
-    memcpy(params, kernel_data, setup_size);
-    
-    // Set command line
-    if (cmdline && strlen(cmdline) > 0) {
-        strcpy((char*)0x90000 + 0x0020, cmdline);
-        params->cmd_line_ptr = 0x90020;
+    return img->kernel ? 0 : -1;
+}
+
+static uint64_t linux_initrd_limit(const struct linux_kernel_header* h) {
+    return h->version >= 0x0203 ? h->initrd_addr_max : LINUX_INITRD_MAX_DEFAULT;
+}
+
+// Top of the range the kernel accepts, where it is least in the way of the
+// kernel's own decompression and early allocations
+static uint8_t* linux_place_initrd(void* ctx, uint32_t size) {
+    struct linux_image* img = (struct linux_image*)ctx;
+    img->initrd_pages = linux_pages(size);
+    img->initrd = (uint8_t*)place_below(linux_initrd_limit(&img->hdr), (uint64_t)img->initrd_pages * LINUX_PAGE_SIZE,
+                                        LINUX_PAGE_SIZE);
+    return img->initrd;
+}
+
+static void linux_add_e820(void* ctx, uint64_t base, uint64_t size, uint32_t type) {
+    uint8_t* zero_page = (uint8_t*)ctx;
+    uint8_t count = zero_page[LINUX_E820_ENTRIES_OFFSET];
+    if (count >= LINUX_E820_MAX) return;
+    uint8_t* e = zero_page + LINUX_E820_TABLE_OFFSET + count * LINUX_E820_ENTRY_SIZE;
+    memcpy(e, &base, 8);
+    memcpy(e + 8, &size, 8);
+    memcpy(e + 16, &type, 4);
+    zero_page[LINUX_E820_ENTRIES_OFFSET] = count + 1;
+}
+
+// The zero page (struct boot_params) with the command line right behind it
+static int linux_build_zero_page(struct linux_image* img, const uint8_t* head, const char* cmdline) {
+    struct linux_kernel_header* h = &img->hdr;
+    uint32_t cmdline_max = h->version >= 0x0206 ? h->cmdline_size : LINUX_CMDLINE_MAX_DEFAULT;
+    uint32_t cmdline_len = cmdline ? (uint32_t)strlen(cmdline) : 0;
+    if (cmdline_len > cmdline_max) cmdline_len = cmdline_max;
+
+    img->zero_page_pages = linux_pages(LINUX_ZERO_PAGE_SIZE + cmdline_len + 1);
+    img->zero_page = (uint8_t*)place_below(LINUX_LOAD_LIMIT, (uint64_t)img->zero_page_pages * LINUX_PAGE_SIZE,
+                                           LINUX_PAGE_SIZE);
+    if (!img->zero_page) return -1;
+    memset(img->zero_page, 0, (size_t)img->zero_page_pages * LINUX_PAGE_SIZE);
+    memcpy(img->zero_page + LINUX_SETUP_HEADER_OFFSET, head + LINUX_SETUP_HEADER_OFFSET, img->header_len);
+
+    char* line = (char*)img->zero_page + LINUX_ZERO_PAGE_SIZE;
+    if (cmdline_len) memcpy(line, cmdline, cmdline_len);
+    line[cmdline_len] = 0;
+
+    struct linux_kernel_header* zh = (struct linux_kernel_header*)(img->zero_page + LINUX_SETUP_HEADER_OFFSET);
+    zh->type_of_loader = LINUX_LOADER_UNDEFINED;
+    zh->loadflags &= ~LINUX_CAN_USE_HEAP;
+    zh->code32_start = (uint32_t)(uintptr_t)img->kernel;
+    zh->cmd_line_ptr = (uint32_t)(uintptr_t)line;
+    zh->ramdisk_image = (uint32_t)(uintptr_t)img->initrd;
+    zh->ramdisk_size = img->initrd_size;
+    put32(img->zero_page + LINUX_EXT_RAMDISK_IMAGE, (uint32_t)((uint64_t)(uintptr_t)img->initrd >> 32));
+    put32(img->zero_page + LINUX_EXT_CMD_LINE_PTR, (uint32_t)((uint64_t)(uintptr_t)line >> 32));
+    place_e820(linux_add_e820, img->zero_page);
+    return 0;
+}
+
+static void linux_release(struct linux_image* img) {
+    if (img->kernel) place_free(img->kernel, (uint64_t)img->kernel_pages * LINUX_PAGE_SIZE);
+    if (img->initrd_pages) place_free(img->initrd, (uint64_t)img->initrd_pages * LINUX_PAGE_SIZE);
+    if (img->zero_page) place_free(img->zero_page, (uint64_t)img->zero_page_pages * LINUX_PAGE_SIZE);
+    img->kernel = img->initrd = img->zero_page = NULL;
+    img->initrd_pages = 0;
+}
+
+// On x86-64 the kernel is entered 0x200 past the load address in long
+// mode, on i386 at the load address in flat protected mode; %esi/%rsi holds
+// the zero page either way. The 32/64-bit boot protocol has no firmware, so
+// boot services (and the TPM queue with them) are finished first.
+static int linux_enter(struct linux_image* img) {
+    if (firmware_exit_boot_services(NULL) != 0) return -1;
+#if defined(__x86_64__)
+    uintptr_t entry = (uintptr_t)img->kernel + LINUX_ENTRY64_OFFSET;  // XLF_KERNEL_64, checked at parse
+    asm volatile ("cli; jmp *%0" : : "r"(entry), "S"(img->zero_page) : "memory");
+#elif defined(__i386__)
+    asm volatile ("cli; jmp *%0" : : "r"(img->kernel), "S"(img->zero_page) : "memory");
+#endif
+    return -1;
+}
+
+// Boot services are still up and the kernel has a handover entry for this
+// CPU mode
+static int linux_efi_capable(const struct linux_kernel_header* h) {
+    if (h->version < 0x020B || h->handover_offset == 0 || !linux_efi_available()) return 0;
+#if defined(__x86_64__)
+    return (h->xloadflags & LINUX_XLF_EFI_HANDOVER_64) != 0;
+#elif defined(__i386__)
+    return (h->xloadflags & LINUX_XLF_EFI_HANDOVER_32) != 0;
+#else
+    return 0;
+#endif
+}
+
+// The stub finds the initrd through LoadFile2 and loads it where it likes,
+// so it is never staged here; the zero page leaves the ramdisk fields empty.
+// The stub exits boot services itself, so the kernel's measurement is
+// extended now and the initrd's from the LoadFile2 callback.
+static int linux_boot_efi(struct linux_image* img, const uint8_t* head, const char* initrd_path,
+                          const uint8_t* initrd_data, uint32_t initrd_size, const char* cmdline) {
+    if (linux_efi_initrd_install(initrd_path, initrd_data, initrd_size) != 0) return -1;
+    if (linux_build_zero_page(img, head, cmdline) == 0 && tpm2_flush_measurements() == 0) {
+        linux_efi_handover(img->kernel, img->hdr.handover_offset, img->zero_page);
     }
-    
-    // Set initrd parameters
-    if (initrd_addr > 0) {
-        params->ramdisk_image = initrd_addr;
-        params->ramdisk_size = initrd_size;
+    linux_efi_initrd_uninstall();
+    return -1;
+}
+
+// An initrd already in memory is used where it is if the kernel can reach
+// it; otherwise it is copied once, to the top of the range it accepts
+static int linux_initrd_buffer(struct linux_image* img, uint8_t* data, uint32_t size) {
+    if (!data || !size) return 0;
+    if ((uint64_t)(uintptr_t)data + size - 1 <= linux_initrd_limit(&img->hdr)) {
+        img->initrd = data;
+        img->initrd_size = size;
+        return 0;
     }
-    
-    // Set memory parameters
-    params->mem_upper = 0x7FE00; // 640KB - 1MB
-    params->ext_mem_k = 0x7FE00; // Extended memory in KB
-    
-    // Jump to kernel
-    void (*kernel_entry)(struct linux_boot_params*) = (void*)0x100000;
-    kernel_entry(params);
-    
+    if (!linux_place_initrd(img, size)) return -1;
+    memcpy(img->initrd, data, size);
+    img->initrd_size = size;
     return 0;
 }
 
-int linux_verify_kernel(const char* kernel_path) {
-    uint8_t* kernel_data = NULL;
-    uint32_t kernel_size = 0;
-    
-    if (load_file(kernel_path, &kernel_data, &kernel_size) != 0) {
+// Kernel already in a buffer (network boot, or a compressed or encrypted
+// file): one copy of the protected-mode part to where it runs
+static int linux_boot_buffer(uint8_t* kernel_data, uint32_t kernel_size, const char* initrd_path,
+                             uint8_t* initrd_data, uint32_t initrd_size, const char* cmdline) {
+    struct linux_image img;
+    uint32_t head_len = kernel_size < LINUX_HEAD_SIZE ? kernel_size : LINUX_HEAD_SIZE;
+
+    if (!kernel_data || linux_parse_header(kernel_data, head_len, kernel_size, &img) != 0) return -1;
+    if (linux_place_kernel(&img) != 0) return -1;
+    memcpy(img.kernel, kernel_data + img.setup_size, img.kernel_size);
+
+    if (linux_efi_capable(&img.hdr)) {
+        linux_boot_efi(&img, kernel_data, initrd_path, initrd_data, initrd_size, cmdline);
+        linux_release(&img);
         return -1;
     }
-    
-    struct linux_kernel_header* header = (struct linux_kernel_header*)kernel_data;
-    
-    // Check magic number
-    if (header->header != 0x53726448) {
-        return -1;
+
+    int r;
+    if (initrd_path && initrd_path[0]) {
+        // Left compressed on purpose: the kernel unpacks initramfs itself
+        r = decomp_load_initrd_at(initrd_path, linux_place_initrd, &img, &img.initrd, &img.initrd_size);
+    } else {
+        r = linux_initrd_buffer(&img, initrd_data, initrd_size);
     }
-    
-    // Check version
-    if (header->version < 0x0200) { // Require 2.0+
+    if (r != 0 || linux_build_zero_page(&img, kernel_data, cmdline) != 0) {
+        linux_release(&img);
         return -1;
     }
-    
-    return 0;
-} 
+    return linux_enter(&img);
+}
 
-int boot_linux_kernel(uint8_t* kernel_data, uint32_t kernel_size, uint8_t* initrd_data, uint32_t initrd_size, const char* cmdline) {
-    struct linux_kernel_header* header = (struct linux_kernel_header*)kernel_data;
-    
-    if (header->header != 0x53726448) {
+int linux_load_kernel(const char* kernel_path, const char* initrd_path, const char* cmdline) {
+    uint8_t head[LINUX_HEAD_SIZE];
+    struct linux_image img;
+    fs_file_info_t info;
+
+    if (!kernel_path || fs_get_info(kernel_path, &info) != 0 || info.size > 0xFFFFFFFFull) return -1;
+    uint32_t file_size = (uint32_t)info.size;
+    uint32_t head_len = file_size < LINUX_HEAD_SIZE ? file_size : LINUX_HEAD_SIZE;
+    if (fs_read_file(kernel_path, head, head_len, 0) != (int)head_len) return -1;
+
+    if (linux_parse_header(head, head_len, file_size, &img) != 0) {
+        // Not a plain bzImage; compressed or encrypted files are unpacked first
+        uint8_t* kernel_data = NULL;
+        uint32_t kernel_size = 0;
+        if (decomp_load_file(kernel_path, &kernel_data, &kernel_size, NULL) != 0) return -1;
+        int r = linux_boot_buffer(kernel_data, kernel_size, initrd_path, NULL, 0, cmdline);
+        free(kernel_data);
+        return r;
+    }
+
+    // Read the protected-mode part straight to where it will run
+    if (linux_place_kernel(&img) != 0) return -1;
+    if (fs_read_file(kernel_path, img.kernel, img.kernel_size, img.setup_size) != (int)img.kernel_size) {
+        linux_release(&img);
         return -1;
     }
-    
-    uint32_t setup_size = (header->setup_sects + 1) * 512;
-    if (setup_size == 0) setup_size = 4 * 512;
-    
-    uint8_t* kernel_dest = (uint8_t*)0x100000;
-    memcpy(kernel_dest, kernel_data + setup_size, kernel_size - setup_size);
-    
-    uint32_t initrd_addr = 0;
-    if (initrd_data && initrd_size > 0) {
-        initrd_addr = 0x100000 + kernel_size - setup_size;
-        memcpy((void*)initrd_addr, initrd_data, initrd_size);
+
+    if (linux_efi_capable(&img.hdr)) {
+        linux_boot_efi(&img, head, initrd_path, NULL, 0, cmdline);
+        linux_release(&img);
+        return -1;
     }
-    
-    struct linux_boot_params* params = (struct linux_boot_params*)0x90000;
-    memset(params, 0, sizeof(struct linux_boot_params));
-    
-    memcpy(params, kernel_data, setup_size);
-    
-    if (cmdline && strlen(cmdline) > 0) {
-        strcpy((char*)0x90000 + 0x0020, cmdline);
-        params->cmd_line_ptr = 0x90020;
+
+    if (initrd_path && initrd_path[0] &&
+        decomp_load_initrd_at(initrd_path, linux_place_initrd, &img, &img.initrd, &img.initrd_size) != 0) {
+        linux_release(&img);
+        return -1;
     }
-    
-    if (initrd_addr > 0) {
-        params->ramdisk_image = initrd_addr;
-        params->ramdisk_size = initrd_size;
+    if (linux_build_zero_page(&img, head, cmdline) != 0) {
+        linux_release(&img);
+        return -1;
     }
-    
-    params->mem_upper = 0x7FE00;
-    params->ext_mem_k = 0x7FE00;
-    
-    void (*kernel_entry)(struct linux_boot_params*) = (void*)0x100000;
-    kernel_entry(params);
-    
-    return 0;
-} 
\ No newline at end of file
+    return linux_enter(&img);
+}
+
+int linux_verify_kernel(const char* kernel_path) {
+    uint8_t head[LINUX_HEAD_SIZE];
+    struct linux_image img;
+    fs_file_info_t info;
+
+    if (!kernel_path || fs_get_info(kernel_path, &info) != 0 || info.size > 0xFFFFFFFFull) return -1;
+    uint32_t head_len = info.size < LINUX_HEAD_SIZE ? (uint32_t)info.size : LINUX_HEAD_SIZE;
+    if (fs_read_file(kernel_path, head, head_len, 0) != (int)head_len) return -1;
+    return linux_parse_header(head, head_len, (uint32_t)info.size, &img);
+}
+
+int boot_linux_kernel(uint8_t* kernel_data, uint32_t kernel_size, uint8_t* initrd_data, uint32_t initrd_size, const char* cmdline) {
+    return linux_boot_buffer(kernel_data, kernel_size, NULL, initrd_data, initrd_size, cmdline);
+}
@@ -10,6 +10,31 @@
 #include <stdint.h>
 #include "compat.h"
 
+// x86 boot protocol (Documentation/arch/x86/boot.rst)
+#define LINUX_HDRS_MAGIC            0x53726448  // "HdrS"
+#define LINUX_BOOT_FLAG             0xAA55
+#define LINUX_SETUP_HEADER_OFFSET   0x1F1
+#define LINUX_HEAD_SIZE             1024        // Covers the whole setup header
+#define LINUX_ZERO_PAGE_SIZE        4096
+#define LINUX_EXT_RAMDISK_IMAGE     0x0C0       // Zero page offsets of the high halves
+#define LINUX_EXT_CMD_LINE_PTR      0x0C8
+#define LINUX_E820_ENTRIES_OFFSET   0x1E8
+#define LINUX_E820_TABLE_OFFSET     0x2D0
+#define LINUX_E820_ENTRY_SIZE       20
+#define LINUX_E820_MAX              128
+#define LINUX_PAGE_SIZE             4096
+#define LINUX_DEFAULT_LOAD          0x100000
+#define LINUX_DEFAULT_ALIGN         0x200000
+#define LINUX_LOAD_LIMIT            0xFFFFFFFFull   // code32_start is 32 bits
+#define LINUX_INITRD_MAX_DEFAULT    0x37FFFFFF      // Before protocol 2.03
+#define LINUX_CMDLINE_MAX_DEFAULT   255             // Before protocol 2.06
+#define LINUX_LOADER_UNDEFINED      0xFF
+#define LINUX_CAN_USE_HEAP          0x80        // loadflags
+#define LINUX_XLF_KERNEL_64         0x0001      // xloadflags
+#define LINUX_XLF_EFI_HANDOVER_32   0x0004
+#define LINUX_XLF_EFI_HANDOVER_64   0x0008
+#define LINUX_ENTRY64_OFFSET        0x200
+
 struct linux_boot_params {
     uint8_t setup_sects;
     uint16_t root_flags;
@@ -53,6 +78,11 @@ struct linux_boot_params {
     uint32_t ext_mem_k;
 };
 
+// Reads the setup header first and then the protected-mode code straight to
+// its final address (pref_address, or anywhere kernel_alignment allows if it
+// is relocatable). Kernels with an EFI handover entry are started through
+// their EFI stub and pull the initrd themselves (see linux_efi.h); others
+// get it read straight to the top of what initrd_addr_max allows.
 int linux_load_kernel(const char* kernel_path, const char* initrd_path, const char* cmdline);
 int linux_verify_kernel(const char* kernel_path);
 int boot_linux_kernel(uint8_t* kernel_data, uint32_t kernel_size, uint8_t* initrd_data, uint32_t initrd_size, const char* cmdline);
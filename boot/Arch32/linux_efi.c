@@ -0,0 +1,155 @@
+/*
+ * linux_efi.c
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#include <Uefi.h>
+#include "compat.h"
+#include <Library/UefiLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/DevicePathLib.h>
+#include <Protocol/DevicePath.h>
+#include <Protocol/LoadFile2.h>
+#include <Guid/LinuxEfiInitrdMedia.h>
+#include "linux_efi.h"
+#include "compress/load.h"
+#include "security/tpm2.h"
+
+#if defined(MDE_CPU_X64)
+// The 64-bit handover entry is 0x200 past the 32-bit one and uses the
+// System V convention whatever the firmware uses
+typedef VOID (__attribute__((sysv_abi)) *LINUX_HANDOVER_ENTRY)(VOID* ImageHandle, EFI_SYSTEM_TABLE* SystemTable,
+                                                                VOID* BootParams);
+#define LINUX_HANDOVER_ENTRY_OFFSET 0x200
+#elif defined(MDE_CPU_IA32)
+typedef VOID (__attribute__((regparm(0))) *LINUX_HANDOVER_ENTRY)(VOID* ImageHandle, EFI_SYSTEM_TABLE* SystemTable,
+                                                                  VOID* BootParams);
+#define LINUX_HANDOVER_ENTRY_OFFSET 0
+#endif
+
+#pragma pack(1)
+typedef struct {
+    VENDOR_DEVICE_PATH Vendor;
+    EFI_DEVICE_PATH_PROTOCOL End;
+} INITRD_DEVICE_PATH;
+#pragma pack()
+
+STATIC CONST INITRD_DEVICE_PATH mInitrdDevicePath = {
+    {
+        { MEDIA_DEVICE_PATH, MEDIA_VENDOR_DP, { sizeof(VENDOR_DEVICE_PATH), 0 } },
+        LINUX_EFI_INITRD_MEDIA_GUID
+    },
+    { END_DEVICE_PATH_TYPE, END_ENTIRE_DEVICE_PATH_SUBTYPE, { sizeof(EFI_DEVICE_PATH_PROTOCOL), 0 } }
+};
+
+// What LoadFile2 hands out; Size is learnt on the first call for a file
+typedef struct {
+    EFI_HANDLE Handle;
+    CONST CHAR8* Path;
+    CONST UINT8* Data;
+    UINT32 Size;
+} INITRD_SOURCE;
+
+STATIC INITRD_SOURCE mInitrd;
+
+typedef struct {
+    UINT8* Buffer;
+    UINTN Capacity;
+    UINT32 Size;
+} INITRD_TARGET;
+
+// Hands the kernel's buffer to the loader if the initrd fits, and notes
+// the size either way, so one failed load doubles as the size query
+STATIC uint8_t* InitrdPlace(void* ctx, uint32_t size) {
+    INITRD_TARGET* Target = (INITRD_TARGET*)ctx;
+    Target->Size = size;
+    return Target->Buffer && size <= Target->Capacity ? Target->Buffer : NULL;
+}
+
+STATIC EFI_STATUS EFIAPI InitrdLoadFile2(
+    IN EFI_LOAD_FILE2_PROTOCOL* This,
+    IN EFI_DEVICE_PATH_PROTOCOL* FilePath,
+    IN BOOLEAN BootPolicy,
+    IN OUT UINTN* BufferSize,
+    IN VOID* Buffer OPTIONAL
+) {
+    if (BootPolicy) return EFI_UNSUPPORTED;
+    if (!BufferSize || !FilePath || !IsDevicePathEnd(FilePath)) return EFI_INVALID_PARAMETER;
+    if (!mInitrd.Path && !mInitrd.Data) return EFI_NOT_FOUND;
+
+    if (mInitrd.Size && (!Buffer || *BufferSize < mInitrd.Size)) {
+        *BufferSize = mInitrd.Size;
+        return EFI_BUFFER_TOO_SMALL;
+    }
+    if (mInitrd.Data) {
+        CopyMem(Buffer, mInitrd.Data, mInitrd.Size);
+        *BufferSize = mInitrd.Size;
+        return EFI_SUCCESS;
+    }
+
+    INITRD_TARGET Target = { (UINT8*)Buffer, Buffer ? *BufferSize : 0, 0 };
+    uint8_t* Data;
+    uint32_t Size;
+    if (decomp_load_initrd_at(mInitrd.Path, InitrdPlace, &Target, &Data, &Size) == 0) {
+        mInitrd.Size = Size;
+        *BufferSize = Size;
+        // The stub exits boot services without us, so this is the last chance
+        return tpm2_flush_measurements() == 0 ? EFI_SUCCESS : EFI_SECURITY_VIOLATION;
+    }
+    if (Target.Size == 0) return EFI_LOAD_ERROR;
+    mInitrd.Size = Target.Size;
+    if (Buffer && *BufferSize >= Target.Size) return EFI_LOAD_ERROR;
+    *BufferSize = Target.Size;
+    return EFI_BUFFER_TOO_SMALL;
+}
+
+STATIC EFI_LOAD_FILE2_PROTOCOL mInitrdLoadFile2 = { InitrdLoadFile2 };
+
+int linux_efi_available(void) {
+    return gST != NULL && gBS != NULL;
+}
+
+int linux_efi_initrd_install(const char* path, const uint8_t* data, uint32_t size) {
+    if (!linux_efi_available() || mInitrd.Handle) return -1;
+    if ((!path || !path[0]) && (!data || !size)) return 0;
+
+    mInitrd.Path = data ? NULL : (CONST CHAR8*)path;
+    mInitrd.Data = data;
+    mInitrd.Size = data ? size : 0;
+    EFI_STATUS Status = gBS->InstallMultipleProtocolInterfaces(
+        &mInitrd.Handle,
+        &gEfiDevicePathProtocolGuid, &mInitrdDevicePath,
+        &gEfiLoadFile2ProtocolGuid, &mInitrdLoadFile2,
+        NULL);
+    if (EFI_ERROR(Status)) {
+        ZeroMem(&mInitrd, sizeof(mInitrd));
+        return -1;
+    }
+    return 0;
+}
+
+void linux_efi_initrd_uninstall(void) {
+    if (mInitrd.Handle) {
+        gBS->UninstallMultipleProtocolInterfaces(
+            mInitrd.Handle,
+            &gEfiDevicePathProtocolGuid, &mInitrdDevicePath,
+            &gEfiLoadFile2ProtocolGuid, &mInitrdLoadFile2,
+            NULL);
+    }
+    ZeroMem(&mInitrd, sizeof(mInitrd));
+}
+
+int linux_efi_handover(void* kernel, uint32_t handover_offset, void* zero_page) {
+#if defined(MDE_CPU_X64) || defined(MDE_CPU_IA32)
+    if (!linux_efi_available() || !kernel || !handover_offset || !zero_page) return -1;
+    LINUX_HANDOVER_ENTRY Entry =
+        (LINUX_HANDOVER_ENTRY)((UINT8*)kernel + handover_offset + LINUX_HANDOVER_ENTRY_OFFSET);
+    DisableInterrupts();
+    Entry(gImageHandle, gST, zero_page);
+    EnableInterrupts();
+#endif
+    return -1;
+}
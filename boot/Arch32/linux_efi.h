@@ -0,0 +1,30 @@
+/*
+ * linux_efi.h
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#ifndef BLOODHORN_LINUX_EFI_H
+#define BLOODHORN_LINUX_EFI_H
+#include <stdint.h>
+#include "compat.h"
+
+// The kernel's EFI stub, entered through the EFI handover protocol while
+// boot services are still up. The stub does its own ExitBootServices(),
+// places itself for KASLR and fetches the initrd through LoadFile2 on the
+// LINUX_EFI_INITRD_MEDIA_GUID device path, into memory it picks itself.
+
+// Nonzero while boot services can be used
+int linux_efi_available(void);
+
+// Serve an initrd from a file (read, and decrypted if need be, only when
+// the kernel asks) or from memory already holding it. Only one at a time.
+int linux_efi_initrd_install(const char* path, const uint8_t* data, uint32_t size);
+void linux_efi_initrd_uninstall(void);
+
+// Enter the kernel at handover_offset past the protected-mode code loaded
+// at kernel, with the zero page at zero_page. Returns only if it fails.
+int linux_efi_handover(void* kernel, uint32_t handover_offset, void* zero_page);
+
+#endif
@@ -8,10 +8,18 @@
 #include <stdint.h>
 #include "compat.h"
 #include <string.h>
+#include <stdlib.h>
 #include "loongarch64.h"
+#include "placement.h"
+#include "compress/load.h"
 
 extern void* allocate_memory(uint32_t size);
 extern int load_file(const char* path, uint8_t** data, uint32_t* size);
+extern int tpm2_flush_measurements(void);
+
+#define LOONGARCH64_DMW_CACHED  0x9000000000000000ULL   // Cached direct-map window the kernel is given addresses in
+#define LOONGARCH64_KERNEL_ALIGN 0x200000
+#define LOONGARCH64_DTB_SIZE    0x100000
 
 struct loongarch64_boot_params {
     uint64_t dtb_addr;
@@ -57,108 +65,164 @@ int loongarch64_load_kernel(const char* kernel_path, const char* initrd_path, co
     uint8_t* kernel_data = NULL;
     uint64_t kernel_size = 0;
     
-    if (load_file(kernel_path, &kernel_data, (uint32_t*)&kernel_size) != 0) {
+    if (decomp_load_file(kernel_path, &kernel_data, (uint32_t*)&kernel_size, NULL) != 0) {
         return -1;
     }
     
     struct loongarch64_linux_header* header = (struct loongarch64_linux_header*)kernel_data;
     
+    int r = -1;
     if (header->magic == 0x4c4f4f4e) {
-        return loongarch64_boot_linux(kernel_data, kernel_size, initrd_path, cmdline);
+        r = loongarch64_boot_linux(kernel_data, kernel_size, initrd_path, cmdline);
     }
     
-    return -1;
+    free(kernel_data);
+    return r;
+}
+
+// Kernel image, DTB space, and the parameter block with the command line
+// behind it, each wherever the memory map has room. Placement works on
+// physical addresses; the kernel gets them through the direct-map window.
+struct loongarch64_placement {
+    uint8_t* kernel_base;
+    uint64_t kernel_span;
+    uint8_t* dtb;
+    struct loongarch64_boot_params* params;
+    uint64_t params_size;
+};
+
+static uint64_t loongarch64_dmw(const void* p) {
+    return LOONGARCH64_DMW_CACHED | (uint64_t)(uintptr_t)p;
+}
+
+static void loongarch64_release(struct loongarch64_placement* p) {
+    if (p->kernel_base) place_free(p->kernel_base, p->kernel_span);
+    if (p->dtb) place_free(p->dtb, LOONGARCH64_DTB_SIZE);
+    if (p->params) place_free(p->params, p->params_size);
+}
+
+static int loongarch64_place(struct loongarch64_placement* p, uint64_t text_offset, uint64_t image_size,
+                             uint64_t cmdline_size) {
+    memset(p, 0, sizeof(*p));
+    struct place_request kernel_req = { text_offset + image_size, LOONGARCH64_KERNEL_ALIGN, 0, 0, PLACE_FIRST_FIT };
+    struct place_request dtb_req = { LOONGARCH64_DTB_SIZE, PLACE_PAGE_SIZE, 0, 0, PLACE_FIRST_FIT };
+    p->kernel_span = kernel_req.size;
+    p->params_size = sizeof(struct loongarch64_boot_params) + cmdline_size;
+    p->kernel_base = (uint8_t*)place_alloc(&kernel_req);
+    p->dtb = (uint8_t*)place_alloc(&dtb_req);
+    p->params = (struct loongarch64_boot_params*)place_below(~0ULL, p->params_size, 8);
+    if (!p->kernel_base || !p->dtb || !p->params) {
+        loongarch64_release(p);
+        return -1;
+    }
+    memset(p->params, 0, sizeof(struct loongarch64_boot_params));
+    return 0;
+}
+
+struct loongarch64_initrd {
+    uint8_t* data;
+    uint64_t size;              // Bytes placed
+};
+
+static uint8_t* loongarch64_place_initrd(void* ctx, uint32_t size) {
+    struct loongarch64_initrd* initrd = (struct loongarch64_initrd*)ctx;
+    struct place_request req = { size ? size : 1, PLACE_PAGE_SIZE, 0, 0, PLACE_BEST_FIT };
+    initrd->data = (uint8_t*)place_alloc(&req);
+    initrd->size = req.size;
+    return initrd->data;
+}
+
+static void loongarch64_fill_params(struct loongarch64_boot_params* params, uint64_t dtb_addr, uint64_t kernel_addr,
+                                    uint64_t kernel_size, const char* cmdline, uint64_t cmdline_size) {
+    params->dtb_addr = dtb_addr;
+    params->kernel_addr = kernel_addr;
+    params->kernel_size = kernel_size;
+    if (cmdline_size) {
+        char* line = (char*)(params + 1);
+        memcpy(line, cmdline, cmdline_size);
+        params->cmdline_addr = loongarch64_dmw(line);
+        params->cmdline_size = cmdline_size;
+    }
+    uint64_t mem_start, mem_end;
+    place_ram_bounds(&mem_start, &mem_end);
+    params->mem_start = LOONGARCH64_DMW_CACHED | mem_start;
+    params->mem_size = mem_end - mem_start;
+    params->acpi_rsdp = 0;
+    params->efi_systab = 0;
 }
 
 int loongarch64_boot_linux(uint8_t* kernel_data, uint64_t kernel_size, const char* initrd_path, const char* cmdline) {
     struct loongarch64_linux_header* header = (struct loongarch64_linux_header*)kernel_data;
+    uint64_t image_size = header->image_size > kernel_size ? header->image_size : kernel_size;
+    uint64_t cmdline_size = cmdline && strlen(cmdline) > 0 ? strlen(cmdline) + 1 : 0;
     
-    uint64_t kernel_load_addr = 0x9000000000200000;
-    uint64_t dtb_addr = 0x9000000000300000;
-    uint64_t initrd_addr = 0;
-    uint64_t initrd_size = 0;
+    struct loongarch64_placement place;
+    if (loongarch64_place(&place, header->text_offset, image_size, cmdline_size) != 0) {
+        return -1;
+    }
+    uint8_t* kernel_dest = place.kernel_base + header->text_offset;
+    uint64_t kernel_load_addr = loongarch64_dmw(kernel_dest);
+    uint64_t dtb_addr = loongarch64_dmw(place.dtb);
+    
+    struct loongarch64_boot_params* params = place.params;
+    loongarch64_fill_params(params, dtb_addr, kernel_load_addr, kernel_size, cmdline, cmdline_size);
     
+    // Read straight into its placement, never into a heap copy
+    struct loongarch64_initrd initrd = { NULL, 0 };
     if (initrd_path && strlen(initrd_path) > 0) {
         uint8_t* initrd_data = NULL;
-        uint32_t initrd_size32 = 0;
-        if (load_file(initrd_path, &initrd_data, &initrd_size32) == 0) {
-            initrd_size = initrd_size32;
-            initrd_addr = dtb_addr + 0x100000;
-            if (initrd_data && initrd_size > 0) {
-                memcpy((void*)initrd_addr, initrd_data, initrd_size);
-            }
+        uint32_t initrd_size = 0;
+        if (decomp_load_initrd_at(initrd_path, loongarch64_place_initrd, &initrd, &initrd_data, &initrd_size) != 0) {
+            if (initrd.data) place_free(initrd.data, initrd.size);
+            loongarch64_release(&place);
+            return -1;
         }
-    }
-
-    uint64_t cmdline_addr = 0;
-    uint64_t cmdline_size = 0;
-    if (cmdline && strlen(cmdline) > 0) {
-        cmdline_addr = initrd_addr + initrd_size + 0x1000;
-        cmdline_size = strlen(cmdline) + 1;
-        // Use strncpy for buffer safety assumes cmdline_addr points to a buffer of at least cmdline_size
-        strncpy((char*)cmdline_addr, cmdline, cmdline_size - 1);
-        ((char*)cmdline_addr)[cmdline_size - 1] = '\0';
+        params->initrd_addr = loongarch64_dmw(initrd_data);
+        params->initrd_size = initrd_size;
     }
 
     if (kernel_data && kernel_size > 0) {
-        memcpy((void*)kernel_load_addr, kernel_data, kernel_size);
+        memcpy(kernel_dest, kernel_data, kernel_size);
     }
-
-    struct loongarch64_boot_params* params = (struct loongarch64_boot_params*)0x9000000000100000;
-    memset(params, 0, sizeof(struct loongarch64_boot_params));
     
-    params->dtb_addr = dtb_addr;
-    params->initrd_addr = initrd_addr;
-    params->initrd_size = initrd_size;
-    params->cmdline_addr = cmdline_addr;
-    params->cmdline_size = cmdline_size;
-    params->kernel_addr = kernel_load_addr;
-    params->kernel_size = kernel_size;
-    params->mem_start = 0x9000000000000000;
-    params->mem_size = 0x800000000;
-    params->acpi_rsdp = 0;
-    params->efi_systab = 0;
+    // Extend what was measured while loading; the kernel can't do it for us
+    if (tpm2_flush_measurements() != 0) {
+        if (initrd.data) place_free(initrd.data, initrd.size);
+        loongarch64_release(&place);
+        return -1;
+    }
     
-    uint64_t entry_point = kernel_load_addr + header->text_offset;
-    void (*kernel_entry)(uint64_t, uint64_t, uint64_t) = (void*)entry_point;
-    kernel_entry(0, dtb_addr, (uint64_t)params);
+    void (*kernel_entry)(uint64_t, uint64_t, uint64_t) = (void*)kernel_load_addr;
+    kernel_entry(0, dtb_addr, loongarch64_dmw(params));
     
     return 0;
 }
 
 int loongarch64_boot_uefi(uint8_t* kernel_data, uint64_t kernel_size, const char* cmdline) {
-    uint64_t kernel_load_addr = 0x9000000000200000;
-    uint64_t dtb_addr = 0x9000000000300000;
-    
-    uint64_t cmdline_addr = 0;
-    uint64_t cmdline_size = 0;
-    if (cmdline && strlen(cmdline) > 0) {
-        cmdline_addr = dtb_addr + 0x100000;
-        cmdline_size = strlen(cmdline) + 1;
-        // Use strncpy for buffer safety; assumes cmdline_addr points to a buffer of at least cmdline_size
-        strncpy((char*)cmdline_addr, cmdline, cmdline_size - 1);
-        ((char*)cmdline_addr)[cmdline_size - 1] = '\0';
+    uint64_t cmdline_size = cmdline && strlen(cmdline) > 0 ? strlen(cmdline) + 1 : 0;
+    
+    struct loongarch64_placement place;
+    if (loongarch64_place(&place, 0, kernel_size, cmdline_size) != 0) {
+        return -1;
     }
+    uint64_t kernel_load_addr = loongarch64_dmw(place.kernel_base);
+    uint64_t dtb_addr = loongarch64_dmw(place.dtb);
+    
+    struct loongarch64_boot_params* params = place.params;
+    loongarch64_fill_params(params, dtb_addr, kernel_load_addr, kernel_size, cmdline, cmdline_size);
 
     if (kernel_data && kernel_size > 0) {
-        memcpy((void*)kernel_load_addr, kernel_data, kernel_size);
+        memcpy(place.kernel_base, kernel_data, kernel_size);
     }
     
-    struct loongarch64_boot_params* params = (struct loongarch64_boot_params*)0x9000000000100000;
-    memset(params, 0, sizeof(struct loongarch64_boot_params));
-    
-    params->dtb_addr = dtb_addr;
-    params->cmdline_addr = cmdline_addr;
-    params->cmdline_size = cmdline_size;
-    params->kernel_addr = kernel_load_addr;
-    params->kernel_size = kernel_size;
-    params->mem_start = 0x9000000000000000;
-    params->mem_size = 0x800000000;
-    params->acpi_rsdp = 0;
-    params->efi_systab = 0;
+    // Extend what was measured while loading; the kernel can't do it for us
+    if (tpm2_flush_measurements() != 0) {
+        loongarch64_release(&place);
+        return -1;
+    }
     
     void (*kernel_entry)(uint64_t, uint64_t, uint64_t) = (void*)kernel_load_addr;
-    kernel_entry(0, dtb_addr, (uint64_t)params);
+    kernel_entry(0, dtb_addr, loongarch64_dmw(params));
     
     return 0;
 }
@@ -167,7 +231,7 @@ int loongarch64_verify_kernel(const char* kernel_path) {
     uint8_t* kernel_data = NULL;
     uint32_t kernel_size = 0;
     
-    if (load_file(kernel_path, &kernel_data, &kernel_size) != 0) {
+    if (decomp_load_file(kernel_path, &kernel_data, &kernel_size, NULL) != 0) {
         return -1;
     }
     
@@ -0,0 +1,176 @@
+/*
+ * module_loader.c
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#include <stdint.h>
+#include "compat.h"
+#include <string.h>
+#include <stdlib.h>
+#include "module_loader.h"
+#include "placement.h"
+#include "fs/fs_common.h"
+#include "compress/load.h"
+#include "security/payload.h"
+
+static uint64_t module_pages(uint64_t size) {
+    if (!size) size = 1;
+    return (size + PLACE_PAGE_SIZE - 1) & ~(uint64_t)(PLACE_PAGE_SIZE - 1);
+}
+
+// Disk order: by volume, then by position on it, then as listed
+static int module_before(const struct module_load* mods, uint32_t a, uint32_t b) {
+    if (mods[a].volume != mods[b].volume) return (uintptr_t)mods[a].volume < (uintptr_t)mods[b].volume;
+    if (mods[a].location != mods[b].location) return mods[a].location < mods[b].location;
+    return a < b;
+}
+
+// Bottom-up merge sort of the indices in order, through tmp
+static void module_sort(const struct module_load* mods, uint32_t* order, uint32_t* tmp, uint32_t count) {
+    for (uint32_t width = 1; width < count; width *= 2) {
+        for (uint32_t lo = 0; lo < count; lo += 2 * width) {
+            uint32_t mid = lo + width < count ? lo + width : count;
+            uint32_t hi = lo + 2 * width < count ? lo + 2 * width : count;
+            uint32_t i = lo, j = mid, k = lo;
+            while (i < mid && j < hi) tmp[k++] = module_before(mods, order[j], order[i]) ? order[j++] : order[i++];
+            while (i < mid) tmp[k++] = order[i++];
+            while (j < hi) tmp[k++] = order[j++];
+        }
+        memcpy(order, tmp, count * sizeof(*order));
+    }
+}
+
+struct module_place_ctx {
+    struct module_load* mod;
+    uint64_t limit;
+};
+
+static uint8_t* module_place(void* ctx, uint32_t size) {
+    struct module_place_ctx* p = (struct module_place_ctx*)ctx;
+    struct module_load* mod = p->mod;
+    mod->reserved = module_pages(size);
+    if (mod->at) {
+        mod->data = (uint8_t*)place_at(mod->at, mod->reserved);
+    } else {
+        struct place_request req = { mod->reserved, PLACE_PAGE_SIZE, MODULE_LOAD_MIN, p->limit, PLACE_BEST_FIT };
+        mod->data = (uint8_t*)place_alloc(&req);
+    }
+    if (!mod->data) mod->reserved = 0;
+    return mod->data;
+}
+
+// Every module placed at once: the fixed ones where they must go, the rest
+// carved out of one block, or placed one by one if no block is big enough
+static int module_reserve(struct module_load* mods, uint32_t count, uint64_t limit) {
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (mods[i].flags & MODULE_MISSING) continue;
+        mods[i].reserved = module_pages(mods[i].size);
+        if (mods[i].at) {
+            mods[i].data = (uint8_t*)place_at(mods[i].at, mods[i].reserved);
+            if (!mods[i].data) return -1;
+        } else {
+            total += mods[i].reserved;
+        }
+    }
+    if (!total) return 0;
+
+    struct place_request req = { total, PLACE_PAGE_SIZE, MODULE_LOAD_MIN, limit, PLACE_BEST_FIT };
+    uint8_t* block = (uint8_t*)place_alloc(&req);
+    for (uint32_t i = 0; i < count; i++) {
+        if ((mods[i].flags & MODULE_MISSING) || mods[i].at) continue;
+        if (block) {
+            mods[i].data = block;
+            block += mods[i].reserved;
+        } else {
+            struct place_request one = { mods[i].reserved, PLACE_PAGE_SIZE, MODULE_LOAD_MIN, limit, PLACE_BEST_FIT };
+            mods[i].data = (uint8_t*)place_alloc(&one);
+            if (!mods[i].data) return -1;
+        }
+    }
+    return 0;
+}
+
+// Straight to its destination. Encrypted containers are only recognised by
+// their first bytes; their plaintext size differs from the file's, so they
+// give back their reservation and go through the payload path instead.
+static int module_read(struct module_load* mod, uint64_t limit) {
+    uint32_t done = 0;
+    while (done < mod->size) {
+        uint32_t n = mod->size - done < MODULE_READ_CHUNK ? mod->size - done : MODULE_READ_CHUNK;
+        if (fs_read_file(mod->path, mod->data + done, n, done) != (int)n) return -1;
+        if (done == 0 && payload_detect(mod->data, n)) {
+            struct module_place_ctx ctx = { mod, limit };
+            uint8_t* data;
+            uint32_t size;
+            place_free(mod->data, mod->reserved);
+            mod->data = NULL;
+            mod->reserved = 0;
+            if (decomp_load_initrd_at(mod->path, module_place, &ctx, &data, &size) != 0) return -1;
+            mod->data = data;
+            mod->size = size;
+            return 0;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+int module_load_all(struct module_load* mods, uint32_t count, uint64_t limit) {
+    if (!mods || count > MODULE_LOAD_MAX) return -1;
+    if (!count) return 0;
+
+    // Sizes and disk positions, from the directory entries alone
+    for (uint32_t i = 0; i < count; i++) {
+        fs_file_info_t info;
+        mods[i].data = NULL;
+        mods[i].size = 0;
+        mods[i].reserved = 0;
+        mods[i].volume = NULL;
+        mods[i].location = 0;
+        mods[i].flags &= ~MODULE_MISSING;
+        if (!mods[i].path) return -1;
+        if (fs_get_info(mods[i].path, &info) != 0) {
+            if (!(mods[i].flags & MODULE_OPTIONAL)) return -1;
+            mods[i].flags |= MODULE_MISSING;
+            continue;
+        }
+        if (info.size > DECOMP_LOAD_MAX) return -1;
+        mods[i].size = (uint32_t)info.size;
+        mods[i].volume = fs_find_mount_point(mods[i].path);
+        if (fs_find_file(mods[i].path, &mods[i].location) != 0) mods[i].location = 0;
+    }
+
+    uint32_t* order = (uint32_t*)malloc(2 * count * sizeof(uint32_t));
+    if (!order) return -1;
+    if (module_reserve(mods, count, limit) != 0) {
+        free(order);
+        module_release_all(mods, count);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < count; i++) order[i] = i;
+    module_sort(mods, order, order + count, count);
+
+    for (uint32_t i = 0; i < count; i++) {
+        struct module_load* mod = &mods[order[i]];
+        if (mod->flags & MODULE_MISSING) continue;
+        if (module_read(mod, limit) != 0) {
+            free(order);
+            module_release_all(mods, count);
+            return -1;
+        }
+    }
+    free(order);
+    return 0;
+}
+
+void module_release_all(struct module_load* mods, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (mods[i].data) place_free(mods[i].data, mods[i].reserved);
+        mods[i].data = NULL;
+        mods[i].reserved = 0;
+    }
+}
@@ -0,0 +1,47 @@
+/*
+ * module_loader.h
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#ifndef BLOODHORN_MODULE_LOADER_H
+#define BLOODHORN_MODULE_LOADER_H
+#include <stdint.h>
+#include "compat.h"
+
+// Whole module lists for the protocols that carry them (BloodChain,
+// Multiboot 2), loaded as one batch. Sizes come from directory info before
+// anything is read, every destination is reserved in one placement pass,
+// and files are then read in the order they lie on disk (first cluster,
+// extent or inode, as the filesystem reports it), so a spinning disk sweeps
+// across the list once instead of seeking back and forth between modules.
+
+#define MODULE_LOAD_MAX         1024
+#define MODULE_READ_CHUNK       (16 * 1024 * 1024)  // Bytes per fs_read_file() call
+#define MODULE_LOAD_MIN         0x100000            // Modules stay clear of low memory
+
+// module_load flags
+#define MODULE_OPTIONAL         0x1     // Skipped, not an error, when the file is missing
+#define MODULE_MISSING          0x2     // Set by the loader for an optional module it skipped
+
+struct module_load {
+    const char* path;
+    uint64_t at;                // Fixed load address, or 0 for anywhere below the limit
+    uint32_t flags;             // MODULE_*
+    uint8_t* data;              // Where it was loaded
+    uint32_t size;
+    uint64_t reserved;          // Bytes placed for it, whole pages
+    const void* volume;         // Mount point the file is on
+    uint32_t location;          // Its position there; 0 when the filesystem cannot say
+};
+
+// Load mods[0..count) below limit (0 for no limit). path, at and flags are
+// set by the caller; everything else is filled in. On failure nothing stays
+// placed.
+int module_load_all(struct module_load* mods, uint32_t count, uint64_t limit);
+
+// Give back what module_load_all() placed, when the boot does not go ahead
+void module_release_all(struct module_load* mods, uint32_t count);
+
+#endif
@@ -9,9 +9,12 @@
 #include "compat.h"
 #include <string.h>
 #include "multiboot1.h"
+#include "placement.h"
+#include "compress/load.h"
 
 extern void* allocate_memory(uint32_t size);
 extern int load_file(const char* path, uint8_t** data, uint32_t* size);
+extern int tpm2_flush_measurements(void);
 
 struct multiboot_info {
     uint32_t flags;
@@ -51,12 +54,29 @@ struct multiboot_module {
     uint32_t reserved;
 };
 
+#define MULTIBOOT1_MAX_MODULES 64
+#define MULTIBOOT1_MODULE_STRING 64
+
+// Module list and strings, in one page below 4 GiB taken with the first module
+static struct multiboot_module* modules;
+static uint32_t module_count;
+
+static void multiboot1_add_mmap(void* ctx, uint64_t base, uint64_t size, uint32_t type) {
+    struct multiboot_info* mb_info = (struct multiboot_info*)ctx;
+    struct multiboot_mmap_entry* entry = (struct multiboot_mmap_entry*)(uintptr_t)(mb_info->mmap_addr + mb_info->mmap_length);
+    entry->size = sizeof(struct multiboot_mmap_entry) - 4;
+    entry->addr = base;
+    entry->len = size;
+    entry->type = type;
+    mb_info->mmap_length += sizeof(struct multiboot_mmap_entry);
+}
+
 int multiboot1_load_kernel(const char* kernel_path, const char* cmdline) {
     uint8_t* kernel_data = NULL;
     uint32_t kernel_size = 0;
     
     // Load kernel file
-    if (load_file(kernel_path, &kernel_data, &kernel_size) != 0) {
+    if (decomp_load_file(kernel_path, &kernel_data, &kernel_size, NULL) != 0) {
         return -1;
     }
     
@@ -90,9 +110,13 @@ int multiboot1_load_kernel(const char* kernel_path, const char* cmdline) {
     if (load_addr == 0) load_addr = 0x100000; // 1MB
     if (entry_addr == 0) entry_addr = load_addr;
     
-    // Load kernel to specified address
+    // Load kernel to specified address, which must not be firmware's
     uint32_t load_size = load_end_addr - load_addr;
     if (load_size > kernel_size) load_size = kernel_size;
+    uint32_t image_end = bss_end_addr > load_addr + load_size ? bss_end_addr : load_addr + load_size;
+    if (!place_at(load_addr, image_end - load_addr)) {
+        return -1;
+    }
     
     memcpy((void*)load_addr, kernel_data, load_size);
     
@@ -101,41 +125,50 @@ int multiboot1_load_kernel(const char* kernel_path, const char* cmdline) {
         memset((void*)load_end_addr, 0, bss_end_addr - load_end_addr);
     }
     
-    // Setup Multiboot 1 info structure
-    struct multiboot_info* mb_info = (struct multiboot_info*)0x90000;
+    // The info structure, the memory map and the command line share one
+    // block below 4 GiB, sized for the real map
+    uint32_t cmdline_len = cmdline ? (uint32_t)strlen(cmdline) : 0;
+    uint32_t mmap_count = place_e820(NULL, NULL);
+    uint32_t mmap_offset = sizeof(struct multiboot_info);
+    uint32_t cmdline_offset = mmap_offset + mmap_count * sizeof(struct multiboot_mmap_entry);
+    struct multiboot_info* mb_info = (struct multiboot_info*)place_below(PLACE_LIMIT_4G, cmdline_offset + cmdline_len + 1, 8);
+    if (!mb_info) {
+        return -1;
+    }
     memset(mb_info, 0, sizeof(struct multiboot_info));
     
     // Set flags
-    mb_info->flags = MULTIBOOT_INFO_MEMORY | MULTIBOOT_INFO_CMDLINE | MULTIBOOT_INFO_BOOTDEV;
+    mb_info->flags = MULTIBOOT_INFO_MEMORY | MULTIBOOT_INFO_CMDLINE | MULTIBOOT_INFO_BOOTDEV | MULTIBOOT_INFO_MEM_MAP;
     
     // Set memory info
-    mb_info->mem_lower = 640; // 640KB
-    mb_info->mem_upper = 0x7FE00; // Extended memory in KB
+    place_basic_meminfo(&mb_info->mem_lower, &mb_info->mem_upper);
     
     // Set command line
-    if (cmdline && strlen(cmdline) > 0) {
-        char* cmdline_addr = (char*)0x90020;
-        strcpy(cmdline_addr, cmdline);
-        mb_info->cmdline = (uint32_t)cmdline_addr;
-    }
+    char* cmdline_addr = (char*)mb_info + cmdline_offset;
+    if (cmdline_len) memcpy(cmdline_addr, cmdline, cmdline_len);
+    cmdline_addr[cmdline_len] = 0;
+    mb_info->cmdline = (uint32_t)(uintptr_t)cmdline_addr;
     
     // Set boot device
     mb_info->boot_device = 0x8000; // First hard disk, first partition
     
-    // Setup memory map
-    struct multiboot_mmap_entry* mmap = (struct multiboot_mmap_entry*)0x90100;
-    mmap[0].size = sizeof(struct multiboot_mmap_entry) - 4;
-    mmap[0].addr = 0;
-    mmap[0].len = 0x100000; // 1MB
-    mmap[0].type = 1; // Available memory
+    // Modules loaded beforehand
+    if (module_count) {
+        mb_info->flags |= MULTIBOOT_INFO_MODS;
+        mb_info->mods_count = module_count;
+        mb_info->mods_addr = (uint32_t)(uintptr_t)modules;
+    }
     
-    mmap[1].size = sizeof(struct multiboot_mmap_entry) - 4;
-    mmap[1].addr = 0x100000;
-    mmap[1].len = 0x7FF00000; // ~2GB
-    mmap[1].type = 1; // Available memory
+    // Setup memory map from the placement map
+    mb_info->mmap_addr = (uint32_t)(uintptr_t)mb_info + mmap_offset;
+    place_e820(multiboot1_add_mmap, mb_info);
     
-    mb_info->mmap_length = 2 * sizeof(struct multiboot_mmap_entry);
-    mb_info->mmap_addr = (uint32_t)mmap;
+    // Extend what was measured while loading; the kernel can't do it for us
+    if (tpm2_flush_measurements() != 0) {
+        place_free(mb_info, cmdline_offset + cmdline_len + 1);
+        place_free((void*)(uintptr_t)load_addr, image_end - load_addr);
+        return -1;
+    }
     
     // Jump to kernel
     void (*kernel_entry)(uint32_t, struct multiboot_info*) = (void*)entry_addr;
@@ -148,7 +181,7 @@ int multiboot1_verify_kernel(const char* kernel_path) {
     uint8_t* kernel_data = NULL;
     uint32_t kernel_size = 0;
     
-    if (load_file(kernel_path, &kernel_data, &kernel_size) != 0) {
+    if (decomp_load_file(kernel_path, &kernel_data, &kernel_size, NULL) != 0) {
         return -1;
     }
     
@@ -178,23 +211,39 @@ int multiboot1_load_module(const char* module_path, const char* cmdline) {
     if (load_file(module_path, &module_data, &module_size) != 0) {
         return -1;
     }
+    return multiboot1_add_module(module_data, module_size, cmdline);
+}
+
+int multiboot1_add_module(const uint8_t* module_data, uint32_t module_size, const char* cmdline) {
+    if (!modules) {
+        modules = (struct multiboot_module*)place_below(PLACE_LIMIT_4G,
+            MULTIBOOT1_MAX_MODULES * (sizeof(struct multiboot_module) + MULTIBOOT1_MODULE_STRING), 16);
+        if (!modules) return -1;
+    }
+    if (module_count >= MULTIBOOT1_MAX_MODULES) {
+        return -1;
+    }
     
-    // Load module to high memory
-    uint32_t module_addr = 0x200000; // 2MB
-    memcpy((void*)module_addr, module_data, module_size);
+    // Load module to high memory, wherever the map has room below 4 GiB
+    uint8_t* module_addr = (uint8_t*)place_below(PLACE_LIMIT_4G, module_size, PLACE_PAGE_SIZE);
+    if (!module_addr) {
+        return -1;
+    }
+    memcpy(module_addr, module_data, module_size);
     
     // Add to module list
-    struct multiboot_module* modules = (struct multiboot_module*)0x90200;
-    static int module_count = 0;
-    
-    modules[module_count].mod_start = module_addr;
-    modules[module_count].mod_end = module_addr + module_size;
-    modules[module_count].string = 0x90300 + module_count * 64;
+    char* strings = (char*)(modules + MULTIBOOT1_MAX_MODULES);
+    char* string = strings + module_count * MULTIBOOT1_MODULE_STRING;
+    modules[module_count].mod_start = (uint32_t)(uintptr_t)module_addr;
+    modules[module_count].mod_end = (uint32_t)(uintptr_t)module_addr + module_size;
+    modules[module_count].string = (uint32_t)(uintptr_t)string;
+    modules[module_count].reserved = 0;
     
     // Copy module command line
-    if (cmdline && strlen(cmdline) > 0) {
-        char* cmdline_addr = (char*)modules[module_count].string;
-        strcpy(cmdline_addr, cmdline);
+    string[0] = 0;
+    if (cmdline) {
+        strncpy(string, cmdline, MULTIBOOT1_MODULE_STRING - 1);
+        string[MULTIBOOT1_MODULE_STRING - 1] = 0;
     }
     
     module_count++;
@@ -203,23 +252,39 @@ int multiboot1_load_module(const char* module_path, const char* cmdline) {
 } 
 
 int boot_multiboot1_kernel(uint8_t* kernel_data, uint32_t kernel_size, const char* cmdline) {
-    struct multiboot_info* info = (struct multiboot_info*)0x1000;
+    uint32_t kernel_entry = 0x100000;
+    uint32_t cmdline_len = cmdline ? (uint32_t)strlen(cmdline) : 0;
+    if (!place_at(kernel_entry, kernel_size)) {
+        return -1;
+    }
+    struct multiboot_info* info = (struct multiboot_info*)place_below(PLACE_LIMIT_4G,
+        sizeof(struct multiboot_info) + cmdline_len + 1, 8);
+    if (!info) {
+        place_free((void*)(uintptr_t)kernel_entry, kernel_size);
+        return -1;
+    }
     memset(info, 0, sizeof(struct multiboot_info));
     
     info->flags = MULTIBOOT_INFO_MEMORY | MULTIBOOT_INFO_CMDLINE;
-    info->mem_lower = 640;
-    info->mem_upper = 0x7FE00;
+    place_basic_meminfo(&info->mem_lower, &info->mem_upper);
     
-    if (cmdline && strlen(cmdline) > 0) {
-        strcpy((char*)0x2000, cmdline);
-        info->cmdline = 0x2000;
+    if (cmdline_len > 0) {
+        char* line = (char*)(info + 1);
+        strcpy(line, cmdline);
+        info->cmdline = (uint32_t)(uintptr_t)line;
     }
     
-    uint32_t kernel_entry = 0x100000;
-    memcpy((void*)kernel_entry, kernel_data, kernel_size);
+    // Extend what was measured while loading; the kernel can't do it for us
+    if (tpm2_flush_measurements() != 0) {
+        place_free(info, sizeof(struct multiboot_info) + cmdline_len + 1);
+        place_free((void*)(uintptr_t)kernel_entry, kernel_size);
+        return -1;
+    }
+    
+    memcpy((void*)(uintptr_t)kernel_entry, kernel_data, kernel_size);
     
-    void (*entry_point)(uint32_t, uint32_t) = (void*)kernel_entry;
-    entry_point(MULTIBOOT_BOOTLOADER_MAGIC, (uint32_t)info);
+    void (*entry_point)(uint32_t, uint32_t) = (void*)(uintptr_t)kernel_entry;
+    entry_point(MULTIBOOT_BOOTLOADER_MAGIC, (uint32_t)(uintptr_t)info);
     
     return 0;
-} 
\ No newline at end of file
+}
@@ -93,6 +93,8 @@ struct multiboot_elf_section_header_table {
 int multiboot1_load_kernel(const char* kernel_path, const char* cmdline);
 int multiboot1_verify_kernel(const char* kernel_path);
 int multiboot1_load_module(const char* module_path, const char* cmdline);
+// Same, for a module already in memory; the bytes are copied
+int multiboot1_add_module(const uint8_t* module_data, uint32_t module_size, const char* cmdline);
 int boot_multiboot1_kernel(uint8_t* kernel_data, uint32_t kernel_size, const char* cmdline);
 
 #endif // BLOODHORN_MULTIBOOT1_H 
\ No newline at end of file
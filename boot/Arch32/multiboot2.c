@@ -8,462 +8,729 @@
 #include <stdint.h>
 #include "compat.h"
 #include <string.h>
+#include <stdlib.h>
 #include "multiboot2.h"
+#include "placement.h"
+#include "elf_loader.h"
+#include "module_loader.h"
+#include "compress/load.h"
 
-extern void* allocate_memory(uint32_t size);
-extern int load_file(const char* path, uint8_t** data, uint32_t* size);
+#include "firmware_info.h"
 
-struct multiboot2_info {
-    uint32_t total_size;
-    uint32_t reserved;
-    uint8_t tags[];
-};
+extern int tpm2_flush_measurements(void);
 
-struct multiboot2_tag {
-    uint32_t type;
-    uint32_t size;
-};
+#define MULTIBOOT2_MAX_MODULES 64
+#define MULTIBOOT2_MODULE_STRING 128
+#define MULTIBOOT2_TAG_ALIGN 8
+#define MULTIBOOT2_LOADER_NAME "BloodHorn"
+#define MULTIBOOT2_MMAP_SLACK 8         // Entries the map may gain from our own allocations
+#define MULTIBOOT2_EFI_MMAP_SLACK 8     // Descriptors it may gain before ExitBootServices()
+#define MULTIBOOT2_TAG_BIT(type) (1u << (type))
 
-struct multiboot2_tag_string {
-    uint32_t type;
+// Modules are loaded as they are added, like Multiboot 1's, and listed in
+// the information structure of whichever boot comes next
+struct multiboot2_module_slot {
+    uint8_t* data;
     uint32_t size;
-    char string[];
+    char cmdline[MULTIBOOT2_MODULE_STRING];
 };
 
-struct multiboot2_tag_basic_meminfo {
-    uint32_t type;
-    uint32_t size;
-    uint32_t mem_lower;
-    uint32_t mem_upper;
-};
+static struct multiboot2_module_slot modules[MULTIBOOT2_MAX_MODULES];
+static uint32_t module_count;
 
-struct multiboot2_tag_bootdev {
-    uint32_t type;
-    uint32_t size;
-    uint32_t biosdev;
-    uint32_t partition;
-    uint32_t subpartition;
-};
+// Below 4 GiB, since the module tag only has 32-bit addresses
+static uint8_t* multiboot2_place_module(void* ctx, uint32_t size) {
+    struct multiboot2_module_slot* slot = (struct multiboot2_module_slot*)ctx;
+    struct place_request req = { size ? size : 1, PLACE_PAGE_SIZE, 0x100000, PLACE_LIMIT_4G, PLACE_BEST_FIT };
+    slot->data = (uint8_t*)place_alloc(&req);
+    slot->size = size;
+    return slot->data;
+}
 
-struct multiboot2_tag_mmap {
-    uint32_t type;
-    uint32_t size;
-    uint32_t entry_size;
-    uint32_t entry_version;
-    struct multiboot2_mmap_entry entries[];
-};
+int multiboot2_load_module(const char* module_path, const char* cmdline) {
+    if (!module_path || module_count >= MULTIBOOT2_MAX_MODULES) {
+        return -1;
+    }
 
-struct multiboot2_mmap_entry {
-    uint64_t addr;
-    uint64_t len;
-    uint32_t type;
-    uint32_t zero;
-};
+    struct multiboot2_module_slot* slot = &modules[module_count];
+    uint8_t* data = NULL;
+    uint32_t size = 0;
+    memset(slot, 0, sizeof(*slot));
+    if (decomp_load_initrd_at(module_path, multiboot2_place_module, slot, &data, &size) != 0) {
+        place_free(slot->data, slot->size);
+        slot->data = NULL;
+        return -1;
+    }
+    slot->data = data;
+    slot->size = size;
+    if (cmdline) {
+        strncpy(slot->cmdline, cmdline, MULTIBOOT2_MODULE_STRING - 1);
+    }
 
-struct multiboot2_tag_vbe {
-    uint32_t type;
-    uint32_t size;
-    uint16_t vbe_mode;
-    uint16_t vbe_interface_seg;
-    uint16_t vbe_interface_off;
-    uint16_t vbe_interface_len;
-    struct multiboot2_vbe_info_block vbe_control_info;
-    struct multiboot2_vbe_mode_info_block vbe_mode_info;
-};
+    module_count++;
+    return 0;
+}
 
-struct multiboot2_vbe_info_block {
-    uint8_t vbe_signature[4];
-    uint16_t vbe_version;
-    uint32_t oem_string_ptr;
-    uint32_t capabilities;
-    uint32_t video_mode_ptr;
-    uint16_t total_memory;
-    uint16_t oem_software_rev;
-    uint32_t oem_vendor_name_ptr;
-    uint32_t oem_product_name_ptr;
-    uint32_t oem_product_rev_ptr;
-    uint8_t reserved[222];
-    uint8_t oem_data[256];
-};
+int multiboot2_add_module(const uint8_t* module_data, uint32_t module_size, const char* cmdline) {
+    if (!module_data || module_count >= MULTIBOOT2_MAX_MODULES) {
+        return -1;
+    }
 
-struct multiboot2_vbe_mode_info_block {
-    uint16_t mode_attributes;
-    uint8_t win_a_attributes;
-    uint8_t win_b_attributes;
-    uint16_t win_granularity;
-    uint16_t win_size;
-    uint16_t win_a_segment;
-    uint16_t win_b_segment;
-    uint32_t win_func_ptr;
-    uint16_t bytes_per_scan_line;
-    uint16_t x_resolution;
-    uint16_t y_resolution;
-    uint8_t x_char_size;
-    uint8_t y_char_size;
-    uint8_t number_of_planes;
-    uint8_t bits_per_pixel;
-    uint8_t number_of_banks;
-    uint8_t memory_model;
-    uint8_t bank_size;
-    uint8_t number_of_image_pages;
-    uint8_t reserved1;
-    uint8_t red_mask_size;
-    uint8_t red_field_position;
-    uint8_t green_mask_size;
-    uint8_t green_field_position;
-    uint8_t blue_mask_size;
-    uint8_t blue_field_position;
-    uint8_t reserved_mask_size;
-    uint8_t reserved_field_position;
-    uint8_t direct_color_mode_info;
-    uint32_t framebuffer;
-    uint32_t off_screen_mem_offset;
-    uint16_t off_screen_mem_size;
-    uint8_t reserved2[206];
-};
+    struct multiboot2_module_slot* slot = &modules[module_count];
+    memset(slot, 0, sizeof(*slot));
+    if (!multiboot2_place_module(slot, module_size)) {
+        return -1;
+    }
+    memcpy(slot->data, module_data, module_size);
+    if (cmdline) {
+        strncpy(slot->cmdline, cmdline, MULTIBOOT2_MODULE_STRING - 1);
+    }
 
-struct multiboot2_tag_framebuffer {
-    uint32_t type;
-    uint32_t size;
-    uint64_t framebuffer_addr;
-    uint32_t framebuffer_pitch;
-    uint32_t framebuffer_width;
-    uint32_t framebuffer_height;
-    uint8_t framebuffer_bpp;
-    uint8_t framebuffer_type;
-    uint8_t reserved;
-    union {
-        struct {
-            uint32_t framebuffer_palette_num_colors;
-            struct multiboot2_color_info framebuffer_palette[];
-        };
-        struct {
-            uint8_t framebuffer_red_field_position;
-            uint8_t framebuffer_red_mask_size;
-            uint8_t framebuffer_green_field_position;
-            uint8_t framebuffer_green_mask_size;
-            uint8_t framebuffer_blue_field_position;
-            uint8_t framebuffer_blue_mask_size;
-        };
-    };
-};
+    module_count++;
+    return 0;
+}
 
-struct multiboot2_color_info {
-    uint8_t red_value;
-    uint8_t green_value;
-    uint8_t blue_value;
-};
+int multiboot2_load_modules(const char* const* module_paths, const char* const* cmdlines, uint32_t count) {
+    if (!module_paths || count > MULTIBOOT2_MAX_MODULES - module_count) {
+        return -1;
+    }
 
-struct multiboot2_tag_elf_sections {
-    uint32_t type;
-    uint32_t size;
-    uint32_t num;
-    uint32_t entsize;
-    uint32_t shndx;
-    char sections[];
-};
+    struct module_load* batch = (struct module_load*)calloc(count ? count : 1, sizeof(*batch));
+    if (!batch) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        batch[i].path = module_paths[i];
+    }
+    if (module_load_all(batch, count, PLACE_LIMIT_4G) != 0) {
+        free(batch);
+        return -1;
+    }
 
-struct multiboot2_tag_apm {
-    uint32_t type;
-    uint32_t size;
-    uint16_t version;
-    uint16_t cseg;
-    uint32_t offset;
-    uint16_t cseg_16;
-    uint16_t dseg;
-    uint16_t flags;
-    uint16_t cseg_len;
-    uint16_t cseg_16_len;
-    uint16_t dseg_len;
-};
+    for (uint32_t i = 0; i < count; i++) {
+        struct multiboot2_module_slot* slot = &modules[module_count++];
+        memset(slot, 0, sizeof(*slot));
+        slot->data = batch[i].data;
+        slot->size = batch[i].size;
+        if (cmdlines && cmdlines[i]) {
+            strncpy(slot->cmdline, cmdlines[i], MULTIBOOT2_MODULE_STRING - 1);
+        }
+    }
+    free(batch);
+    return 0;
+}
 
-struct multiboot2_tag_efi32 {
-    uint32_t type;
-    uint32_t size;
-    uint32_t pointer;
+// What the kernel's header asks of the loader
+struct multiboot2_request {
+    uint32_t requested;             // MULTIBOOT2_TAG_BIT() of each requested tag
+    int unknown;                    // It also named a tag type this loader has never heard of
+    int required;                   // The information request tag is not optional
+    int have_addr;
+    struct multiboot2_header_tag_address addr;
+    uint32_t entry_addr;
+    uint64_t efi64_entry;
+    int keep_boot_services;         // EFI boot services tag
 };
 
-struct multiboot2_tag_efi64 {
-    uint32_t type;
-    uint32_t size;
-    uint64_t pointer;
+// The tags this boot will carry and what goes in them
+struct multiboot2_plan {
+    uint32_t tags;                  // MULTIBOOT2_TAG_BIT() of each
+    const char* cmdline;
+    struct firmware_framebuffer fb;
+    const uint8_t* rsdp;
+    uint32_t rsdp_length;           // Of the ACPI 2.0 structure; 0 when there is only 1.0
+    uint32_t mmap_count;
+    uint32_t efi_mmap_capacity;
 };
 
-struct multiboot2_tag_smbios {
-    uint32_t type;
-    uint32_t size;
-    uint8_t major;
-    uint8_t minor;
-    uint8_t reserved[6];
-    uint8_t tables[];
-};
+static void multiboot2_parse_header(const uint8_t* head, uint32_t header_offset, struct multiboot2_request* req) {
+    const struct multiboot2_header* header = (const struct multiboot2_header*)(head + header_offset);
+    uint32_t offset = header_offset + sizeof(struct multiboot2_header);
+    uint32_t header_end = header_offset + header->header_length;
 
-struct multiboot2_tag_old_acpi {
-    uint32_t type;
-    uint32_t size;
-    uint8_t rsdp[];
-};
+    memset(req, 0, sizeof(*req));
+    while (offset + sizeof(struct multiboot2_header_tag) <= header_end) {
+        const struct multiboot2_header_tag* tag = (const struct multiboot2_header_tag*)(head + offset);
 
-struct multiboot2_tag_new_acpi {
-    uint32_t type;
-    uint32_t size;
-    uint8_t rsdp[];
-};
+        if (tag->type == MULTIBOOT2_HEADER_TAG_END || tag->size < sizeof(*tag) || tag->size > header_end - offset) {
+            break;
+        }
 
-struct multiboot2_tag_network {
-    uint32_t type;
-    uint32_t size;
-    uint8_t dhcpack[];
-};
+        if (tag->type == MULTIBOOT2_HEADER_TAG_INFORMATION_REQUEST) {
+            const struct multiboot2_header_tag_information_request* info =
+                (const struct multiboot2_header_tag_information_request*)tag;
+            uint32_t count = (tag->size - sizeof(*info)) / sizeof(uint32_t);
+            for (uint32_t i = 0; i < count; i++) {
+                if (info->requests[i] < 32) {
+                    req->requested |= MULTIBOOT2_TAG_BIT(info->requests[i]);
+                } else {
+                    req->unknown = 1;
+                }
+            }
+            if (!(tag->flags & MULTIBOOT2_HEADER_TAG_OPTIONAL)) req->required = 1;
+        } else if (tag->type == MULTIBOOT2_HEADER_TAG_ADDRESS && tag->size >= sizeof(req->addr)) {
+            memcpy(&req->addr, tag, sizeof(req->addr));
+            req->have_addr = 1;
+        } else if (tag->type == MULTIBOOT2_HEADER_TAG_ENTRY_ADDRESS &&
+                   tag->size >= sizeof(struct multiboot2_header_tag_entry_address)) {
+            req->entry_addr = ((const struct multiboot2_header_tag_entry_address*)tag)->entry_addr;
+        } else if (tag->type == MULTIBOOT2_HEADER_TAG_ENTRY_ADDRESS_EFI_64 &&
+                   tag->size >= sizeof(struct multiboot2_header_tag_entry_address)) {
+            req->efi64_entry = ((const struct multiboot2_header_tag_entry_address*)tag)->entry_addr;
+        } else if (tag->type == MULTIBOOT2_HEADER_TAG_EFI_BS) {
+            req->keep_boot_services = 1;
+        }
 
-struct multiboot2_tag_efi_mmap {
-    uint32_t type;
-    uint32_t size;
-    uint32_t descr_size;
-    uint32_t descr_vers;
-    uint8_t efi_mmap[];
-};
+        offset += (tag->size + 7) & ~7u;
+    }
 
-struct multiboot2_tag_efi32_ih {
-    uint32_t type;
-    uint32_t size;
-    uint32_t pointer;
-};
+    // Boot services are only kept for kernels that can be entered with
+    // them: in long mode, through their EFI amd64 entry
+#if defined(__x86_64__)
+    if (!req->efi64_entry) req->keep_boot_services = 0;
+#else
+    req->keep_boot_services = 0;
+#endif
+}
 
-struct multiboot2_tag_efi64_ih {
-    uint32_t type;
-    uint32_t size;
-    uint64_t pointer;
-};
+// Everything the firmware can give, narrowed to what the kernel asked for
+// when it asked at all. The command line, loader name, modules and memory
+// maps always go.
+static int multiboot2_plan(struct multiboot2_plan* plan, const struct multiboot2_request* req, const char* cmdline) {
+    uint32_t basics = MULTIBOOT2_TAG_BIT(MULTIBOOT2_TAG_TYPE_CMDLINE) |
+                      MULTIBOOT2_TAG_BIT(MULTIBOOT2_TAG_TYPE_BOOT_LOADER_NAME) |
+                      MULTIBOOT2_TAG_BIT(MULTIBOOT2_TAG_TYPE_MODULE) |
+                      MULTIBOOT2_TAG_BIT(MULTIBOOT2_TAG_TYPE_BASIC_MEMINFO) |
+                      MULTIBOOT2_TAG_BIT(MULTIBOOT2_TAG_TYPE_MMAP) |
+                      MULTIBOOT2_TAG_BIT(MULTIBOOT2_TAG_TYPE_EFI_BS);
+    uint32_t available = basics;
+    int wide = sizeof(void*) == 8;
 
-struct multiboot2_tag_load_base_addr {
-    uint32_t type;
-    uint32_t size;
-    uint32_t load_base_addr;
-};
+    memset(plan, 0, sizeof(*plan));
+    plan->cmdline = cmdline ? cmdline : "";
 
-int multiboot2_load_kernel(const char* kernel_path, const char* cmdline) {
-    uint8_t* kernel_data = NULL;
-    uint32_t kernel_size = 0;
-    
-    // Load kernel file
-    if (load_file(kernel_path, &kernel_data, &kernel_size) != 0) {
-        return -1;
+    if (firmware_framebuffers(&plan->fb, 1)) {
+        available |= MULTIBOOT2_TAG_BIT(MULTIBOOT2_TAG_TYPE_FRAMEBUFFER);
     }
-    
-    // Parse Multiboot 2 header
-    uint32_t* header = (uint32_t*)kernel_data;
-    
-    // Verify Multiboot 2 magic
-    if (header[0] != MULTIBOOT2_HEADER_MAGIC) {
-        return -1;
-    }
-    
-    // Find header address and entry point
-    uint32_t header_addr = 0;
-    uint32_t load_addr = 0;
-    uint32_t load_end_addr = 0;
-    uint32_t bss_end_addr = 0;
-    uint32_t entry_addr = 0;
-    
-    // Parse header tags
-    uint32_t offset = 8;
-    while (offset < kernel_size) {
-        struct multiboot2_tag* tag = (struct multiboot2_tag*)(kernel_data + offset);
-        
-        if (tag->type == MULTIBOOT2_HEADER_TAG_END) {
-            break;
+
+    plan->rsdp = (const uint8_t*)firmware_acpi_rsdp();
+    if (plan->rsdp) {
+        available |= MULTIBOOT2_TAG_BIT(MULTIBOOT2_TAG_TYPE_ACPI_OLD);
+        if (plan->rsdp[15] >= 2) {
+            memcpy(&plan->rsdp_length, plan->rsdp + 20, sizeof(plan->rsdp_length));
+            if (plan->rsdp_length >= 36) available |= MULTIBOOT2_TAG_BIT(MULTIBOOT2_TAG_TYPE_ACPI_NEW);
         }
-        
-        if (tag->type == MULTIBOOT2_HEADER_TAG_INFORMATION_REQUEST) {
-            // Handle information request
-        } else if (tag->type == MULTIBOOT2_HEADER_TAG_ADDRESS) {
-            struct multiboot2_header_tag_address* addr_tag = (struct multiboot2_header_tag_address*)tag;
-            header_addr = addr_tag->header_addr;
-            load_addr = addr_tag->load_addr;
-            load_end_addr = addr_tag->load_end_addr;
-            bss_end_addr = addr_tag->bss_end_addr;
-        } else if (tag->type == MULTIBOOT2_HEADER_TAG_ENTRY_ADDRESS) {
-            struct multiboot2_header_tag_entry_address* entry_tag = (struct multiboot2_header_tag_entry_address*)tag;
-            entry_addr = entry_tag->entry_addr;
+    }
+
+    if (firmware_system_table()) {
+        available |= MULTIBOOT2_TAG_BIT(wide ? MULTIBOOT2_TAG_TYPE_EFI64 : MULTIBOOT2_TAG_TYPE_EFI32);
+        available |= MULTIBOOT2_TAG_BIT(wide ? MULTIBOOT2_TAG_TYPE_EFI64_IH : MULTIBOOT2_TAG_TYPE_EFI32_IH);
+        if (!req->keep_boot_services) {
+            uint32_t descriptor_size = 0;
+            uint32_t map_size = firmware_memory_map_size(&descriptor_size);
+            if (map_size) {
+                plan->efi_mmap_capacity = map_size + MULTIBOOT2_EFI_MMAP_SLACK * descriptor_size;
+                basics |= MULTIBOOT2_TAG_BIT(MULTIBOOT2_TAG_TYPE_EFI_MMAP);
+                available |= MULTIBOOT2_TAG_BIT(MULTIBOOT2_TAG_TYPE_EFI_MMAP);
+            }
         }
-        
-        offset += tag->size;
-        if (tag->size % 8 != 0) {
-            offset += 8 - (tag->size % 8);
+    }
+    if (!module_count) available &= ~MULTIBOOT2_TAG_BIT(MULTIBOOT2_TAG_TYPE_MODULE);
+    if (!req->keep_boot_services) available &= ~MULTIBOOT2_TAG_BIT(MULTIBOOT2_TAG_TYPE_EFI_BS);
+
+    if (req->requested || req->unknown) {
+        if (req->required && (req->unknown || (req->requested & ~available))) return -1;
+        plan->tags = available & (basics | req->requested);
+    } else {
+        plan->tags = available;
+    }
+
+    plan->mmap_count = place_e820(NULL, NULL) + MULTIBOOT2_MMAP_SLACK;
+    return 0;
+}
+
+static uint32_t multiboot2_align(uint32_t size) {
+    return (size + MULTIBOOT2_TAG_ALIGN - 1) & ~(MULTIBOOT2_TAG_ALIGN - 1);
+}
+
+#define MULTIBOOT2_HAS(plan, type) ((plan)->tags & MULTIBOOT2_TAG_BIT(type))
+
+// Mirrors multiboot2_build() tag for tag
+static uint32_t multiboot2_info_size(const struct multiboot2_plan* plan) {
+    uint32_t size = sizeof(struct multiboot2_info);
+    if (MULTIBOOT2_HAS(plan, MULTIBOOT2_TAG_TYPE_CMDLINE)) {
+        size += multiboot2_align(sizeof(struct multiboot2_tag_string) + strlen(plan->cmdline) + 1);
+    }
+    if (MULTIBOOT2_HAS(plan, MULTIBOOT2_TAG_TYPE_BOOT_LOADER_NAME)) {
+        size += multiboot2_align(sizeof(struct multiboot2_tag_string) + sizeof(MULTIBOOT2_LOADER_NAME));
+    }
+    if (MULTIBOOT2_HAS(plan, MULTIBOOT2_TAG_TYPE_MODULE)) {
+        for (uint32_t i = 0; i < module_count; i++) {
+            size += multiboot2_align(sizeof(struct multiboot2_tag_module) + strlen(modules[i].cmdline) + 1);
         }
     }
-    
-    // Default values if not specified
-    if (load_addr == 0) load_addr = 0x100000; // 1MB
-    if (entry_addr == 0) entry_addr = load_addr;
-    
-    // Load kernel to specified address
-    uint32_t load_size = load_end_addr - load_addr;
-    if (load_size > kernel_size) load_size = kernel_size;
-    
-    memcpy((void*)load_addr, kernel_data, load_size);
-    
-    // Zero out BSS
-    if (bss_end_addr > load_end_addr) {
-        memset((void*)load_end_addr, 0, bss_end_addr - load_end_addr);
+    if (MULTIBOOT2_HAS(plan, MULTIBOOT2_TAG_TYPE_BASIC_MEMINFO)) {
+        size += multiboot2_align(sizeof(struct multiboot2_tag_basic_meminfo));
     }
-    
-    // Setup Multiboot 2 info structure
-    struct multiboot2_info* mb_info = (struct multiboot2_info*)0x90000;
-    memset(mb_info, 0, sizeof(struct multiboot2_info));
-    
-    uint32_t info_offset = sizeof(struct multiboot2_info);
-    
-    // Add command line tag
-    if (cmdline && strlen(cmdline) > 0) {
-        struct multiboot2_tag_string* cmdline_tag = (struct multiboot2_tag_string*)((uint8_t*)mb_info + info_offset);
-        cmdline_tag->type = MULTIBOOT2_TAG_TYPE_CMDLINE;
-        cmdline_tag->size = sizeof(struct multiboot2_tag_string) + strlen(cmdline) + 1;
-        strcpy(cmdline_tag->string, cmdline);
-        
-        info_offset += cmdline_tag->size;
-        if (cmdline_tag->size % 8 != 0) {
-            info_offset += 8 - (cmdline_tag->size % 8);
+    if (MULTIBOOT2_HAS(plan, MULTIBOOT2_TAG_TYPE_MMAP)) {
+        size += multiboot2_align(sizeof(struct multiboot2_tag_mmap) +
+                                 plan->mmap_count * sizeof(struct multiboot2_mmap_entry));
+    }
+    if (MULTIBOOT2_HAS(plan, MULTIBOOT2_TAG_TYPE_FRAMEBUFFER)) {
+        size += multiboot2_align(sizeof(struct multiboot2_tag_framebuffer));
+    }
+    if (MULTIBOOT2_HAS(plan, MULTIBOOT2_TAG_TYPE_ACPI_OLD)) {
+        size += multiboot2_align(sizeof(struct multiboot2_tag_old_acpi) + 20);
+    }
+    if (MULTIBOOT2_HAS(plan, MULTIBOOT2_TAG_TYPE_ACPI_NEW)) {
+        size += multiboot2_align(sizeof(struct multiboot2_tag_new_acpi) + plan->rsdp_length);
+    }
+    if (MULTIBOOT2_HAS(plan, MULTIBOOT2_TAG_TYPE_EFI64)) size += multiboot2_align(sizeof(struct multiboot2_tag_efi64));
+    if (MULTIBOOT2_HAS(plan, MULTIBOOT2_TAG_TYPE_EFI32)) size += multiboot2_align(sizeof(struct multiboot2_tag_efi32));
+    if (MULTIBOOT2_HAS(plan, MULTIBOOT2_TAG_TYPE_EFI64_IH)) size += multiboot2_align(sizeof(struct multiboot2_tag_efi64_ih));
+    if (MULTIBOOT2_HAS(plan, MULTIBOOT2_TAG_TYPE_EFI32_IH)) size += multiboot2_align(sizeof(struct multiboot2_tag_efi32_ih));
+    if (MULTIBOOT2_HAS(plan, MULTIBOOT2_TAG_TYPE_EFI_BS)) size += multiboot2_align(sizeof(struct multiboot2_tag));
+    if (MULTIBOOT2_HAS(plan, MULTIBOOT2_TAG_TYPE_EFI_MMAP)) {
+        size += multiboot2_align(sizeof(struct multiboot2_tag_efi_mmap) + plan->efi_mmap_capacity);
+    }
+    return size + sizeof(struct multiboot2_tag);
+}
+
+struct multiboot2_builder {
+    struct multiboot2_info* info;
+    uint32_t used;
+    uint32_t capacity;
+};
+
+static void* multiboot2_tag(struct multiboot2_builder* b, uint32_t type, uint32_t size) {
+    uint32_t at = multiboot2_align(b->used);
+    if (at + size > b->capacity) return NULL;
+    struct multiboot2_tag* tag = (struct multiboot2_tag*)((uint8_t*)b->info + at);
+    memset(tag, 0, size);
+    tag->type = type;
+    tag->size = size;
+    b->used = at + size;
+    return tag;
+}
+
+static void multiboot2_finish(struct multiboot2_builder* b) {
+    multiboot2_tag(b, MULTIBOOT2_TAG_TYPE_END, sizeof(struct multiboot2_tag));
+    b->info->total_size = b->used;
+    b->info->reserved = 0;
+}
+
+struct multiboot2_mmap_ctx {
+    struct multiboot2_tag_mmap* tag;
+    uint32_t max;
+};
+
+static void multiboot2_add_mmap(void* ctx, uint64_t base, uint64_t size, uint32_t type) {
+    struct multiboot2_mmap_ctx* mmap = (struct multiboot2_mmap_ctx*)ctx;
+    uint32_t count = (mmap->tag->size - sizeof(struct multiboot2_tag_mmap)) / sizeof(struct multiboot2_mmap_entry);
+    if (count >= mmap->max) return;
+    struct multiboot2_mmap_entry* entry = &mmap->tag->entries[count];
+    entry->addr = base;
+    entry->len = size;
+    entry->type = type;
+    entry->zero = 0;
+    mmap->tag->size += sizeof(struct multiboot2_mmap_entry);
+}
+
+// Every tag but the end tag. The EFI memory map goes last, so it can be
+// filled in and cut to size once boot services are gone.
+static int multiboot2_build(struct multiboot2_builder* b, const struct multiboot2_plan* plan,
+                            struct multiboot2_tag_efi_mmap** efi_mmap) {
+    b->info->total_size = 0;
+    b->info->reserved = 0;
+    b->used = sizeof(struct multiboot2_info);
+    *efi_mmap = NULL;
+
+    if (MULTIBOOT2_HAS(plan, MULTIBOOT2_TAG_TYPE_CMDLINE)) {
+        uint32_t len = (uint32_t)strlen(plan->cmdline) + 1;
+        struct multiboot2_tag_string* tag = multiboot2_tag(b, MULTIBOOT2_TAG_TYPE_CMDLINE, sizeof(*tag) + len);
+        if (!tag) return -1;
+        memcpy(tag->string, plan->cmdline, len);
+    }
+
+    if (MULTIBOOT2_HAS(plan, MULTIBOOT2_TAG_TYPE_BOOT_LOADER_NAME)) {
+        struct multiboot2_tag_string* tag = multiboot2_tag(b, MULTIBOOT2_TAG_TYPE_BOOT_LOADER_NAME,
+                                                           sizeof(*tag) + sizeof(MULTIBOOT2_LOADER_NAME));
+        if (!tag) return -1;
+        memcpy(tag->string, MULTIBOOT2_LOADER_NAME, sizeof(MULTIBOOT2_LOADER_NAME));
+    }
+
+    if (MULTIBOOT2_HAS(plan, MULTIBOOT2_TAG_TYPE_MODULE)) {
+        for (uint32_t i = 0; i < module_count; i++) {
+            uint32_t len = (uint32_t)strlen(modules[i].cmdline) + 1;
+            struct multiboot2_tag_module* tag = multiboot2_tag(b, MULTIBOOT2_TAG_TYPE_MODULE, sizeof(*tag) + len);
+            if (!tag) return -1;
+            tag->mod_start = (uint32_t)(uintptr_t)modules[i].data;
+            tag->mod_end = tag->mod_start + modules[i].size;
+            memcpy(tag->cmdline, modules[i].cmdline, len);
         }
     }
-    
-    // Add basic memory info tag
-    struct multiboot2_tag_basic_meminfo* meminfo_tag = (struct multiboot2_tag_basic_meminfo*)((uint8_t*)mb_info + info_offset);
-    meminfo_tag->type = MULTIBOOT2_TAG_TYPE_BASIC_MEMINFO;
-    meminfo_tag->size = sizeof(struct multiboot2_tag_basic_meminfo);
-    meminfo_tag->mem_lower = 640; // 640KB
-    meminfo_tag->mem_upper = 0x7FE00; // Extended memory in KB
-    
-    info_offset += meminfo_tag->size;
-    if (meminfo_tag->size % 8 != 0) {
-        info_offset += 8 - (meminfo_tag->size % 8);
+
+    if (MULTIBOOT2_HAS(plan, MULTIBOOT2_TAG_TYPE_BASIC_MEMINFO)) {
+        struct multiboot2_tag_basic_meminfo* tag = multiboot2_tag(b, MULTIBOOT2_TAG_TYPE_BASIC_MEMINFO, sizeof(*tag));
+        if (!tag) return -1;
+        place_basic_meminfo(&tag->mem_lower, &tag->mem_upper);
     }
-    
-    // Add boot device tag
-    struct multiboot2_tag_bootdev* bootdev_tag = (struct multiboot2_tag_bootdev*)((uint8_t*)mb_info + info_offset);
-    bootdev_tag->type = MULTIBOOT2_TAG_TYPE_BOOTDEV;
-    bootdev_tag->size = sizeof(struct multiboot2_tag_bootdev);
-    bootdev_tag->biosdev = 0x80; // First hard disk
-    bootdev_tag->partition = 0;
-    bootdev_tag->subpartition = 0;
-    
-    info_offset += bootdev_tag->size;
-    if (bootdev_tag->size % 8 != 0) {
-        info_offset += 8 - (bootdev_tag->size % 8);
+
+    // Straight from the placement map, after the last allocation, so the
+    // kernel sees the same firmware regions the loader avoided
+    if (MULTIBOOT2_HAS(plan, MULTIBOOT2_TAG_TYPE_MMAP)) {
+        struct multiboot2_mmap_ctx mmap;
+        uint32_t room = sizeof(struct multiboot2_tag_mmap) + plan->mmap_count * sizeof(struct multiboot2_mmap_entry);
+        mmap.tag = multiboot2_tag(b, MULTIBOOT2_TAG_TYPE_MMAP, room);
+        if (!mmap.tag) return -1;
+        mmap.tag->size = sizeof(struct multiboot2_tag_mmap);
+        mmap.tag->entry_size = sizeof(struct multiboot2_mmap_entry);
+        mmap.tag->entry_version = 0;
+        mmap.max = plan->mmap_count;
+        place_e820(multiboot2_add_mmap, &mmap);
+        b->used = (uint32_t)((uint8_t*)mmap.tag - (uint8_t*)b->info) + mmap.tag->size;
     }
-    
-    // Add memory map tag
-    struct multiboot2_tag_mmap* mmap_tag = (struct multiboot2_tag_mmap*)((uint8_t*)mb_info + info_offset);
-    mmap_tag->type = MULTIBOOT2_TAG_TYPE_MMAP;
-    mmap_tag->size = sizeof(struct multiboot2_tag_mmap) + 2 * sizeof(struct multiboot2_mmap_entry);
-    mmap_tag->entry_size = sizeof(struct multiboot2_mmap_entry);
-    mmap_tag->entry_version = 0;
-    
-    mmap_tag->entries[0].addr = 0;
-    mmap_tag->entries[0].len = 0x100000; // 1MB
-    mmap_tag->entries[0].type = MULTIBOOT2_MMAP_TYPE_AVAILABLE;
-    mmap_tag->entries[0].zero = 0;
-    
-    mmap_tag->entries[1].addr = 0x100000;
-    mmap_tag->entries[1].len = 0x7FF00000; // ~2GB
-    mmap_tag->entries[1].type = MULTIBOOT2_MMAP_TYPE_AVAILABLE;
-    mmap_tag->entries[1].zero = 0;
-    
-    info_offset += mmap_tag->size;
-    if (mmap_tag->size % 8 != 0) {
-        info_offset += 8 - (mmap_tag->size % 8);
+
+    if (MULTIBOOT2_HAS(plan, MULTIBOOT2_TAG_TYPE_FRAMEBUFFER)) {
+        struct multiboot2_tag_framebuffer* tag = multiboot2_tag(b, MULTIBOOT2_TAG_TYPE_FRAMEBUFFER, sizeof(*tag));
+        if (!tag) return -1;
+        tag->framebuffer_addr = plan->fb.base;
+        tag->framebuffer_pitch = plan->fb.pitch;
+        tag->framebuffer_width = plan->fb.width;
+        tag->framebuffer_height = plan->fb.height;
+        tag->framebuffer_bpp = (uint8_t)plan->fb.bpp;
+        tag->framebuffer_type = MULTIBOOT2_FRAMEBUFFER_TYPE_RGB;
+        tag->framebuffer_red_field_position = plan->fb.red_shift;
+        tag->framebuffer_red_mask_size = plan->fb.red_size;
+        tag->framebuffer_green_field_position = plan->fb.green_shift;
+        tag->framebuffer_green_mask_size = plan->fb.green_size;
+        tag->framebuffer_blue_field_position = plan->fb.blue_shift;
+        tag->framebuffer_blue_mask_size = plan->fb.blue_size;
+    }
+
+    // The old tag carries the ACPI 1.0 part of the RSDP, the new one all of it
+    if (MULTIBOOT2_HAS(plan, MULTIBOOT2_TAG_TYPE_ACPI_OLD)) {
+        struct multiboot2_tag_old_acpi* tag = multiboot2_tag(b, MULTIBOOT2_TAG_TYPE_ACPI_OLD, sizeof(*tag) + 20);
+        if (!tag) return -1;
+        memcpy(tag->rsdp, plan->rsdp, 20);
+    }
+    if (MULTIBOOT2_HAS(plan, MULTIBOOT2_TAG_TYPE_ACPI_NEW)) {
+        struct multiboot2_tag_new_acpi* tag = multiboot2_tag(b, MULTIBOOT2_TAG_TYPE_ACPI_NEW,
+                                                             sizeof(*tag) + plan->rsdp_length);
+        if (!tag) return -1;
+        memcpy(tag->rsdp, plan->rsdp, plan->rsdp_length);
+    }
+
+    if (MULTIBOOT2_HAS(plan, MULTIBOOT2_TAG_TYPE_EFI64)) {
+        struct multiboot2_tag_efi64* tag = multiboot2_tag(b, MULTIBOOT2_TAG_TYPE_EFI64, sizeof(*tag));
+        if (!tag) return -1;
+        tag->pointer = (uint64_t)(uintptr_t)firmware_system_table();
+    }
+    if (MULTIBOOT2_HAS(plan, MULTIBOOT2_TAG_TYPE_EFI32)) {
+        struct multiboot2_tag_efi32* tag = multiboot2_tag(b, MULTIBOOT2_TAG_TYPE_EFI32, sizeof(*tag));
+        if (!tag) return -1;
+        tag->pointer = (uint32_t)(uintptr_t)firmware_system_table();
+    }
+    if (MULTIBOOT2_HAS(plan, MULTIBOOT2_TAG_TYPE_EFI64_IH)) {
+        struct multiboot2_tag_efi64_ih* tag = multiboot2_tag(b, MULTIBOOT2_TAG_TYPE_EFI64_IH, sizeof(*tag));
+        if (!tag) return -1;
+        tag->pointer = (uint64_t)(uintptr_t)firmware_image_handle();
+    }
+    if (MULTIBOOT2_HAS(plan, MULTIBOOT2_TAG_TYPE_EFI32_IH)) {
+        struct multiboot2_tag_efi32_ih* tag = multiboot2_tag(b, MULTIBOOT2_TAG_TYPE_EFI32_IH, sizeof(*tag));
+        if (!tag) return -1;
+        tag->pointer = (uint32_t)(uintptr_t)firmware_image_handle();
+    }
+    if (MULTIBOOT2_HAS(plan, MULTIBOOT2_TAG_TYPE_EFI_BS)) {
+        if (!multiboot2_tag(b, MULTIBOOT2_TAG_TYPE_EFI_BS, sizeof(struct multiboot2_tag))) return -1;
+    }
+
+    if (MULTIBOOT2_HAS(plan, MULTIBOOT2_TAG_TYPE_EFI_MMAP)) {
+        *efi_mmap = multiboot2_tag(b, MULTIBOOT2_TAG_TYPE_EFI_MMAP,
+                                   sizeof(struct multiboot2_tag_efi_mmap) + plan->efi_mmap_capacity);
+        if (!*efi_mmap) return -1;
     }
-    
-    // Add end tag
-    struct multiboot2_tag* end_tag = (struct multiboot2_tag*)((uint8_t*)mb_info + info_offset);
-    end_tag->type = MULTIBOOT2_TAG_TYPE_END;
-    end_tag->size = sizeof(struct multiboot2_tag);
-    
-    info_offset += end_tag->size;
-    
-    // Set total size
-    mb_info->total_size = info_offset;
-    mb_info->reserved = 0;
-    
-    // Jump to kernel
-    void (*kernel_entry)(uint32_t, struct multiboot2_info*) = (void*)entry_addr;
-    kernel_entry(MULTIBOOT2_BOOTLOADER_MAGIC, mb_info);
-    
     return 0;
 }
 
-int multiboot2_verify_kernel(const char* kernel_path) {
-    uint8_t* kernel_data = NULL;
-    uint32_t kernel_size = 0;
-    
-    if (load_file(kernel_path, &kernel_data, &kernel_size) != 0) {
+#if defined(__x86_64__)
+
+// The i386 machine state the protocol promises: 32-bit protected mode,
+// flat segments, paging off, EAX the magic and EBX the information
+// structure. Copied below 4 GiB and entered from long mode with the entry
+// point in EDI and the structure in ESI.
+extern uint8_t multiboot2_stub[], multiboot2_stub_end[];
+extern uint8_t multiboot2_stub_gdt[], multiboot2_stub_gdtr[];
+
+asm (
+    ".pushsection .text\n"
+    ".code64\n"
+    "multiboot2_stub:\n"
+    "    lgdt multiboot2_stub_gdtr(%rip)\n"
+    "    pushq $0x08\n"
+    "    leaq multiboot2_stub_pm(%rip), %rax\n"
+    "    pushq %rax\n"
+    "    lretq\n"
+    ".code32\n"
+    "multiboot2_stub_pm:\n"
+    "    movl $0x10, %eax\n"
+    "    movw %ax, %ds\n"
+    "    movw %ax, %es\n"
+    "    movw %ax, %fs\n"
+    "    movw %ax, %gs\n"
+    "    movw %ax, %ss\n"
+    "    movl %cr0, %eax\n"
+    "    andl $0x7FFFFFFF, %eax\n"
+    "    movl %eax, %cr0\n"
+    "    movl $0xC0000080, %ecx\n"
+    "    rdmsr\n"
+    "    andl $0xFFFFFEFF, %eax\n"
+    "    wrmsr\n"
+    "    movl %esi, %ebx\n"
+    "    movl $0x36D76289, %eax\n"
+    "    jmp *%edi\n"
+    "    .balign 8\n"
+    "multiboot2_stub_gdt:\n"
+    "    .quad 0\n"
+    "    .quad 0x00cf9a000000ffff\n"
+    "    .quad 0x00cf92000000ffff\n"
+    "multiboot2_stub_gdtr:\n"
+    "    .word 23\n"
+    "    .quad 0\n"
+    "multiboot2_stub_end:\n"
+    ".code64\n"
+    ".popsection\n"
+);
+
+static uint8_t* multiboot2_stub_install(void) {
+    uint8_t* page = (uint8_t*)place_below(PLACE_LIMIT_4G, PLACE_PAGE_SIZE, PLACE_PAGE_SIZE);
+    if (!page) return NULL;
+    place_add((uint64_t)(uintptr_t)page, PLACE_PAGE_SIZE, PLACE_RECLAIMABLE);
+    memcpy(page, multiboot2_stub, multiboot2_stub_end - multiboot2_stub);
+    uint64_t gdt = (uint64_t)(uintptr_t)(page + (multiboot2_stub_gdt - multiboot2_stub));
+    memcpy(page + (multiboot2_stub_gdtr - multiboot2_stub) + 2, &gdt, sizeof(gdt));
+    return page;
+}
+
+static void multiboot2_stub_release(uint8_t* stub) {
+    place_free(stub, PLACE_PAGE_SIZE);
+}
+
+static __attribute__((noreturn)) void multiboot2_enter(uint8_t* stub, uint32_t entry, struct multiboot2_info* mb_info) {
+    // Paging cannot be turned off with PCIDs on
+    uint64_t cr4;
+    asm volatile ("cli\n\t"
+                  "mov %%cr4, %0" : "=r"(cr4));
+    asm volatile ("mov %0, %%cr4" : : "r"(cr4 & ~(1ULL << 17)) : "memory");
+    asm volatile ("jmpq *%2" : : "D"(entry), "S"((uint32_t)(uintptr_t)mb_info), "r"(stub) : "memory");
+    __builtin_unreachable();
+}
+
+// EFI amd64 entry: long mode on the firmware's tables, boot services up
+static __attribute__((noreturn)) void multiboot2_enter_efi64(uint64_t entry, struct multiboot2_info* mb_info) {
+    asm volatile ("jmpq *%2" : : "a"(MULTIBOOT2_BOOTLOADER_MAGIC), "b"(mb_info), "r"(entry) : "memory");
+    __builtin_unreachable();
+}
+
+#else
+
+static uint8_t* multiboot2_stub_install(void) {
+    return (uint8_t*)1;     // Already in protected mode; nothing to copy
+}
+
+static void multiboot2_stub_release(uint8_t* stub) {
+    (void)stub;
+}
+
+static __attribute__((noreturn)) void multiboot2_enter(uint8_t* stub, uint32_t entry, struct multiboot2_info* mb_info) {
+    (void)stub;
+    asm volatile ("cli\n\t"
+                  "movl %%cr0, %%ecx\n\t"
+                  "andl $0x7FFFFFFF, %%ecx\n\t"
+                  "movl %%ecx, %%cr0\n\t"
+                  "jmp *%2"
+                  : : "a"(MULTIBOOT2_BOOTLOADER_MAGIC), "b"(mb_info), "r"(entry) : "ecx", "memory");
+    __builtin_unreachable();
+}
+
+#endif
+
+// The header sits at an 8-byte boundary somewhere in the first
+// MULTIBOOT2_SEARCH bytes, with a checksum that makes its first four fields
+// sum to zero
+static int multiboot2_find_header(const uint8_t* head, uint32_t head_len, uint32_t* header_offset) {
+    for (uint32_t off = 0; off + sizeof(struct multiboot2_header) <= head_len; off += MULTIBOOT2_HEADER_ALIGN) {
+        const struct multiboot2_header* h = (const struct multiboot2_header*)(head + off);
+        if (h->magic != MULTIBOOT2_HEADER_MAGIC) continue;
+        if (h->magic + h->architecture + h->header_length + h->checksum != 0) continue;
+        if (h->header_length < sizeof(*h) || h->header_length > head_len - off) continue;
+        *header_offset = off;
+        return 0;
+    }
+    return -1;
+}
+
+// The address tag describes a flat image: the file from load_addr (found
+// relative to the header) up to load_end_addr or the end of the file,
+// followed by BSS up to bss_end_addr. *image_size is the span placed at
+// load_addr.
+static int multiboot2_load_flat(const struct elf_source* src, uint32_t header_offset,
+                                const struct multiboot2_header_tag_address* addr, uint64_t* image_size) {
+    if (addr->load_addr > addr->header_addr || addr->header_addr - addr->load_addr > header_offset) return -1;
+    if (addr->load_end_addr && addr->load_end_addr < addr->load_addr) return -1;
+    uint64_t file_offset = header_offset - (addr->header_addr - addr->load_addr);
+    uint64_t load_size = addr->load_end_addr ? (uint64_t)addr->load_end_addr - addr->load_addr : src->size - file_offset;
+    if (load_size > src->size - file_offset) return -1;
+
+    uint64_t load_end = (uint64_t)addr->load_addr + load_size;
+    uint64_t image_end = addr->bss_end_addr > load_end ? addr->bss_end_addr : load_end;
+    if (image_end - 1 > PLACE_LIMIT_4G || !place_at(addr->load_addr, image_end - addr->load_addr)) return -1;
+
+    if (elf_source_read(src, (void*)(uintptr_t)addr->load_addr, file_offset, load_size) != 0) {
+        place_free((void*)(uintptr_t)addr->load_addr, image_end - addr->load_addr);
         return -1;
     }
-    
-    uint32_t* header = (uint32_t*)kernel_data;
-    
-    // Check Multiboot 2 magic
-    if (header[0] != MULTIBOOT2_HEADER_MAGIC) {
+    elf_zero((void*)(uintptr_t)load_end, image_end - load_end);
+    *image_size = image_end - addr->load_addr;
+    return 0;
+}
+
+// Load the image, build the information structure the kernel asked for and
+// enter it. Only returns on failure.
+static int multiboot2_boot(const struct elf_source* src, const char* cmdline) {
+    // Only the header search area is read up front; the image itself is
+    // streamed from its source to its load address
+    uint32_t head_len = src->size < MULTIBOOT2_SEARCH ? (uint32_t)src->size : MULTIBOOT2_SEARCH;
+    uint8_t* head = (uint8_t*)malloc(head_len ? head_len : 1);
+    uint32_t header_offset = 0;
+    if (!head || elf_source_read(src, head, 0, head_len) != 0 ||
+        multiboot2_find_header(head, head_len, &header_offset) != 0) {
+        free(head);
         return -1;
     }
-    
-    // Check architecture
-    if (header[1] != MULTIBOOT2_ARCHITECTURE_I386) {
+
+    struct multiboot2_request req;
+    struct multiboot2_plan plan;
+    multiboot2_parse_header(head, header_offset, &req);
+    if (multiboot2_plan(&plan, &req, cmdline) != 0) {
+        free(head);
         return -1;
     }
-    
-    // Check header length
-    if (header[2] < 8 || header[2] > kernel_size) {
+
+    // Without an address tag the image is an ELF, loaded by physical address
+    int r;
+    uint32_t entry_addr = req.entry_addr;
+    uint64_t flat_size = 0;
+    struct elf_image img;
+    memset(&img, 0, sizeof(img));
+    if (req.have_addr) {
+        r = multiboot2_load_flat(src, header_offset, &req.addr, &flat_size);
+        if (entry_addr == 0) entry_addr = req.addr.load_addr;
+    } else {
+        struct elf_load_policy policy = { 0, 0, PLACE_LIMIT_4G, 1 };
+        r = elf_load(src, &policy, &img);
+        if (r == 0 && entry_addr == 0) {
+            uint64_t entry = elf_virt_to_phys(&img, img.entry);
+            entry_addr = (uint32_t)(entry ? entry : img.entry);
+        }
+    }
+    free(head);
+    if (r != 0) {
         return -1;
     }
-    
-    // Check header checksum
-    uint32_t checksum = 0;
-    for (uint32_t i = 0; i < header[2] / 4; i++) {
-        checksum += header[i];
+
+    // Everything else is placed before the structure is sized, so the
+    // memory map it carries already shows it
+    uint8_t* stub = NULL;
+    struct multiboot2_builder b;
+    struct multiboot2_tag_efi_mmap* efi_mmap;
+    struct firmware_memory_map map;
+    b.info = NULL;
+    b.capacity = multiboot2_info_size(&plan);
+    if (!req.keep_boot_services) {
+        stub = multiboot2_stub_install();
+        if (!stub) goto fail;
+    }
+
+    b.info = (struct multiboot2_info*)place_below(PLACE_LIMIT_4G, b.capacity, MULTIBOOT2_TAG_ALIGN);
+    if (!b.info || multiboot2_build(&b, &plan, &efi_mmap) != 0) goto fail;
+
+#if defined(__x86_64__)
+    if (req.keep_boot_services) {
+        multiboot2_finish(&b);
+        if (tpm2_flush_measurements() != 0) goto fail;
+        multiboot2_enter_efi64(req.efi64_entry, b.info);
+    }
+#endif
+
+    // The EFI memory map is the one ExitBootServices() was given, written
+    // into its tag in place; the end tag follows once its size is known
+    memset(&map, 0, sizeof(map));
+    if (efi_mmap) {
+        map.buffer = efi_mmap->efi_mmap;
+        map.capacity = plan.efi_mmap_capacity;
+    }
+    if (firmware_exit_boot_services(efi_mmap ? &map : NULL) != 0) goto fail;
+    if (efi_mmap) {
+        efi_mmap->size = sizeof(struct multiboot2_tag_efi_mmap) + map.size;
+        efi_mmap->descr_size = map.descriptor_size;
+        efi_mmap->descr_vers = map.descriptor_version;
+        b.used = (uint32_t)((uint8_t*)efi_mmap - (uint8_t*)b.info) + efi_mmap->size;
     }
-    if (checksum != 0) {
+    multiboot2_finish(&b);
+
+    multiboot2_enter(stub, entry_addr, b.info);
+
+fail:
+    place_free(b.info, b.capacity);
+    if (stub) multiboot2_stub_release(stub);
+    if (req.have_addr) {
+        place_free((void*)(uintptr_t)req.addr.load_addr, flat_size);
+    } else {
+        elf_release(&img);
+    }
+    return -1;
+}
+
+int multiboot2_load_kernel(const char* kernel_path, const char* cmdline) {
+    struct elf_source src;
+
+    if (elf_source_open(&src, kernel_path) != 0) {
         return -1;
     }
-    
-    return 0;
-} 
+    int r = multiboot2_boot(&src, cmdline);
+    elf_source_close(&src);
+    return r;
+}
 
-int boot_multiboot2_kernel(uint8_t* kernel_data, uint32_t kernel_size, const char* cmdline) {
-    struct multiboot2_info* info = (struct multiboot2_info*)0x1000;
-    uint8_t* tag_ptr = (uint8_t*)info + 8;
-    
-    info->total_size = 8;
-    info->reserved = 0;
-    
-    struct multiboot2_tag_basic_meminfo* meminfo = (struct multiboot2_tag_basic_meminfo*)tag_ptr;
-    meminfo->type = 4;
-    meminfo->size = 16;
-    meminfo->mem_lower = 640;
-    meminfo->mem_upper = 0x7FE00;
-    tag_ptr += meminfo->size;
-    info->total_size += meminfo->size;
+int multiboot2_verify_kernel(const char* kernel_path) {
+    struct elf_source src;
     
-    if (cmdline && strlen(cmdline) > 0) {
-        struct multiboot2_tag_string* cmdline_tag = (struct multiboot2_tag_string*)tag_ptr;
-        cmdline_tag->type = 1;
-        strcpy(cmdline_tag->string, cmdline);
-        cmdline_tag->size = 8 + strlen(cmdline) + 1;
-        tag_ptr += cmdline_tag->size;
-        info->total_size += cmdline_tag->size;
+    if (elf_source_open(&src, kernel_path) != 0) {
+        return -1;
     }
-    
-    struct multiboot2_tag* end_tag = (struct multiboot2_tag*)tag_ptr;
-    end_tag->type = 0;
-    end_tag->size = 8;
-    info->total_size += 8;
-    
-    uint32_t kernel_entry = 0x100000;
-    memcpy((void*)kernel_entry, kernel_data, kernel_size);
-    
-    void (*entry_point)(uint32_t, uint32_t) = (void*)kernel_entry;
-    entry_point(0x36d76289, (uint32_t)info);
-    
-    return 0;
-} 
\ No newline at end of file
+    uint32_t head_len = src.size < MULTIBOOT2_SEARCH ? (uint32_t)src.size : MULTIBOOT2_SEARCH;
+    uint8_t* head = (uint8_t*)malloc(head_len ? head_len : 1);
+    uint32_t header_offset = 0;
+    int r = -1;
+    
+    // Magic, checksum and length are checked by the search
+    if (head && elf_source_read(&src, head, 0, head_len) == 0 &&
+        multiboot2_find_header(head, head_len, &header_offset) == 0) {
+        const struct multiboot2_header* header = (const struct multiboot2_header*)(head + header_offset);
+        
+        // Check architecture
+        r = header->architecture == MULTIBOOT2_ARCHITECTURE_I386 ? 0 : -1;
+    }
+    free(head);
+    elf_source_close(&src);
+    return r;
+}
+
+
+int boot_multiboot2_kernel(uint8_t* kernel_data, uint32_t kernel_size, const char* cmdline) {
+    struct elf_source src;
+
+    elf_source_buffer(&src, kernel_data, kernel_size);
+    return multiboot2_boot(&src, cmdline);
+}
@@ -11,6 +11,8 @@
 #include "compat.h"
 
 #define MULTIBOOT2_HEADER_MAGIC 0xE85250D6
+#define MULTIBOOT2_SEARCH 32768
+#define MULTIBOOT2_HEADER_ALIGN 8
 #define MULTIBOOT2_BOOTLOADER_MAGIC 0x36D76289
 
 #define MULTIBOOT2_ARCHITECTURE_I386 0
@@ -28,6 +30,9 @@
 #define MULTIBOOT2_HEADER_TAG_ENTRY_ADDRESS_EFI_64 9
 #define MULTIBOOT2_HEADER_TAG_RELOCATABLE 10
 
+// Header tag flag: the kernel boots without what the tag asks for
+#define MULTIBOOT2_HEADER_TAG_OPTIONAL 1
+
 #define MULTIBOOT2_TAG_TYPE_END 0
 #define MULTIBOOT2_TAG_TYPE_CMDLINE 1
 #define MULTIBOOT2_TAG_TYPE_BOOT_LOADER_NAME 2
@@ -51,6 +56,10 @@
 #define MULTIBOOT2_TAG_TYPE_EFI64_IH 20
 #define MULTIBOOT2_TAG_TYPE_LOAD_BASE_ADDR 21
 
+#define MULTIBOOT2_FRAMEBUFFER_TYPE_INDEXED 0
+#define MULTIBOOT2_FRAMEBUFFER_TYPE_RGB 1
+#define MULTIBOOT2_FRAMEBUFFER_TYPE_EGA_TEXT 2
+
 #define MULTIBOOT2_MMAP_TYPE_AVAILABLE 1
 #define MULTIBOOT2_MMAP_TYPE_RESERVED 2
 #define MULTIBOOT2_MMAP_TYPE_ACPI_RECLAIMABLE 3
@@ -77,6 +86,14 @@ struct multiboot2_tag_string {
     char string[];
 };
 
+struct multiboot2_tag_module {
+    uint32_t type;
+    uint32_t size;
+    uint32_t mod_start;
+    uint32_t mod_end;
+    char cmdline[];
+};
+
 struct multiboot2_tag_basic_meminfo {
     uint32_t type;
     uint32_t size;
@@ -92,14 +109,6 @@ struct multiboot2_tag_bootdev {
     uint32_t subpartition;
 };
 
-struct multiboot2_tag_mmap {
-    uint32_t type;
-    uint32_t size;
-    uint32_t entry_size;
-    uint32_t entry_version;
-    struct multiboot2_mmap_entry entries[];
-};
-
 struct multiboot2_mmap_entry {
     uint64_t addr;
     uint64_t len;
@@ -107,15 +116,12 @@ struct multiboot2_mmap_entry {
     uint32_t zero;
 };
 
-struct multiboot2_tag_vbe {
+struct multiboot2_tag_mmap {
     uint32_t type;
     uint32_t size;
-    uint16_t vbe_mode;
-    uint16_t vbe_interface_seg;
-    uint16_t vbe_interface_off;
-    uint16_t vbe_interface_len;
-    struct multiboot2_vbe_info_block vbe_control_info;
-    struct multiboot2_vbe_mode_info_block vbe_mode_info;
+    uint32_t entry_size;
+    uint32_t entry_version;
+    struct multiboot2_mmap_entry entries[];
 };
 
 struct multiboot2_vbe_info_block {
@@ -169,6 +175,23 @@ struct multiboot2_vbe_mode_info_block {
     uint8_t reserved2[206];
 };
 
+struct multiboot2_tag_vbe {
+    uint32_t type;
+    uint32_t size;
+    uint16_t vbe_mode;
+    uint16_t vbe_interface_seg;
+    uint16_t vbe_interface_off;
+    uint16_t vbe_interface_len;
+    struct multiboot2_vbe_info_block vbe_control_info;
+    struct multiboot2_vbe_mode_info_block vbe_mode_info;
+};
+
+struct multiboot2_color_info {
+    uint8_t red_value;
+    uint8_t green_value;
+    uint8_t blue_value;
+};
+
 struct multiboot2_tag_framebuffer {
     uint32_t type;
     uint32_t size;
@@ -195,12 +218,6 @@ struct multiboot2_tag_framebuffer {
     };
 };
 
-struct multiboot2_color_info {
-    uint8_t red_value;
-    uint8_t green_value;
-    uint8_t blue_value;
-};
-
 struct multiboot2_tag_elf_sections {
     uint32_t type;
     uint32_t size;
@@ -289,15 +306,32 @@ struct multiboot2_tag_load_base_addr {
     uint32_t load_base_addr;
 };
 
+// At an 8-byte boundary in the first MULTIBOOT2_SEARCH bytes of the image
+struct multiboot2_header {
+    uint32_t magic;
+    uint32_t architecture;
+    uint32_t header_length;
+    uint32_t checksum;
+};
+
+// Header tags, unlike information tags, carry 16-bit type and flags
+struct multiboot2_header_tag {
+    uint16_t type;
+    uint16_t flags;
+    uint32_t size;
+};
+
 struct multiboot2_header_tag_information_request {
-    uint32_t type;
-    uint32_t flags;
+    uint16_t type;
+    uint16_t flags;
+    uint32_t size;
     uint32_t requests[];
 };
 
 struct multiboot2_header_tag_address {
-    uint32_t type;
-    uint32_t flags;
+    uint16_t type;
+    uint16_t flags;
+    uint32_t size;
     uint32_t header_addr;
     uint32_t load_addr;
     uint32_t load_end_addr;
@@ -305,39 +339,51 @@ struct multiboot2_header_tag_address {
 };
 
 struct multiboot2_header_tag_entry_address {
-    uint32_t type;
-    uint32_t flags;
+    uint16_t type;
+    uint16_t flags;
+    uint32_t size;
     uint32_t entry_addr;
 };
 
 struct multiboot2_header_tag_console_flags {
-    uint32_t type;
-    uint32_t flags;
+    uint16_t type;
+    uint16_t flags;
+    uint32_t size;
     uint32_t console_flags;
 };
 
 struct multiboot2_header_tag_framebuffer {
-    uint32_t type;
-    uint32_t flags;
+    uint16_t type;
+    uint16_t flags;
+    uint32_t size;
     uint32_t width;
     uint32_t height;
     uint32_t depth;
 };
 
 struct multiboot2_header_tag_module_align {
-    uint32_t type;
-    uint32_t flags;
+    uint16_t type;
+    uint16_t flags;
+    uint32_t size;
 };
 
 struct multiboot2_header_tag_relocatable {
-    uint32_t type;
-    uint32_t flags;
+    uint16_t type;
+    uint16_t flags;
+    uint32_t size;
     uint32_t min_addr;
     uint32_t max_addr;
     uint32_t align;
     uint32_t preference;
 };
 
+// Modules are loaded when added and handed over by the next boot
+int multiboot2_load_module(const char* module_path, const char* cmdline);
+// Same, for a module already in memory; the bytes are copied
+int multiboot2_add_module(const uint8_t* module_data, uint32_t module_size, const char* cmdline);
+
+// A whole module list at once, read in on-disk order; cmdlines may be NULL
+int multiboot2_load_modules(const char* const* module_paths, const char* const* cmdlines, uint32_t count);
 int multiboot2_load_kernel(const char* kernel_path, const char* cmdline);
 int multiboot2_verify_kernel(const char* kernel_path);
 int boot_multiboot2_kernel(uint8_t* kernel_data, uint32_t kernel_size, const char* cmdline);
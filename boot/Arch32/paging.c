@@ -0,0 +1,209 @@
+/*
+ * paging.c
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#include <stdint.h>
+#include "compat.h"
+#include <string.h>
+#include "paging.h"
+#include "placement.h"
+
+#define PAGING_CR4_LA57     (1ULL << 12)
+
+static int paging_has_1g(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t eax = 0x80000000, ebx, ecx, edx;
+    asm volatile ("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    if (eax < 0x80000001) return 0;
+    eax = 0x80000001;
+    asm volatile ("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    return (edx >> 26) & 1;
+#else
+    return 0;
+#endif
+}
+
+int paging_has_la57(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t eax = 0, ebx, ecx = 0, edx;
+    asm volatile ("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    if (eax < 7) return 0;
+    eax = 7;
+    ecx = 0;
+    asm volatile ("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    return (ecx >> 16) & 1;
+#else
+    return 0;
+#endif
+}
+
+int paging_la57_active(void) {
+#if defined(__x86_64__)
+    uint64_t cr4;
+    asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+    return (cr4 & PAGING_CR4_LA57) != 0;
+#else
+    return 0;
+#endif
+}
+
+// Tables stay in use until the kernel replaces them, so the arena is
+// reported as bootloader-reclaimable rather than given back
+static uint64_t* paging_table(struct paging* pt) {
+    if (pt->tables >= pt->arena_pages) return NULL;
+    uint64_t* table = (uint64_t*)(pt->arena + (uint64_t)pt->tables * PAGING_SIZE_4K);
+    memset(table, 0, PAGING_SIZE_4K);
+    pt->tables++;
+    return table;
+}
+
+// The table entry points to, made if there is none yet
+static uint64_t* paging_next(struct paging* pt, uint64_t* entry) {
+    if (*entry & PAGING_PRESENT) {
+        if (*entry & PAGING_LARGE) return NULL;     // Already mapped by a larger page
+        return (uint64_t*)(uintptr_t)(*entry & PAGING_ADDR_MASK);
+    }
+    uint64_t* table = paging_table(pt);
+    if (!table) return NULL;
+    *entry = (uint64_t)(uintptr_t)table | PAGING_PRESENT | PAGING_WRITE;
+    return table;
+}
+
+// Entry for virt in the table at level (0 maps 4 KiB, 1 2 MiB, 2 1 GiB),
+// making the tables above it as needed
+static uint64_t* paging_entry(struct paging* pt, uint64_t virt, int level) {
+    uint64_t* table = pt->root;
+    for (int l = pt->levels - 1; l > level; l--) {
+        table = paging_next(pt, &table[(virt >> (12 + 9 * l)) & 0x1FF]);
+        if (!table) return NULL;
+    }
+    return &table[(virt >> (12 + 9 * level)) & 0x1FF];
+}
+
+static uint32_t paging_memory_runs(void);
+
+int paging_init(struct paging* pt, uint64_t span, uint32_t flags) {
+    memset(pt, 0, sizeof(*pt));
+    pt->huge_1g = paging_has_1g();
+    pt->levels = ((flags & PAGING_LA57) && paging_has_la57()) ? 5 : 4;
+
+    // Tables holding the large pages, plus one per level above them for
+    // every 512 GiB (and 256 TiB) of span. The ends of each run of memory
+    // above 4 GiB may each need a 2 MiB and a 4 KiB table, in every
+    // paging_map_memory() mapping; a fragmented map has many runs.
+    uint64_t pages = (span >> 39) + (span >> 48) + pt->levels + PAGING_ARENA_SLACK;
+    if (!pt->huge_1g) pages += span >> 30;
+    pages += (uint64_t)paging_memory_runs() * PAGING_RUN_TABLES * PAGING_MEMORY_MAPS;
+    if (pages * PAGING_SIZE_4K > PAGING_TABLE_LIMIT) return -1;
+
+    pt->arena = (uint8_t*)place_below(PAGING_TABLE_LIMIT, pages * PAGING_SIZE_4K, PAGING_SIZE_4K);
+    if (!pt->arena) return -1;
+    place_add((uint64_t)(uintptr_t)pt->arena, pages * PAGING_SIZE_4K, PLACE_RECLAIMABLE);
+    pt->arena_pages = (uint32_t)pages;
+    pt->root = paging_table(pt);
+    return 0;
+}
+
+int paging_map(struct paging* pt, uint64_t virt, uint64_t phys, uint64_t size, uint64_t flags) {
+    if ((virt | phys | size) & (PAGING_SIZE_4K - 1)) return -1;
+    flags |= PAGING_PRESENT;
+
+    while (size) {
+        int level = 0;
+        uint64_t both = virt | phys;
+        if (pt->huge_1g && !(both & (PAGING_SIZE_1G - 1)) && size >= PAGING_SIZE_1G) {
+            level = 2;
+        } else if (!(both & (PAGING_SIZE_2M - 1)) && size >= PAGING_SIZE_2M) {
+            level = 1;
+        }
+
+        // A smaller page has to do where a table is already in the way
+        uint64_t* entry;
+        for (;;) {
+            entry = paging_entry(pt, virt, level);
+            if (!entry) return -1;
+            if (level == 0 || !(*entry & PAGING_PRESENT) || (*entry & PAGING_LARGE)) break;
+            level--;
+        }
+
+        uint64_t page = PAGING_SIZE_4K << (9 * level);
+        *entry = phys | flags | (level ? PAGING_LARGE : 0);
+        virt += page;
+        phys += page;
+        size -= page;
+    }
+    return 0;
+}
+
+// Regions above 4 GiB, merged while the walk goes up through the map so
+// that neighbouring usable regions are mapped as one run. With no pt the
+// runs are only counted.
+struct paging_memory_ctx {
+    struct paging* pt;
+    uint64_t offset;
+    uint64_t flags;
+    int error;
+    uint32_t runs;
+    uint64_t run_base;
+    uint64_t run_end;           // 0 while there is no run
+};
+
+static void paging_flush_run(struct paging_memory_ctx* m) {
+    if (!m->run_end) return;
+    m->runs++;
+    if (m->pt && paging_map(m->pt, m->run_base + m->offset, m->run_base, m->run_end - m->run_base, m->flags) != 0) {
+        m->error = 1;
+    }
+    m->run_end = 0;
+}
+
+static void paging_map_region(void* ctx, uint64_t base, uint64_t size, enum place_type type) {
+    struct paging_memory_ctx* m = (struct paging_memory_ctx*)ctx;
+    uint64_t end = base + size;
+    if (type == PLACE_RESERVED || end <= PLACE_LIMIT_4G + 1) return;
+    if (base < PLACE_LIMIT_4G + 1) base = PLACE_LIMIT_4G + 1;
+    base &= ~(PAGING_SIZE_4K - 1);
+    end = (end + PAGING_SIZE_4K - 1) & ~(PAGING_SIZE_4K - 1);
+
+    if (m->run_end && base <= m->run_end) {
+        if (end > m->run_end) m->run_end = end;
+        return;
+    }
+    paging_flush_run(m);
+    m->run_base = base;
+    m->run_end = end;
+}
+
+static uint32_t paging_memory_runs(void) {
+    struct paging_memory_ctx m = { NULL, 0, 0, 0, 0, 0, 0 };
+    place_walk(paging_map_region, &m);
+    paging_flush_run(&m);
+    return m.runs;
+}
+
+int paging_map_memory(struct paging* pt, uint64_t offset, uint64_t flags) {
+    struct paging_memory_ctx m = { pt, offset, flags, 0, 0, 0, 0 };
+    if (paging_map(pt, offset, 0, PLACE_LIMIT_4G + 1, flags) != 0) return -1;
+    place_walk(paging_map_region, &m);
+    paging_flush_run(&m);
+    return m.error ? -1 : 0;
+}
+
+void paging_trim(struct paging* pt) {
+    if (!pt->arena || pt->tables >= pt->arena_pages) return;
+    place_free(pt->arena + (uint64_t)pt->tables * PAGING_SIZE_4K,
+               (uint64_t)(pt->arena_pages - pt->tables) * PAGING_SIZE_4K);
+    pt->arena_pages = pt->tables;
+}
+
+void paging_release(struct paging* pt) {
+    if (pt->arena) place_free(pt->arena, (uint64_t)pt->arena_pages * PAGING_SIZE_4K);
+    memset(pt, 0, sizeof(*pt));
+}
+
+uint64_t paging_root(const struct paging* pt) {
+    return (uint64_t)(uintptr_t)pt->root;
+}
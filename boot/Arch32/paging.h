@@ -0,0 +1,80 @@
+/*
+ * paging.h
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#ifndef BLOODHORN_PAGING_H
+#define BLOODHORN_PAGING_H
+#include <stdint.h>
+#include "compat.h"
+
+// x86-64 page tables for kernels that expect to be entered with paging
+// already set up the way their protocol describes. Ranges are mapped with
+// the largest pages their alignment allows: 1 GiB where the CPU has them,
+// then 2 MiB, and 4 KiB only for the unaligned edges, so covering all of
+// RAM takes a handful of tables. Every table comes from one contiguous
+// arena sized up front from the span to be mapped.
+
+#define PAGING_PRESENT      0x001ULL
+#define PAGING_WRITE        0x002ULL
+#define PAGING_USER         0x004ULL
+#define PAGING_PWT          0x008ULL
+#define PAGING_PCD          0x010ULL
+#define PAGING_LARGE        0x080ULL    // PS: this entry maps a 2 MiB or 1 GiB page
+#define PAGING_GLOBAL       0x100ULL
+#define PAGING_NX           (1ULL << 63)
+#define PAGING_ADDR_MASK    0x000FFFFFFFFFF000ULL
+
+#define PAGING_SIZE_4K      0x1000ULL
+#define PAGING_SIZE_2M      0x200000ULL
+#define PAGING_SIZE_1G      0x40000000ULL
+#define PAGING_ENTRIES      512
+
+// Tables must be reachable before long mode is on, for APs started
+// through a real-mode trampoline
+#define PAGING_TABLE_LIMIT  0xFFFFFFFFULL
+
+// Arena pages kept on top of the estimate, for the ranges mapped besides
+// the span (framebuffers, the kernel's higher-half block)
+#define PAGING_ARENA_SLACK  64
+#define PAGING_RUN_TABLES   4           // Table pages a memory run's two unaligned ends can need
+#define PAGING_MEMORY_MAPS  2           // paging_map_memory() calls budgeted for (identity, HHDM)
+
+// paging_init() flags
+#define PAGING_LA57         0x1         // Five levels, if the CPU has them
+
+struct paging {
+    uint64_t* root;             // PML4, or PML5 with five levels
+    int levels;                 // 4 or 5
+    int huge_1g;                // CPU supports 1 GiB pages
+    uint8_t* arena;
+    uint32_t arena_pages;
+    uint32_t tables;            // Table pages in use, root included
+};
+
+// Whether the CPU can do 5-level paging, and whether it is on right now
+int paging_has_la57(void);
+int paging_la57_active(void);
+
+// Empty tables with an arena big enough to map span bytes
+int paging_init(struct paging* pt, uint64_t span, uint32_t flags);
+
+// Map [virt, virt + size) to phys. All three must be 4 KiB aligned.
+int paging_map(struct paging* pt, uint64_t virt, uint64_t phys, uint64_t size, uint64_t flags);
+
+// The first 4 GiB and every region of the memory map above it that is not
+// reserved, at offset (0 for the identity map)
+int paging_map_memory(struct paging* pt, uint64_t offset, uint64_t flags);
+
+// Give back the arena pages no table was made in
+void paging_trim(struct paging* pt);
+
+// Give back all of it, when the tables will not be used after all
+void paging_release(struct paging* pt);
+
+// Value for CR3
+uint64_t paging_root(const struct paging* pt);
+
+#endif
@@ -0,0 +1,538 @@
+/*
+ * placement.c
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#include <stdint.h>
+#include "compat.h"
+#include <string.h>
+#include <stdlib.h>
+#include "placement.h"
+
+extern int firmware_memory_map(place_region_fn fn, void* ctx);
+extern void* firmware_allocate_pages_at(uint64_t address, uint32_t pages);
+extern void firmware_free_pages(void* base, uint32_t pages);
+
+#define BY_ADDR 0
+#define BY_SIZE 1
+#define PLACE_CLAIM_TRIES 8
+#define PLACE_TOP (~0ULL & ~(PLACE_PAGE_SIZE - 1))
+
+// One run of the address space. Every region is in the by-address tree;
+// free ones are also in the by-size tree. Regions never overlap, and
+// neighbours of the same type are merged.
+struct place_region {
+    uint64_t base;
+    uint64_t size;
+    enum place_type type;
+    uint64_t max_free;                      // Largest free region in the by-address subtree
+    struct place_region* child[2][2];       // [tree][left, right]
+    int height[2];
+};
+
+static struct place_region* place_spare;
+static struct place_region* place_root[2];
+static uint32_t place_regions;              // In the trees
+static int place_ready;
+static int place_overflow;
+
+static uint64_t region_end(const struct place_region* r) {
+    return r->base + r->size;
+}
+
+static uint64_t page_down(uint64_t v) {
+    return v & ~(PLACE_PAGE_SIZE - 1);
+}
+
+static uint64_t page_up(uint64_t v) {
+    return v > PLACE_TOP ? PLACE_TOP : page_down(v + PLACE_PAGE_SIZE - 1);
+}
+
+// Region records come from heap blocks that are never given back, one more
+// whenever the spare list runs dry, so the map has no fixed size. A block
+// taken from memory the map still calls free is caught by place_claim().
+static int place_grow(uint32_t count) {
+    struct place_region* block = (struct place_region*)malloc(count * sizeof(*block));
+    if (!block) return -1;
+    for (uint32_t i = count; i-- > 0;) {
+        block[i].child[BY_ADDR][0] = place_spare;
+        place_spare = &block[i];
+    }
+    return 0;
+}
+
+// --- AVL trees, one implementation indexed by tree ---
+
+// The size tree breaks ties by address so every key is unique
+static int place_before(int t, const struct place_region* a, const struct place_region* b) {
+    if (t == BY_SIZE && a->size != b->size) return a->size < b->size;
+    return a->base < b->base;
+}
+
+static int place_height(const struct place_region* r, int t) {
+    return r ? r->height[t] : 0;
+}
+
+static void place_update(struct place_region* r, int t) {
+    int hl = place_height(r->child[t][0], t), hr = place_height(r->child[t][1], t);
+    r->height[t] = 1 + (hl > hr ? hl : hr);
+    if (t != BY_ADDR) return;
+    uint64_t m = r->type == PLACE_FREE ? r->size : 0;
+    for (int i = 0; i < 2; i++) {
+        if (r->child[t][i] && r->child[t][i]->max_free > m) m = r->child[t][i]->max_free;
+    }
+    r->max_free = m;
+}
+
+// dir 0 lifts the right child, dir 1 the left one
+static struct place_region* place_rotate(struct place_region* r, int t, int dir) {
+    struct place_region* c = r->child[t][!dir];
+    r->child[t][!dir] = c->child[t][dir];
+    c->child[t][dir] = r;
+    place_update(r, t);
+    place_update(c, t);
+    return c;
+}
+
+static struct place_region* place_balance(struct place_region* r, int t) {
+    place_update(r, t);
+    int bf = place_height(r->child[t][0], t) - place_height(r->child[t][1], t);
+    if (bf > 1) {
+        struct place_region* l = r->child[t][0];
+        if (place_height(l->child[t][0], t) < place_height(l->child[t][1], t)) r->child[t][0] = place_rotate(l, t, 0);
+        return place_rotate(r, t, 1);
+    }
+    if (bf < -1) {
+        struct place_region* g = r->child[t][1];
+        if (place_height(g->child[t][1], t) < place_height(g->child[t][0], t)) r->child[t][1] = place_rotate(g, t, 1);
+        return place_rotate(r, t, 0);
+    }
+    return r;
+}
+
+static struct place_region* place_insert(struct place_region* root, struct place_region* n, int t) {
+    if (!root) {
+        n->child[t][0] = n->child[t][1] = NULL;
+        place_update(n, t);
+        return n;
+    }
+    int dir = !place_before(t, n, root);
+    root->child[t][dir] = place_insert(root->child[t][dir], n, t);
+    return place_balance(root, t);
+}
+
+static struct place_region* place_remove_min(struct place_region* root, int t, struct place_region** min) {
+    if (!root->child[t][0]) {
+        *min = root;
+        return root->child[t][1];
+    }
+    root->child[t][0] = place_remove_min(root->child[t][0], t, min);
+    return place_balance(root, t);
+}
+
+static struct place_region* place_remove(struct place_region* root, struct place_region* n, int t) {
+    if (!root) return NULL;
+    if (root != n) {
+        int dir = !place_before(t, n, root);
+        root->child[t][dir] = place_remove(root->child[t][dir], n, t);
+        return place_balance(root, t);
+    }
+    struct place_region* l = n->child[t][0];
+    struct place_region* r = n->child[t][1];
+    if (!r) return l;
+    struct place_region* m;
+    r = place_remove_min(r, t, &m);
+    m->child[t][0] = l;
+    m->child[t][1] = r;
+    return place_balance(m, t);
+}
+
+// A region's base, size or type only changes while it is out of the trees
+static void place_link(struct place_region* r) {
+    place_root[BY_ADDR] = place_insert(place_root[BY_ADDR], r, BY_ADDR);
+    if (r->type == PLACE_FREE) place_root[BY_SIZE] = place_insert(place_root[BY_SIZE], r, BY_SIZE);
+}
+
+static void place_unlink(struct place_region* r) {
+    place_root[BY_ADDR] = place_remove(place_root[BY_ADDR], r, BY_ADDR);
+    if (r->type == PLACE_FREE) place_root[BY_SIZE] = place_remove(place_root[BY_SIZE], r, BY_SIZE);
+}
+
+static struct place_region* place_new(uint64_t base, uint64_t size, enum place_type type) {
+    if (!place_spare && place_grow(PLACE_GROW_REGIONS) != 0) {
+        place_overflow = 1;
+        return NULL;
+    }
+    struct place_region* r = place_spare;
+    place_spare = r->child[BY_ADDR][0];
+    place_regions++;
+    memset(r, 0, sizeof(*r));
+    r->base = base;
+    r->size = size;
+    r->type = type;
+    place_link(r);
+    return r;
+}
+
+static void place_delete(struct place_region* r) {
+    place_unlink(r);
+    place_regions--;
+    r->child[BY_ADDR][0] = place_spare;
+    place_spare = r;
+}
+
+// The region holding addr, or failing that the first one above it
+static struct place_region* place_find(uint64_t addr) {
+    struct place_region* r = place_root[BY_ADDR];
+    struct place_region* above = NULL;
+    while (r) {
+        if (addr < r->base) {
+            above = r;
+            r = r->child[BY_ADDR][0];
+        } else if (addr >= region_end(r)) {
+            r = r->child[BY_ADDR][1];
+        } else {
+            return r;
+        }
+    }
+    return above;
+}
+
+// The last region starting below addr
+static struct place_region* place_find_below(uint64_t addr) {
+    struct place_region* r = place_root[BY_ADDR];
+    struct place_region* below = NULL;
+    while (r) {
+        if (r->base < addr) {
+            below = r;
+            r = r->child[BY_ADDR][1];
+        } else {
+            r = r->child[BY_ADDR][0];
+        }
+    }
+    return below;
+}
+
+// --- Region bookkeeping ---
+
+// Cut r at at, which lies strictly inside it; r keeps the head
+static struct place_region* place_split(struct place_region* r, uint64_t at) {
+    if (!place_spare && place_grow(PLACE_GROW_REGIONS) != 0) {
+        place_overflow = 1;
+        return NULL;
+    }
+    uint64_t end = region_end(r);
+    place_unlink(r);
+    r->size = at - r->base;
+    place_link(r);
+    return place_new(at, end - at, r->type);
+}
+
+// Fold neighbours of the same type together from just below base to end
+static void place_merge(uint64_t base, uint64_t end) {
+    struct place_region* r = place_find_below(base);
+    if (!r) r = place_find(base);
+    while (r && r->base <= end) {
+        struct place_region* next = place_find(region_end(r));
+        if (!next) break;
+        if (next->base == region_end(r) && next->type == r->type) {
+            uint64_t size = next->size;
+            place_delete(next);
+            place_unlink(r);
+            r->size += size;
+            place_link(r);
+        } else {
+            r = next;
+        }
+    }
+}
+
+// Give [base, end) the type, creating regions for holes. Without override
+// only the holes are filled.
+static int place_mark(uint64_t base, uint64_t end, enum place_type type, int override) {
+    uint64_t at = base;
+    while (at < end) {
+        struct place_region* r = place_find(at);
+        if (!r || r->base > at) {
+            uint64_t hole_end = r && r->base < end ? r->base : end;
+            if (!place_new(at, hole_end - at, type)) return -1;
+            at = hole_end;
+            continue;
+        }
+        if (override && r->type != type) {
+            if (r->base < at && !(r = place_split(r, at))) return -1;
+            if (region_end(r) > end && !place_split(r, end)) return -1;
+            place_unlink(r);
+            r->type = type;
+            place_link(r);
+        }
+        at = region_end(r);
+    }
+    place_merge(base, end);
+    return 0;
+}
+
+// Free memory is shrunk to whole pages, anything else grown to them
+static int place_record(uint64_t base, uint64_t size, enum place_type type) {
+    uint64_t end = base + size < base ? PLACE_TOP : base + size;
+    if (type == PLACE_FREE) {
+        base = page_up(base);
+        end = page_down(end);
+    } else {
+        base = page_down(base);
+        end = page_up(end);
+    }
+    if (end <= base) return 0;
+    return place_mark(base, end, type, type != PLACE_FREE);
+}
+
+static void place_record_fn(void* ctx, uint64_t base, uint64_t size, enum place_type type) {
+    (void)ctx;
+    place_record(base, size, type);
+}
+
+static void place_count_fn(void* ctx, uint64_t base, uint64_t size, enum place_type type) {
+    (void)base; (void)size; (void)type;
+    (*(uint32_t*)ctx)++;
+}
+
+// --- Searches ---
+
+// Where in r the request would go, if anywhere
+static int place_fits(const struct place_region* r, const struct place_request* q, uint64_t size, uint64_t align,
+                      uint64_t* out) {
+    if (r->type != PLACE_FREE || r->size < size) return 0;
+    uint64_t lo = r->base > q->min ? r->base : q->min;
+    uint64_t hi = region_end(r);
+    if (q->limit && q->limit < hi - 1) hi = q->limit + 1;
+    if (lo > PLACE_TOP - align) return 0;
+    lo = (lo + align - 1) & ~(align - 1);
+    if (lo >= hi || hi - lo < size) return 0;
+    *out = q->fit == PLACE_LAST_FIT ? (hi - size) & ~(align - 1) : lo;
+    return 1;
+}
+
+// First or last fit by address. Subtrees without a big enough free region,
+// or wholly outside [min, limit], are never entered.
+static struct place_region* place_search(struct place_region* r, const struct place_request* q, uint64_t size,
+                                         uint64_t align, uint64_t* out) {
+    if (!r || r->max_free < size) return NULL;
+    int low_ok = r->base > q->min;
+    int high_ok = !q->limit || region_end(r) <= q->limit;
+    int near = q->fit == PLACE_LAST_FIT;
+    int near_ok = near ? high_ok : low_ok;
+    int far_ok = near ? low_ok : high_ok;
+    struct place_region* hit;
+
+    if (near_ok && (hit = place_search(r->child[BY_ADDR][near], q, size, align, out))) return hit;
+    if (place_fits(r, q, size, align, out)) return r;
+    return far_ok ? place_search(r->child[BY_ADDR][!near], q, size, align, out) : NULL;
+}
+
+// Smallest free region that takes the request: the lower bound on size in
+// the size tree, then upwards from there
+static struct place_region* place_search_size(struct place_region* r, const struct place_request* q, uint64_t size,
+                                              uint64_t align, uint64_t* out) {
+    if (!r) return NULL;
+    if (r->size < size) return place_search_size(r->child[BY_SIZE][1], q, size, align, out);
+    struct place_region* hit = place_search_size(r->child[BY_SIZE][0], q, size, align, out);
+    if (hit) return hit;
+    if (place_fits(r, q, size, align, out)) return r;
+    return place_search_size(r->child[BY_SIZE][1], q, size, align, out);
+}
+
+// Take [base, end) from the firmware too. If it says no, its map moved since
+// it was read, so the range is marked reserved and the caller looks again.
+static int place_claim(uint64_t base, uint64_t end, void** out) {
+    uint32_t pages = (uint32_t)((end - base) / PLACE_PAGE_SIZE);
+    *out = firmware_allocate_pages_at(base, pages);
+    if (place_mark(base, end, *out ? PLACE_LOADED : PLACE_RESERVED, 1) != 0) {
+        if (*out) firmware_free_pages(*out, pages);
+        *out = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// --- Public interface ---
+
+int place_init(void) {
+    if (place_ready) return 0;
+    place_root[BY_ADDR] = place_root[BY_SIZE] = NULL;
+    place_regions = 0;
+    place_overflow = 0;
+
+    // Sized from the map up front: each entry makes at most itself and the
+    // hole before it, and a block's worth on top covers typical loading
+    uint32_t entries = 0;
+    if (firmware_memory_map(place_count_fn, &entries) != 0) return -1;
+    if (!place_spare && place_grow(2 * entries + PLACE_GROW_REGIONS) != 0) return -1;
+    if (firmware_memory_map(place_record_fn, NULL) != 0 || place_overflow) return -1;
+    place_ready = 1;
+    return 0;
+}
+
+int place_add(uint64_t base, uint64_t size, enum place_type type) {
+    if (place_init() != 0) return -1;
+    return place_record(base, size, type);
+}
+
+void* place_alloc(const struct place_request* req) {
+    if (!req || !req->size || place_init() != 0) return NULL;
+    uint64_t align = req->align > PLACE_PAGE_SIZE ? req->align : PLACE_PAGE_SIZE;
+    if (align & (align - 1)) return NULL;
+    uint64_t size = page_up(req->size);
+    struct place_request q = *req;
+    if (q.min < PLACE_PAGE_SIZE) q.min = PLACE_PAGE_SIZE;     // Address 0 would read as failure
+
+    for (int tries = 0; tries < PLACE_CLAIM_TRIES; tries++) {
+        uint64_t base;
+        struct place_region* r = q.fit == PLACE_BEST_FIT
+            ? place_search_size(place_root[BY_SIZE], &q, size, align, &base)
+            : place_search(place_root[BY_ADDR], &q, size, align, &base);
+        void* p;
+        if (!r || place_claim(base, base + size, &p) != 0) return NULL;
+        if (p) return p;
+    }
+    return NULL;
+}
+
+// base need not be page aligned; the pages around it are taken whole
+void* place_at(uint64_t base, uint64_t size) {
+    if (!base || !size || place_init() != 0) return NULL;
+    uint64_t start = page_down(base);
+    uint64_t end = page_up(base + size);
+    if (end <= start || place_conflict(start, end - start) != PLACE_FREE) return NULL;
+    void* p;
+    if (place_claim(start, end, &p) != 0 || !p) return NULL;
+    return (uint8_t*)p + (base - start);
+}
+
+void* place_below(uint64_t limit, uint64_t size, uint64_t align) {
+    struct place_request req = { size, align, 0, limit, PLACE_LAST_FIT };
+    return place_alloc(&req);
+}
+
+void place_free(void* base, uint64_t size) {
+    if (!base || !size || !place_ready) return;
+    uint64_t start = page_down((uint64_t)(uintptr_t)base);
+    uint64_t end = page_up((uint64_t)(uintptr_t)base + size);
+    firmware_free_pages((void*)(uintptr_t)start, (uint32_t)((end - start) / PLACE_PAGE_SIZE));
+    place_mark(start, end, PLACE_FREE, 1);
+}
+
+enum place_type place_conflict(uint64_t base, uint64_t size) {
+    if (place_init() != 0) return PLACE_RESERVED;
+    uint64_t at = page_down(base);
+    uint64_t end = page_up(base + size);
+    while (at < end) {
+        struct place_region* r = place_find(at);
+        if (!r || r->base > at) return PLACE_RESERVED;
+        if (r->type != PLACE_FREE) return r->type;
+        at = region_end(r);
+    }
+    return PLACE_FREE;
+}
+
+static void place_walk_tree(const struct place_region* r, place_region_fn fn, void* ctx) {
+    if (!r) return;
+    place_walk_tree(r->child[BY_ADDR][0], fn, ctx);
+    fn(ctx, r->base, r->size, r->type);
+    place_walk_tree(r->child[BY_ADDR][1], fn, ctx);
+}
+
+void place_walk(place_region_fn fn, void* ctx) {
+    if (place_init() != 0) return;
+    place_walk_tree(place_root[BY_ADDR], fn, ctx);
+}
+
+uint32_t place_count(void) {
+    return place_init() == 0 ? place_regions : 0;
+}
+
+static uint32_t place_e820_type(enum place_type type) {
+    switch (type) {
+    case PLACE_FREE:
+    case PLACE_LOADED:
+    case PLACE_RECLAIMABLE: return PLACE_E820_RAM;
+    case PLACE_ACPI: return PLACE_E820_ACPI;
+    case PLACE_NVS: return PLACE_E820_NVS;
+    case PLACE_BAD: return PLACE_E820_UNUSABLE;
+    default: return PLACE_E820_RESERVED;
+    }
+}
+
+struct place_e820_walk {
+    place_e820_fn fn;
+    void* ctx;
+    uint32_t count;
+    uint64_t base;          // Entry being grown
+    uint64_t size;
+    uint32_t type;
+};
+
+static void place_e820_flush(struct place_e820_walk* w) {
+    if (!w->size) return;
+    if (w->fn) w->fn(w->ctx, w->base, w->size, w->type);
+    w->count++;
+}
+
+static void place_e820_region(void* ctx, uint64_t base, uint64_t size, enum place_type type) {
+    struct place_e820_walk* w = (struct place_e820_walk*)ctx;
+    uint32_t e820 = place_e820_type(type);
+    if (w->size && w->type == e820 && w->base + w->size == base) {
+        w->size += size;
+        return;
+    }
+    place_e820_flush(w);
+    w->base = base;
+    w->size = size;
+    w->type = e820;
+}
+
+uint32_t place_e820(place_e820_fn fn, void* ctx) {
+    struct place_e820_walk w = { fn, ctx, 0, 0, 0, 0 };
+    place_walk(place_e820_region, &w);
+    place_e820_flush(&w);
+    return w.count;
+}
+
+// Bytes of RAM (free, loaded or reclaimable) running unbroken from addr
+static uint64_t place_usable_from(uint64_t addr) {
+    uint64_t at = addr;
+    for (;;) {
+        struct place_region* r = place_find(at);
+        if (!r || r->base > at) break;
+        if (r->type != PLACE_FREE && r->type != PLACE_LOADED && r->type != PLACE_RECLAIMABLE) break;
+        at = region_end(r);
+    }
+    return at - addr;
+}
+
+void place_basic_meminfo(uint32_t* lower_kb, uint32_t* upper_kb) {
+    uint64_t lower = 0, upper = 0;
+    if (place_init() == 0) {
+        lower = place_usable_from(0);
+        upper = place_usable_from(0x100000);
+    }
+    if (lower > 0xA0000) lower = 0xA0000;
+    if (upper > 0xFFFFFFFFULL * 1024) upper = 0xFFFFFFFFULL * 1024;
+    *lower_kb = (uint32_t)(lower / 1024);
+    *upper_kb = (uint32_t)(upper / 1024);
+}
+
+static void place_ram_bounds_region(void* ctx, uint64_t base, uint64_t size, uint32_t type) {
+    uint64_t* bounds = (uint64_t*)ctx;
+    if (type != PLACE_E820_RAM) return;
+    if (!bounds[1] || base < bounds[0]) bounds[0] = base;
+    if (base + size > bounds[1]) bounds[1] = base + size;
+}
+
+void place_ram_bounds(uint64_t* start, uint64_t* end) {
+    uint64_t bounds[2] = { 0, 0 };
+    place_e820(place_ram_bounds_region, bounds);
+    *start = bounds[0];
+    *end = bounds[1];
+}
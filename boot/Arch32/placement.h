@@ -0,0 +1,100 @@
+/*
+ * placement.h
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#ifndef BLOODHORN_PLACEMENT_H
+#define BLOODHORN_PLACEMENT_H
+#include <stdint.h>
+#include "compat.h"
+
+// Where the boot protocols put kernels, modules and boot information. The
+// physical address space is kept as non-overlapping regions built from the
+// firmware's memory map (UEFI, with coreboot's table folded in when it is
+// there), in one balanced tree by address and one by size for the free
+// ones, so fixed, first, last and best fit are all O(log n) lookups.
+// Whatever place_alloc hands out is also claimed from the firmware, so
+// nothing else can allocate over a payload afterwards.
+
+#define PLACE_PAGE_SIZE   0x1000ULL
+#define PLACE_GROW_REGIONS 256              // region records added at a time
+#define PLACE_LIMIT_4G    0xFFFFFFFFULL     // last byte a 32-bit entry can reach
+
+enum place_type {
+    PLACE_FREE = 0,         // usable RAM nothing holds
+    PLACE_LOADED,           // handed out by place_alloc
+    PLACE_RECLAIMABLE,      // boot services and loader memory, the OS's after boot
+    PLACE_ACPI,             // ACPI tables, reclaimable once parsed
+    PLACE_NVS,
+    PLACE_RESERVED,         // firmware, MMIO and anything the map has no entry for
+    PLACE_BAD
+};
+
+enum place_fit {
+    PLACE_FIRST_FIT,        // lowest address
+    PLACE_LAST_FIT,         // highest address
+    PLACE_BEST_FIT          // smallest free region it fits in
+};
+
+struct place_request {
+    uint64_t size;          // bytes, rounded up to whole pages
+    uint64_t align;         // power of two; 0 means a page
+    uint64_t min;           // lowest acceptable base
+    uint64_t limit;         // highest acceptable last byte; 0 means none
+    enum place_fit fit;
+};
+
+// BIOS e820 types, which the Multiboot memory maps share
+#define PLACE_E820_RAM      1
+#define PLACE_E820_RESERVED 2
+#define PLACE_E820_ACPI     3
+#define PLACE_E820_NVS      4
+#define PLACE_E820_UNUSABLE 5
+
+typedef void (*place_region_fn)(void* ctx, uint64_t base, uint64_t size, enum place_type type);
+typedef void (*place_e820_fn)(void* ctx, uint64_t base, uint64_t size, uint32_t type);
+
+// Build the map from firmware_memory_map() the first time; every call below
+// does this on its own, so loaders only need it to fail early.
+int place_init(void);
+
+// Record a region. Anything but PLACE_FREE overrides what is already there;
+// free memory only fills holes, so the most restrictive report wins.
+int place_add(uint64_t base, uint64_t size, enum place_type type);
+
+void* place_alloc(const struct place_request* req);
+
+// Exactly [base, base + size), for images linked to a fixed address
+void* place_at(uint64_t base, uint64_t size);
+
+// Highest fit whose last byte is at or below limit
+void* place_below(uint64_t limit, uint64_t size, uint64_t align);
+
+void place_free(void* base, uint64_t size);
+
+// PLACE_FREE if all of [base, base + size) could be handed out, otherwise
+// the type of the first region (or hole, as PLACE_RESERVED) in the way
+enum place_type place_conflict(uint64_t base, uint64_t size);
+
+// Every region in address order, adjacent ones of a type merged
+void place_walk(place_region_fn fn, void* ctx);
+
+// How many regions place_walk() reports, for sizing a copy of the map
+uint32_t place_count(void);
+
+// The map as a kernel should see it: e820 types, with everything BloodHorn
+// or boot services hold reported as RAM and neighbours of a type merged.
+// Returns the number of entries; fn may be NULL to just count them.
+uint32_t place_e820(place_e820_fn fn, void* ctx);
+
+// Lowest RAM address and the end of the highest RAM region, for boot
+// parameters that describe memory as one range
+void place_ram_bounds(uint64_t* start, uint64_t* end);
+
+// KiB of RAM running unbroken from 0 (at most 640) and from 1 MiB, for the
+// mem_lower and mem_upper fields of Multiboot and the old Linux headers
+void place_basic_meminfo(uint32_t* lower_kb, uint32_t* upper_kb);
+
+#endif
@@ -0,0 +1,68 @@
+/*
+ * crc.c
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#include "crc.h"
+#include "compat.h"
+#include <stdint.h>
+
+#define CRC32_POLY 0xEDB88320u
+#define CRC64_POLY 0xC96C5795D7870F42ull
+
+// Slicing-by-8: eight bytes per step, built on first use
+static uint32_t crc32_table[8][256];
+static uint64_t crc64_table[256];
+static int crc32_ready, crc64_ready;
+
+static void crc32_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c >> 1) ^ (CRC32_POLY & (0u - (c & 1)));
+        crc32_table[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            uint32_t c = crc32_table[t - 1][i];
+            crc32_table[t][i] = (c >> 8) ^ crc32_table[0][c & 0xFF];
+        }
+    }
+    crc32_ready = 1;
+}
+
+uint32_t crc32_update(uint32_t crc, const void* data, uint64_t len) {
+    const uint8_t* p = (const uint8_t*)data;
+    if (!crc32_ready) crc32_init();
+
+    crc = ~crc;
+    while (len >= 8) {
+        uint32_t lo = crc ^ ((uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+        uint32_t hi = (uint32_t)p[4] | ((uint32_t)p[5] << 8) | ((uint32_t)p[6] << 16) | ((uint32_t)p[7] << 24);
+        crc = crc32_table[7][lo & 0xFF] ^ crc32_table[6][(lo >> 8) & 0xFF] ^
+              crc32_table[5][(lo >> 16) & 0xFF] ^ crc32_table[4][lo >> 24] ^
+              crc32_table[3][hi & 0xFF] ^ crc32_table[2][(hi >> 8) & 0xFF] ^
+              crc32_table[1][(hi >> 16) & 0xFF] ^ crc32_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) crc = (crc >> 8) ^ crc32_table[0][(crc ^ *p++) & 0xFF];
+    return ~crc;
+}
+
+uint64_t crc64_update(uint64_t crc, const void* data, uint64_t len) {
+    const uint8_t* p = (const uint8_t*)data;
+    if (!crc64_ready) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint64_t c = i;
+            for (int k = 0; k < 8; k++) c = (c >> 1) ^ (CRC64_POLY & (0ull - (c & 1)));
+            crc64_table[i] = c;
+        }
+        crc64_ready = 1;
+    }
+
+    crc = ~crc;
+    while (len--) crc = (crc >> 8) ^ crc64_table[(crc ^ *p++) & 0xFF];
+    return ~crc;
+}
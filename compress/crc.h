@@ -0,0 +1,20 @@
+/*
+ * crc.h
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#ifndef BLOODHORN_CRC_H
+#define BLOODHORN_CRC_H
+#include <stdint.h>
+#include "compat.h"
+
+// CRC-32 as used by gzip and xz (IEEE 802.3, reflected). Pass 0 to start;
+// the result of one call can be passed back in to continue.
+uint32_t crc32_update(uint32_t crc, const void* data, uint64_t len);
+
+// CRC-64 as used by xz (ECMA-182, reflected)
+uint64_t crc64_update(uint64_t crc, const void* data, uint64_t len);
+
+#endif
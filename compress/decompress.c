@@ -0,0 +1,131 @@
+/*
+ * decompress.c
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#include "decompress.h"
+#include "compat.h"
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+// Indexed by enum decomp_format
+static const struct decomp_ops* const decomp_table[DECOMP_FORMAT_COUNT] = {
+    [DECOMP_FORMAT_NONE] = NULL,
+    [DECOMP_FORMAT_ZSTD] = &zstd_decomp_ops,
+    [DECOMP_FORMAT_LZ4] = &lz4_decomp_ops,
+    [DECOMP_FORMAT_LZ4_LEGACY] = &lz4_legacy_decomp_ops,
+    [DECOMP_FORMAT_GZIP] = &gzip_decomp_ops,
+    [DECOMP_FORMAT_XZ] = &xz_decomp_ops,
+};
+
+static const struct decomp_ops* decomp_lookup(enum decomp_format format) {
+    if ((unsigned)format >= DECOMP_FORMAT_COUNT) return NULL;
+    return decomp_table[format];
+}
+
+enum decomp_format decomp_detect(const uint8_t* data, uint32_t len) {
+    if (!data) return DECOMP_FORMAT_NONE;
+    for (int f = 0; f < DECOMP_FORMAT_COUNT; f++) {
+        const struct decomp_ops* ops = decomp_table[f];
+        if (ops && len >= ops->magic_len && memcmp(data, ops->magic, ops->magic_len) == 0) {
+            return (enum decomp_format)f;
+        }
+    }
+    return DECOMP_FORMAT_NONE;
+}
+
+const char* decomp_format_name(enum decomp_format format) {
+    const struct decomp_ops* ops = decomp_lookup(format);
+    return ops ? ops->name : "none";
+}
+
+uint64_t decomp_content_size(const uint8_t* data, uint32_t len) {
+    const struct decomp_ops* ops = decomp_lookup(decomp_detect(data, len));
+    return ops && ops->content_size ? ops->content_size(data, len) : 0;
+}
+
+uint64_t decomp_trailer_size(enum decomp_format format, const uint8_t* tail, uint32_t len) {
+    const struct decomp_ops* ops = decomp_lookup(format);
+    return ops && ops->trailer_size && tail ? ops->trailer_size(tail, len) : 0;
+}
+
+int decomp_init(struct decomp_stream* s, enum decomp_format format, uint8_t* out, uint64_t out_cap, uint32_t flags) {
+    if (!s) return DECOMP_ERROR;
+    memset(s, 0, sizeof(*s));
+    s->format = format;
+    s->ops = decomp_lookup(format);
+    s->flags = flags;
+    s->out = out;
+    s->out_cap = out ? out_cap : 0;
+    return s->ops ? s->ops->init(s) : DECOMP_ERROR;
+}
+
+int decomp_feed(struct decomp_stream* s, const uint8_t* in, uint32_t len) {
+    if (!s || !s->ops || (!in && len)) return DECOMP_ERROR;
+    if (len == 0) return DECOMP_OK;
+    return s->ops->feed(s, in, len);
+}
+
+int decomp_finish(struct decomp_stream* s) {
+    if (!s || !s->ops) return DECOMP_ERROR;
+    return s->ops->finish(s);
+}
+
+// Releases decoder scratch only; the output buffer belongs to the caller
+void decomp_free(struct decomp_stream* s) {
+    if (!s) return;
+    if (s->ops && s->ops->release) s->ops->release(s);
+    if (s->stage) free(s->stage);
+    s->stage = NULL;
+    s->stage_cap = s->stage_len = 0;
+}
+
+int decomp_reserve(struct decomp_stream* s, uint64_t extra) {
+    uint64_t need = s->out_pos + extra;
+    if (need <= s->out_cap) return DECOMP_OK;
+    if (!(s->flags & DECOMP_F_GROW)) return DECOMP_NO_SPACE;
+
+    uint64_t cap = s->out_cap ? s->out_cap : 64 * 1024;
+    while (cap < need) cap *= 2;
+    if (cap != (uint64_t)(size_t)cap) return DECOMP_NO_MEMORY;
+    uint8_t* grown = (uint8_t*)realloc(s->out, (size_t)cap);
+    if (!grown) return DECOMP_NO_MEMORY;
+    s->out = grown;
+    s->out_cap = cap;
+    return DECOMP_OK;
+}
+
+// Hand out the next 'need' contiguous input bytes. Points straight into the
+// caller's buffer when the whole unit is there, and only copies into the
+// staging buffer when the unit is split across feeds. Returns 1 with *unit
+// set, 0 when more input is needed, or a negative DECOMP_* error.
+int decomp_stage(struct decomp_stream* s, const uint8_t** in, uint32_t* len, uint32_t need, const uint8_t** unit) {
+    if (s->stage_len == 0 && *len >= need) {
+        *unit = *in;
+        *in += need;
+        *len -= need;
+        return 1;
+    }
+
+    if (s->stage_cap < need) {
+        uint8_t* grown = (uint8_t*)realloc(s->stage, need);
+        if (!grown) return DECOMP_NO_MEMORY;
+        s->stage = grown;
+        s->stage_cap = need;
+    }
+
+    uint32_t take = need - s->stage_len;
+    if (take > *len) take = *len;
+    memcpy(s->stage + s->stage_len, *in, take);
+    s->stage_len += take;
+    *in += take;
+    *len -= take;
+
+    if (s->stage_len < need) return 0;
+    s->stage_len = 0;
+    *unit = s->stage;
+    return 1;
+}
@@ -0,0 +1,105 @@
+/*
+ * decompress.h
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#ifndef BLOODHORN_DECOMPRESS_H
+#define BLOODHORN_DECOMPRESS_H
+#include <stdint.h>
+#include "compat.h"
+#include "zstd.h"
+#include "lz4.h"
+#include "inflate.h"
+#include "xz.h"
+
+// Return codes
+#define DECOMP_OK           0
+#define DECOMP_DONE         1   // Finished cleanly; further input is an error
+#define DECOMP_ERROR       -1   // Corrupt or unsupported input
+#define DECOMP_NO_SPACE    -2   // Output buffer too small and not growable
+#define DECOMP_NO_MEMORY   -3
+
+// Flags for decomp_init()
+#define DECOMP_F_GROW       0x01    // out came from malloc() and may be realloc()ed
+#define DECOMP_F_NO_VERIFY  0x02    // Skip content checksums
+
+enum decomp_format {
+    DECOMP_FORMAT_NONE = 0,
+    DECOMP_FORMAT_ZSTD,
+    DECOMP_FORMAT_LZ4,              // LZ4 frame format
+    DECOMP_FORMAT_LZ4_LEGACY,       // lz4 -l, as used for Linux kernels/initramfs
+    DECOMP_FORMAT_GZIP,
+    DECOMP_FORMAT_XZ,
+    DECOMP_FORMAT_COUNT
+};
+
+struct decomp_stream;
+
+// One entry per format. Adding a format means an enum value, an ops table
+// in its own file and a slot in decompress.c.
+struct decomp_ops {
+    const char* name;
+    const uint8_t* magic;           // Leading bytes that identify the format
+    uint32_t magic_len;
+
+    // Uncompressed size from the start or the end of the file, 0 if unknown
+    uint64_t (*content_size)(const uint8_t* data, uint32_t len);
+    uint64_t (*trailer_size)(const uint8_t* tail, uint32_t len);
+
+    int (*init)(struct decomp_stream* s);
+    int (*feed)(struct decomp_stream* s, const uint8_t* in, uint32_t len);
+    int (*finish)(struct decomp_stream* s);
+    void (*release)(struct decomp_stream* s);  // Optional
+};
+
+// A decoder that takes input in arbitrary pieces (network blocks, disk
+// reads) and writes straight into one flat output buffer. Everything already
+// written doubles as the match history window, so no separate window copy is
+// kept. Input is only staged when a compressed block straddles two pieces.
+struct decomp_stream {
+    enum decomp_format format;
+    const struct decomp_ops* ops;
+    uint32_t flags;
+
+    uint8_t* out;
+    uint64_t out_cap;
+    uint64_t out_pos;
+    uint64_t frame_start;           // Output offset of the current frame
+
+    uint64_t consumed;              // Compressed bytes accepted so far
+
+    // Staging for units split across input pieces
+    uint8_t* stage;
+    uint32_t stage_cap;
+    uint32_t stage_len;
+    uint32_t need;                  // Bytes the current unit needs
+    int state;
+
+    union {
+        struct zstd_dstate zstd;
+        struct lz4_dstate lz4;
+        struct gzip_dstate gzip;
+        struct xz_dstate xz;
+    } u;
+};
+
+enum decomp_format decomp_detect(const uint8_t* data, uint32_t len);
+const char* decomp_format_name(enum decomp_format format);
+
+// Uncompressed size recorded in the first frame header, or 0 if absent
+uint64_t decomp_content_size(const uint8_t* data, uint32_t len);
+// Same from the last bytes of the file (gzip ISIZE, xz index), 0 if absent
+uint64_t decomp_trailer_size(enum decomp_format format, const uint8_t* tail, uint32_t len);
+
+int decomp_init(struct decomp_stream* s, enum decomp_format format, uint8_t* out, uint64_t out_cap, uint32_t flags);
+int decomp_feed(struct decomp_stream* s, const uint8_t* in, uint32_t len);
+int decomp_finish(struct decomp_stream* s);
+void decomp_free(struct decomp_stream* s);
+
+// Helpers for the format decoders
+int decomp_reserve(struct decomp_stream* s, uint64_t extra);
+int decomp_stage(struct decomp_stream* s, const uint8_t** in, uint32_t* len, uint32_t need, const uint8_t** unit);
+
+#endif
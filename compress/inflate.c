@@ -0,0 +1,512 @@
+/*
+ * inflate.c
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#include "inflate.h"
+#include "decompress.h"
+#include "crc.h"
+#include "compat.h"
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+// DEFLATE has no byte-aligned framing to stage on, so compressed input is
+// buffered in a small window instead. While more input may follow, a step
+// (block header, symbol) only starts with INFLATE_MARGIN bytes in hand, which
+// is more than any single step can read; that keeps the bit reader free of
+// bounds checks. At finish the window is padded with zeros and decoding runs
+// to the real end of the input.
+#define INFLATE_WINDOW_SIZE     (64 * 1024)
+#define INFLATE_MARGIN          1024
+#define INFLATE_SLACK           (INFLATE_MARGIN + 8)
+
+#define GZIP_ID1                0x1F
+#define GZIP_ID2                0x8B
+#define GZIP_CM_DEFLATE         8
+#define GZIP_FHCRC              0x02
+#define GZIP_FEXTRA             0x04
+#define GZIP_FNAME              0x08
+#define GZIP_FCOMMENT           0x10
+#define GZIP_FRESERVED          0xE0
+
+enum {
+    GZ_ST_HEADER = 0,
+    GZ_ST_BLOCK,
+    GZ_ST_STORED,
+    GZ_ST_HUFFMAN,
+    GZ_ST_TRAILER
+};
+
+static const uint16_t len_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t len_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+static const uint8_t clen_order[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+static uint32_t read_le16(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8);
+}
+
+static uint32_t read_le32(const uint8_t* p) {
+    return read_le16(p) | (read_le16(p + 2) << 16);
+}
+
+static inline uint64_t read_le64(const uint8_t* p) {
+    return (uint64_t)read_le32(p) | ((uint64_t)read_le32(p + 4) << 32);
+}
+
+static uint32_t bit_reverse16(uint32_t v) {
+    v = ((v & 0xAAAA) >> 1) | ((v & 0x5555) << 1);
+    v = ((v & 0xCCCC) >> 2) | ((v & 0x3333) << 2);
+    v = ((v & 0xF0F0) >> 4) | ((v & 0x0F0F) << 4);
+    v = ((v & 0xFF00) >> 8) | ((v & 0x00FF) << 8);
+    return v;
+}
+
+// Top the bit buffer up to at least 56 bits with one unaligned load. Bits
+// above bitcnt already hold the following bytes, so OR-ing them in again
+// is harmless.
+static inline void bits_refill(struct gzip_dstate* z) {
+    z->bitbuf |= read_le64(z->window + z->in_pos) << z->bitcnt;
+    z->in_pos += (63 - z->bitcnt) >> 3;
+    z->bitcnt |= 56;
+}
+
+static inline uint32_t bits_get(struct gzip_dstate* z, uint32_t n) {
+    uint32_t v = (uint32_t)(z->bitbuf & ((1ull << n) - 1));
+    z->bitbuf >>= n;
+    z->bitcnt -= n;
+    return v;
+}
+
+// Drop to the next byte boundary and give back whole bytes still buffered
+static void bits_unread(struct gzip_dstate* z) {
+    z->in_pos -= z->bitcnt >> 3;
+    z->bitbuf = 0;
+    z->bitcnt = 0;
+}
+
+static int huff_build(struct inflate_huffman* h, const uint8_t* lengths, uint32_t num) {
+    uint32_t count[16], next_code[16];
+    uint32_t code = 0, symbols = 0;
+
+    memset(count, 0, sizeof(count));
+    memset(h->fast, 0, sizeof(h->fast));
+    memset(h->size, 0, sizeof(h->size));
+    for (uint32_t i = 0; i < num; i++) count[lengths[i]]++;
+    count[0] = 0;
+
+    for (uint32_t n = 1; n < 16; n++) {
+        next_code[n] = code;
+        h->first_code[n] = (uint16_t)code;
+        h->first_symbol[n] = (uint16_t)symbols;
+        code += count[n];
+        if (code > (1u << n)) return DECOMP_ERROR;     // Over-subscribed
+        h->max_code[n] = code << (16 - n);
+        code <<= 1;
+        symbols += count[n];
+    }
+    h->max_code[16] = 0x10000;
+
+    for (uint32_t i = 0; i < num; i++) {
+        uint32_t n = lengths[i];
+        if (!n) continue;
+        uint32_t slot = next_code[n] - h->first_code[n] + h->first_symbol[n];
+        h->size[slot] = (uint8_t)n;
+        h->value[slot] = (uint16_t)i;
+        if (n <= INFLATE_FAST_BITS) {
+            // DEFLATE sends codes MSB first into an LSB first stream
+            uint32_t rev = bit_reverse16(next_code[n]) >> (16 - n);
+            for (uint32_t j = rev; j < (1u << INFLATE_FAST_BITS); j += 1u << n) {
+                h->fast[j] = (uint16_t)((n << 9) | i);
+            }
+        }
+        next_code[n]++;
+    }
+    return DECOMP_OK;
+}
+
+static int huff_decode_slow(struct gzip_dstate* z, const struct inflate_huffman* h) {
+    uint32_t k = bit_reverse16((uint32_t)(z->bitbuf & 0xFFFF));
+    uint32_t n;
+    for (n = INFLATE_FAST_BITS + 1; n < 16; n++) {
+        if (k < h->max_code[n]) break;
+    }
+    if (n >= 16) return DECOMP_ERROR;
+
+    uint32_t slot = (k >> (16 - n)) - h->first_code[n] + h->first_symbol[n];
+    if (slot >= INFLATE_MAX_SYMBOLS || h->size[slot] != n) return DECOMP_ERROR;
+    z->bitbuf >>= n;
+    z->bitcnt -= n;
+    return h->value[slot];
+}
+
+// Needs at least 15 bits buffered
+static inline int huff_decode(struct gzip_dstate* z, const struct inflate_huffman* h) {
+    uint32_t e = h->fast[z->bitbuf & ((1u << INFLATE_FAST_BITS) - 1)];
+    if (e) {
+        uint32_t n = e >> 9;
+        z->bitbuf >>= n;
+        z->bitcnt -= n;
+        return (int)(e & 511);
+    }
+    return huff_decode_slow(z, h);
+}
+
+static int inflate_fixed(struct gzip_dstate* z) {
+    uint8_t lengths[INFLATE_MAX_SYMBOLS + 32];
+    memset(lengths, 8, 144);
+    memset(lengths + 144, 9, 112);
+    memset(lengths + 256, 7, 24);
+    memset(lengths + 280, 8, 8);
+    memset(lengths + INFLATE_MAX_SYMBOLS, 5, 32);
+    if (huff_build(&z->lit, lengths, INFLATE_MAX_SYMBOLS) != DECOMP_OK) return DECOMP_ERROR;
+    return huff_build(&z->dist, lengths + INFLATE_MAX_SYMBOLS, 32);
+}
+
+static int inflate_dynamic(struct gzip_dstate* z) {
+    uint8_t lengths[286 + 30];
+    uint8_t clen[19];
+
+    bits_refill(z);
+    uint32_t hlit = bits_get(z, 5) + 257;
+    uint32_t hdist = bits_get(z, 5) + 1;
+    uint32_t hclen = bits_get(z, 4) + 4;
+    if (hlit > 286 || hdist > 30) return DECOMP_ERROR;
+
+    memset(clen, 0, sizeof(clen));
+    for (uint32_t i = 0; i < hclen; i++) {
+        if (z->bitcnt < 3) bits_refill(z);
+        clen[clen_order[i]] = (uint8_t)bits_get(z, 3);
+    }
+    // The code length code is only needed until both real tables are built
+    struct inflate_huffman* cl = &z->dist;
+    if (huff_build(cl, clen, 19) != DECOMP_OK) return DECOMP_ERROR;
+
+    uint32_t n = 0;
+    while (n < hlit + hdist) {
+        bits_refill(z);
+        int sym = huff_decode(z, cl);
+        if (sym < 0) return DECOMP_ERROR;
+        if (sym < 16) {
+            lengths[n++] = (uint8_t)sym;
+            continue;
+        }
+
+        uint32_t rep;
+        uint8_t fill = 0;
+        if (sym == 16) {
+            if (n == 0) return DECOMP_ERROR;
+            fill = lengths[n - 1];
+            rep = 3 + bits_get(z, 2);
+        } else if (sym == 17) {
+            rep = 3 + bits_get(z, 3);
+        } else {
+            rep = 11 + bits_get(z, 7);
+        }
+        if (n + rep > hlit + hdist) return DECOMP_ERROR;
+        memset(lengths + n, fill, rep);
+        n += rep;
+    }
+    if (lengths[256] == 0) return DECOMP_ERROR;     // No end-of-block code
+
+    if (huff_build(&z->lit, lengths, hlit) != DECOMP_OK) return DECOMP_ERROR;
+    return huff_build(&z->dist, lengths + hlit, hdist);
+}
+
+// 1 if another step may start, 0 if it has to wait for more input
+static int inflate_room(const struct gzip_dstate* z, int final) {
+    if (!final) return z->in_len - z->in_pos >= INFLATE_MARGIN;
+    // Past the real end we are decoding the zero padding
+    if (z->in_pos - (z->bitcnt >> 3) > z->in_len) return DECOMP_ERROR;
+    return 1;
+}
+
+// Match copy that tolerates overlap (distance < length repeats a pattern)
+static inline void inflate_copy_match(uint8_t* op, const uint8_t* match, uint32_t len, uint32_t dist) {
+    if (dist >= 8) {
+        while (len >= 8) {
+            memcpy(op, match, 8);
+            op += 8; match += 8; len -= 8;
+        }
+        while (len--) *op++ = *match++;
+    } else if (dist >= len) {
+        memcpy(op, match, len);
+    } else {
+        while (len--) *op++ = *match++;
+    }
+}
+
+// Returns 1 at end of block, 0 when out of input, or a DECOMP_* error
+static int inflate_huffman(struct decomp_stream* s, struct gzip_dstate* z, int final) {
+    uint8_t* out = s->out;
+    uint64_t op = s->out_pos;
+    uint64_t cap = s->out_cap;
+    int r;
+
+    for (;;) {
+        r = inflate_room(z, final);
+        if (r <= 0) break;
+
+        bits_refill(z);
+        int sym = huff_decode(z, &z->lit);
+        if (sym < 256) {
+            if (sym < 0) { r = DECOMP_ERROR; break; }
+            if (op >= cap) {
+                s->out_pos = op;
+                if ((r = decomp_reserve(s, 1)) != DECOMP_OK) break;
+                out = s->out;
+                cap = s->out_cap;
+            }
+            out[op++] = (uint8_t)sym;
+            continue;
+        }
+        if (sym == 256) { r = 1; break; }
+
+        sym -= 257;
+        if (sym >= 29) { r = DECOMP_ERROR; break; }
+        uint32_t len = len_base[sym] + bits_get(z, len_extra[sym]);
+
+        int d = huff_decode(z, &z->dist);
+        if (d < 0 || d >= 30) { r = DECOMP_ERROR; break; }
+        uint32_t dist = dist_base[d] + bits_get(z, dist_extra[d]);
+        if (dist > op - s->frame_start) { r = DECOMP_ERROR; break; }
+
+        if (op + len > cap) {
+            s->out_pos = op;
+            if ((r = decomp_reserve(s, len)) != DECOMP_OK) break;
+            out = s->out;
+            cap = s->out_cap;
+        }
+        inflate_copy_match(out + op, out + op - dist, len, dist);
+        op += len;
+    }
+
+    s->out_pos = op;
+    return r;
+}
+
+// Returns 1 once the whole member header is buffered and parsed, 0 if more
+// input is needed
+static int gzip_header(struct gzip_dstate* z, int final) {
+    const uint8_t* p = z->window + z->in_pos;
+    uint32_t avail = z->in_len - z->in_pos;
+    uint32_t n = 10;
+
+    if (avail < n) goto need_more;
+    if (p[0] != GZIP_ID1 || p[1] != GZIP_ID2 || p[2] != GZIP_CM_DEFLATE || (p[3] & GZIP_FRESERVED)) {
+        return DECOMP_ERROR;
+    }
+    uint8_t flg = p[3];
+
+    if (flg & GZIP_FEXTRA) {
+        if (avail < n + 2) goto need_more;
+        n += 2 + read_le16(p + n);
+    }
+    if (flg & GZIP_FNAME) {
+        while (n < avail && p[n]) n++;
+        if (n++ >= avail) goto need_more;
+    }
+    if (flg & GZIP_FCOMMENT) {
+        while (n < avail && p[n]) n++;
+        if (n++ >= avail) goto need_more;
+    }
+    if (flg & GZIP_FHCRC) {
+        if (avail < n + 2) goto need_more;
+        if ((crc32_update(0, p, n) & 0xFFFF) != read_le16(p + n)) return DECOMP_ERROR;
+        n += 2;
+    }
+    if (avail < n) goto need_more;
+
+    z->in_pos += n;
+    return 1;
+
+need_more:
+    // A header that does not fit the window would never complete
+    if (final || avail >= INFLATE_WINDOW_SIZE) return DECOMP_ERROR;
+    return 0;
+}
+
+// Decode as far as the buffered input allows
+static int gzip_run(struct decomp_stream* s, int final) {
+    struct gzip_dstate* z = &s->u.gzip;
+    int r;
+
+    for (;;) {
+        switch (s->state) {
+        case GZ_ST_HEADER:
+            if (z->in_pos == z->in_len) return DECOMP_OK;
+            r = gzip_header(z, final);
+            if (r <= 0) return r;
+            s->frame_start = s->out_pos;
+            z->bitbuf = 0;
+            z->bitcnt = 0;
+            s->state = GZ_ST_BLOCK;
+            break;
+
+        case GZ_ST_BLOCK: {
+            r = inflate_room(z, final);
+            if (r <= 0) return r;
+
+            bits_refill(z);
+            z->last_block = (uint8_t)bits_get(z, 1);
+            uint32_t type = bits_get(z, 2);
+            if (type == 0) {
+                bits_get(z, z->bitcnt & 7);
+                uint32_t len = bits_get(z, 16);
+                uint32_t nlen = bits_get(z, 16);
+                if (len != (~nlen & 0xFFFF)) return DECOMP_ERROR;
+                bits_unread(z);
+                z->stored_left = len;
+                s->state = GZ_ST_STORED;
+            } else if (type == 1) {
+                if (inflate_fixed(z) != DECOMP_OK) return DECOMP_ERROR;
+                s->state = GZ_ST_HUFFMAN;
+            } else if (type == 2) {
+                if (inflate_dynamic(z) != DECOMP_OK) return DECOMP_ERROR;
+                s->state = GZ_ST_HUFFMAN;
+            } else {
+                return DECOMP_ERROR;
+            }
+            break;
+        }
+
+        case GZ_ST_STORED: {
+            if (z->in_pos > z->in_len) return DECOMP_ERROR;
+            uint32_t take = z->in_len - z->in_pos;
+            if (take > z->stored_left) take = z->stored_left;
+            if (take) {
+                r = decomp_reserve(s, take);
+                if (r != DECOMP_OK) return r;
+                memcpy(s->out + s->out_pos, z->window + z->in_pos, take);
+                s->out_pos += take;
+                z->in_pos += take;
+                z->stored_left -= take;
+            }
+            if (z->stored_left) return final ? DECOMP_ERROR : DECOMP_OK;
+            s->state = z->last_block ? GZ_ST_TRAILER : GZ_ST_BLOCK;
+            break;
+        }
+
+        case GZ_ST_HUFFMAN:
+            r = inflate_huffman(s, z, final);
+            if (r <= 0) return r;
+            if (z->last_block) {
+                bits_get(z, z->bitcnt & 7);
+                bits_unread(z);
+                if (z->in_pos > z->in_len) return DECOMP_ERROR;
+                s->state = GZ_ST_TRAILER;
+            } else {
+                s->state = GZ_ST_BLOCK;
+            }
+            break;
+
+        case GZ_ST_TRAILER: {
+            if (z->in_len - z->in_pos < 8) return final ? DECOMP_ERROR : DECOMP_OK;
+            const uint8_t* p = z->window + z->in_pos;
+            uint64_t size = s->out_pos - s->frame_start;
+            if (!(s->flags & DECOMP_F_NO_VERIFY) &&
+                read_le32(p) != crc32_update(0, s->out + s->frame_start, size)) {
+                return DECOMP_ERROR;
+            }
+            if (read_le32(p + 4) != (uint32_t)size) return DECOMP_ERROR;
+            z->in_pos += 8;
+            z->members++;
+            s->state = GZ_ST_HEADER;
+            break;
+        }
+
+        default:
+            return DECOMP_ERROR;
+        }
+    }
+}
+
+// Slide unconsumed input (and bytes still held in the bit buffer) to the front
+static void gzip_compact(struct gzip_dstate* z) {
+    uint32_t start = z->in_pos - (z->bitcnt >> 3);
+    if (start == 0) return;
+    memmove(z->window, z->window + start, z->in_len - start);
+    z->in_len -= start;
+    z->in_pos -= start;
+}
+
+static int gzip_stream_init(struct decomp_stream* s) {
+    struct gzip_dstate* z = &s->u.gzip;
+    memset(z, 0, sizeof(*z));
+    z->window = (uint8_t*)malloc(INFLATE_WINDOW_SIZE + INFLATE_SLACK);
+    if (!z->window) return DECOMP_NO_MEMORY;
+    s->state = GZ_ST_HEADER;
+    return DECOMP_OK;
+}
+
+static int gzip_stream_feed(struct decomp_stream* s, const uint8_t* in, uint32_t len) {
+    struct gzip_dstate* z = &s->u.gzip;
+
+    s->consumed += len;
+    while (len > 0) {
+        gzip_compact(z);
+        uint32_t take = INFLATE_WINDOW_SIZE - z->in_len;
+        if (take == 0) return DECOMP_ERROR;
+        if (take > len) take = len;
+        memcpy(z->window + z->in_len, in, take);
+        z->in_len += take;
+        in += take;
+        len -= take;
+
+        int r = gzip_run(s, 0);
+        if (r < 0) return r;
+    }
+    return DECOMP_OK;
+}
+
+static int gzip_stream_finish(struct decomp_stream* s) {
+    struct gzip_dstate* z = &s->u.gzip;
+    if (s->consumed == 0) return DECOMP_ERROR;
+
+    memset(z->window + z->in_len, 0, INFLATE_SLACK);
+    int r = gzip_run(s, 1);
+    if (r < 0) return r;
+    if (s->state != GZ_ST_HEADER || z->in_pos != z->in_len || z->members == 0) return DECOMP_ERROR;
+    return DECOMP_DONE;
+}
+
+static void gzip_stream_free(struct decomp_stream* s) {
+    free(s->u.gzip.window);
+    s->u.gzip.window = NULL;
+}
+
+// ISIZE of the last member; exact for the usual single member file
+static uint64_t gzip_trailer_size(const uint8_t* tail, uint32_t len) {
+    return len >= 4 ? read_le32(tail + len - 4) : 0;
+}
+
+static const uint8_t gzip_magic[] = { GZIP_ID1, GZIP_ID2, GZIP_CM_DEFLATE };
+
+const struct decomp_ops gzip_decomp_ops = {
+    .name = "gzip",
+    .magic = gzip_magic,
+    .magic_len = sizeof(gzip_magic),
+    .trailer_size = gzip_trailer_size,
+    .init = gzip_stream_init,
+    .feed = gzip_stream_feed,
+    .finish = gzip_stream_finish,
+    .release = gzip_stream_free,
+};
@@ -0,0 +1,46 @@
+/*
+ * inflate.h
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#ifndef BLOODHORN_INFLATE_H
+#define BLOODHORN_INFLATE_H
+#include <stdint.h>
+#include "compat.h"
+
+#define INFLATE_FAST_BITS       10
+#define INFLATE_MAX_SYMBOLS     288
+
+struct decomp_stream;
+struct decomp_ops;
+
+// Canonical Huffman code; codes up to INFLATE_FAST_BITS long resolve with
+// one table lookup, longer ones by walking first_code/max_code
+struct inflate_huffman {
+    uint16_t fast[1 << INFLATE_FAST_BITS];     // (length << 9) | symbol, 0 if longer
+    uint16_t first_code[16];
+    uint16_t first_symbol[16];
+    uint32_t max_code[17];
+    uint8_t size[INFLATE_MAX_SYMBOLS];
+    uint16_t value[INFLATE_MAX_SYMBOLS];
+};
+
+// DEFLATE (RFC 1951) inside gzip members (RFC 1952)
+struct gzip_dstate {
+    uint8_t* window;                // Buffered compressed input, allocated at init
+    uint32_t in_pos;
+    uint32_t in_len;
+    uint64_t bitbuf;
+    uint32_t bitcnt;
+    uint8_t last_block;
+    uint32_t stored_left;           // Bytes left in a stored block
+    uint32_t members;               // Complete members seen
+    struct inflate_huffman lit;
+    struct inflate_huffman dist;
+};
+
+extern const struct decomp_ops gzip_decomp_ops;
+
+#endif
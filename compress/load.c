@@ -0,0 +1,353 @@
+/*
+ * load.c
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#include "load.h"
+#include "decompress.h"
+#include "compat.h"
+#include "fs/fs_common.h"
+#include "security/payload.h"
+#include "security/tpm2.h"
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+static int load_read(const char* path, uint8_t* buf, uint32_t len, uint32_t offset) {
+    int got = fs_read_file(path, buf, len, offset);
+    return got == (int)len ? 0 : -1;
+}
+
+// Best guess at the decompressed size, so the output is allocated once in
+// the common case. Kernels record it in the header (zstd, LZ4 frames) or at
+// the end (gzip ISIZE, xz index); otherwise assume a typical 4:1 ratio and
+// let the decoder grow the buffer.
+static uint64_t load_size_hint(const char* path, enum decomp_format fmt, const uint8_t* head,
+                               uint32_t head_len, uint32_t file_size) {
+    uint64_t hint = decomp_content_size(head, head_len);
+    if (hint) return hint;
+
+    uint32_t tail_len = file_size < DECOMP_LOAD_TAIL ? file_size : DECOMP_LOAD_TAIL;
+    if (file_size == head_len) {
+        hint = decomp_trailer_size(fmt, head + head_len - tail_len, tail_len);
+    } else {
+        uint8_t* tail = (uint8_t*)malloc(tail_len);
+        if (tail) {
+            if (load_read(path, tail, tail_len, file_size - tail_len) == 0) {
+                hint = decomp_trailer_size(fmt, tail, tail_len);
+            }
+            free(tail);
+        }
+    }
+    if (hint) return hint;
+    return (uint64_t)file_size * 4;
+}
+
+// Where the result of a load goes: a heap buffer, or memory handed out by
+// the caller's placement callback that load.c never frees
+struct load_target {
+    decomp_place_fn place;
+    void* ctx;
+};
+
+static uint8_t* target_alloc(const struct load_target* t, uint32_t size) {
+    if (t->place) return t->place(t->ctx, size);
+    return (uint8_t*)malloc(size ? size : 1);
+}
+
+static void target_free(const struct load_target* t, uint8_t* buf) {
+    if (!t->place) free(buf);
+}
+
+static int load_raw(const char* path, uint8_t* head, uint32_t head_len, uint32_t file_size,
+                    const struct load_target* t, uint8_t** data) {
+    uint8_t* buf;
+    if (t->place) {
+        buf = t->place(t->ctx, file_size);
+        if (buf) memcpy(buf, head, head_len);
+        free(head);
+    } else {
+        buf = (uint8_t*)realloc(head, file_size ? file_size : 1);
+        if (!buf) free(head);
+    }
+    if (!buf) return -1;
+
+    // The head is already in place; read the rest right behind it
+    if (file_size > head_len && load_read(path, buf + head_len, file_size - head_len, head_len) != 0) {
+        target_free(t, buf);
+        return -1;
+    }
+    *data = buf;
+    return 0;
+}
+
+static int load_decompress(const char* path, enum decomp_format fmt, uint8_t* head,
+                           uint32_t head_len, uint32_t file_size, uint8_t** data, uint64_t* size) {
+    uint64_t hint = load_size_hint(path, fmt, head, head_len, file_size);
+    if (hint > DECOMP_LOAD_MAX) return -1;
+
+    uint8_t* out = (uint8_t*)malloc((size_t)(hint ? hint : 1));
+    if (!out) return -1;
+
+    struct decomp_stream s;
+    if (decomp_init(&s, fmt, out, hint, DECOMP_F_GROW) != DECOMP_OK) {
+        decomp_free(&s);
+        free(s.out);
+        return -1;
+    }
+
+    // The head buffer doubles as the read buffer for the rest of the file
+    uint32_t off = head_len;
+    int r = decomp_feed(&s, head, head_len);
+    while (r == DECOMP_OK && off < file_size) {
+        uint32_t len = file_size - off < DECOMP_LOAD_CHUNK ? file_size - off : DECOMP_LOAD_CHUNK;
+        if (load_read(path, head, len, off) != 0) {
+            r = DECOMP_ERROR;
+            break;
+        }
+        off += len;
+        r = decomp_feed(&s, head, len);
+    }
+    if (r >= 0) r = decomp_finish(&s);
+    decomp_free(&s);
+
+    if (r != DECOMP_DONE || s.out_pos > DECOMP_LOAD_MAX) {
+        free(s.out);
+        return -1;
+    }
+    *data = s.out;
+    *size = s.out_pos;
+    return 0;
+}
+
+int decomp_load_buffer(const uint8_t* in, uint32_t len, uint8_t** data, uint32_t* size, enum decomp_format* format) {
+    if (!in || !data || !size) return -1;
+
+    enum decomp_format fmt = decomp_detect(in, len);
+    if (format) *format = fmt;
+    if (fmt == DECOMP_FORMAT_NONE) return -1;
+
+    uint32_t tail_len = len < DECOMP_LOAD_TAIL ? len : DECOMP_LOAD_TAIL;
+    uint64_t hint = decomp_content_size(in, len);
+    if (!hint) hint = decomp_trailer_size(fmt, in + len - tail_len, tail_len);
+    if (!hint) hint = (uint64_t)len * 4;
+    if (hint > DECOMP_LOAD_MAX) return -1;
+
+    uint8_t* out = (uint8_t*)malloc((size_t)(hint ? hint : 1));
+    if (!out) return -1;
+
+    struct decomp_stream s;
+    int r = decomp_init(&s, fmt, out, hint, DECOMP_F_GROW);
+    if (r == DECOMP_OK) r = decomp_feed(&s, in, len);
+    if (r >= 0) r = decomp_finish(&s);
+    decomp_free(&s);
+
+    if (r != DECOMP_DONE || s.out_pos > DECOMP_LOAD_MAX) {
+        free(s.out);
+        return -1;
+    }
+    *data = s.out;
+    *size = (uint32_t)s.out_pos;
+    return 0;
+}
+
+// Encrypted containers are authenticated and decrypted one chunk at a time
+// as they are read. The header and tag table go through the stream; after
+// that each chunk is read straight to where its plaintext belongs and
+// decrypted there.
+static int payload_open(const char* path, uint8_t* head, uint32_t head_len, uint32_t file_size,
+                        struct payload_stream* ps, uint8_t* out) {
+    struct payload_header hdr;
+    if (payload_parse_header(head, head_len, &hdr) != 0 || payload_container_size(&hdr) != file_size) return -1;
+    if (payload_stream_init(ps, head, head_len, out) != 0) return -1;
+
+    // The tag table can run past the head; the head buffer reads the rest
+    uint32_t off = 0;
+    uint32_t len = head_len < ps->data_start ? head_len : (uint32_t)ps->data_start;
+    while (len > 0) {
+        if (off && load_read(path, head, len, off) != 0) break;
+        if (payload_stream_feed(ps, head, len) != 0) break;
+        off += len;
+        len = ps->data_start - off < DECOMP_LOAD_CHUNK ? (uint32_t)(ps->data_start - off) : DECOMP_LOAD_CHUNK;
+    }
+    if (off != ps->data_start) {
+        payload_stream_free(ps);
+        return -1;
+    }
+    return 0;
+}
+
+static int payload_read_chunk(const char* path, const struct payload_stream* ps, uint32_t index, uint8_t* buf) {
+    uint32_t len = payload_chunk_len(&ps->hdr, index);
+    uint64_t off = ps->data_start + (uint64_t)index * ps->hdr.chunk_size;
+    if (load_read(path, buf, len, (uint32_t)off) != 0) {
+        crypto_memzero_secure(buf, len);
+        return -1;
+    }
+    return payload_decrypt_chunk(ps, index, buf);
+}
+
+// A compressed plaintext goes through one chunk buffer into the
+// decompressor, so it never exists in full next to the decompressed image
+static int load_payload_decompress(const char* path, struct payload_stream* ps, uint8_t* chunk,
+                                   enum decomp_format fmt, uint8_t** data, uint32_t* size) {
+    uint32_t count = ps->hdr.chunk_count;
+    uint32_t first = payload_chunk_len(&ps->hdr, 0);
+
+    // Size from the frame header, or the trailer in the last chunk
+    uint64_t hint = decomp_content_size(chunk, first);
+    if (!hint) {
+        uint32_t last = payload_chunk_len(&ps->hdr, count - 1);
+        if (count > 1 && payload_read_chunk(path, ps, count - 1, chunk) != 0) return -1;
+        uint32_t tail_len = last < DECOMP_LOAD_TAIL ? last : DECOMP_LOAD_TAIL;
+        hint = decomp_trailer_size(fmt, chunk + last - tail_len, tail_len);
+        if (count > 1 && payload_read_chunk(path, ps, 0, chunk) != 0) return -1;
+    }
+    if (!hint) hint = ps->hdr.payload_size * 4;
+    if (hint > DECOMP_LOAD_MAX) return -1;
+
+    uint8_t* out = (uint8_t*)malloc((size_t)(hint ? hint : 1));
+    if (!out) return -1;
+
+    struct decomp_stream s;
+    int r = decomp_init(&s, fmt, out, hint, DECOMP_F_GROW);
+    if (r == DECOMP_OK) r = decomp_feed(&s, chunk, first);
+    for (uint32_t i = 1; i < count && r == DECOMP_OK; i++) {
+        if (payload_read_chunk(path, ps, i, chunk) != 0) {
+            r = DECOMP_ERROR;
+            break;
+        }
+        r = decomp_feed(&s, chunk, payload_chunk_len(&ps->hdr, i));
+    }
+    if (r >= 0) r = decomp_finish(&s);
+    decomp_free(&s);
+
+    if (r != DECOMP_DONE || s.out_pos > DECOMP_LOAD_MAX) {
+        free(s.out);
+        return -1;
+    }
+    *data = s.out;
+    *size = (uint32_t)s.out_pos;
+    return 0;
+}
+
+static int load_payload(const char* path, uint8_t* head, uint32_t head_len, uint32_t file_size, int decompress,
+                        const struct load_target* t, uint8_t** data, uint32_t* size, enum decomp_format* format) {
+    struct payload_header hdr;
+    if (payload_parse_header(head, head_len, &hdr) != 0 || hdr.payload_size > DECOMP_LOAD_MAX) return -1;
+
+    uint8_t* chunk = (uint8_t*)malloc(hdr.chunk_size);
+    if (!chunk) return -1;
+
+    struct payload_stream ps;
+    if (payload_open(path, head, head_len, file_size, &ps, chunk) != 0) {
+        free(chunk);
+        return -1;
+    }
+
+    // Encryption comes after compression, so the plaintext may still be compressed
+    int r = -1;
+    uint32_t first = payload_chunk_len(&hdr, 0);
+    if (payload_read_chunk(path, &ps, 0, chunk) != 0) goto out;
+    enum decomp_format fmt = decompress ? decomp_detect(chunk, first) : DECOMP_FORMAT_NONE;
+    if (format) *format = fmt;
+
+    if (fmt != DECOMP_FORMAT_NONE) {
+        r = load_payload_decompress(path, &ps, chunk, fmt, data, size);
+        goto out;
+    }
+
+    uint8_t* plain = target_alloc(t, (uint32_t)hdr.payload_size);
+    if (!plain) goto out;
+    memcpy(plain, chunk, first);
+    r = 0;
+    for (uint32_t i = 1; i < hdr.chunk_count && r == 0; i++) {
+        r = payload_read_chunk(path, &ps, i, plain + (uint64_t)i * hdr.chunk_size);
+    }
+    if (r != 0) {
+        crypto_memzero_secure(plain, (uint32_t)hdr.payload_size);
+        target_free(t, plain);
+        goto out;
+    }
+    *data = plain;
+    *size = (uint32_t)hdr.payload_size;
+
+out:
+    payload_stream_free(&ps);
+    crypto_memzero_secure(chunk, hdr.chunk_size);
+    free(chunk);
+    return r;
+}
+
+// With a placement target nothing is decompressed, so the final size is
+// always known before the output is allocated
+static int load_file_read(const char* path, uint8_t** data, uint32_t* size, enum decomp_format* format,
+                            int decompress, const struct load_target* t) {
+    if (!path || !data || !size) return -1;
+
+    fs_file_info_t info;
+    if (fs_get_info(path, &info) != 0 || info.size > DECOMP_LOAD_MAX) return -1;
+    uint32_t file_size = (uint32_t)info.size;
+
+    uint32_t head_len = file_size < DECOMP_LOAD_CHUNK ? file_size : DECOMP_LOAD_CHUNK;
+    uint8_t* head = (uint8_t*)malloc(DECOMP_LOAD_CHUNK);
+    if (!head) return -1;
+    if (head_len && load_read(path, head, head_len, 0) != 0) {
+        free(head);
+        return -1;
+    }
+
+    if (payload_detect(head, head_len)) {
+        int r = load_payload(path, head, head_len, file_size, decompress, t, data, size, format);
+        free(head);
+        return r;
+    }
+
+    enum decomp_format fmt = decompress ? decomp_detect(head, head_len) : DECOMP_FORMAT_NONE;
+    if (format) *format = fmt;
+
+    if (fmt == DECOMP_FORMAT_NONE) {
+        if (load_raw(path, head, head_len, file_size, t, data) != 0) return -1;
+        *size = file_size;
+        return 0;
+    }
+
+    uint64_t out_size = 0;
+    int r = load_decompress(path, fmt, head, head_len, file_size, data, &out_size);
+    free(head);
+    if (r != 0) return -1;
+    *size = (uint32_t)out_size;
+    return 0;
+}
+
+// Every image is queued for PCR 9 under its path as it will run, i.e. after
+// decryption and decompression; the loaders flush the queue before handing
+// over. A measurement that can't be queued fails the load.
+static int load_file_common(const char* path, uint8_t** data, uint32_t* size, enum decomp_format* format,
+                            int decompress, const struct load_target* t) {
+    if (load_file_read(path, data, size, format, decompress, t) != 0) return -1;
+    if (tpm2_is_available() && tpm2_measure_file(TPM2_PCR_KERNEL, EV_IPL, path, *data, *size) != 0) {
+        target_free(t, *data);
+        *data = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int decomp_load_file(const char* path, uint8_t** data, uint32_t* size, enum decomp_format* format) {
+    struct load_target heap = { NULL, NULL };
+    return load_file_common(path, data, size, format, 1, &heap);
+}
+
+int decomp_load_initrd(const char* path, uint8_t** data, uint32_t* size) {
+    struct load_target heap = { NULL, NULL };
+    return load_file_common(path, data, size, NULL, 0, &heap);
+}
+
+int decomp_load_initrd_at(const char* path, decomp_place_fn place, void* ctx, uint8_t** data, uint32_t* size) {
+    struct load_target t = { place, ctx };
+    if (!place) return -1;
+    return load_file_common(path, data, size, NULL, 0, &t);
+}
@@ -0,0 +1,44 @@
+/*
+ * load.h
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#ifndef BLOODHORN_LOAD_H
+#define BLOODHORN_LOAD_H
+#include <stdint.h>
+#include "compat.h"
+#include "decompress.h"
+
+#define DECOMP_LOAD_CHUNK       (128 * 1024)    // Bytes per fs_read_file() call
+#define DECOMP_LOAD_TAIL        4096            // Bytes read from the end for the size hint
+#define DECOMP_LOAD_MAX         0xFFFFFFFFull
+
+// Read a file through the fs layer, decompressing it on the way if it starts
+// with a known magic. Reads go straight into the decoder, so the compressed
+// file is never held in memory next to the result. *data is malloc()ed and
+// holds *size bytes; *format (optional) reports what the file was.
+// Encrypted containers (security/payload.h) are verified and decrypted chunk
+// by chunk while reading, and what they hold is decompressed if need be; a
+// compressed plaintext goes to the decoder one chunk at a time and is never
+// held in full. With a TPM up, the result is queued for measurement
+// (security/tpm2.h), as are the initrds below.
+int decomp_load_file(const char* path, uint8_t** data, uint32_t* size, enum decomp_format* format);
+
+// Same for an image already in memory; fails if it isn't compressed
+int decomp_load_buffer(const uint8_t* in, uint32_t len, uint8_t** data, uint32_t* size, enum decomp_format* format);
+
+// Initrds stay compressed, since the kernel unpacks initramfs itself; only
+// an encrypted container is unwrapped
+int decomp_load_initrd(const char* path, uint8_t** data, uint32_t* size);
+
+// Returns size bytes at the address an image must end up at, or NULL. The
+// memory stays the caller's, also when the load fails.
+typedef uint8_t* (*decomp_place_fn)(void* ctx, uint32_t size);
+
+// decomp_load_initrd() straight into memory from place(), once the final
+// size is known, so the initrd is never staged in a heap buffer first
+int decomp_load_initrd_at(const char* path, decomp_place_fn place, void* ctx, uint8_t** data, uint32_t* size);
+
+#endif
@@ -0,0 +1,331 @@
+/*
+ * lz4.c
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#include "lz4.h"
+#include "decompress.h"
+#include "xxhash.h"
+#include "compat.h"
+#include <stdint.h>
+#include <string.h>
+
+enum {
+    LZ4_ST_MAGIC = 0,
+    LZ4_ST_DESCRIPTOR,
+    LZ4_ST_HEADER_REST,
+    LZ4_ST_BLOCK_SIZE,
+    LZ4_ST_BLOCK_DATA,
+    LZ4_ST_BLOCK_RAW,
+    LZ4_ST_BLOCK_CHECKSUM,
+    LZ4_ST_CONTENT_CHECKSUM,
+    LZ4_ST_LEGACY_SIZE,
+    LZ4_ST_LEGACY_DATA,
+    LZ4_ST_SKIP_SIZE,
+    LZ4_ST_SKIP
+};
+
+// FLG bits
+#define LZ4_FLG_VERSION_MASK    0xC0
+#define LZ4_FLG_VERSION         0x40
+#define LZ4_FLG_BLOCK_CHECKSUM  0x10
+#define LZ4_FLG_CONTENT_SIZE    0x08
+#define LZ4_FLG_CONTENT_CHECKSUM 0x04
+#define LZ4_FLG_DICT_ID         0x01
+
+static uint32_t read_le32(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t read_le64(const uint8_t* p) {
+    return (uint64_t)read_le32(p) | ((uint64_t)read_le32(p + 4) << 32);
+}
+
+// Match copy that tolerates overlap (offset < length repeats a pattern)
+static inline void lz4_copy_match(uint8_t* op, const uint8_t* match, uint32_t len, uint32_t offset) {
+    if (offset >= 16) {
+        while (len >= 16) {
+            memcpy(op, match, 16);
+            op += 16; match += 16; len -= 16;
+        }
+        memcpy(op, match, len);
+    } else if (offset >= len) {
+        memcpy(op, match, len);
+    } else {
+        while (len--) *op++ = *match++;
+    }
+}
+
+int lz4_decode_block(const uint8_t* src, uint32_t src_len, uint8_t* dst, uint64_t dst_pos,
+                     uint64_t dst_cap, uint64_t history_start, uint64_t* out_len) {
+    const uint8_t* ip = src;
+    const uint8_t* iend = src + src_len;
+    uint64_t op = dst_pos;
+
+    for (;;) {
+        if (ip >= iend) return DECOMP_ERROR;
+        uint8_t token = *ip++;
+
+        uint32_t lit = token >> 4;
+        if (lit == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return DECOMP_ERROR;
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > (uint32_t)(iend - ip) || op + lit > dst_cap) return DECOMP_ERROR;
+        memcpy(dst + op, ip, lit);
+        ip += lit;
+        op += lit;
+
+        // The last sequence carries literals only
+        if (ip == iend) break;
+
+        if (iend - ip < 2) return DECOMP_ERROR;
+        uint32_t offset = ip[0] | ((uint32_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op - history_start) return DECOMP_ERROR;
+
+        uint32_t mlen = token & 15;
+        if (mlen == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return DECOMP_ERROR;
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += 4;
+        if (op + mlen > dst_cap) return DECOMP_ERROR;
+        lz4_copy_match(dst + op, dst + op - offset, mlen, offset);
+        op += mlen;
+    }
+
+    *out_len = op - dst_pos;
+    return DECOMP_OK;
+}
+
+static uint64_t lz4_content_size(const uint8_t* data, uint32_t len) {
+    if (len < 15 || read_le32(data) != LZ4_FRAME_MAGIC) return 0;
+    if (!(data[4] & LZ4_FLG_CONTENT_SIZE)) return 0;
+    return read_le64(data + 6);
+}
+
+static int lz4_stream_init(struct decomp_stream* s) {
+    memset(&s->u.lz4, 0, sizeof(s->u.lz4));
+    s->state = LZ4_ST_MAGIC;
+    s->need = 4;
+    return DECOMP_OK;
+}
+
+static int lz4_block(struct decomp_stream* s, const uint8_t* src, uint32_t len, uint32_t max_out) {
+    struct lz4_dstate* z = &s->u.lz4;
+    uint64_t produced = 0;
+
+    int r = decomp_reserve(s, max_out);
+    if (r != DECOMP_OK) return r;
+
+    if (z->flags & LZ4_FLG_BLOCK_CHECKSUM) z->skip = xxh32(src, len, 0);
+
+    // Linked blocks may reach back into earlier blocks of the same frame
+    r = lz4_decode_block(src, len, s->out, s->out_pos, s->out_pos + max_out, s->frame_start, &produced);
+    if (r != DECOMP_OK) return r;
+    s->out_pos += produced;
+    return DECOMP_OK;
+}
+
+static int lz4_stream_feed(struct decomp_stream* s, const uint8_t* in, uint32_t len) {
+    struct lz4_dstate* z = &s->u.lz4;
+    const uint8_t* unit;
+    int r;
+
+    s->consumed += len;
+    while (len > 0) {
+        if (s->state == LZ4_ST_BLOCK_RAW || s->state == LZ4_ST_SKIP) {
+            uint32_t take = z->skip < len ? z->skip : len;
+            if (s->state == LZ4_ST_BLOCK_RAW) {
+                memcpy(s->out + s->out_pos, in, take);
+                s->out_pos += take;
+            }
+            in += take; len -= take; z->skip -= take;
+            if (z->skip) continue;
+
+            if (s->state == LZ4_ST_SKIP) {
+                s->state = LZ4_ST_MAGIC; s->need = 4;
+            } else if (z->flags & LZ4_FLG_BLOCK_CHECKSUM) {
+                z->skip = xxh32(s->out + s->out_pos - z->block_size, z->block_size, 0);
+                s->state = LZ4_ST_BLOCK_CHECKSUM; s->need = 4;
+            } else {
+                s->state = LZ4_ST_BLOCK_SIZE; s->need = 4;
+            }
+            continue;
+        }
+
+        r = decomp_stage(s, &in, &len, s->need, &unit);
+        if (r <= 0) return r;
+
+        switch (s->state) {
+        case LZ4_ST_MAGIC: {
+            uint32_t magic = read_le32(unit);
+            s->frame_start = s->out_pos;
+            if (magic == LZ4_FRAME_MAGIC) {
+                z->legacy = 0;
+                s->state = LZ4_ST_DESCRIPTOR; s->need = 2;
+            } else if (magic == LZ4_LEGACY_MAGIC) {
+                z->legacy = 1;
+                z->flags = 0;
+                s->state = LZ4_ST_LEGACY_SIZE; s->need = 4;
+            } else if ((magic & 0xFFFFFFF0u) == LZ4_SKIPPABLE_MAGIC) {
+                s->state = LZ4_ST_SKIP_SIZE; s->need = 4;
+            } else {
+                return DECOMP_ERROR;
+            }
+            break;
+        }
+
+        case LZ4_ST_DESCRIPTOR: {
+            uint8_t flg = unit[0], bd = unit[1];
+            if ((flg & LZ4_FLG_VERSION_MASK) != LZ4_FLG_VERSION || (flg & 0x02) || (bd & 0x8F)) return DECOMP_ERROR;
+            uint32_t bsid = (bd >> 4) & 7;
+            if (bsid < 4) return DECOMP_ERROR;
+            z->flags = flg;
+            z->block_max = 1u << (8 + 2 * bsid);
+            // Keep FLG/BD around for the header checksum
+            z->content_size = ((uint64_t)flg << 8) | bd;
+            s->need = 1 + ((flg & LZ4_FLG_CONTENT_SIZE) ? 8 : 0) + ((flg & LZ4_FLG_DICT_ID) ? 4 : 0);
+            s->state = LZ4_ST_HEADER_REST;
+            break;
+        }
+
+        case LZ4_ST_HEADER_REST: {
+            uint8_t desc[14];
+            uint32_t n = s->need - 1;
+            desc[0] = (uint8_t)(z->content_size >> 8);
+            desc[1] = (uint8_t)z->content_size;
+            memcpy(desc + 2, unit, n);
+            if (((xxh32(desc, n + 2, 0) >> 8) & 0xFF) != unit[n]) return DECOMP_ERROR;
+            if (z->flags & LZ4_FLG_DICT_ID) return DECOMP_ERROR;   // No dictionaries at boot time
+
+            z->content_size = (z->flags & LZ4_FLG_CONTENT_SIZE) ? read_le64(unit) : 0;
+            if (z->content_size) {
+                // Size the destination once instead of growing it block by block
+                r = decomp_reserve(s, z->content_size);
+                if (r != DECOMP_OK) return r;
+            }
+            s->state = LZ4_ST_BLOCK_SIZE; s->need = 4;
+            break;
+        }
+
+        case LZ4_ST_BLOCK_SIZE: {
+            uint32_t size = read_le32(unit);
+            if (size == 0) {
+                if (z->content_size && s->out_pos - s->frame_start != z->content_size) return DECOMP_ERROR;
+                if (z->flags & LZ4_FLG_CONTENT_CHECKSUM) {
+                    s->state = LZ4_ST_CONTENT_CHECKSUM; s->need = 4;
+                } else {
+                    s->state = LZ4_ST_MAGIC; s->need = 4;
+                }
+                break;
+            }
+            z->block_raw = (size & 0x80000000u) != 0;
+            z->block_size = size & 0x7FFFFFFFu;
+            if (z->block_size > z->block_max) return DECOMP_ERROR;
+            if (z->block_raw) {
+                r = decomp_reserve(s, z->block_size);
+                if (r != DECOMP_OK) return r;
+                z->skip = z->block_size;
+                s->state = LZ4_ST_BLOCK_RAW;
+            } else {
+                s->state = LZ4_ST_BLOCK_DATA; s->need = z->block_size;
+            }
+            break;
+        }
+
+        case LZ4_ST_BLOCK_DATA:
+            r = lz4_block(s, unit, z->block_size, z->block_max);
+            if (r != DECOMP_OK) return r;
+            s->state = (z->flags & LZ4_FLG_BLOCK_CHECKSUM) ? LZ4_ST_BLOCK_CHECKSUM : LZ4_ST_BLOCK_SIZE;
+            s->need = 4;
+            break;
+
+        case LZ4_ST_BLOCK_CHECKSUM:
+            if (!(s->flags & DECOMP_F_NO_VERIFY) && read_le32(unit) != z->skip) return DECOMP_ERROR;
+            z->skip = 0;
+            s->state = LZ4_ST_BLOCK_SIZE; s->need = 4;
+            break;
+
+        case LZ4_ST_CONTENT_CHECKSUM:
+            if (!(s->flags & DECOMP_F_NO_VERIFY) &&
+                read_le32(unit) != xxh32(s->out + s->frame_start, s->out_pos - s->frame_start, 0)) {
+                return DECOMP_ERROR;
+            }
+            s->state = LZ4_ST_MAGIC; s->need = 4;
+            break;
+
+        case LZ4_ST_LEGACY_SIZE: {
+            uint32_t size = read_le32(unit);
+            // Legacy frames have no end mark; a repeated magic starts the next one
+            if (size == LZ4_LEGACY_MAGIC) {
+                s->frame_start = s->out_pos;
+                break;
+            }
+            if (size == 0 || size > LZ4_LEGACY_BLOCK_MAX + LZ4_LEGACY_BLOCK_MAX / 255 + 16) return DECOMP_ERROR;
+            z->block_size = size;
+            s->state = LZ4_ST_LEGACY_DATA; s->need = size;
+            break;
+        }
+
+        case LZ4_ST_LEGACY_DATA:
+            // Every legacy block is independent
+            s->frame_start = s->out_pos;
+            r = lz4_block(s, unit, z->block_size, LZ4_LEGACY_BLOCK_MAX);
+            if (r != DECOMP_OK) return r;
+            s->state = LZ4_ST_LEGACY_SIZE; s->need = 4;
+            break;
+
+        case LZ4_ST_SKIP_SIZE:
+            z->skip = read_le32(unit);
+            s->state = z->skip ? LZ4_ST_SKIP : LZ4_ST_MAGIC;
+            s->need = 4;
+            break;
+
+        default:
+            return DECOMP_ERROR;
+        }
+    }
+    return DECOMP_OK;
+}
+
+static int lz4_stream_finish(struct decomp_stream* s) {
+    if (s->consumed == 0 || s->stage_len != 0) return DECOMP_ERROR;
+    if (s->state == LZ4_ST_MAGIC) return DECOMP_DONE;
+    if (s->state == LZ4_ST_LEGACY_SIZE) return DECOMP_DONE;
+    return DECOMP_ERROR;
+}
+
+static const uint8_t lz4_magic[] = { 0x04, 0x22, 0x4D, 0x18 };
+static const uint8_t lz4_legacy_magic[] = { 0x02, 0x21, 0x4C, 0x18 };
+
+const struct decomp_ops lz4_decomp_ops = {
+    .name = "lz4",
+    .magic = lz4_magic,
+    .magic_len = sizeof(lz4_magic),
+    .content_size = lz4_content_size,
+    .init = lz4_stream_init,
+    .feed = lz4_stream_feed,
+    .finish = lz4_stream_finish,
+};
+
+// Same decoder; the magic decides which framing it expects
+const struct decomp_ops lz4_legacy_decomp_ops = {
+    .name = "lz4-legacy",
+    .magic = lz4_legacy_magic,
+    .magic_len = sizeof(lz4_legacy_magic),
+    .init = lz4_stream_init,
+    .feed = lz4_stream_feed,
+    .finish = lz4_stream_finish,
+};
@@ -0,0 +1,38 @@
+/*
+ * lz4.h
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#ifndef BLOODHORN_LZ4_H
+#define BLOODHORN_LZ4_H
+#include <stdint.h>
+#include "compat.h"
+
+#define LZ4_FRAME_MAGIC         0x184D2204
+#define LZ4_LEGACY_MAGIC        0x184C2102
+#define LZ4_SKIPPABLE_MAGIC     0x184D2A50
+#define LZ4_LEGACY_BLOCK_MAX    (8 * 1024 * 1024)
+
+struct decomp_stream;
+struct decomp_ops;
+
+struct lz4_dstate {
+    uint8_t flags;                  // FLG byte of the current frame
+    uint8_t legacy;
+    uint32_t block_max;
+    uint32_t block_size;
+    uint8_t block_raw;
+    uint32_t skip;
+    uint64_t content_size;          // From the frame header, 0 if absent
+};
+
+extern const struct decomp_ops lz4_decomp_ops;
+extern const struct decomp_ops lz4_legacy_decomp_ops;
+
+// Decode one raw LZ4 block; history is everything in dst before dst_pos
+int lz4_decode_block(const uint8_t* src, uint32_t src_len, uint8_t* dst, uint64_t dst_pos,
+                     uint64_t dst_cap, uint64_t history_start, uint64_t* out_len);
+
+#endif
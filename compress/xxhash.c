@@ -0,0 +1,133 @@
+/*
+ * xxhash.c
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#include "xxhash.h"
+#include "compat.h"
+#include <stdint.h>
+#include <string.h>
+
+#define P32_1 0x9E3779B1u
+#define P32_2 0x85EBCA77u
+#define P32_3 0xC2B2AE3Du
+#define P32_4 0x27D4EB2Fu
+#define P32_5 0x165667B1u
+
+#define P64_1 0x9E3779B185EBCA87ull
+#define P64_2 0xC2B2AE3D27D4EB4Full
+#define P64_3 0x165667B19E3779F9ull
+#define P64_4 0x85EBCA77C2B2AE63ull
+#define P64_5 0x27D4EB2F165667C5ull
+
+static inline uint32_t rotl32(uint32_t x, int r) { return (x << r) | (x >> (32 - r)); }
+static inline uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+// Both hashes are defined on little-endian words
+static inline uint32_t read32(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t read64(const uint8_t* p) {
+    return (uint64_t)read32(p) | ((uint64_t)read32(p + 4) << 32);
+}
+
+static inline uint32_t round32(uint32_t acc, uint32_t input) {
+    acc += input * P32_2;
+    return rotl32(acc, 13) * P32_1;
+}
+
+uint32_t xxh32(const void* data, uint64_t len, uint32_t seed) {
+    const uint8_t* p = (const uint8_t*)data;
+    const uint8_t* end = p + len;
+    uint32_t h;
+
+    if (len >= 16) {
+        uint32_t v1 = seed + P32_1 + P32_2, v2 = seed + P32_2, v3 = seed, v4 = seed - P32_1;
+        const uint8_t* limit = end - 16;
+        do {
+            v1 = round32(v1, read32(p));
+            v2 = round32(v2, read32(p + 4));
+            v3 = round32(v3, read32(p + 8));
+            v4 = round32(v4, read32(p + 12));
+            p += 16;
+        } while (p <= limit);
+        h = rotl32(v1, 1) + rotl32(v2, 7) + rotl32(v3, 12) + rotl32(v4, 18);
+    } else {
+        h = seed + P32_5;
+    }
+
+    h += (uint32_t)len;
+    while (p + 4 <= end) {
+        h += read32(p) * P32_3;
+        h = rotl32(h, 17) * P32_4;
+        p += 4;
+    }
+    while (p < end) {
+        h += (*p++) * P32_5;
+        h = rotl32(h, 11) * P32_1;
+    }
+
+    h ^= h >> 15; h *= P32_2;
+    h ^= h >> 13; h *= P32_3;
+    h ^= h >> 16;
+    return h;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input) {
+    acc += input * P64_2;
+    return rotl64(acc, 31) * P64_1;
+}
+
+static inline uint64_t merge64(uint64_t acc, uint64_t v) {
+    acc ^= round64(0, v);
+    return acc * P64_1 + P64_4;
+}
+
+uint64_t xxh64(const void* data, uint64_t len, uint64_t seed) {
+    const uint8_t* p = (const uint8_t*)data;
+    const uint8_t* end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + P64_1 + P64_2, v2 = seed + P64_2, v3 = seed, v4 = seed - P64_1;
+        const uint8_t* limit = end - 32;
+        do {
+            v1 = round64(v1, read64(p));
+            v2 = round64(v2, read64(p + 8));
+            v3 = round64(v3, read64(p + 16));
+            v4 = round64(v4, read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = merge64(h, v1);
+        h = merge64(h, v2);
+        h = merge64(h, v3);
+        h = merge64(h, v4);
+    } else {
+        h = seed + P64_5;
+    }
+
+    h += len;
+    while (p + 8 <= end) {
+        h ^= round64(0, read64(p));
+        h = rotl64(h, 27) * P64_1 + P64_4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)read32(p) * P64_1;
+        h = rotl64(h, 23) * P64_2 + P64_3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p++) * P64_5;
+        h = rotl64(h, 11) * P64_1;
+    }
+
+    h ^= h >> 33; h *= P64_2;
+    h ^= h >> 29; h *= P64_3;
+    h ^= h >> 32;
+    return h;
+}
@@ -0,0 +1,17 @@
+/*
+ * xxhash.h
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#ifndef BLOODHORN_XXHASH_H
+#define BLOODHORN_XXHASH_H
+#include <stdint.h>
+#include "compat.h"
+
+// One-shot XXH32/XXH64, used for zstd and LZ4 frame checksums
+uint32_t xxh32(const void* data, uint64_t len, uint32_t seed);
+uint64_t xxh64(const void* data, uint64_t len, uint64_t seed);
+
+#endif
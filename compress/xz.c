@@ -0,0 +1,679 @@
+/*
+ * xz.c
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#include "xz.h"
+#include "decompress.h"
+#include "crc.h"
+#include "compat.h"
+#include "security/crypto.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+
+enum {
+    XZ_ST_STREAM_START = 0,
+    XZ_ST_STREAM_HEADER,
+    XZ_ST_BLOCK_START,
+    XZ_ST_BLOCK_HEADER,
+    XZ_ST_LZMA2_CTRL,
+    XZ_ST_LZMA2_HEADER,
+    XZ_ST_LZMA2_DATA,
+    XZ_ST_LZMA2_RAW,
+    XZ_ST_BLOCK_PADDING,
+    XZ_ST_CHECK,
+    XZ_ST_INDEX,
+    XZ_ST_INDEX_CRC,
+    XZ_ST_FOOTER
+};
+
+#define XZ_HEADER_SIZE          12
+#define XZ_FOOTER_SIZE          12
+#define XZ_VLI_BYTES_MAX        9
+#define XZ_DICT_PROP_MAX        40
+
+// Index fields, in the order they appear
+#define XZ_INDEX_COUNT          0
+#define XZ_INDEX_UNPADDED       1
+#define XZ_INDEX_UNCOMPRESSED   2
+#define XZ_INDEX_PADDING        3
+
+#define LZMA_PROB_INIT          1024
+#define LZMA_MATCH_LEN_MIN      2
+#define LZMA_DIST_MODEL_END     14
+#define LZMA_ALIGN_BITS         4
+
+static const uint8_t xz_header_magic[6] = { 0xFD, '7', 'z', 'X', 'Z', 0x00 };
+static const uint8_t xz_footer_magic[2] = { 'Y', 'Z' };
+
+static uint32_t read_le32(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t read_le64(const uint8_t* p) {
+    return (uint64_t)read_le32(p) | ((uint64_t)read_le32(p + 4) << 32);
+}
+
+static uint32_t read_be16(const uint8_t* p) {
+    return ((uint32_t)p[0] << 8) | p[1];
+}
+
+static uint32_t read_be32(const uint8_t* p) {
+    return (read_be16(p) << 16) | read_be16(p + 2);
+}
+
+static void write_le64(uint8_t* p, uint64_t v) {
+    for (int i = 0; i < 8; i++) p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static int xz_vli(const uint8_t* p, uint32_t len, uint32_t* pos, uint64_t* out) {
+    uint64_t v = 0;
+    for (uint32_t i = 0; i < XZ_VLI_BYTES_MAX && *pos < len; i++) {
+        uint8_t b = p[(*pos)++];
+        v |= (uint64_t)(b & 0x7F) << (7 * i);
+        if (!(b & 0x80)) {
+            if (b == 0 && i > 0) return DECOMP_ERROR;   // Not minimally encoded
+            *out = v;
+            return DECOMP_OK;
+        }
+    }
+    return DECOMP_ERROR;
+}
+
+static uint32_t xz_check_size(uint8_t type) {
+    switch (type) {
+    case XZ_CHECK_NONE: return 0;
+    case XZ_CHECK_CRC32: return 4;
+    case XZ_CHECK_CRC64: return 8;
+    case XZ_CHECK_SHA256: return 32;
+    default: return 0xFF;
+    }
+}
+
+// Both the blocks and the index feed the same hash, so the index can be
+// checked without keeping a list of blocks
+static uint32_t xz_record_hash(uint32_t hash, uint64_t unpadded, uint64_t uncompressed) {
+    uint8_t rec[16];
+    write_le64(rec, unpadded);
+    write_le64(rec + 8, uncompressed);
+    return crc32_update(hash, rec, sizeof(rec));
+}
+
+// Range decoder. The whole chunk is in memory; reading past its end feeds
+// zeros and the chunk is rejected afterwards.
+struct lzma_rc {
+    uint32_t range;
+    uint32_t code;
+    const uint8_t* ip;
+    const uint8_t* end;
+};
+
+static inline void rc_normalize(struct lzma_rc* rc) {
+    if (rc->range < (1u << 24)) {
+        rc->range <<= 8;
+        rc->code = (rc->code << 8) | (rc->ip < rc->end ? *rc->ip : 0);
+        rc->ip++;
+    }
+}
+
+static inline uint32_t rc_bit(struct lzma_rc* rc, uint16_t* prob) {
+    rc_normalize(rc);
+    uint32_t bound = (rc->range >> 11) * *prob;
+    if (rc->code < bound) {
+        rc->range = bound;
+        *prob += (2048 - *prob) >> 5;
+        return 0;
+    }
+    rc->range -= bound;
+    rc->code -= bound;
+    *prob -= *prob >> 5;
+    return 1;
+}
+
+static inline uint32_t rc_bittree(struct lzma_rc* rc, uint16_t* probs, uint32_t limit) {
+    uint32_t sym = 1;
+    do {
+        sym = (sym << 1) | rc_bit(rc, &probs[sym]);
+    } while (sym < limit);
+    return sym - limit;
+}
+
+// probs[base + sym] for sym starting at 1; base may be -1
+static inline void rc_bittree_reverse(struct lzma_rc* rc, uint16_t* probs, int32_t base,
+                                      uint32_t* dest, uint32_t limit) {
+    uint32_t sym = 1;
+    for (uint32_t i = 0; i < limit; i++) {
+        if (rc_bit(rc, &probs[base + (int32_t)sym])) {
+            sym = (sym << 1) + 1;
+            *dest += 1u << i;
+        } else {
+            sym <<= 1;
+        }
+    }
+}
+
+static inline void rc_direct(struct lzma_rc* rc, uint32_t* dest, uint32_t count) {
+    while (count--) {
+        rc_normalize(rc);
+        rc->range >>= 1;
+        rc->code -= rc->range;
+        uint32_t mask = 0u - (rc->code >> 31);
+        rc->code += rc->range & mask;
+        *dest = (*dest << 1) + (mask + 1);
+    }
+}
+
+static void lzma_reset(struct xz_dstate* z) {
+    uint16_t* p = (uint16_t*)z->probs;
+    // Only the literal coders that lc + lp can select are ever touched
+    size_t n = offsetof(struct lzma_probs, literal) / sizeof(uint16_t) +
+               ((size_t)LZMA_LITERAL_CODER_SIZE << (z->lc + z->lp));
+    for (size_t i = 0; i < n; i++) p[i] = LZMA_PROB_INIT;
+    z->state = 0;
+    memset(z->rep, 0, sizeof(z->rep));
+}
+
+static int lzma_props(struct xz_dstate* z, uint8_t props) {
+    if (props >= 9 * 5 * 5) return DECOMP_ERROR;
+    z->lc = props % 9;
+    props /= 9;
+    z->lp = props % 5;
+    z->pb = props / 5;
+    if (z->lc + z->lp > LZMA_LCLP_MAX || z->pb > 4) return DECOMP_ERROR;
+    return DECOMP_OK;
+}
+
+static inline uint32_t lzma_len(struct lzma_rc* rc, struct lzma_len_probs* l, uint32_t pos_state) {
+    if (!rc_bit(rc, &l->choice)) return LZMA_MATCH_LEN_MIN + rc_bittree(rc, l->low[pos_state], 8);
+    if (!rc_bit(rc, &l->choice2)) return LZMA_MATCH_LEN_MIN + 8 + rc_bittree(rc, l->mid[pos_state], 8);
+    return LZMA_MATCH_LEN_MIN + 16 + rc_bittree(rc, l->high, 256);
+}
+
+// Returns distance - 1, the form the rep registers hold
+static inline uint32_t lzma_distance(struct lzma_rc* rc, struct lzma_probs* p, uint32_t len) {
+    uint32_t len_state = len - LZMA_MATCH_LEN_MIN < 3 ? len - LZMA_MATCH_LEN_MIN : 3;
+    uint32_t slot = rc_bittree(rc, p->dist_slot[len_state], 64);
+    if (slot < 4) return slot;
+
+    uint32_t limit = (slot >> 1) - 1;
+    uint32_t dist = 2 | (slot & 1);
+    if (slot < LZMA_DIST_MODEL_END) {
+        dist <<= limit;
+        rc_bittree_reverse(rc, p->dist_special, (int32_t)(dist - slot) - 1, &dist, limit);
+    } else {
+        rc_direct(rc, &dist, limit - LZMA_ALIGN_BITS);
+        dist <<= LZMA_ALIGN_BITS;
+        rc_bittree_reverse(rc, p->dist_align, 0, &dist, LZMA_ALIGN_BITS);
+    }
+    return dist;
+}
+
+static inline void lzma_copy_match(uint8_t* op, const uint8_t* match, uint32_t len, uint32_t dist) {
+    if (dist >= len) {
+        memcpy(op, match, len);
+    } else {
+        while (len--) *op++ = *match++;
+    }
+}
+
+// Decode one LZMA chunk of exactly usize bytes straight into the output.
+// The output itself is the dictionary, back to the last dictionary reset.
+static int lzma_chunk(struct decomp_stream* s, struct xz_dstate* z, const uint8_t* src,
+                      uint32_t csize, uint32_t usize) {
+    struct lzma_probs* p = z->probs;
+    struct lzma_rc rc;
+
+    if (csize < 5 || src[0] != 0) return DECOMP_ERROR;
+    rc.range = 0xFFFFFFFFu;
+    rc.code = read_be32(src + 1);
+    rc.ip = src + 5;
+    rc.end = src + csize;
+
+    int r = decomp_reserve(s, usize);
+    if (r != DECOMP_OK) return r;
+
+    uint8_t* out = s->out;
+    uint64_t op = s->out_pos;
+    uint64_t end = op + usize;
+    uint64_t dict_start = z->dict_start;
+    uint32_t state = z->state;
+    uint32_t rep0 = z->rep[0], rep1 = z->rep[1], rep2 = z->rep[2], rep3 = z->rep[3];
+    uint32_t lc = z->lc;
+    uint32_t lp_mask = (1u << z->lp) - 1;
+    uint32_t pb_mask = (1u << z->pb) - 1;
+
+    while (op < end) {
+        uint32_t pos = (uint32_t)(op - dict_start);
+        uint32_t pos_state = pos & pb_mask;
+        uint32_t len;
+
+        if (!rc_bit(&rc, &p->is_match[state][pos_state])) {
+            uint32_t prev = pos ? out[op - 1] : 0;
+            uint16_t* lit = p->literal[((pos & lp_mask) << lc) + (prev >> (8 - lc))];
+            uint32_t sym = 1;
+
+            if (state >= 7) {
+                // After a match the literal is coded relative to the byte the
+                // match would have produced next
+                if (rep0 >= pos) return DECOMP_ERROR;
+                uint32_t match_byte = out[op - rep0 - 1];
+                do {
+                    uint32_t match_bit = (match_byte >> 7) & 1;
+                    match_byte <<= 1;
+                    uint32_t bit = rc_bit(&rc, &lit[((1 + match_bit) << 8) + sym]);
+                    sym = (sym << 1) | bit;
+                    if (match_bit != bit) break;
+                } while (sym < 0x100);
+            }
+            while (sym < 0x100) sym = (sym << 1) | rc_bit(&rc, &lit[sym]);
+
+            out[op++] = (uint8_t)sym;
+            state = state < 4 ? 0 : (state < 10 ? state - 3 : state - 6);
+            continue;
+        }
+
+        if (rc_bit(&rc, &p->is_rep[state])) {
+            if (pos == 0) return DECOMP_ERROR;
+            if (!rc_bit(&rc, &p->is_rep0[state])) {
+                if (!rc_bit(&rc, &p->is_rep0_long[state][pos_state])) {
+                    // Short rep: one byte from rep0
+                    if (rep0 >= pos) return DECOMP_ERROR;
+                    out[op] = out[op - rep0 - 1];
+                    op++;
+                    state = state < 7 ? 9 : 11;
+                    continue;
+                }
+            } else {
+                uint32_t dist;
+                if (!rc_bit(&rc, &p->is_rep1[state])) {
+                    dist = rep1;
+                } else {
+                    if (!rc_bit(&rc, &p->is_rep2[state])) {
+                        dist = rep2;
+                    } else {
+                        dist = rep3;
+                        rep3 = rep2;
+                    }
+                    rep2 = rep1;
+                }
+                rep1 = rep0;
+                rep0 = dist;
+            }
+            len = lzma_len(&rc, &p->rep_len, pos_state);
+            state = state < 7 ? 8 : 11;
+        } else {
+            rep3 = rep2;
+            rep2 = rep1;
+            rep1 = rep0;
+            len = lzma_len(&rc, &p->match_len, pos_state);
+            state = state < 7 ? 7 : 10;
+            rep0 = lzma_distance(&rc, p, len);
+        }
+
+        // Also rejects the end marker (rep0 == ~0), which LZMA2 never uses.
+        // Matches never cross a chunk boundary.
+        if (rep0 >= pos || len > end - op) return DECOMP_ERROR;
+        lzma_copy_match(out + op, out + op - rep0 - 1, len, rep0 + 1);
+        op += len;
+    }
+
+    z->state = state;
+    z->rep[0] = rep0; z->rep[1] = rep1; z->rep[2] = rep2; z->rep[3] = rep3;
+    s->out_pos = op;
+
+    // The encoder flushes the range coder so that, after one last
+    // normalization, it ends exactly here
+    rc_normalize(&rc);
+    if (rc.ip != rc.end || rc.code != 0) return DECOMP_ERROR;
+    return DECOMP_OK;
+}
+
+static int xz_block_header(struct xz_dstate* z, uint8_t size_byte, const uint8_t* h, uint32_t len) {
+    uint32_t body = len - 4;
+    uint32_t crc = crc32_update(crc32_update(0, &size_byte, 1), h, body);
+    if (crc != read_le32(h + body)) return DECOMP_ERROR;
+
+    uint8_t flags = h[0];
+    uint32_t pos = 1;
+    if (flags & 0x3C) return DECOMP_ERROR;
+
+    z->header_csize = ~0ull;
+    z->header_usize = ~0ull;
+    if ((flags & 0x40) && xz_vli(h, body, &pos, &z->header_csize) != DECOMP_OK) return DECOMP_ERROR;
+    if ((flags & 0x80) && xz_vli(h, body, &pos, &z->header_usize) != DECOMP_OK) return DECOMP_ERROR;
+
+    // Only a lone LZMA2 filter; BCJ and delta filters are not supported
+    uint64_t id, props_size;
+    if ((flags & 0x03) != 0) return DECOMP_ERROR;
+    if (xz_vli(h, body, &pos, &id) != DECOMP_OK || id != XZ_FILTER_LZMA2) return DECOMP_ERROR;
+    if (xz_vli(h, body, &pos, &props_size) != DECOMP_OK || props_size != 1) return DECOMP_ERROR;
+    if (pos >= body || h[pos] > XZ_DICT_PROP_MAX) return DECOMP_ERROR;
+    pos++;
+
+    while (pos < body) {
+        if (h[pos++] != 0) return DECOMP_ERROR;
+    }
+    return DECOMP_OK;
+}
+
+static int xz_check(struct decomp_stream* s, struct xz_dstate* z, const uint8_t* unit) {
+    const uint8_t* data = s->out + z->block_start;
+    uint64_t len = s->out_pos - z->block_start;
+
+    if (s->flags & DECOMP_F_NO_VERIFY) return DECOMP_OK;
+    switch (z->stream_flags[1]) {
+    case XZ_CHECK_CRC32:
+        return crc32_update(0, data, len) == read_le32(unit) ? DECOMP_OK : DECOMP_ERROR;
+    case XZ_CHECK_CRC64:
+        return crc64_update(0, data, len) == read_le64(unit) ? DECOMP_OK : DECOMP_ERROR;
+    case XZ_CHECK_SHA256: {
+        crypto_sha256_ctx_t ctx;
+        uint8_t digest[CRYPTO_SHA256_DIGEST_LENGTH];
+        crypto_sha256_init(&ctx);
+        while (len) {
+            uint32_t n = len > 0x40000000u ? 0x40000000u : (uint32_t)len;
+            crypto_sha256_update(&ctx, data, n);
+            data += n;
+            len -= n;
+        }
+        crypto_sha256_final(&ctx, digest);
+        return memcmp(digest, unit, sizeof(digest)) == 0 ? DECOMP_OK : DECOMP_ERROR;
+    }
+    default:
+        return DECOMP_OK;
+    }
+}
+
+static int xz_block_end(struct decomp_stream* s, struct xz_dstate* z) {
+    uint64_t usize = s->out_pos - z->block_start;
+    if (z->header_csize != ~0ull && z->header_csize != z->block_compressed) return DECOMP_ERROR;
+    if (z->header_usize != ~0ull && z->header_usize != usize) return DECOMP_ERROR;
+
+    z->blocks++;
+    z->blocks_hash = xz_record_hash(z->blocks_hash, z->header_size + z->block_compressed + z->check_size, usize);
+    return DECOMP_OK;
+}
+
+// One byte of the index: VLI fields, then zero padding to a multiple of four
+static int xz_index_byte(struct xz_dstate* z, uint8_t b) {
+    z->index_crc = crc32_update(z->index_crc, &b, 1);
+    z->index_size++;
+
+    if (z->index_field == XZ_INDEX_PADDING) return b == 0 ? DECOMP_OK : DECOMP_ERROR;
+
+    if (z->vli_shift >= 7 * XZ_VLI_BYTES_MAX) return DECOMP_ERROR;
+    z->vli |= (uint64_t)(b & 0x7F) << z->vli_shift;
+    z->vli_shift += 7;
+    if (b & 0x80) return DECOMP_OK;
+    if (b == 0 && z->vli_shift > 7) return DECOMP_ERROR;
+
+    uint64_t v = z->vli;
+    z->vli = 0;
+    z->vli_shift = 0;
+    switch (z->index_field) {
+    case XZ_INDEX_COUNT:
+        z->index_count = v;
+        z->index_field = v ? XZ_INDEX_UNPADDED : XZ_INDEX_PADDING;
+        break;
+    case XZ_INDEX_UNPADDED:
+        z->record_unpadded = v;
+        z->index_field = XZ_INDEX_UNCOMPRESSED;
+        break;
+    default:
+        z->index_hash = xz_record_hash(z->index_hash, z->record_unpadded, v);
+        z->index_field = ++z->index_seen == z->index_count ? XZ_INDEX_PADDING : XZ_INDEX_UNPADDED;
+        break;
+    }
+    return DECOMP_OK;
+}
+
+static int xz_stream_init(struct decomp_stream* s) {
+    struct xz_dstate* z = &s->u.xz;
+    memset(z, 0, sizeof(*z));
+    z->probs = (struct lzma_probs*)malloc(sizeof(*z->probs));
+    if (!z->probs) return DECOMP_NO_MEMORY;
+    s->state = XZ_ST_STREAM_START;
+    s->need = 4;
+    return DECOMP_OK;
+}
+
+static void xz_stream_free(struct decomp_stream* s) {
+    free(s->u.xz.probs);
+    s->u.xz.probs = NULL;
+}
+
+static int xz_stream_feed(struct decomp_stream* s, const uint8_t* in, uint32_t len) {
+    struct xz_dstate* z = &s->u.xz;
+    const uint8_t* unit;
+    int r;
+
+    s->consumed += len;
+    while (len > 0) {
+        if (s->state == XZ_ST_LZMA2_RAW) {
+            uint32_t take = z->skip < len ? z->skip : len;
+            memcpy(s->out + s->out_pos, in, take);
+            s->out_pos += take;
+            in += take; len -= take; z->skip -= take;
+            if (z->skip == 0) {
+                s->state = XZ_ST_LZMA2_CTRL; s->need = 1;
+            }
+            continue;
+        }
+
+        r = decomp_stage(s, &in, &len, s->need, &unit);
+        if (r <= 0) return r;
+
+        switch (s->state) {
+        case XZ_ST_STREAM_START:
+            // Zero padding in multiples of four may separate streams
+            if (z->streams && read_le32(unit) == 0) break;
+            if (memcmp(unit, xz_header_magic, 4) != 0) return DECOMP_ERROR;
+            s->state = XZ_ST_STREAM_HEADER; s->need = XZ_HEADER_SIZE - 4;
+            break;
+
+        case XZ_ST_STREAM_HEADER:
+            if (memcmp(unit, xz_header_magic + 4, 2) != 0) return DECOMP_ERROR;
+            if (crc32_update(0, unit + 2, 2) != read_le32(unit + 4)) return DECOMP_ERROR;
+            if (unit[2] != 0 || (unit[3] & 0xF0)) return DECOMP_ERROR;
+            z->stream_flags[0] = unit[2];
+            z->stream_flags[1] = unit[3];
+            z->check_size = (uint8_t)xz_check_size(unit[3]);
+            if (z->check_size == 0xFF) return DECOMP_ERROR;
+            z->blocks = z->index_count = z->index_seen = 0;
+            z->blocks_hash = z->index_hash = 0;
+            s->frame_start = s->out_pos;
+            s->state = XZ_ST_BLOCK_START; s->need = 1;
+            break;
+
+        case XZ_ST_BLOCK_START:
+            if (unit[0] == 0) {
+                // Index indicator
+                z->index_crc = crc32_update(0, unit, 1);
+                z->index_size = 1;
+                z->index_field = XZ_INDEX_COUNT;
+                z->vli = 0;
+                z->vli_shift = 0;
+                s->state = XZ_ST_INDEX; s->need = 1;
+                break;
+            }
+            z->header_size = ((uint32_t)unit[0] + 1) * 4;
+            s->state = XZ_ST_BLOCK_HEADER; s->need = z->header_size - 1;
+            break;
+
+        case XZ_ST_BLOCK_HEADER:
+            if (xz_block_header(z, (uint8_t)(z->header_size / 4 - 1), unit, s->need) != DECOMP_OK) {
+                return DECOMP_ERROR;
+            }
+            if (z->header_usize != ~0ull) {
+                r = decomp_reserve(s, z->header_usize);
+                if (r != DECOMP_OK) return r;
+            }
+            z->block_start = s->out_pos;
+            z->block_compressed = 0;
+            z->need_dict_reset = 1;
+            z->need_props = 1;
+            s->state = XZ_ST_LZMA2_CTRL; s->need = 1;
+            break;
+
+        case XZ_ST_LZMA2_CTRL: {
+            uint8_t ctrl = unit[0];
+            z->block_compressed++;
+            if (ctrl == 0) {
+                uint32_t pad = (uint32_t)((4 - ((z->header_size + z->block_compressed) & 3)) & 3);
+                if (pad) {
+                    s->state = XZ_ST_BLOCK_PADDING; s->need = pad;
+                } else if (z->check_size) {
+                    s->state = XZ_ST_CHECK; s->need = z->check_size;
+                } else {
+                    if (xz_block_end(s, z) != DECOMP_OK) return DECOMP_ERROR;
+                    s->state = XZ_ST_BLOCK_START; s->need = 1;
+                }
+                break;
+            }
+
+            if (ctrl >= 0xE0 || ctrl == 0x01) {
+                z->need_props = 1;
+                z->need_dict_reset = 0;
+                z->dict_start = s->out_pos;
+            } else if (z->need_dict_reset) {
+                return DECOMP_ERROR;
+            }
+
+            z->ctrl = ctrl;
+            if (ctrl >= 0x80) {
+                if (ctrl >= 0xC0) {
+                    z->need_props = 0;
+                    s->need = 5;
+                } else if (z->need_props) {
+                    return DECOMP_ERROR;
+                } else {
+                    s->need = 4;
+                }
+            } else if (ctrl <= 0x02) {
+                s->need = 2;
+            } else {
+                return DECOMP_ERROR;
+            }
+            s->state = XZ_ST_LZMA2_HEADER;
+            break;
+        }
+
+        case XZ_ST_LZMA2_HEADER:
+            z->block_compressed += s->need;
+            if (z->ctrl < 0x80) {
+                z->skip = read_be16(unit) + 1;
+                r = decomp_reserve(s, z->skip);
+                if (r != DECOMP_OK) return r;
+                s->state = XZ_ST_LZMA2_RAW;
+                z->block_compressed += z->skip;
+                break;
+            }
+            z->chunk_usize = (((uint32_t)z->ctrl & 0x1F) << 16) + read_be16(unit) + 1;
+            z->chunk_csize = read_be16(unit + 2) + 1;
+            if (z->ctrl >= 0xC0) {
+                if (lzma_props(z, unit[4]) != DECOMP_OK) return DECOMP_ERROR;
+                lzma_reset(z);
+            } else if (z->ctrl >= 0xA0) {
+                lzma_reset(z);
+            }
+            s->state = XZ_ST_LZMA2_DATA; s->need = z->chunk_csize;
+            break;
+
+        case XZ_ST_LZMA2_DATA:
+            z->block_compressed += z->chunk_csize;
+            r = lzma_chunk(s, z, unit, z->chunk_csize, z->chunk_usize);
+            if (r != DECOMP_OK) return r;
+            s->state = XZ_ST_LZMA2_CTRL; s->need = 1;
+            break;
+
+        case XZ_ST_BLOCK_PADDING:
+            for (uint32_t i = 0; i < s->need; i++) {
+                if (unit[i]) return DECOMP_ERROR;
+            }
+            if (z->check_size) {
+                s->state = XZ_ST_CHECK; s->need = z->check_size;
+            } else {
+                if (xz_block_end(s, z) != DECOMP_OK) return DECOMP_ERROR;
+                s->state = XZ_ST_BLOCK_START; s->need = 1;
+            }
+            break;
+
+        case XZ_ST_CHECK:
+            if (xz_check(s, z, unit) != DECOMP_OK) return DECOMP_ERROR;
+            if (xz_block_end(s, z) != DECOMP_OK) return DECOMP_ERROR;
+            s->state = XZ_ST_BLOCK_START; s->need = 1;
+            break;
+
+        case XZ_ST_INDEX:
+            if (xz_index_byte(z, unit[0]) != DECOMP_OK) return DECOMP_ERROR;
+            if (z->index_field == XZ_INDEX_PADDING && (z->index_size & 3) == 0) {
+                s->state = XZ_ST_INDEX_CRC; s->need = 4;
+            }
+            break;
+
+        case XZ_ST_INDEX_CRC:
+            if (read_le32(unit) != z->index_crc) return DECOMP_ERROR;
+            if (z->index_count != z->blocks || z->index_hash != z->blocks_hash) return DECOMP_ERROR;
+            z->index_size += 4;
+            s->state = XZ_ST_FOOTER; s->need = XZ_FOOTER_SIZE;
+            break;
+
+        case XZ_ST_FOOTER:
+            if (crc32_update(0, unit + 4, 6) != read_le32(unit)) return DECOMP_ERROR;
+            if ((read_le32(unit + 4) + 1ull) * 4 != z->index_size) return DECOMP_ERROR;
+            if (memcmp(unit + 8, z->stream_flags, 2) != 0 || memcmp(unit + 10, xz_footer_magic, 2) != 0) {
+                return DECOMP_ERROR;
+            }
+            z->streams++;
+            s->state = XZ_ST_STREAM_START; s->need = 4;
+            break;
+
+        default:
+            return DECOMP_ERROR;
+        }
+    }
+    return DECOMP_OK;
+}
+
+static int xz_stream_finish(struct decomp_stream* s) {
+    if (s->stage_len != 0 || s->state != XZ_ST_STREAM_START || s->u.xz.streams == 0) return DECOMP_ERROR;
+    return DECOMP_DONE;
+}
+
+// Sum of the uncompressed sizes in the last stream's index, if the index
+// is within the tail we were given
+static uint64_t xz_trailer_size(const uint8_t* tail, uint32_t len) {
+    if (len < XZ_FOOTER_SIZE) return 0;
+    const uint8_t* footer = tail + len - XZ_FOOTER_SIZE;
+    if (memcmp(footer + 10, xz_footer_magic, 2) != 0) return 0;
+
+    uint64_t index_size = (read_le32(footer + 4) + 1ull) * 4;
+    if (index_size > len - XZ_FOOTER_SIZE) return 0;
+    const uint8_t* index = footer - index_size;
+    uint32_t pos = 1;
+    uint64_t count, total = 0;
+
+    if (index[0] != 0 || xz_vli(index, (uint32_t)index_size, &pos, &count) != DECOMP_OK) return 0;
+    while (count--) {
+        uint64_t unpadded, usize;
+        if (xz_vli(index, (uint32_t)index_size, &pos, &unpadded) != DECOMP_OK) return 0;
+        if (xz_vli(index, (uint32_t)index_size, &pos, &usize) != DECOMP_OK) return 0;
+        total += usize;
+    }
+    return total;
+}
+
+const struct decomp_ops xz_decomp_ops = {
+    .name = "xz",
+    .magic = xz_header_magic,
+    .magic_len = sizeof(xz_header_magic),
+    .trailer_size = xz_trailer_size,
+    .init = xz_stream_init,
+    .feed = xz_stream_feed,
+    .finish = xz_stream_finish,
+    .release = xz_stream_free,
+};
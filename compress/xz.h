@@ -0,0 +1,95 @@
+/*
+ * xz.h
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#ifndef BLOODHORN_XZ_H
+#define BLOODHORN_XZ_H
+#include <stdint.h>
+#include "compat.h"
+
+#define XZ_FILTER_LZMA2         0x21
+#define XZ_CHECK_NONE           0x00
+#define XZ_CHECK_CRC32          0x01
+#define XZ_CHECK_CRC64          0x04
+#define XZ_CHECK_SHA256         0x0A
+
+#define LZMA_STATES             12
+#define LZMA_POS_STATES_MAX     16
+#define LZMA_LITERAL_CODER_SIZE 0x300
+#define LZMA_LCLP_MAX           4       // LZMA2 limits lc + lp to 4
+
+struct decomp_stream;
+struct decomp_ops;
+
+struct lzma_len_probs {
+    uint16_t choice;
+    uint16_t choice2;
+    uint16_t low[LZMA_POS_STATES_MAX][8];
+    uint16_t mid[LZMA_POS_STATES_MAX][8];
+    uint16_t high[256];
+};
+
+// Adaptive bit probabilities; allocated once per stream (about 28 KiB)
+struct lzma_probs {
+    uint16_t is_match[LZMA_STATES][LZMA_POS_STATES_MAX];
+    uint16_t is_rep[LZMA_STATES];
+    uint16_t is_rep0[LZMA_STATES];
+    uint16_t is_rep1[LZMA_STATES];
+    uint16_t is_rep2[LZMA_STATES];
+    uint16_t is_rep0_long[LZMA_STATES][LZMA_POS_STATES_MAX];
+    uint16_t dist_slot[4][64];
+    uint16_t dist_special[114];
+    uint16_t dist_align[16];
+    struct lzma_len_probs match_len;
+    struct lzma_len_probs rep_len;
+    uint16_t literal[1 << LZMA_LCLP_MAX][LZMA_LITERAL_CODER_SIZE];
+};
+
+// .xz container with a single LZMA2 filter per block
+struct xz_dstate {
+    uint8_t stream_flags[2];
+    uint8_t check_size;
+    uint32_t streams;               // Complete streams seen
+
+    // Current block
+    uint32_t header_size;
+    uint64_t block_start;           // Output offset
+    uint64_t block_compressed;      // LZMA2 bytes so far
+    uint64_t header_usize;          // From the block header, ~0 if absent
+    uint64_t header_csize;
+
+    // LZMA2 chunk parser
+    uint8_t ctrl;
+    uint8_t need_dict_reset;
+    uint8_t need_props;
+    uint32_t chunk_usize;
+    uint32_t chunk_csize;
+    uint32_t skip;                  // Bytes left in an uncompressed chunk
+    uint64_t dict_start;            // Output offset of the last dictionary reset
+
+    // LZMA decoder state carried between chunks
+    uint8_t lc, lp, pb;
+    uint32_t state;
+    uint32_t rep[4];
+    struct lzma_probs* probs;
+
+    // Index, checked against what the blocks actually contained
+    uint64_t blocks;
+    uint32_t blocks_hash;
+    uint64_t index_count;
+    uint64_t index_seen;
+    uint32_t index_hash;
+    uint32_t index_crc;
+    uint32_t index_size;
+    uint8_t index_field;
+    uint8_t vli_shift;
+    uint64_t vli;
+    uint64_t record_unpadded;
+};
+
+extern const struct decomp_ops xz_decomp_ops;
+
+#endif
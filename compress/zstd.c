@@ -0,0 +1,799 @@
+/*
+ * zstd.c
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#include "zstd.h"
+#include "decompress.h"
+#include "xxhash.h"
+#include "compat.h"
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+// Decoder for the Zstandard format (RFC 8878), without dictionary support.
+// Output goes to one flat buffer, so the window is simply everything decoded
+// so far in the current frame.
+
+enum {
+    ZST_MAGIC = 0,
+    ZST_FRAME_HEADER,
+    ZST_BLOCK_HEADER,
+    ZST_BLOCK_RAW,
+    ZST_BLOCK_RLE,
+    ZST_BLOCK_COMPRESSED,
+    ZST_CHECKSUM,
+    ZST_SKIP_SIZE,
+    ZST_SKIP
+};
+
+#define TABLE_LL 1
+#define TABLE_OF 2
+#define TABLE_ML 4
+
+#define LL_MAX_SYMBOL 35
+#define ML_MAX_SYMBOL 52
+#define OF_MAX_SYMBOL 31
+
+static const uint32_t ll_base[LL_MAX_SYMBOL + 1] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+    16, 18, 20, 22, 24, 28, 32, 40, 48, 64, 128, 256, 512, 1024, 2048, 4096,
+    8192, 16384, 32768, 65536
+};
+static const uint8_t ll_bits[LL_MAX_SYMBOL + 1] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    1, 1, 1, 1, 2, 2, 3, 3, 4, 6, 7, 8, 9, 10, 11, 12,
+    13, 14, 15, 16
+};
+static const uint32_t ml_base[ML_MAX_SYMBOL + 1] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18,
+    19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34,
+    35, 37, 39, 41, 43, 47, 51, 59, 67, 83, 99, 131, 259, 515, 1027, 2051,
+    4099, 8195, 16387, 32771, 65539
+};
+static const uint8_t ml_bits[ML_MAX_SYMBOL + 1] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    1, 1, 1, 1, 2, 2, 3, 3, 4, 4, 5, 7, 8, 9, 10, 11,
+    12, 13, 14, 15, 16
+};
+
+// Predefined distributions (RFC 8878 3.1.1.3.2.2)
+static const int16_t ll_default[LL_MAX_SYMBOL + 1] = {
+    4, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 3, 2, 1, 1, 1, 1, 1,
+    -1, -1, -1, -1
+};
+static const int16_t ml_default[ML_MAX_SYMBOL + 1] = {
+    1, 4, 3, 2, 2, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, -1, -1,
+    -1, -1, -1, -1, -1
+};
+static const int16_t of_default[29] = {
+    1, 1, 1, 1, 1, 1, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, -1, -1, -1, -1, -1
+};
+
+static uint32_t read_le16(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8);
+}
+
+static uint32_t read_le32(const uint8_t* p) {
+    return read_le16(p) | (read_le16(p + 2) << 16);
+}
+
+static uint64_t read_le64(const uint8_t* p) {
+    return (uint64_t)read_le32(p) | ((uint64_t)read_le32(p + 4) << 32);
+}
+
+static int highbit32(uint32_t v) {
+    int n = 0;
+    while (v >>= 1) n++;
+    return n;
+}
+
+// Backward bit reader: streams are read from the last byte towards the
+// first, starting just below the final byte's padding marker bit
+struct zbits {
+    const uint8_t* buf;
+    uint32_t len;
+    int64_t pos;        // Bits left; negative once the stream was overread
+};
+
+static int zbits_init(struct zbits* b, const uint8_t* buf, uint32_t len) {
+    if (len == 0 || buf[len - 1] == 0) return -1;
+    b->buf = buf;
+    b->len = len;
+    b->pos = (int64_t)(len - 1) * 8 + highbit32(buf[len - 1]);
+    return 0;
+}
+
+static inline uint64_t zbits_load(const uint8_t* p, uint32_t avail) {
+    uint64_t v = 0;
+    if (avail >= 8) {
+        v = read_le64(p);
+    } else {
+        for (uint32_t i = 0; i < avail; i++) v |= (uint64_t)p[i] << (8 * i);
+    }
+    return v;
+}
+
+// Bits below the start of the stream read as zero
+static inline uint32_t zbits_peek(const struct zbits* b, int n) {
+    if (n == 0) return 0;
+    int64_t start = b->pos - n;
+    if (start >= 0) {
+        uint32_t byte = (uint32_t)(start >> 3);
+        uint64_t v = zbits_load(b->buf + byte, b->len - byte) >> (start & 7);
+        return (uint32_t)(v & ((1ull << n) - 1));
+    }
+    if (b->pos <= 0) return 0;
+    uint64_t v = zbits_load(b->buf, b->len) & ((1ull << b->pos) - 1);
+    return (uint32_t)(v << (-start));
+}
+
+static inline uint32_t zbits_read(struct zbits* b, int n) {
+    uint32_t v = zbits_peek(b, n);
+    b->pos -= n;
+    return v;
+}
+
+// Build an FSE decoding table from normalized counts (-1 = "less than 1")
+static int fse_build(struct zstd_fse_entry* table, const int16_t* norm, int max_symbol, int log) {
+    uint32_t size = 1u << log;
+    uint32_t high = size - 1;
+    uint16_t next[64];
+
+    for (int s = 0; s <= max_symbol; s++) {
+        if (norm[s] == -1) {
+            table[high--].symbol = (uint8_t)s;
+            next[s] = 1;
+        } else {
+            next[s] = (uint16_t)norm[s];
+        }
+    }
+
+    uint32_t pos = 0, step = (size >> 1) + (size >> 3) + 3, mask = size - 1;
+    for (int s = 0; s <= max_symbol; s++) {
+        for (int i = 0; i < norm[s]; i++) {
+            table[pos].symbol = (uint8_t)s;
+            do {
+                pos = (pos + step) & mask;
+            } while (pos > high);
+        }
+    }
+    if (pos != 0) return -1;
+
+    for (uint32_t u = 0; u < size; u++) {
+        uint8_t s = table[u].symbol;
+        uint32_t state = next[s]++;
+        int nb = log - highbit32(state);
+        table[u].nb_bits = (uint8_t)nb;
+        table[u].new_state = (uint16_t)((state << nb) - size);
+    }
+    return 0;
+}
+
+// FSE_Table_Description: returns bytes consumed or -1
+static int fse_read_counts(const uint8_t* src, uint32_t len, int16_t* norm, int* max_symbol, int* log, int max_log) {
+    uint32_t bitpos = 0;
+    int symbol = 0;
+
+#define FSE_PEEK(n) ((uint32_t)((zbits_load(src + (bitpos >> 3), len - (bitpos >> 3)) >> (bitpos & 7)) & ((1ull << (n)) - 1)))
+    if (len < 1) return -1;
+    int acc_log = (src[0] & 0xF) + 5;
+    if (acc_log > max_log) return -1;
+    bitpos = 4;
+
+    int remaining = (1 << acc_log) + 1;
+    int threshold = 1 << acc_log;
+    int nb = acc_log + 1;
+    int previous0 = 0;
+
+    while (remaining > 1 && symbol <= *max_symbol) {
+        if (previous0) {
+            // Run of zero probabilities: repeated 2-bit counts, 3 means "more"
+            uint32_t rep;
+            do {
+                if ((bitpos >> 3) >= len) return -1;
+                rep = FSE_PEEK(2);
+                bitpos += 2;
+                for (uint32_t i = 0; i < rep; i++) {
+                    if (symbol > *max_symbol) return -1;
+                    norm[symbol++] = 0;
+                }
+            } while (rep == 3);
+            if (symbol > *max_symbol) break;
+        }
+        if ((bitpos >> 3) >= len) return -1;
+
+        int max = (2 * threshold - 1) - remaining;
+        int count;
+        uint32_t bits = FSE_PEEK(nb);
+        if ((int)(bits & (threshold - 1)) < max) {
+            count = bits & (threshold - 1);
+            bitpos += nb - 1;
+        } else {
+            count = bits & (2 * threshold - 1);
+            if (count >= threshold) count -= max;
+            bitpos += nb;
+        }
+        count--;
+        remaining -= count < 0 ? -count : count;
+        norm[symbol++] = (int16_t)count;
+        previous0 = count == 0;
+        while (remaining < threshold) {
+            nb--;
+            threshold >>= 1;
+        }
+    }
+#undef FSE_PEEK
+
+    if (remaining != 1 || (bitpos + 7) / 8 > len) return -1;
+    *max_symbol = symbol - 1;
+    *log = acc_log;
+    return (int)((bitpos + 7) / 8);
+}
+
+static int huf_build(struct zstd_dstate* z, const uint8_t* weights, int count) {
+    uint32_t total = 0;
+    uint8_t w[256];
+    uint32_t rank_count[ZSTD_HUF_MAX_LOG + 2];
+
+    if (count < 1 || count > 255) return -1;
+    memcpy(w, weights, count);
+    for (int i = 0; i < count; i++) {
+        if (w[i] > ZSTD_HUF_MAX_LOG) return -1;
+        if (w[i]) total += 1u << (w[i] - 1);
+    }
+    if (total == 0) return -1;
+
+    // The last weight is implied: it tops the sum up to the next power of two
+    int max_bits = highbit32(total) + 1;
+    uint32_t left = (1u << max_bits) - total;
+    if (left & (left - 1)) return -1;
+    if (max_bits > ZSTD_HUF_MAX_LOG) return -1;
+    w[count] = (uint8_t)(highbit32(left) + 1);
+    count++;
+
+    memset(rank_count, 0, sizeof(rank_count));
+    for (int i = 0; i < count; i++) rank_count[w[i]]++;
+
+    // Lowest weights (longest codes) take the first table slots
+    uint32_t rank_start[ZSTD_HUF_MAX_LOG + 2];
+    uint32_t next = 0;
+    for (int wt = 1; wt <= max_bits; wt++) {
+        rank_start[wt] = next;
+        next += rank_count[wt] << (wt - 1);
+    }
+
+    for (int s = 0; s < count; s++) {
+        if (!w[s]) continue;
+        uint32_t len = 1u << (w[s] - 1);
+        uint8_t nb = (uint8_t)(max_bits + 1 - w[s]);
+        for (uint32_t i = 0; i < len; i++) {
+            z->huf_table[rank_start[w[s]] + i].symbol = (uint8_t)s;
+            z->huf_table[rank_start[w[s]] + i].nb_bits = nb;
+        }
+        rank_start[w[s]] += len;
+    }
+    z->huf_log = (uint8_t)max_bits;
+    return 0;
+}
+
+// Huffman_Tree_Description: returns bytes consumed or -1
+static int huf_read_tree(struct zstd_dstate* z, const uint8_t* src, uint32_t len) {
+    uint8_t weights[256];
+    int count = 0;
+
+    if (len < 1) return -1;
+    uint8_t header = src[0];
+
+    if (header >= 128) {
+        count = header - 127;
+        uint32_t bytes = (count + 1) / 2;
+        if (1 + bytes > len) return -1;
+        for (int i = 0; i < count; i++) {
+            uint8_t b = src[1 + i / 2];
+            weights[i] = (i & 1) ? (b & 0xF) : (b >> 4);
+        }
+        if (huf_build(z, weights, count) != 0) return -1;
+        return 1 + bytes;
+    }
+
+    // FSE-compressed weights, two interleaved states
+    uint32_t csize = header;
+    if (csize == 0 || 1 + csize > len) return -1;
+    int16_t norm[16];
+    int max_symbol = 15, log;
+    struct zstd_fse_entry table[1 << 6];
+    int hdr = fse_read_counts(src + 1, csize, norm, &max_symbol, &log, 6);
+    if (hdr < 0 || fse_build(table, norm, max_symbol, log) != 0) return -1;
+
+    struct zbits br;
+    if (zbits_init(&br, src + 1 + hdr, csize - hdr) != 0) return -1;
+    uint32_t s1 = zbits_read(&br, log);
+    uint32_t s2 = zbits_read(&br, log);
+
+    for (;;) {
+        if (count > 253) return -1;
+        weights[count++] = table[s1].symbol;
+        s1 = table[s1].new_state + zbits_read(&br, table[s1].nb_bits);
+        if (br.pos < 0) {
+            weights[count++] = table[s2].symbol;
+            break;
+        }
+        weights[count++] = table[s2].symbol;
+        s2 = table[s2].new_state + zbits_read(&br, table[s2].nb_bits);
+        if (br.pos < 0) {
+            weights[count++] = table[s1].symbol;
+            break;
+        }
+    }
+
+    if (huf_build(z, weights, count) != 0) return -1;
+    return 1 + csize;
+}
+
+static int huf_decode_stream(const struct zstd_dstate* z, const uint8_t* src, uint32_t len, uint8_t* dst, uint32_t n) {
+    struct zbits br;
+    int log = z->huf_log;
+    if (zbits_init(&br, src, len) != 0) return -1;
+
+    for (uint32_t i = 0; i < n; i++) {
+        const struct zstd_huf_entry* e = &z->huf_table[zbits_peek(&br, log)];
+        dst[i] = e->symbol;
+        br.pos -= e->nb_bits;
+    }
+    return br.pos == 0 ? 0 : -1;
+}
+
+// Literals_Section; returns bytes consumed or -1
+static int zstd_literals(struct zstd_dstate* z, const uint8_t* src, uint32_t len,
+                         const uint8_t** lit, uint32_t* lit_len) {
+    if (len < 1) return -1;
+    uint32_t type = src[0] & 3, fmt = (src[0] >> 2) & 3;
+    uint32_t regen, csize = 0, hdr;
+    int streams = 1;
+
+    if (type == 0 || type == 1) {
+        switch (fmt) {
+        case 0: case 2: hdr = 1; regen = src[0] >> 3; break;
+        case 1: hdr = 2; if (len < 2) return -1; regen = (src[0] >> 4) | ((uint32_t)src[1] << 4); break;
+        default: hdr = 3; if (len < 3) return -1; regen = (src[0] >> 4) | ((uint32_t)src[1] << 4) | ((uint32_t)src[2] << 12); break;
+        }
+        if (regen > ZSTD_BLOCK_MAX) return -1;
+        if (type == 0) {
+            if (hdr + regen > len) return -1;
+            *lit = src + hdr;       // Raw literals are used in place
+            *lit_len = regen;
+            return hdr + regen;
+        }
+        if (hdr + 1 > len) return -1;
+        memset(z->literals, src[hdr], regen);
+        *lit = z->literals;
+        *lit_len = regen;
+        return hdr + 1;
+    }
+
+    switch (fmt) {
+    case 0: case 1:
+        hdr = 3; if (len < 3) return -1;
+        streams = fmt == 0 ? 1 : 4;
+        regen = (src[0] >> 4) | (((uint32_t)src[1] & 0x3F) << 4);
+        csize = (src[1] >> 6) | ((uint32_t)src[2] << 2);
+        break;
+    case 2:
+        hdr = 4; if (len < 4) return -1;
+        streams = 4;
+        regen = (src[0] >> 4) | ((uint32_t)src[1] << 4) | (((uint32_t)src[2] & 3) << 12);
+        csize = (src[2] >> 2) | ((uint32_t)src[3] << 6);
+        break;
+    default:
+        hdr = 5; if (len < 5) return -1;
+        streams = 4;
+        regen = (src[0] >> 4) | ((uint32_t)src[1] << 4) | (((uint32_t)src[2] & 0x3F) << 12);
+        csize = (src[2] >> 6) | ((uint32_t)src[3] << 2) | ((uint32_t)src[4] << 10);
+        break;
+    }
+    if (regen > ZSTD_BLOCK_MAX || hdr + csize > len) return -1;
+
+    const uint8_t* p = src + hdr;
+    uint32_t remain = csize;
+    if (type == 2) {
+        int n = huf_read_tree(z, p, remain);
+        if (n < 0) return -1;
+        p += n; remain -= n;
+    } else if (!z->huf_log) {
+        return -1;  // Treeless literals without a previous table
+    }
+
+    if (streams == 1) {
+        if (huf_decode_stream(z, p, remain, z->literals, regen) != 0) return -1;
+    } else {
+        if (remain < 6) return -1;
+        uint32_t s1 = read_le16(p), s2 = read_le16(p + 2), s3 = read_le16(p + 4);
+        if (6 + s1 + s2 + s3 > remain) return -1;
+        uint32_t s4 = remain - 6 - s1 - s2 - s3;
+        uint32_t seg = (regen + 3) / 4;
+        if (3 * seg > regen) return -1;
+        const uint8_t* q = p + 6;
+        if (huf_decode_stream(z, q, s1, z->literals, seg) != 0) return -1;
+        if (huf_decode_stream(z, q + s1, s2, z->literals + seg, seg) != 0) return -1;
+        if (huf_decode_stream(z, q + s1 + s2, s3, z->literals + 2 * seg, seg) != 0) return -1;
+        if (huf_decode_stream(z, q + s1 + s2 + s3, s4, z->literals + 3 * seg, regen - 3 * seg) != 0) return -1;
+    }
+
+    *lit = z->literals;
+    *lit_len = regen;
+    return hdr + csize;
+}
+
+// Set up one of the three sequence tables according to its compression mode
+static int zstd_seq_table(struct zstd_dstate* z, int which, uint32_t mode, const uint8_t* src, uint32_t len) {
+    struct zstd_fse_entry* table;
+    uint8_t* log;
+    const int16_t* def;
+    int def_max, def_log, max_log, max_symbol;
+
+    switch (which) {
+    case TABLE_LL: table = z->ll_table; log = &z->ll_log; def = ll_default; def_max = LL_MAX_SYMBOL; def_log = 6; max_log = ZSTD_LL_MAX_LOG; break;
+    case TABLE_OF: table = z->of_table; log = &z->of_log; def = of_default; def_max = 28; def_log = 5; max_log = ZSTD_OF_MAX_LOG; break;
+    default:       table = z->ml_table; log = &z->ml_log; def = ml_default; def_max = ML_MAX_SYMBOL; def_log = 6; max_log = ZSTD_ML_MAX_LOG; break;
+    }
+    max_symbol = which == TABLE_LL ? LL_MAX_SYMBOL : which == TABLE_OF ? OF_MAX_SYMBOL : ML_MAX_SYMBOL;
+
+    switch (mode) {
+    case 0:
+        if (fse_build(table, def, def_max, def_log) != 0) return -1;
+        *log = (uint8_t)def_log;
+        z->tables_valid |= which;
+        return 0;
+    case 1:
+        if (len < 1 || src[0] > max_symbol) return -1;
+        table[0].symbol = src[0];
+        table[0].nb_bits = 0;
+        table[0].new_state = 0;
+        *log = 0;
+        z->tables_valid |= which;
+        return 1;
+    case 2: {
+        int16_t norm[ML_MAX_SYMBOL + 1];
+        int l;
+        int n = fse_read_counts(src, len, norm, &max_symbol, &l, max_log);
+        if (n < 0 || fse_build(table, norm, max_symbol, l) != 0) return -1;
+        *log = (uint8_t)l;
+        z->tables_valid |= which;
+        return n;
+    }
+    default:
+        return (z->tables_valid & which) ? 0 : -1;
+    }
+}
+
+static int zstd_copy_match(struct decomp_stream* s, uint32_t offset, uint32_t length) {
+    if (offset == 0 || offset > s->out_pos - s->frame_start) return -1;
+    uint8_t* op = s->out + s->out_pos;
+    const uint8_t* match = op - offset;
+    if (offset >= 16) {
+        uint32_t n = length;
+        while (n >= 16) {
+            memcpy(op, match, 16);
+            op += 16; match += 16; n -= 16;
+        }
+        memcpy(op, match, n);
+    } else if (offset >= length) {
+        memcpy(op, match, length);
+    } else {
+        for (uint32_t i = 0; i < length; i++) op[i] = match[i];
+    }
+    s->out_pos += length;
+    return 0;
+}
+
+static int zstd_block(struct decomp_stream* s, const uint8_t* src, uint32_t len) {
+    struct zstd_dstate* z = &s->u.zstd;
+    const uint8_t* lit;
+    uint32_t lit_len;
+
+    int n = zstd_literals(z, src, len, &lit, &lit_len);
+    if (n < 0) return DECOMP_ERROR;
+    src += n; len -= n;
+
+    // Sequences_Section header
+    if (len < 1) return DECOMP_ERROR;
+    uint32_t nseq = src[0], hdr = 1;
+    if (nseq >= 128) {
+        if (nseq < 255) {
+            if (len < 2) return DECOMP_ERROR;
+            nseq = ((nseq - 128) << 8) + src[1];
+            hdr = 2;
+        } else {
+            if (len < 3) return DECOMP_ERROR;
+            nseq = read_le16(src + 1) + 0x7F00;
+            hdr = 3;
+        }
+    }
+    src += hdr; len -= hdr;
+
+    if (decomp_reserve(s, ZSTD_BLOCK_MAX) != DECOMP_OK) return DECOMP_NO_SPACE;
+    uint64_t block_start = s->out_pos;
+
+    if (nseq == 0) {
+        memcpy(s->out + s->out_pos, lit, lit_len);
+        s->out_pos += lit_len;
+        return DECOMP_OK;
+    }
+
+    if (len < 1) return DECOMP_ERROR;
+    uint8_t modes = src[0];
+    if (modes & 3) return DECOMP_ERROR;
+    src++; len--;
+    if ((n = zstd_seq_table(z, TABLE_LL, modes >> 6, src, len)) < 0) return DECOMP_ERROR;
+    src += n; len -= n;
+    if ((n = zstd_seq_table(z, TABLE_OF, (modes >> 4) & 3, src, len)) < 0) return DECOMP_ERROR;
+    src += n; len -= n;
+    if ((n = zstd_seq_table(z, TABLE_ML, (modes >> 2) & 3, src, len)) < 0) return DECOMP_ERROR;
+    src += n; len -= n;
+
+    struct zbits br;
+    if (zbits_init(&br, src, len) != 0) return DECOMP_ERROR;
+    uint32_t ll_state = zbits_read(&br, z->ll_log);
+    uint32_t of_state = zbits_read(&br, z->of_log);
+    uint32_t ml_state = zbits_read(&br, z->ml_log);
+    uint32_t lit_pos = 0;
+
+    for (uint32_t i = 0; i < nseq; i++) {
+        uint32_t ll_code = z->ll_table[ll_state].symbol;
+        uint32_t of_code = z->of_table[of_state].symbol;
+        uint32_t ml_code = z->ml_table[ml_state].symbol;
+        if (ll_code > LL_MAX_SYMBOL || ml_code > ML_MAX_SYMBOL || of_code > OF_MAX_SYMBOL) return DECOMP_ERROR;
+
+        // Extra bits come in offset, match length, literal length order
+        uint32_t ofv = (1u << of_code) + zbits_read(&br, of_code);
+        uint32_t ml = ml_base[ml_code] + zbits_read(&br, ml_bits[ml_code]);
+        uint32_t ll = ll_base[ll_code] + zbits_read(&br, ll_bits[ll_code]);
+
+        uint32_t offset;
+        if (ofv > 3) {
+            offset = ofv - 3;
+            z->rep[2] = z->rep[1];
+            z->rep[1] = z->rep[0];
+            z->rep[0] = offset;
+        } else {
+            uint32_t idx = ofv - 1 + (ll == 0);
+            if (idx == 0) {
+                offset = z->rep[0];
+            } else {
+                offset = idx == 3 ? z->rep[0] - 1 : z->rep[idx];
+                if (offset == 0) offset = 1;
+                if (idx > 1) z->rep[2] = z->rep[1];
+                z->rep[1] = z->rep[0];
+                z->rep[0] = offset;
+            }
+        }
+
+        if (i + 1 < nseq) {
+            // States update in literal length, match length, offset order
+            ll_state = z->ll_table[ll_state].new_state + zbits_read(&br, z->ll_table[ll_state].nb_bits);
+            ml_state = z->ml_table[ml_state].new_state + zbits_read(&br, z->ml_table[ml_state].nb_bits);
+            of_state = z->of_table[of_state].new_state + zbits_read(&br, z->of_table[of_state].nb_bits);
+        }
+        if (br.pos < 0) return DECOMP_ERROR;
+
+        if (ll > lit_len - lit_pos) return DECOMP_ERROR;
+        if (s->out_pos - block_start + ll + ml > ZSTD_BLOCK_MAX) return DECOMP_ERROR;
+        memcpy(s->out + s->out_pos, lit + lit_pos, ll);
+        s->out_pos += ll;
+        lit_pos += ll;
+        if (zstd_copy_match(s, offset, ml) != 0) return DECOMP_ERROR;
+    }
+    if (br.pos != 0) return DECOMP_ERROR;
+
+    uint32_t rest = lit_len - lit_pos;
+    if (s->out_pos - block_start + rest > ZSTD_BLOCK_MAX) return DECOMP_ERROR;
+    memcpy(s->out + s->out_pos, lit + lit_pos, rest);
+    s->out_pos += rest;
+    return DECOMP_OK;
+}
+
+static uint32_t zstd_header_size(uint8_t fhd) {
+    static const uint8_t did_size[4] = { 0, 1, 2, 4 };
+    static const uint8_t fcs_size[4] = { 0, 2, 4, 8 };
+    uint32_t single = (fhd >> 5) & 1;
+    uint32_t fcs = fcs_size[fhd >> 6];
+    if (single && fcs == 0) fcs = 1;
+    return (single ? 0 : 1) + did_size[fhd & 3] + fcs;
+}
+
+static uint64_t zstd_header_content_size(uint8_t fhd, const uint8_t* p) {
+    static const uint8_t did_size[4] = { 0, 1, 2, 4 };
+    uint32_t single = (fhd >> 5) & 1;
+    p += (single ? 0 : 1) + did_size[fhd & 3];
+    switch (fhd >> 6) {
+    case 0: return single ? p[0] : 0;
+    case 1: return read_le16(p) + 256;
+    case 2: return read_le32(p);
+    default: return read_le64(p);
+    }
+}
+
+static uint64_t zstd_content_size(const uint8_t* data, uint32_t len) {
+    if (len < 5 || read_le32(data) != ZSTD_MAGIC) return 0;
+    if (len < 5 + zstd_header_size(data[4])) return 0;
+    return zstd_header_content_size(data[4], data + 5);
+}
+
+static int zstd_stream_init(struct decomp_stream* s) {
+    struct zstd_dstate* z = &s->u.zstd;
+    memset(z, 0, sizeof(*z));
+    z->literals = (uint8_t*)malloc(ZSTD_BLOCK_MAX);
+    if (!z->literals) return DECOMP_NO_MEMORY;
+    s->state = ZST_MAGIC;
+    s->need = 5;
+    return DECOMP_OK;
+}
+
+static void zstd_stream_free(struct decomp_stream* s) {
+    if (s->u.zstd.literals) free(s->u.zstd.literals);
+    s->u.zstd.literals = NULL;
+}
+
+static int zstd_stream_feed(struct decomp_stream* s, const uint8_t* in, uint32_t len) {
+    struct zstd_dstate* z = &s->u.zstd;
+    const uint8_t* unit;
+    int r;
+
+    s->consumed += len;
+    while (len > 0) {
+        if (s->state == ZST_BLOCK_RAW || s->state == ZST_SKIP) {
+            // Stored blocks go straight to the output without staging
+            uint32_t take = z->skip < len ? z->skip : len;
+            if (s->state == ZST_BLOCK_RAW) {
+                memcpy(s->out + s->out_pos, in, take);
+                s->out_pos += take;
+            }
+            in += take; len -= take; z->skip -= take;
+            if (z->skip == 0) {
+                if (s->state == ZST_SKIP) {
+                    s->state = ZST_MAGIC; s->need = 5;
+                } else if (z->last_block) {
+                    s->state = z->frame_checksum ? ZST_CHECKSUM : ZST_MAGIC;
+                    s->need = z->frame_checksum ? 4 : 5;
+                } else {
+                    s->state = ZST_BLOCK_HEADER; s->need = 3;
+                }
+            }
+            continue;
+        }
+
+        r = decomp_stage(s, &in, &len, s->need, &unit);
+        if (r <= 0) return r;
+
+        switch (s->state) {
+        case ZST_MAGIC: {
+            // Magic plus the frame header descriptor, or a skippable frame
+            uint32_t magic = read_le32(unit);
+            if ((magic & 0xFFFFFFF0u) == ZSTD_SKIPPABLE_MAGIC) {
+                // The fifth byte already belongs to the size field
+                z->skip = unit[4];
+                s->state = ZST_SKIP_SIZE; s->need = 3;
+                break;
+            }
+            if (magic != ZSTD_MAGIC) return DECOMP_ERROR;
+            uint8_t fhd = unit[4];
+            if (fhd & 0x08) return DECOMP_ERROR;    // Reserved bit
+            if (fhd & 0x03) return DECOMP_ERROR;    // Dictionaries are not supported
+            z->frame_descriptor = fhd;
+            z->frame_checksum = (fhd >> 2) & 1;
+            s->need = zstd_header_size(fhd);
+            s->state = ZST_FRAME_HEADER;
+            break;
+        }
+
+        case ZST_FRAME_HEADER:
+            z->content_size = zstd_header_content_size(z->frame_descriptor, unit);
+            s->frame_start = s->out_pos;
+            z->rep[0] = 1; z->rep[1] = 4; z->rep[2] = 8;
+            z->tables_valid = 0;
+            z->huf_log = 0;
+            if (z->content_size) {
+                r = decomp_reserve(s, z->content_size);
+                if (r != DECOMP_OK) return r;
+            }
+            s->state = ZST_BLOCK_HEADER; s->need = 3;
+            break;
+
+        case ZST_BLOCK_HEADER: {
+            uint32_t bh = unit[0] | ((uint32_t)unit[1] << 8) | ((uint32_t)unit[2] << 16);
+            z->last_block = bh & 1;
+            z->block_type = (bh >> 1) & 3;
+            z->block_size = bh >> 3;
+            if (z->block_size > ZSTD_BLOCK_MAX) return DECOMP_ERROR;
+
+            if (z->block_type == 0) {
+                r = decomp_reserve(s, z->block_size);
+                if (r != DECOMP_OK) return r;
+                z->skip = z->block_size;
+                s->state = ZST_BLOCK_RAW;
+                if (z->skip == 0) {
+                    // Empty stored block: run the end-of-block transition now
+                    if (z->last_block) {
+                        s->state = z->frame_checksum ? ZST_CHECKSUM : ZST_MAGIC;
+                        s->need = z->frame_checksum ? 4 : 5;
+                    } else {
+                        s->state = ZST_BLOCK_HEADER; s->need = 3;
+                    }
+                }
+            } else if (z->block_type == 1) {
+                s->state = ZST_BLOCK_RLE; s->need = 1;
+            } else if (z->block_type == 2) {
+                s->state = ZST_BLOCK_COMPRESSED; s->need = z->block_size;
+                if (z->block_size == 0) return DECOMP_ERROR;
+            } else {
+                return DECOMP_ERROR;
+            }
+            break;
+        }
+
+        case ZST_BLOCK_RLE:
+        case ZST_BLOCK_COMPRESSED:
+            if (s->state == ZST_BLOCK_RLE) {
+                r = decomp_reserve(s, z->block_size);
+                if (r != DECOMP_OK) return r;
+                memset(s->out + s->out_pos, unit[0], z->block_size);
+                s->out_pos += z->block_size;
+            } else {
+                r = zstd_block(s, unit, z->block_size);
+                if (r != DECOMP_OK) return r;
+            }
+            if (z->last_block) {
+                if (z->content_size && s->out_pos - s->frame_start != z->content_size) return DECOMP_ERROR;
+                s->state = z->frame_checksum ? ZST_CHECKSUM : ZST_MAGIC;
+                s->need = z->frame_checksum ? 4 : 5;
+            } else {
+                s->state = ZST_BLOCK_HEADER; s->need = 3;
+            }
+            break;
+
+        case ZST_CHECKSUM:
+            if (!(s->flags & DECOMP_F_NO_VERIFY)) {
+                uint32_t h = (uint32_t)xxh64(s->out + s->frame_start, s->out_pos - s->frame_start, 0);
+                if (h != read_le32(unit)) return DECOMP_ERROR;
+            }
+            s->state = ZST_MAGIC; s->need = 5;
+            break;
+
+        case ZST_SKIP_SIZE:
+            z->skip |= ((uint32_t)unit[0] << 8) | ((uint32_t)unit[1] << 16) | ((uint32_t)unit[2] << 24);
+            s->state = z->skip ? ZST_SKIP : ZST_MAGIC;
+            s->need = 5;
+            break;
+
+        default:
+            return DECOMP_ERROR;
+        }
+    }
+    return DECOMP_OK;
+}
+
+static int zstd_stream_finish(struct decomp_stream* s) {
+    if (s->consumed == 0 || s->stage_len != 0 || s->state != ZST_MAGIC) return DECOMP_ERROR;
+    return DECOMP_DONE;
+}
+
+static const uint8_t zstd_magic[] = { 0x28, 0xB5, 0x2F, 0xFD };
+
+const struct decomp_ops zstd_decomp_ops = {
+    .name = "zstd",
+    .magic = zstd_magic,
+    .magic_len = sizeof(zstd_magic),
+    .content_size = zstd_content_size,
+    .init = zstd_stream_init,
+    .feed = zstd_stream_feed,
+    .finish = zstd_stream_finish,
+    .release = zstd_stream_free,
+};
@@ -0,0 +1,60 @@
+/*
+ * zstd.h
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#ifndef BLOODHORN_ZSTD_H
+#define BLOODHORN_ZSTD_H
+#include <stdint.h>
+#include "compat.h"
+
+#define ZSTD_MAGIC              0xFD2FB528
+#define ZSTD_SKIPPABLE_MAGIC    0x184D2A50  // Low nibble is free
+#define ZSTD_BLOCK_MAX          (128 * 1024)
+
+#define ZSTD_LL_MAX_LOG         9
+#define ZSTD_ML_MAX_LOG         9
+#define ZSTD_OF_MAX_LOG         8
+#define ZSTD_HUF_MAX_LOG        11
+
+struct decomp_stream;
+struct decomp_ops;
+
+struct zstd_fse_entry {
+    uint8_t symbol;
+    uint8_t nb_bits;
+    uint16_t new_state;
+};
+
+struct zstd_huf_entry {
+    uint8_t symbol;
+    uint8_t nb_bits;
+};
+
+// Decoder state that survives from one block to the next (RFC 8878)
+struct zstd_dstate {
+    uint8_t frame_descriptor;
+    uint8_t frame_checksum;
+    uint8_t last_block;
+    uint8_t block_type;
+    uint8_t huf_log;                // 0 until a Huffman table was sent
+    uint32_t block_size;
+    uint32_t skip;                  // Bytes left in a raw block or skippable frame
+    uint64_t content_size;          // From the frame header, 0 if absent
+    uint32_t rep[3];
+
+    uint8_t ll_log, of_log, ml_log;
+    uint8_t tables_valid;           // Bit per table, for Repeat_Mode
+    struct zstd_fse_entry ll_table[1 << ZSTD_LL_MAX_LOG];
+    struct zstd_fse_entry of_table[1 << ZSTD_OF_MAX_LOG];
+    struct zstd_fse_entry ml_table[1 << ZSTD_ML_MAX_LOG];
+    struct zstd_huf_entry huf_table[1 << ZSTD_HUF_MAX_LOG];
+
+    uint8_t* literals;              // ZSTD_BLOCK_MAX scratch, allocated at init
+};
+
+extern const struct decomp_ops zstd_decomp_ops;
+
+#endif
@@ -17,10 +17,14 @@
 #include <Protocol/SimpleFileSystem.h>
 #include <Protocol/DevicePath.h>
 #include <Protocol/Tcg2Protocol.h>
+#include <Protocol/Rng.h>
+#include <Protocol/MpService.h>
 #include <Library/DevicePathLib.h>
 #include <Library/BaseLib.h>
 #include <Library/PrintLib.h>
 #include <Guid/FileInfo.h>
+#include <Guid/Acpi.h>
+#include <Guid/SmBios.h>
 
 // Include BloodHorn boot modules
 #include "boot/menu.h"
@@ -32,10 +36,14 @@
 #include "fs/fat32.h"
 #include "security/crypto.h"
 #include "security/tpm2.h"
+#include "security/entropy.h"
+#include "security/manifest.h"
+#include "security/payload.h"
 #include "scripting/lua.h"
 #include "recovery/shell.h"
 #include "plugins/plugin.h"
 #include "net/pxe.h"
+#include "net/net_stats.h"
 #include "boot/Arch32/linux.h"
 #include "boot/Arch32/limine.h"
 #include "boot/Arch32/multiboot1.h"
@@ -46,6 +54,9 @@
 #include "boot/Arch32/aarch64.h"
 #include "boot/Arch32/riscv64.h"
 #include "boot/Arch32/loongarch64.h"
+#include "boot/Arch32/placement.h"
+#include "boot/Arch32/module_loader.h"
+#include "boot/Arch32/firmware_info.h"
 #include "boot/Arch32/BloodChain/bloodchain.h"
 #include "config/config_ini.h"
 #include "config/config_json.h"
@@ -59,11 +70,13 @@
 // File hash verification structure (typedef before usage)
 typedef struct {
     char path[256];
-    uint8_t expected_hash[64];
+    uint8_t expected_hash[64];      // SHA-512 of the file itself
+    uint8_t manifest_digest[64];    // SHA-512 of the signed part of <path>.bhm
 } FILE_HASH;
 
 // Global TPM 2.0 context
 static EFI_TCG2_PROTOCOL* gTcg2Protocol = NULL;
+static MeasuredBootContext gMeasuredBoot;
 
 // Global BloodHorn context
 static bh_context_t* gBhContext = NULL;
@@ -102,6 +115,18 @@ typedef struct {
     uint32_t header_font_size;
     char language[8];
     bool enable_networking;
+    // [security] manifest trust roots for network boot
+    bool manifest_pinned;                   // Any configured, loaded or not
+    char manifest_key[MANIFEST_MAX_KEYS][128];
+    UINTN manifest_key_count;
+    uint8_t manifest_digest[MANIFEST_MAX_TRUSTED][MANIFEST_DIGEST_SIZE];
+    UINTN manifest_digest_count;
+    // [security] keys for encrypted images (payload_pack.py)
+    char payload_key[PAYLOAD_MAX_KEYS][128];
+    UINTN payload_key_count;
+    // [pxe] modules fetched alongside the network kernel ("path [cmdline]")
+    char pxe_module[PXE_MAX_MODULES][2 * PXE_MODULE_STRING];
+    UINTN pxe_module_count;
 } BOOT_CONFIG;
 
 // Coreboot boot parameter structure definitions
@@ -230,6 +255,21 @@ STATIC VOID trim_ascii(CHAR8* s) {
     while (n > 0 && (s[n-1] == ' ' || s[n-1] == '\t' || s[n-1] == '\r' || s[n-1] == '\n')) { s[n-1] = 0; n--; }
 }
 
+// Hex digest of exactly len bytes
+STATIC BOOLEAN parse_hex_ascii(const CHAR8* v, uint8_t* out, UINTN len) {
+    if (!v || AsciiStrLen(v) != len * 2) return FALSE;
+    for (UINTN i = 0; i < len * 2; i++) {
+        CHAR8 c = v[i];
+        UINT8 nibble;
+        if (c >= '0' && c <= '9') nibble = (UINT8)(c - '0');
+        else if (c >= 'a' && c <= 'f') nibble = (UINT8)(c - 'a' + 10);
+        else if (c >= 'A' && c <= 'F') nibble = (UINT8)(c - 'A' + 10);
+        else return FALSE;
+        out[i / 2] = (uint8_t)((i & 1) ? (out[i / 2] | nibble) : (nibble << 4));
+    }
+    return TRUE;
+}
+
 STATIC EFI_STATUS ReadWholeFileAscii(EFI_FILE_HANDLE root, CONST CHAR16* path, CHAR8** outBuf, UINTN* outLen) {
     EFI_STATUS Status;
     EFI_FILE_HANDLE file = NULL;
@@ -297,6 +337,30 @@ STATIC VOID ApplyIniToConfig(const CHAR8* ini, BOOT_CONFIG* config) {
             } else if (str_ieq(k, "use_gui")) {
                 config->use_gui = parse_bool_ascii(v, config->use_gui);
             }
+        } else if (str_ieq(section, "security")) {
+            // Repeatable; anything malformed still pins, so nothing is trusted
+            if (str_ieq(k, "manifest_key")) {
+                config->manifest_pinned = TRUE;
+                if (config->manifest_key_count < MANIFEST_MAX_KEYS) {
+                    AsciiStrCpyS(config->manifest_key[config->manifest_key_count++], sizeof(config->manifest_key[0]), v);
+                }
+            } else if (str_ieq(k, "manifest_digest")) {
+                config->manifest_pinned = TRUE;
+                if (config->manifest_digest_count < MANIFEST_MAX_TRUSTED &&
+                    parse_hex_ascii(v, config->manifest_digest[config->manifest_digest_count], MANIFEST_DIGEST_SIZE)) {
+                    config->manifest_digest_count++;
+                }
+            } else if (str_ieq(k, "payload_key")) {
+                if (config->payload_key_count < PAYLOAD_MAX_KEYS) {
+                    AsciiStrCpyS(config->payload_key[config->payload_key_count++], sizeof(config->payload_key[0]), v);
+                }
+            }
+        } else if (str_ieq(section, "pxe")) {
+            if (str_ieq(k, "module")) {
+                if (config->pxe_module_count < PXE_MAX_MODULES) {
+                    AsciiStrCpyS(config->pxe_module[config->pxe_module_count++], sizeof(config->pxe_module[0]), v);
+                }
+            }
         } else if (str_ieq(section, "linux")) {
             if (str_ieq(k, "kernel")) {
                 AsciiStrCpyS(config->kernel, sizeof(config->kernel), v);
@@ -360,6 +424,104 @@ STATIC VOID ApplyUefiEnvOverrides(BOOT_CONFIG* config) {
     }
 }
 
+/**
+ * Register the configured manifest trust roots, and the allow-list's pinned
+ * manifest digest, with security/manifest.c. Once any are configured,
+ * network manifests must match them; a key that fails to load is reported
+ * and leaves the pin in place, so the network boot fails closed.
+ */
+STATIC
+VOID
+LoadManifestTrust (
+  IN BOOT_CONFIG* config
+  )
+{
+    manifest_clear_trusted();
+    if (config->manifest_pinned) {
+        manifest_pin_trust();
+    }
+
+    for (UINTN i = 0; i < config->manifest_digest_count; i++) {
+        manifest_add_trusted(config->manifest_digest[i]);
+    }
+    if (g_known_hashes[0].manifest_digest[0] != 0) {
+        manifest_add_trusted(g_known_hashes[0].manifest_digest);
+    }
+
+    for (UINTN i = 0; i < config->manifest_key_count; i++) {
+        CHAR16 KeyPath[128];
+        VOID* Key = NULL;
+        UINTN KeySize = 0;
+        AsciiStrToUnicodeStrS(config->manifest_key[i], KeyPath, ARRAY_SIZE(KeyPath));
+        if (EFI_ERROR(LoadFileRaw(KeyPath, &Key, &KeySize)) ||
+            manifest_add_key(Key, (uint32_t)KeySize) != 0) {
+            Print(L"Manifest key %s could not be loaded; network images will be refused\n", KeyPath);
+        }
+        if (Key) FreePool(Key);
+    }
+}
+
+/**
+ * Register the configured keys for encrypted kernels and initrds with
+ * security/payload.c. The key files are wiped from memory once registered;
+ * an image whose key is missing simply fails to load.
+ */
+STATIC
+VOID
+LoadPayloadKeys (
+  IN BOOT_CONFIG* config
+  )
+{
+    payload_clear_keys();
+    if (config->payload_key_count == 0) {
+        return;
+    }
+    if (payload_self_test() != CRYPTO_SUCCESS) {
+        Print(L"Payload decryption self-test failed; encrypted images will be refused\n");
+        return;
+    }
+
+    for (UINTN i = 0; i < config->payload_key_count; i++) {
+        CHAR16 KeyPath[128];
+        VOID* Key = NULL;
+        UINTN KeySize = 0;
+        AsciiStrToUnicodeStrS(config->payload_key[i], KeyPath, ARRAY_SIZE(KeyPath));
+        if (EFI_ERROR(LoadFileRaw(KeyPath, &Key, &KeySize)) ||
+            payload_add_key_file(Key, (uint32_t)KeySize) != 0) {
+            Print(L"Payload key %s could not be loaded\n", KeyPath);
+        }
+        if (Key) {
+            crypto_memzero_secure(Key, KeySize);
+            FreePool(Key);
+        }
+    }
+}
+
+/**
+ * Queue the configured [pxe] modules, so network boot fetches them in the
+ * same concurrent transfer as the kernel and initrd. The path ends at the
+ * first blank; the rest is the module's command line.
+ */
+STATIC
+VOID
+QueuePxeModules (
+  IN BOOT_CONFIG* config
+  )
+{
+    for (UINTN i = 0; i < config->pxe_module_count; i++) {
+        CHAR8* Path = config->pxe_module[i];
+        CHAR8* Args = Path;
+        while (*Args && *Args != ' ' && *Args != '\t') Args++;
+        if (*Args) {
+            *Args++ = 0;
+            while (*Args == ' ' || *Args == '\t') Args++;
+        }
+        if (pxe_add_module(Path, *Args ? Args : NULL) != 0) {
+            Print(L"PXE module %a could not be queued\n", Path);
+        }
+    }
+}
+
 /**
  * Load boot configuration from files
  */
@@ -381,6 +543,11 @@ LoadBootConfig (
     AsciiStrCpyS(config->language, sizeof(config->language), "en");
     config->enable_networking = FALSE;
     config->kernel[0] = 0; config->initrd[0] = 0; config->cmdline[0] = 0;
+    config->manifest_pinned = FALSE;
+    config->manifest_key_count = 0;
+    config->manifest_digest_count = 0;
+    config->payload_key_count = 0;
+    config->pxe_module_count = 0;
 
     EFI_STATUS Status;
     EFI_FILE_HANDLE root_dir;
@@ -547,6 +714,19 @@ UefiMain (
     // Load configuration (INI -> JSON -> UEFI vars)
     BOOT_CONFIG config;
     LoadBootConfig(&config);
+    LoadManifestTrust(&config);
+    LoadPayloadKeys(&config);
+    QueuePxeModules(&config);
+
+    // Measured boot: from here every image the loaders read is queued for
+    // the TPM, and each boot path extends the queue before handing over
+    if (config.tpm_enabled) {
+        if (measured_boot_init(&gMeasuredBoot) == 0) {
+            measured_boot_measure_bootloader(&gMeasuredBoot);
+        } else {
+            Print(L"TPM not available, boot will not be measured\n");
+        }
+    }
 
     // Apply language and font from configuration before any UI
     SetLanguage(config.language);
@@ -678,6 +858,320 @@ static void bh_uefi_debug_break(void) {
 #endif
 }
 
+// Microsecond delay for the plain C drivers (TPM polling)
+void firmware_stall(uint32_t microseconds) {
+    gBS->Stall(microseconds);
+}
+
+void* firmware_allocate_pages(uint32_t pages) {
+    EFI_PHYSICAL_ADDRESS Addr;
+    if (EFI_ERROR(gBS->AllocatePages(AllocateAnyPages, EfiLoaderData, pages, &Addr))) return NULL;
+    return (void*)(UINTN)Addr;
+}
+
+void firmware_free_pages(void* base, uint32_t pages) {
+    gBS->FreePages((EFI_PHYSICAL_ADDRESS)(UINTN)base, pages);
+}
+
+// Pages at exactly address, for images with a fixed or preferred load address
+void* firmware_allocate_pages_at(uint64_t address, uint32_t pages) {
+    EFI_PHYSICAL_ADDRESS Addr = address;
+    if (EFI_ERROR(gBS->AllocatePages(AllocateAddress, EfiLoaderData, pages, &Addr))) return NULL;
+    return (void*)(UINTN)Addr;
+}
+
+STATIC enum place_type EfiPlaceType(UINT32 Type) {
+    switch (Type) {
+    case EfiConventionalMemory: return PLACE_FREE;
+    case EfiLoaderCode:
+    case EfiLoaderData:
+    case EfiBootServicesCode:
+    case EfiBootServicesData: return PLACE_RECLAIMABLE;
+    case EfiACPIReclaimMemory: return PLACE_ACPI;
+    case EfiACPIMemoryNVS: return PLACE_NVS;
+    case EfiUnusableMemory: return PLACE_BAD;
+    default: return PLACE_RESERVED;
+    }
+}
+
+STATIC enum place_type CorebootPlaceType(UINT32 Type) {
+    switch (Type) {
+    case CB_MEM_RAM: return PLACE_FREE;
+    case CB_MEM_ACPI: return PLACE_ACPI;
+    case CB_MEM_NVS: return PLACE_NVS;
+    case CB_MEM_UNUSABLE: return PLACE_BAD;
+    default: return PLACE_RESERVED;
+    }
+}
+
+// The memory map for boot/Arch32/placement.c: coreboot's table when there is
+// one, then the UEFI map over it, which knows what boot services hold
+int firmware_memory_map(place_region_fn fn, void* ctx) {
+    if (gCorebootAvailable) {
+        UINT32 Count = 0;
+        CONST COREBOOT_MEM_ENTRY* Map = CorebootGetMemoryMap(&Count);
+        for (UINT32 i = 0; Map && i < Count; i++) {
+            fn(ctx, Map[i].addr, Map[i].size, CorebootPlaceType(Map[i].type));
+        }
+    }
+
+    UINTN MapSize = 0, MapKey = 0, DescSize = 0;
+    UINT32 DescVer = 0;
+    EFI_STATUS Status = gBS->GetMemoryMap(&MapSize, NULL, &MapKey, &DescSize, &DescVer);
+    if (Status != EFI_BUFFER_TOO_SMALL) return -1;
+    MapSize += 4 * DescSize;    // The pool allocation itself can split a descriptor
+    EFI_MEMORY_DESCRIPTOR* MemMap = AllocatePool(MapSize);
+    if (!MemMap) return -1;
+    Status = gBS->GetMemoryMap(&MapSize, MemMap, &MapKey, &DescSize, &DescVer);
+    if (!EFI_ERROR(Status)) {
+        for (UINTN Offset = 0; Offset + DescSize <= MapSize; Offset += DescSize) {
+            EFI_MEMORY_DESCRIPTOR* Desc = (EFI_MEMORY_DESCRIPTOR*)((UINT8*)MemMap + Offset);
+            fn(ctx, Desc->PhysicalStart, EFI_PAGES_TO_SIZE(Desc->NumberOfPages), EfiPlaceType(Desc->Type));
+        }
+    }
+    FreePool(MemMap);
+    return EFI_ERROR(Status) ? -1 : 0;
+}
+
+// EFI_RNG_PROTOCOL with the platform's default algorithm, for security/entropy.c
+int firmware_get_rng(uint8_t* buf, uint32_t len) {
+    EFI_RNG_PROTOCOL* Rng = NULL;
+    if (EFI_ERROR(gBS->LocateProtocol(&gEfiRngProtocolGuid, NULL, (VOID**)&Rng)) || !Rng) return -1;
+    return EFI_ERROR(Rng->GetRNG(Rng, NULL, len, buf)) ? -1 : 0;
+}
+
+typedef struct {
+    void (*Fn)(void* arg);
+    void* Arg;
+} AP_CALL;
+
+// APs are called with the EFIAPI convention, the security code isn't
+STATIC VOID EFIAPI ApCallTrampoline(IN OUT VOID* Buffer) {
+    AP_CALL* Call = (AP_CALL*)Buffer;
+    Call->Fn(Call->Arg);
+}
+
+// Run fn on every enabled AP and on the BSP at once, for security/manifest.c.
+// The APs are started non-blocking so the BSP can take its share, then it
+// polls for theirs; without MP services the BSP runs fn alone.
+void firmware_run_on_all_cpus(void (*fn)(void* arg), void* arg) {
+    EFI_MP_SERVICES_PROTOCOL* Mp = NULL;
+    EFI_EVENT Done = NULL;
+    AP_CALL Call = { fn, arg };
+
+    if (EFI_ERROR(gBS->LocateProtocol(&gEfiMpServiceProtocolGuid, NULL, (VOID**)&Mp)) || !Mp ||
+        EFI_ERROR(gBS->CreateEvent(0, TPL_CALLBACK, NULL, NULL, &Done))) {
+        fn(arg);
+        return;
+    }
+    // EFI_NOT_STARTED means there are no enabled APs
+    if (EFI_ERROR(Mp->StartupAllAPs(Mp, ApCallTrampoline, FALSE, Done, 0, &Call, NULL))) {
+        gBS->CloseEvent(Done);
+        fn(arg);
+        return;
+    }
+    fn(arg);
+    while (gBS->CheckEvent(Done) == EFI_NOT_READY) {
+        CpuPause();
+    }
+    gBS->CloseEvent(Done);
+}
+
+STATIC UINT8 MaskShift(UINT32 Mask) {
+    UINT8 Shift = 0;
+    while (Mask && !(Mask & 1)) { Mask >>= 1; Shift++; }
+    return Shift;
+}
+
+STATIC UINT8 MaskSize(UINT32 Mask) {
+    UINT8 Size = 0;
+    for (; Mask; Mask &= Mask - 1) Size++;
+    return Size;
+}
+
+// Every GOP with a linear framebuffer, or coreboot's when GOP has none
+uint32_t firmware_framebuffers(struct firmware_framebuffer* fb, uint32_t max) {
+    EFI_HANDLE* Handles = NULL;
+    UINTN HandleCount = 0;
+    uint32_t Count = 0;
+
+    if (!EFI_ERROR(gBS->LocateHandleBuffer(ByProtocol, &gEfiGraphicsOutputProtocolGuid, NULL,
+                                           &HandleCount, &Handles))) {
+        for (UINTN i = 0; i < HandleCount && Count < max; i++) {
+            EFI_GRAPHICS_OUTPUT_PROTOCOL* Gop = NULL;
+            if (EFI_ERROR(gBS->HandleProtocol(Handles[i], &gEfiGraphicsOutputProtocolGuid, (VOID**)&Gop)) ||
+                !Gop || !Gop->Mode || !Gop->Mode->Info) {
+                continue;
+            }
+            EFI_GRAPHICS_OUTPUT_MODE_INFORMATION* Info = Gop->Mode->Info;
+            EFI_PIXEL_BITMASK Mask;
+            switch (Info->PixelFormat) {
+            case PixelRedGreenBlueReserved8BitPerColor:
+                Mask = (EFI_PIXEL_BITMASK){ 0x000000FF, 0x0000FF00, 0x00FF0000, 0xFF000000 };
+                break;
+            case PixelBlueGreenRedReserved8BitPerColor:
+                Mask = (EFI_PIXEL_BITMASK){ 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000 };
+                break;
+            case PixelBitMask:
+                Mask = Info->PixelInformation;
+                break;
+            default:
+                continue;   // Blt only, nothing to hand over
+            }
+            UINT32 AllBits = Mask.RedMask | Mask.GreenMask | Mask.BlueMask | Mask.ReservedMask;
+            struct firmware_framebuffer* f = &fb[Count++];
+            f->base = Gop->Mode->FrameBufferBase;
+            f->size = Gop->Mode->FrameBufferSize;
+            f->width = Info->HorizontalResolution;
+            f->height = Info->VerticalResolution;
+            f->bpp = (uint16_t)(32 - __builtin_clz(AllBits ? AllBits : 1));
+            f->bpp = (uint16_t)((f->bpp + 7) & ~7);
+            f->pitch = Info->PixelsPerScanLine * (f->bpp / 8);
+            f->red_size = MaskSize(Mask.RedMask);
+            f->red_shift = MaskShift(Mask.RedMask);
+            f->green_size = MaskSize(Mask.GreenMask);
+            f->green_shift = MaskShift(Mask.GreenMask);
+            f->blue_size = MaskSize(Mask.BlueMask);
+            f->blue_shift = MaskShift(Mask.BlueMask);
+        }
+        FreePool(Handles);
+    }
+
+    if (Count == 0 && max > 0 && gCorebootAvailable) {
+        CONST COREBOOT_FB* Cb = CorebootGetFramebuffer();
+        if (Cb && Cb->physical_address) {
+            struct firmware_framebuffer* f = &fb[Count++];
+            f->base = Cb->physical_address;
+            f->size = (uint64_t)Cb->bytes_per_line * Cb->y_resolution;
+            f->width = Cb->x_resolution;
+            f->height = Cb->y_resolution;
+            f->pitch = Cb->bytes_per_line;
+            f->bpp = Cb->bits_per_pixel;
+            f->red_size = Cb->red_mask_size;
+            f->red_shift = Cb->red_mask_pos;
+            f->green_size = Cb->green_mask_size;
+            f->green_shift = Cb->green_mask_pos;
+            f->blue_size = Cb->blue_mask_size;
+            f->blue_shift = Cb->blue_mask_pos;
+        }
+    }
+    return Count;
+}
+
+STATIC VOID* FindConfigTable(EFI_GUID* Guid) {
+    for (UINTN i = 0; i < gST->NumberOfTableEntries; i++) {
+        if (CompareGuid(&gST->ConfigurationTable[i].VendorGuid, Guid)) {
+            return gST->ConfigurationTable[i].VendorTable;
+        }
+    }
+    return NULL;
+}
+
+void* firmware_acpi_rsdp(void) {
+    VOID* Rsdp = FindConfigTable(&gEfiAcpi20TableGuid);
+    return Rsdp ? Rsdp : FindConfigTable(&gEfiAcpi10TableGuid);
+}
+
+void* firmware_smbios_entry32(void) {
+    return FindConfigTable(&gEfiSmbiosTableGuid);
+}
+
+void* firmware_smbios_entry64(void) {
+    return FindConfigTable(&gEfiSmbios3TableGuid);
+}
+
+void* firmware_system_table(void) {
+    return gST;
+}
+
+// APIC IDs from MP services; without them only the BSP is known, and CPUID
+// gives its ID
+uint32_t firmware_cpu_ids(uint32_t* ids, uint32_t max, uint32_t* bsp) {
+    EFI_MP_SERVICES_PROTOCOL* Mp = NULL;
+    UINTN Total = 0, Enabled = 0;
+    uint32_t Count = 0;
+
+    *bsp = 0;
+    if (max == 0) return 0;
+    if (!EFI_ERROR(gBS->LocateProtocol(&gEfiMpServiceProtocolGuid, NULL, (VOID**)&Mp)) && Mp &&
+        !EFI_ERROR(Mp->GetNumberOfProcessors(Mp, &Total, &Enabled))) {
+        for (UINTN i = 0; i < Total && Count < max; i++) {
+            EFI_PROCESSOR_INFORMATION Info;
+            if (EFI_ERROR(Mp->GetProcessorInfo(Mp, i, &Info)) || !(Info.StatusFlag & PROCESSOR_ENABLED_BIT)) {
+                continue;
+            }
+            if (Info.StatusFlag & PROCESSOR_AS_BSP_BIT) *bsp = Count;
+            ids[Count++] = (uint32_t)Info.ProcessorId;
+        }
+    }
+#if defined(MDE_CPU_X64) || defined(MDE_CPU_IA32)
+    if (Count == 0) {
+        UINT32 Ebx;
+        AsmCpuid(1, NULL, &Ebx, NULL, NULL);
+        ids[Count++] = Ebx >> 24;
+    }
+#endif
+    return Count;
+}
+
+void* firmware_image_handle(void) {
+    return gImageHandle;
+}
+
+uint32_t firmware_memory_map_size(uint32_t* descriptor_size) {
+    UINTN MapSize = 0, MapKey = 0, DescSize = 0;
+    UINT32 DescVer = 0;
+
+    gBS->GetMemoryMap(&MapSize, NULL, &MapKey, &DescSize, &DescVer);
+    *descriptor_size = (uint32_t)DescSize;
+    return (uint32_t)MapSize;
+}
+
+// For the protocols that hand over a machine without boot services
+int firmware_exit_boot_services(struct firmware_memory_map* map) {
+    UINTN MapSize = 0, MapKey = 0, DescSize = 0;
+    UINT32 DescVer = 0;
+    EFI_MEMORY_DESCRIPTOR* MemMap = NULL;
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    if (tpm2_flush_measurements() != 0) return -1;
+    entropy_exit_boot_services();
+
+    for (int attempt = 0; attempt < 8; attempt++) {
+        if (map) {
+            // Straight into the caller's buffer, which must already hold
+            // the map with room to spare: allocating now would change it
+            MapSize = map->capacity;
+            Status = gBS->GetMemoryMap(&MapSize, (EFI_MEMORY_DESCRIPTOR*)map->buffer, &MapKey, &DescSize, &DescVer);
+            if (Status == EFI_BUFFER_TOO_SMALL) return -1;
+        } else {
+            MapSize = 0;
+            Status = gBS->GetMemoryMap(&MapSize, MemMap, &MapKey, &DescSize, &DescVer);
+            if (Status == EFI_BUFFER_TOO_SMALL) {
+                if (MemMap) FreePool(MemMap);
+                MapSize += 4 * DescSize;
+                MemMap = AllocatePool(MapSize);
+                if (!MemMap) return -1;
+                Status = gBS->GetMemoryMap(&MapSize, MemMap, &MapKey, &DescSize, &DescVer);
+            }
+        }
+        if (EFI_ERROR(Status)) continue;
+
+        // EFI_INVALID_PARAMETER means the map changed since it was read
+        Status = gBS->ExitBootServices(gImageHandle, MapKey);
+        if (Status != EFI_INVALID_PARAMETER) break;
+    }
+    if (EFI_ERROR(Status)) return -1;
+
+    // The pool is gone along with boot services, so MemMap is not freed
+    if (map) {
+        map->size = (uint32_t)MapSize;
+        map->descriptor_size = (uint32_t)DescSize;
+        map->descriptor_version = DescVer;
+    }
+    return 0;
+}
+
 // Boot wrapper implementations
 EFI_STATUS EFIAPI BootLinuxKernelWrapper(VOID) {
     return linux_load_kernel("/boot/vmlinuz", "/boot/initrd.img", "root=/dev/sda1 ro");
@@ -756,6 +1250,7 @@ EFI_STATUS EFIAPI BootBloodchainWrapper(VOID) {
     EFI_STATUS Status;
     EFI_PHYSICAL_ADDRESS KernelBase = 0x100000; // 1MB mark
     EFI_PHYSICAL_ADDRESS BcbpBase;
+    struct bcbp_builder Chain;
 
     // Allocate memory for BCBP header (4KB aligned)
     Status = gBS->AllocatePages(AllocateAnyPages, EfiLoaderData,
@@ -765,38 +1260,70 @@ EFI_STATUS EFIAPI BootBloodchainWrapper(VOID) {
         return Status;
     }
 
-    // Initialize BCBP header
-    struct bcbp_header* hdr = (struct bcbp_header*)(UINTN)BcbpBase;
-    bcbp_init(hdr, KernelBase, 0);  // 0 for boot device (set by bootloader)
+    // Initialize BCBP header; unused module slots are dropped by bcbp_finish()
+    if (bcbp_init(&Chain, (VOID*)(UINTN)BcbpBase, 64 * 1024, 64, KernelBase, 0) != 0) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+    struct bcbp_header* hdr = Chain.hdr;
 
     // Load kernel
     const char* kernel_path = "kernel.elf";
     const char* initrd_path = "initrd.img";
     const char* cmdline = "root=/dev/sda1 ro";
 
-    // Load kernel into memory
-    EFI_PHYSICAL_ADDRESS KernelLoadAddr = KernelBase;
-    UINTN KernelSize = 0;
-
-    Status = LoadFileToMemory(kernel_path, &KernelLoadAddr, &KernelSize);
-    if (EFI_ERROR(Status)) {
-        Print(L"Failed to load kernel: %r\n", Status);
-        return Status;
+    // Load the kernel and its modules as one manifest: placed together,
+    // then read in on-disk order
+    struct module_load Manifest[] = {
+        { kernel_path, KernelBase, 0 },
+        { initrd_path, 0, MODULE_OPTIONAL },
+    };
+    if (module_load_all(Manifest, ARRAY_SIZE(Manifest), PLACE_LIMIT_4G) != 0) {
+        Print(L"Failed to load kernel and modules\n");
+        return EFI_LOAD_ERROR;
     }
 
     // Add kernel module
-    bcbp_add_module(hdr, KernelLoadAddr, KernelSize, "kernel",
-                   BCBP_MODTYPE_KERNEL, cmdline);
-
-    // Load initrd if it exists
-    EFI_PHYSICAL_ADDRESS InitrdLoadAddr = KernelLoadAddr + ALIGN_UP(KernelSize, 0x1000);
-    UINTN InitrdSize = 0;
-
-    if (FileExists(initrd_path)) {
-        Status = LoadFileToMemory(initrd_path, &InitrdLoadAddr, &InitrdSize);
-        if (!EFI_ERROR(Status) && InitrdSize > 0) {
-            bcbp_add_module(hdr, InitrdLoadAddr, InitrdSize, "initrd",
-                          BCBP_MODTYPE_INITRD, NULL);
+    EFI_PHYSICAL_ADDRESS KernelLoadAddr = (EFI_PHYSICAL_ADDRESS)(UINTN)Manifest[0].data;
+    UINTN KernelSize = Manifest[0].size;
+    if (bcbp_add_module(&Chain, KernelLoadAddr, KernelSize, "kernel",
+                        BCBP_MODTYPE_KERNEL, cmdline) != 0) {
+        module_release_all(Manifest, ARRAY_SIZE(Manifest));
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    // Add initrd if it exists
+    EFI_PHYSICAL_ADDRESS InitrdLoadAddr = (EFI_PHYSICAL_ADDRESS)(UINTN)Manifest[1].data;
+    UINTN InitrdSize = Manifest[1].size;
+    if (!(Manifest[1].flags & MODULE_MISSING) && InitrdSize > 0) {
+        bcbp_add_module(&Chain, InitrdLoadAddr, InitrdSize, "initrd",
+                        BCBP_MODTYPE_INITRD, NULL);
+    }
+
+    // Extend the measurements queued while loading, while the TPM is still
+    // ours. Done before the modules below so the event log is complete.
+    if (tpm2_flush_measurements() != 0) {
+        Print(L"Failed to extend queued TPM measurements\n");
+        module_release_all(Manifest, ARRAY_SIZE(Manifest));
+        return EFI_SECURITY_VIOLATION;
+    }
+
+    // Hand the TCG event log to the OS; it already sits in loader pages
+    const void* TcgLog = NULL;
+    UINT32 TcgLogSize = 0;
+    if (tpm2_event_log_get(&TcgLog, &TcgLogSize) == 0 && TcgLogSize > 0) {
+        bcbp_add_module(&Chain, (UINT64)(UINTN)TcgLog, TcgLogSize, "tcglog",
+                      BCBP_MODTYPE_TCGLOG, NULL);
+    }
+
+    // Hand network boot statistics to the OS when anything went over the wire
+    struct net_stats* NetStats = net_stats_get();
+    if (NetStats->transfer_count > 0 || NetStats->phase[NET_PHASE_DHCP].runs > 0) {
+        EFI_PHYSICAL_ADDRESS StatsAddr;
+        if (!EFI_ERROR(gBS->AllocatePages(AllocateAnyPages, EfiLoaderData,
+                                          EFI_SIZE_TO_PAGES(sizeof(*NetStats)), &StatsAddr))) {
+            CopyMem((VOID*)(UINTN)StatsAddr, NetStats, sizeof(*NetStats));
+            bcbp_add_module(&Chain, StatsAddr, sizeof(*NetStats), "netstats",
+                          BCBP_MODTYPE_NETSTATS, NULL);
         }
     }
 
@@ -842,8 +1369,10 @@ EFI_STATUS EFIAPI BootBloodchainWrapper(VOID) {
     hdr->uefi_64bit = (sizeof(UINTN) == 8) ? 1 : 0;
 
     // Validate BCBP structure
+    bcbp_finish(&Chain);
     if (bcbp_validate(hdr) != 0) {
         Print(L"Invalid BCBP structure\n");
+        module_release_all(Manifest, ARRAY_SIZE(Manifest));
         return EFI_LOAD_ERROR;
     }
 
@@ -860,6 +1389,7 @@ EFI_STATUS EFIAPI BootBloodchainWrapper(VOID) {
     KernelEntry EntryPoint = (KernelEntry)(UINTN)KernelLoadAddr;
 
     // Properly exit boot services (robustly handle map changes/races)
+    entropy_exit_boot_services();
     UINTN MapSize = 0, MapKey = 0, DescSize = 0;
     UINT32 DescVer = 0;
     EFI_MEMORY_DESCRIPTOR* MemMap = NULL;
@@ -898,6 +1428,7 @@ EFI_STATUS EFIAPI BootBloodchainWrapper(VOID) {
     if (MemMap) { FreePool(MemMap); MemMap = NULL; }
     if (EFI_ERROR(EStatus)) {
         Print(L"Failed to exit boot services (status=%r)\n", EStatus);
+        module_release_all(Manifest, ARRAY_SIZE(Manifest));
         return EFI_LOAD_ERROR;
     }
 
@@ -1066,6 +1597,36 @@ LoadAndVerifyKernel (
     *KernelBuffer = buffer;
     *KernelSize = size;
 
+    // A manifest next to the kernel lists per-chunk digests, which every CPU
+    // checks in parallel; it has to pass the same trust roots (keys and the
+    // pinned manifest digests) as a network manifest before it counts
+    CHAR16 ManifestPath[512];
+    VOID* ManifestData = NULL;
+    UINTN ManifestSize = 0;
+    UnicodeSPrint(ManifestPath, sizeof(ManifestPath), L"%s%a", KernelPath, MANIFEST_SUFFIX);
+    if (!EFI_ERROR(LoadFileRaw(ManifestPath, &ManifestData, &ManifestSize))) {
+        struct manifest Manifest;
+        BOOLEAN Valid = manifest_parse(ManifestData, (uint32_t)ManifestSize, &Manifest) == 0 &&
+                        manifest_check_trust(&Manifest) == 0 &&
+                        manifest_verify_image(&Manifest, buffer, size) == 0;
+        FreePool(ManifestData);
+
+        if (!Valid) {
+            Print(L"Kernel manifest verification failed!\n");
+            FreePool(buffer);
+            return EFI_SECURITY_VIOLATION;
+        }
+        return EFI_SUCCESS;
+    }
+
+    // Without a manifest, pinned trust roots still refuse the kernel unless
+    // its own hash is pinned
+    if (manifest_trust_required() && g_known_hashes[0].expected_hash[0] == 0) {
+        Print(L"Kernel has no trusted manifest!\n");
+        FreePool(buffer);
+        return EFI_SECURITY_VIOLATION;
+    }
+
     // Verify kernel hash if security is enabled
     if (g_known_hashes[0].expected_hash[0] != 0) {
         crypto_sha512_ctx_t ctx;
@@ -1135,16 +1696,11 @@ ExecuteKernelWithCoreboot (
         return EFI_DEVICE_ERROR;
     }
 
-    // Find suitable memory region for kernel execution
-    UINT64 kernel_base = 0;
-    UINT64 largest_size = 0;
-
-    for (UINT32 i = 0; i < mem_map_count; i++) {
-        if (mem_map[i].type == CB_MEM_RAM && mem_map[i].size > largest_size) {
-            kernel_base = mem_map[i].addr;
-            largest_size = mem_map[i].size;
-        }
-    }
+    // Place the kernel through the allocator, which has coreboot's table
+    // folded into the firmware map, instead of taking the start of the
+    // largest RAM range whatever else lives there
+    struct place_request kernel_req = { KernelSize, SIZE_2MB, SIZE_1MB, 0, PLACE_BEST_FIT };
+    UINT64 kernel_base = (UINT64)(UINTN)place_alloc(&kernel_req);
 
     if (kernel_base == 0) {
         Print(L"No suitable RAM region found for kernel execution\n");
@@ -1168,7 +1724,11 @@ ExecuteKernelWithCoreboot (
 
     // Set up boot parameters in Coreboot format
     // Set up proper boot parameter structure that kernel can access
-    UINT64 boot_params_addr = kernel_base + 0x1000; // 4KB after kernel
+    UINT64 boot_params_addr = (UINT64)(UINTN)place_below(PLACE_LIMIT_4G, sizeof(COREBOOT_BOOT_PARAMS), 8);
+    if (boot_params_addr == 0) {
+        place_free((VOID*)(UINTN)kernel_base, KernelSize);
+        return EFI_OUT_OF_RESOURCES;
+    }
 
     // Set up Coreboot boot parameters structure
     COREBOOT_BOOT_PARAMS* boot_params = (COREBOOT_BOOT_PARAMS*)boot_params_addr;
@@ -1203,14 +1763,6 @@ ExecuteKernelWithCoreboot (
         boot_params->boot_flags |= COREBOOT_BOOT_FLAG_INITRD;
     }
 
-    /* Ensure kernel is placed at chosen Coreboot region. The Coreboot memory map
-       provides physical addresses; copy the kernel buffer into the selected
-       kernel_base region so boot params and entry point are consistent. */
-    if (KernelSize > largest_size) {
-        Print(L"Kernel size %u exceeds selected Coreboot region of %u bytes\n", KernelSize, largest_size);
-        return EFI_BAD_BUFFER_SIZE;
-    }
-
     VOID* kernel_target = (VOID*)(UINTN)kernel_base;
     CopyMem(kernel_target, KernelBuffer, (UINTN)KernelSize);
     /* Use the kernel target as the canonical kernel buffer/entry point from now on */
@@ -1321,7 +1873,14 @@ ExitBootServicesAndExecuteKernel (
     UINT32 DescVer = 0;
     EFI_MEMORY_DESCRIPTOR* MemMap = NULL;
 
+    // Extend the measurements queued while loading, while the TPM is still ours
+    if (tpm2_flush_measurements() != 0) {
+        Print(L"Failed to extend queued TPM measurements\n");
+        return EFI_SECURITY_VIOLATION;
+    }
+
     // Robustly get the memory map and exit boot services (handle concurrent map updates)
+    entropy_exit_boot_services();
     Status = EFI_SUCCESS;
     const int max_retries = 8;
     int attempt = 0;
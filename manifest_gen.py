@@ -0,0 +1,139 @@
+# manifest_gen.py
+#
+# This file is part of BloodHorn and is licensed under the BSD License.
+# See the root of the repository for license details.
+#
+
+"""
+BloodHorn Image Manifest Generator
+
+Writes the chunked manifest read by security/manifest.c next to a kernel, so
+the bootloader can hash the image on every CPU at once instead of running a
+single SHA-512 over all of it on the BSP, and can check each chunk of a
+network download the moment it arrives.
+
+    python3 manifest_gen.py vmlinuz
+    python3 manifest_gen.py --sign key.pem --chunk-size 4194304 vmlinuz
+    python3 manifest_gen.py --sign key.pem --export-key manifest.key
+
+Manifests are Merkle trees (version 2) by default, so the signed part is the
+same size for any image; --flat writes the older version 1 layout.
+
+The manifest goes to <image>.bhm unless -o is given. The printed manifest
+digest is what belongs in the kernel allow-list once a manifest is used.
+--export-key writes the signing key's public half in the layout the
+bootloader's manifest_key setting reads.
+"""
+
+import argparse
+import hashlib
+import struct
+import sys
+
+MAGIC = 0x464D4842  # "BHMF"
+VERSION_FLAT = 1
+VERSION_MERKLE = 2
+HASH_SHA256 = 1
+MIN_CHUNK = 64 * 1024
+MAX_CHUNK = 64 * 1024 * 1024
+DEFAULT_CHUNK = 1024 * 1024
+SIG_LEN = 256
+
+# Public key file: modulus bit count (LE), then exponent and modulus (BE, 256 bytes each)
+KEY_HEADER = struct.Struct("<I")
+
+# magic, version, hash_alg, chunk_size, chunk_count, image_size, sig_len, reserved
+HEADER = struct.Struct("<IHHIIQII")
+
+
+def load_key(key_path):
+    try:
+        from cryptography.hazmat.primitives import serialization
+    except ImportError:
+        sys.exit("--sign needs the 'cryptography' package (pip install cryptography)")
+    with open(key_path, "rb") as f:
+        key = serialization.load_pem_private_key(f.read(), password=None)
+    if getattr(key, "key_size", None) != 2048 or not hasattr(key, "private_numbers"):
+        sys.exit("signing key must be RSA-2048")
+    return key
+
+
+def sign(data, key_path):
+    from cryptography.hazmat.primitives import hashes
+    from cryptography.hazmat.primitives.asymmetric import padding
+    return load_key(key_path).sign(data, padding.PKCS1v15(), hashes.SHA256())
+
+
+def export_key(key_path):
+    numbers = load_key(key_path).public_key().public_numbers()
+    return (KEY_HEADER.pack(SIG_LEN * 8) + numbers.e.to_bytes(SIG_LEN, "big") +
+            numbers.n.to_bytes(SIG_LEN, "big"))
+
+
+def merkle_root(leaves):
+    if not leaves:
+        return hashlib.sha256(b"").digest()
+    level = leaves
+    while len(level) > 1:
+        nxt = [hashlib.sha256(b"\x01" + level[i] + level[i + 1]).digest()
+               for i in range(0, len(level) - 1, 2)]
+        if len(level) % 2:
+            nxt.append(level[-1])
+        level = nxt
+    return level[0]
+
+
+def build(data, chunk_size, key_path, flat):
+    count = (len(data) + chunk_size - 1) // chunk_size
+    chunks = [data[i * chunk_size:(i + 1) * chunk_size] for i in range(count)]
+    sig_len = SIG_LEN if key_path else 0
+    version = VERSION_FLAT if flat else VERSION_MERKLE
+    header = HEADER.pack(MAGIC, version, HASH_SHA256, chunk_size, count, len(data), sig_len, 0)
+
+    if flat:
+        signed = header + b"".join(hashlib.sha256(c).digest() for c in chunks)
+        body = signed
+    else:
+        leaves = [hashlib.sha256(b"\x00" + c).digest() for c in chunks]
+        signed = header + merkle_root(leaves)
+        body = signed + b"".join(leaves)
+    signature = sign(signed, key_path) if key_path else b""
+    return body + signature, hashlib.sha512(signed).hexdigest()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Write a BloodHorn chunked image manifest")
+    parser.add_argument("--chunk-size", type=int, default=DEFAULT_CHUNK)
+    parser.add_argument("--sign", metavar="KEY", help="RSA-2048 private key (PEM) to sign with")
+    parser.add_argument("--flat", action="store_true", help="write a version 1 manifest without a Merkle tree")
+    parser.add_argument("-o", "--output", help="manifest path (default: <image>.bhm)")
+    parser.add_argument("--export-key", metavar="FILE", help="write the --sign key's public half for manifest_key")
+    parser.add_argument("image", nargs="?")
+    args = parser.parse_args()
+
+    if args.export_key:
+        if not args.sign:
+            sys.exit("--export-key needs --sign KEY")
+        with open(args.export_key, "wb") as f:
+            f.write(export_key(args.sign))
+        print(f"{args.export_key}: public key")
+    if not args.image:
+        if args.export_key:
+            return
+        parser.error("an image is required")
+
+    if not MIN_CHUNK <= args.chunk_size <= MAX_CHUNK:
+        sys.exit(f"chunk size must be between {MIN_CHUNK} and {MAX_CHUNK}")
+    with open(args.image, "rb") as f:
+        data = f.read()
+
+    manifest, digest = build(data, args.chunk_size, args.sign, args.flat)
+    output = args.output or args.image + ".bhm"
+    with open(output, "wb") as f:
+        f.write(manifest)
+    print(f"{output}: {(len(data) + args.chunk_size - 1) // args.chunk_size} chunks")
+    print(f"manifest digest (SHA-512): {digest}")
+
+
+if __name__ == "__main__":
+    main()
@@ -7,6 +7,7 @@
 
 #include "arp.h"
 #include "compat.h"
+#include "net_stats.h"
 #include <stdint.h>
 #include <string.h>
 static uint8_t arp_cache_ip[4];
@@ -24,21 +25,31 @@ int arp_resolve(const uint8_t* sender_mac, const uint8_t* sender_ip, const uint8
         memcpy(out_mac, arp_cache_mac, 6);
         return 0;
     }
+    struct net_counters* stats = net_stats_phase(NET_PHASE_ARP);
     uint8_t req[42];
     arp_build_request(req, sender_mac, sender_ip, target_ip);
+    net_stats_phase_begin(NET_PHASE_ARP);
     for (int retry = 0; retry < 3; ++retry) {
         send_ethernet(req, 42);
+        net_counters_tx(stats, 42);
+        if (retry > 0) stats->retransmits++;
+        uint32_t sent_at = net_stats_now();
         for (int t = 0; t < 10000; ++t) {
             uint8_t resp[60];
             int n = recv_ethernet(resp, 60);
+            if (n > 0) net_counters_rx(stats, n);
             if (n >= 42 && resp[12] == 0x08 && resp[13] == 0x06 && memcmp(resp+28, target_ip, 4) == 0) {
                 memcpy(arp_cache_ip, target_ip, 4);
                 memcpy(arp_cache_mac, resp+22, 6);
                 arp_cache_valid = 1;
                 memcpy(out_mac, resp+22, 6);
+                if (retry == 0) net_counters_rtt(stats, net_stats_elapsed_ms(sent_at, net_stats_now()));
+                net_stats_phase_end(NET_PHASE_ARP);
                 return 0;
             }
         }
+        stats->timeouts++;
     }
+    net_stats_phase_end(NET_PHASE_ARP);
     return -1;
 } 
\ No newline at end of file
@@ -7,54 +7,482 @@
 
 #include "dhcp.h"
 #include "compat.h"
+#include "net_stats.h"
 #include <stdint.h>
 #include <string.h>
-static uint8_t dhcp_options[312];
-static uint32_t dhcp_lease_time;
-static uint32_t dhcp_renew_time;
-static uint32_t dhcp_rebind_time;
+#include <stdio.h>
+
+extern int pxe_udp_broadcast(uint16_t src_port, uint16_t dest_port, const void* data, int len);
+extern int pxe_udp_recv(char* src_ip, uint16_t* src_port, void* buf, int maxlen, int timeout_ms);
+
+#define DHCP_POLL_SLICE_MS 100
+
+// Fixed BOOTP header offsets
+#define BOOTP_OP      0
+#define BOOTP_XID     4
+#define BOOTP_SECS    8
+#define BOOTP_FLAGS   10
+#define BOOTP_CIADDR  12
+#define BOOTP_YIADDR  16
+#define BOOTP_SIADDR  20
+#define BOOTP_CHADDR  28
+#define BOOTP_SNAME   44
+#define BOOTP_FILE    108
+#define BOOTP_MAGIC   236
+#define BOOTP_OPTIONS 240
+
+// Option codes we send or understand
+#define OPT_PAD           0
+#define OPT_SUBNET_MASK   1
+#define OPT_TIME_OFFSET   2
+#define OPT_ROUTER        3
+#define OPT_DNS           6
+#define OPT_DOMAIN_NAME   15
+#define OPT_BROADCAST     28
+#define OPT_NTP           42
+#define OPT_VENDOR        43
+#define OPT_REQUESTED_IP  50
+#define OPT_LEASE_TIME    51
+#define OPT_OVERLOAD      52
+#define OPT_MSG_TYPE      53
+#define OPT_SERVER_ID     54
+#define OPT_PARAM_LIST    55
+#define OPT_MAX_MSG_SIZE  57
+#define OPT_RENEW_TIME    58
+#define OPT_REBIND_TIME   59
+#define OPT_VENDOR_CLASS  60
+#define OPT_CLIENT_ID     61
+#define OPT_TFTP_SERVER   66
+#define OPT_BOOTFILE      67
+#define OPT_CLIENT_ARCH   93
+#define OPT_CLIENT_NDI    94
+#define OPT_END           255
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define DHCP_CLIENT_ARCH 0x0007
+#elif defined(__i386__) || defined(_M_IX86)
+#define DHCP_CLIENT_ARCH 0x0006
+#elif defined(__aarch64__)
+#define DHCP_CLIENT_ARCH 0x000B
+#elif defined(__arm__)
+#define DHCP_CLIENT_ARCH 0x000A
+#elif defined(__riscv) && __riscv_xlen == 64
+#define DHCP_CLIENT_ARCH 0x001B
+#elif defined(__loongarch64)
+#define DHCP_CLIENT_ARCH 0x0027
+#else
+#define DHCP_CLIENT_ARCH 0x0007
+#endif
+
+static const uint8_t dhcp_param_list[] = {
+    OPT_SUBNET_MASK, OPT_TIME_OFFSET, OPT_ROUTER, OPT_DNS, OPT_DOMAIN_NAME,
+    OPT_BROADCAST, OPT_NTP, OPT_VENDOR, OPT_LEASE_TIME, OPT_SERVER_ID,
+    OPT_RENEW_TIME, OPT_REBIND_TIME, OPT_VENDOR_CLASS, OPT_TFTP_SERVER, OPT_BOOTFILE
+};
+
+// Last OFFER seen through the legacy dhcp_parse_offer() entry point
+static struct dhcp_lease dhcp_last_offer;
+
+static uint32_t get_be32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put_be16(uint8_t* p, uint16_t v) {
+    p[0] = (uint8_t)(v >> 8); p[1] = (uint8_t)v;
+}
+
+static void copy_option_string(char* dst, int dstlen, const uint8_t* src, int len) {
+    if (len > dstlen - 1) len = dstlen - 1;
+    memcpy(dst, src, len);
+    dst[len] = 0;
+    // Some servers include the terminating NUL in the option length
+    while (len > 0 && dst[len - 1] == 0) len--;
+}
+
+static int dhcp_header(uint8_t* buf, uint32_t xid, const uint8_t* mac, uint16_t secs) {
+    memset(buf, 0, DHCP_PACKET_MIN);
+    buf[BOOTP_OP] = 1; buf[1] = 1; buf[2] = 6; buf[3] = 0;
+    memcpy(&buf[BOOTP_XID], &xid, 4);
+    put_be16(&buf[BOOTP_SECS], secs);
+    put_be16(&buf[BOOTP_FLAGS], 0x8000); // We cannot receive unicast before configuring the stack
+    if (mac) memcpy(&buf[BOOTP_CHADDR], mac, 6);
+    buf[BOOTP_MAGIC] = 99; buf[BOOTP_MAGIC + 1] = 130; buf[BOOTP_MAGIC + 2] = 83; buf[BOOTP_MAGIC + 3] = 99;
+    return BOOTP_OPTIONS;
+}
+
+static int dhcp_put_option(uint8_t* buf, int opt, int maxlen, uint8_t code, const void* data, int len) {
+    if (opt + 2 + len + 1 > maxlen) return opt; // always keep room for OPT_END
+    buf[opt++] = code;
+    buf[opt++] = (uint8_t)len;
+    memcpy(buf + opt, data, len);
+    return opt + len;
+}
+
+static int dhcp_put_pxe_options(uint8_t* buf, int opt, int maxlen, const uint8_t* mac, uint16_t arch) {
+    uint8_t tmp[8];
+    char vendor[40];
+
+    put_be16(tmp, DHCP_PACKET_MAX);
+    opt = dhcp_put_option(buf, opt, maxlen, OPT_MAX_MSG_SIZE, tmp, 2);
+
+    if (mac) {
+        tmp[0] = 1; memcpy(tmp + 1, mac, 6);
+        opt = dhcp_put_option(buf, opt, maxlen, OPT_CLIENT_ID, tmp, 7);
+    }
+
+    put_be16(tmp, arch);
+    opt = dhcp_put_option(buf, opt, maxlen, OPT_CLIENT_ARCH, tmp, 2);
+    tmp[0] = 1; tmp[1] = 3; tmp[2] = 16; // UNDI 3.16
+    opt = dhcp_put_option(buf, opt, maxlen, OPT_CLIENT_NDI, tmp, 3);
+
+    int n = snprintf(vendor, sizeof(vendor), "PXEClient:Arch:%05u:UNDI:003016", arch);
+    opt = dhcp_put_option(buf, opt, maxlen, OPT_VENDOR_CLASS, vendor, n);
+
+    return dhcp_put_option(buf, opt, maxlen, OPT_PARAM_LIST, dhcp_param_list, sizeof(dhcp_param_list));
+}
+
+static int dhcp_finish(uint8_t* buf, int opt) {
+    buf[opt++] = OPT_END;
+    return opt < DHCP_PACKET_MIN ? DHCP_PACKET_MIN : opt;
+}
+
 int dhcp_build_discover(uint8_t* buf, int xid) {
-    memset(buf, 0, 300);
-    buf[0] = 1; buf[1] = 1; buf[2] = 6; buf[3] = 0;
-    *(uint32_t*)&buf[4] = xid;
-    buf[236] = 99; buf[237] = 130; buf[238] = 83; buf[239] = 99;
-    int opt = 240;
-    buf[opt++] = 53; buf[opt++] = 1; buf[opt++] = 1;
-    buf[opt++] = 55; buf[opt++] = 4; buf[opt++] = 1; buf[opt++] = 3; buf[opt++] = 6; buf[opt++] = 15;
-    buf[opt++] = 255;
-    return opt;
+    int opt = dhcp_header(buf, (uint32_t)xid, NULL, 0);
+    uint8_t type = DHCP_DISCOVER;
+    opt = dhcp_put_option(buf, opt, DHCP_PACKET_MAX, OPT_MSG_TYPE, &type, 1);
+    opt = dhcp_put_pxe_options(buf, opt, DHCP_PACKET_MAX, NULL, DHCP_CLIENT_ARCH);
+    return dhcp_finish(buf, opt);
 }
-int dhcp_parse_offer(const uint8_t* buf, uint32_t* offered_ip) {
-    *offered_ip = *(uint32_t*)&buf[16];
-    memcpy(dhcp_options, buf+240, 312);
-    for (int i = 0; i < 312;) {
-        uint8_t code = dhcp_options[i++];
-        if (code == 0xFF) break;
-        uint8_t len = dhcp_options[i++];
-        if (code == 51) dhcp_lease_time = *(uint32_t*)&dhcp_options[i];
-        if (code == 58) dhcp_renew_time = *(uint32_t*)&dhcp_options[i];
-        if (code == 59) dhcp_rebind_time = *(uint32_t*)&dhcp_options[i];
-        i += len;
+
+// Walk one option area. Returns -1 on a malformed area, otherwise ORs any
+// option-overload request into *overload.
+static int dhcp_walk_options(const uint8_t* opts, int len, uint8_t* msg_type,
+                             struct dhcp_lease* lease, uint8_t* overload) {
+    int i = 0;
+    while (i < len) {
+        uint8_t code = opts[i++];
+        if (code == OPT_PAD) continue;
+        if (code == OPT_END) return 0;
+        if (i >= len) return -1;
+        uint8_t olen = opts[i++];
+        if (i + olen > len) return -1;
+        const uint8_t* v = opts + i;
+
+        switch (code) {
+        case OPT_MSG_TYPE:    if (olen >= 1) *msg_type = v[0]; break;
+        case OPT_SUBNET_MASK: if (olen >= 4) memcpy(&lease->subnet_mask, v, 4); break;
+        case OPT_ROUTER:      if (olen >= 4) memcpy(&lease->router_ip, v, 4); break;
+        case OPT_DNS:         if (olen >= 4) memcpy(&lease->dns_server, v, 4); break;
+        case OPT_BROADCAST:   if (olen >= 4) memcpy(&lease->broadcast_ip, v, 4); break;
+        case OPT_NTP:         if (olen >= 4) memcpy(&lease->ntp_server, v, 4); break;
+        case OPT_SERVER_ID:   if (olen >= 4) memcpy(&lease->server_id, v, 4); break;
+        case OPT_TIME_OFFSET: if (olen >= 4) lease->time_offset = (int32_t)get_be32(v); break;
+        case OPT_LEASE_TIME:  if (olen >= 4) lease->lease_time = get_be32(v); break;
+        case OPT_RENEW_TIME:  if (olen >= 4) lease->renew_time = get_be32(v); break;
+        case OPT_REBIND_TIME: if (olen >= 4) lease->rebind_time = get_be32(v); break;
+        case OPT_OVERLOAD:    if (olen >= 1) *overload |= v[0] & 3; break;
+        case OPT_DOMAIN_NAME:
+            copy_option_string(lease->domain_name, sizeof(lease->domain_name), v, olen);
+            break;
+        case OPT_VENDOR_CLASS:
+            copy_option_string(lease->vendor_class, sizeof(lease->vendor_class), v, olen);
+            break;
+        case OPT_TFTP_SERVER:
+            copy_option_string(lease->tftp_server, sizeof(lease->tftp_server), v, olen);
+            break;
+        case OPT_BOOTFILE:
+            copy_option_string(lease->boot_file, sizeof(lease->boot_file), v, olen);
+            break;
+        case OPT_VENDOR: {
+            int n = olen > (int)sizeof(lease->vendor_opts) ? (int)sizeof(lease->vendor_opts) : olen;
+            memcpy(lease->vendor_opts, v, n);
+            lease->vendor_opts_len = (uint8_t)n;
+            break;
+        }
+        default:
+            break;
+        }
+        i += olen;
     }
     return 0;
 }
+
+int dhcp_parse_packet(const uint8_t* buf, int len, uint32_t xid, uint8_t* msg_type, struct dhcp_lease* lease) {
+    if (!buf || !lease || !msg_type || len < BOOTP_OPTIONS + 1) return -1;
+    if (buf[BOOTP_OP] != 2) return -1; // BOOTREPLY
+    if (xid && memcmp(&buf[BOOTP_XID], &xid, 4) != 0) return -1;
+    if (buf[BOOTP_MAGIC] != 99 || buf[BOOTP_MAGIC + 1] != 130 ||
+        buf[BOOTP_MAGIC + 2] != 83 || buf[BOOTP_MAGIC + 3] != 99) return -1;
+
+    memset(lease, 0, sizeof(*lease));
+    lease->version = DHCP_LEASE_VERSION;
+    memcpy(&lease->client_ip, &buf[BOOTP_YIADDR], 4);
+    memcpy(&lease->next_server, &buf[BOOTP_SIADDR], 4);
+    memcpy(lease->client_mac, &buf[BOOTP_CHADDR], 6);
+
+    *msg_type = 0;
+    uint8_t overload = 0;
+    if (dhcp_walk_options(buf + BOOTP_OPTIONS, len - BOOTP_OPTIONS, msg_type, lease, &overload) != 0) return -1;
+
+    // RFC 2132 9.3: the file field is parsed before sname when both are overloaded
+    if (overload & 1) {
+        if (dhcp_walk_options(buf + BOOTP_FILE, 128, msg_type, lease, &overload) != 0) return -1;
+    } else if (!lease->boot_file[0] && buf[BOOTP_FILE]) {
+        copy_option_string(lease->boot_file, sizeof(lease->boot_file), buf + BOOTP_FILE, 128);
+    }
+    if (overload & 2) {
+        if (dhcp_walk_options(buf + BOOTP_SNAME, 64, msg_type, lease, &overload) != 0) return -1;
+    } else if (!lease->tftp_server[0] && buf[BOOTP_SNAME]) {
+        copy_option_string(lease->tftp_server, sizeof(lease->tftp_server), buf + BOOTP_SNAME, 64);
+    }
+
+    // Plain BOOTP replies carry no option 53
+    if (*msg_type == 0) *msg_type = DHCP_ACK;
+
+    // Defaults from RFC 2131 4.4.5 when the server omits T1/T2
+    if (lease->lease_time && !lease->renew_time) lease->renew_time = lease->lease_time / 2;
+    if (lease->lease_time && !lease->rebind_time) lease->rebind_time = (uint32_t)((uint64_t)lease->lease_time * 7 / 8);
+    if (!lease->server_id) lease->server_id = lease->next_server;
+    return 0;
+}
+
+int dhcp_parse_offer(const uint8_t* buf, uint32_t* offered_ip) {
+    uint8_t type = 0;
+    if (dhcp_parse_packet(buf, BOOTP_OPTIONS + 312, 0, &type, &dhcp_last_offer) != 0) return -1;
+    if (type != DHCP_OFFER) return -1;
+    *offered_ip = dhcp_last_offer.client_ip;
+    return 0;
+}
+
+// REQUEST in RENEWING state: ciaddr set, no server identifier or requested IP
 int dhcp_renew(uint8_t* buf, int xid) {
-    memset(buf, 0, 300);
-    buf[0] = 1; buf[1] = 1; buf[2] = 6; buf[3] = 0;
-    *(uint32_t*)&buf[4] = xid;
-    buf[236] = 99; buf[237] = 130; buf[238] = 83; buf[239] = 99;
-    int opt = 240;
-    buf[opt++] = 53; buf[opt++] = 1; buf[opt++] = 5;
-    buf[opt++] = 255;
-    return opt;
+    int opt = dhcp_header(buf, (uint32_t)xid, dhcp_last_offer.client_mac, 0);
+    memcpy(&buf[BOOTP_CIADDR], &dhcp_last_offer.client_ip, 4);
+    put_be16(&buf[BOOTP_FLAGS], 0);
+    uint8_t type = DHCP_REQUEST;
+    opt = dhcp_put_option(buf, opt, DHCP_PACKET_MAX, OPT_MSG_TYPE, &type, 1);
+    return dhcp_finish(buf, opt);
 }
+
 int dhcp_release(uint8_t* buf, int xid) {
-    memset(buf, 0, 300);
-    buf[0] = 1; buf[1] = 1; buf[2] = 6; buf[3] = 0;
-    *(uint32_t*)&buf[4] = xid;
-    buf[236] = 99; buf[237] = 130; buf[238] = 83; buf[239] = 99;
-    int opt = 240;
-    buf[opt++] = 53; buf[opt++] = 1; buf[opt++] = 7;
-    buf[opt++] = 255;
-    return opt;
-} 
\ No newline at end of file
+    int opt = dhcp_header(buf, (uint32_t)xid, dhcp_last_offer.client_mac, 0);
+    memcpy(&buf[BOOTP_CIADDR], &dhcp_last_offer.client_ip, 4);
+    put_be16(&buf[BOOTP_FLAGS], 0);
+    uint8_t type = DHCP_RELEASE;
+    opt = dhcp_put_option(buf, opt, DHCP_PACKET_MAX, OPT_MSG_TYPE, &type, 1);
+    if (dhcp_last_offer.server_id) {
+        opt = dhcp_put_option(buf, opt, DHCP_PACKET_MAX, OPT_SERVER_ID, &dhcp_last_offer.server_id, 4);
+    }
+    return dhcp_finish(buf, opt);
+}
+
+int dhcp_lease_valid(const struct dhcp_lease* lease, const uint8_t* mac) {
+    if (!lease || lease->version != DHCP_LEASE_VERSION || lease->client_ip == 0) return 0;
+    if (mac && memcmp(lease->client_mac, mac, 6) != 0) return 0;
+    return 1;
+}
+
+static void dhcp_enter(struct dhcp_client* client, enum dhcp_state state) {
+    client->state = state;
+    client->attempt = 0;
+    client->timeout_ms = DHCP_INITIAL_TIMEOUT_MS;
+}
+
+void dhcp_client_init(struct dhcp_client* client, const uint8_t* mac, uint32_t xid, const struct dhcp_lease* cached) {
+    memset(client, 0, sizeof(*client));
+    memcpy(client->mac, mac, 6);
+    client->xid = xid;
+    client->arch = DHCP_CLIENT_ARCH;
+    client->rng = xid ^ 0x9E3779B9u;
+
+    // A lease cached by a previous boot lets us skip DISCOVER/OFFER entirely
+    if (cached && dhcp_lease_valid(cached, mac)) {
+        client->lease = *cached;
+        dhcp_enter(client, DHCP_STATE_INIT_REBOOT);
+    } else {
+        dhcp_enter(client, DHCP_STATE_INIT);
+    }
+}
+
+int dhcp_client_build(struct dhcp_client* client, uint8_t* buf, int maxlen) {
+    if (!client || !buf || maxlen < DHCP_PACKET_MIN) return -1;
+
+    uint16_t secs = (uint16_t)(client->elapsed_ms / 1000);
+    int opt = dhcp_header(buf, client->xid, client->mac, secs);
+    uint8_t type;
+
+    switch (client->state) {
+    case DHCP_STATE_INIT:
+    case DHCP_STATE_SELECTING:
+        type = DHCP_DISCOVER;
+        opt = dhcp_put_option(buf, opt, maxlen, OPT_MSG_TYPE, &type, 1);
+        break;
+    case DHCP_STATE_REQUESTING:
+        type = DHCP_REQUEST;
+        opt = dhcp_put_option(buf, opt, maxlen, OPT_MSG_TYPE, &type, 1);
+        opt = dhcp_put_option(buf, opt, maxlen, OPT_REQUESTED_IP, &client->offer.client_ip, 4);
+        opt = dhcp_put_option(buf, opt, maxlen, OPT_SERVER_ID, &client->offer.server_id, 4);
+        break;
+    case DHCP_STATE_INIT_REBOOT:
+    case DHCP_STATE_REBOOTING:
+        // RFC 2131 4.3.2: INIT-REBOOT requests carry the old address but no server id
+        type = DHCP_REQUEST;
+        opt = dhcp_put_option(buf, opt, maxlen, OPT_MSG_TYPE, &type, 1);
+        opt = dhcp_put_option(buf, opt, maxlen, OPT_REQUESTED_IP, &client->lease.client_ip, 4);
+        break;
+    default:
+        return -1;
+    }
+
+    opt = dhcp_put_pxe_options(buf, opt, maxlen, client->mac, client->arch);
+    return dhcp_finish(buf, opt);
+}
+
+static void dhcp_bind(struct dhcp_client* client, const struct dhcp_lease* ack) {
+    client->lease = *ack;
+    memcpy(client->lease.client_mac, client->mac, 6);
+    dhcp_enter(client, DHCP_STATE_BOUND);
+}
+
+enum dhcp_state dhcp_client_input(struct dhcp_client* client, const uint8_t* buf, int len) {
+    struct dhcp_lease reply;
+    uint8_t type = 0;
+
+    if (dhcp_parse_packet(buf, len, client->xid, &type, &reply) != 0) return client->state;
+    if (memcmp(reply.client_mac, client->mac, 6) != 0) return client->state;
+
+    switch (client->state) {
+    case DHCP_STATE_INIT:
+    case DHCP_STATE_SELECTING:
+        // Take the first usable offer; PXE proxy offers without yiaddr are ignored here
+        if (type == DHCP_OFFER && reply.client_ip != 0) {
+            client->offer = reply;
+            dhcp_enter(client, DHCP_STATE_REQUESTING);
+        }
+        break;
+    case DHCP_STATE_REQUESTING:
+        if (type == DHCP_ACK && reply.client_ip != 0 &&
+            (reply.server_id == 0 || reply.server_id == client->offer.server_id)) {
+            // Options missing from the ACK fall back to what the OFFER told us
+            if (!reply.boot_file[0]) memcpy(reply.boot_file, client->offer.boot_file, sizeof(reply.boot_file));
+            if (!reply.tftp_server[0]) memcpy(reply.tftp_server, client->offer.tftp_server, sizeof(reply.tftp_server));
+            if (!reply.next_server) reply.next_server = client->offer.next_server;
+            if (!reply.server_id) reply.server_id = client->offer.server_id;
+            dhcp_bind(client, &reply);
+        } else if (type == DHCP_NAK && reply.server_id == client->offer.server_id) {
+            dhcp_enter(client, DHCP_STATE_INIT);
+        }
+        break;
+    case DHCP_STATE_INIT_REBOOT:
+    case DHCP_STATE_REBOOTING:
+        if (type == DHCP_ACK && reply.client_ip == client->lease.client_ip) {
+            dhcp_bind(client, &reply);
+        } else if (type == DHCP_NAK) {
+            // Moved to another network since the lease was cached
+            memset(&client->lease, 0, sizeof(client->lease));
+            dhcp_enter(client, DHCP_STATE_INIT);
+        }
+        break;
+    default:
+        break;
+    }
+    return client->state;
+}
+
+enum dhcp_state dhcp_client_timeout(struct dhcp_client* client) {
+    client->attempt++;
+
+    switch (client->state) {
+    case DHCP_STATE_INIT:
+    case DHCP_STATE_SELECTING:
+        if (client->attempt >= DHCP_MAX_DISCOVER) { client->state = DHCP_STATE_FAILED; return client->state; }
+        client->state = DHCP_STATE_SELECTING;
+        break;
+    case DHCP_STATE_REQUESTING:
+        if (client->attempt >= DHCP_MAX_REQUEST) { dhcp_enter(client, DHCP_STATE_INIT); return client->state; }
+        break;
+    case DHCP_STATE_INIT_REBOOT:
+    case DHCP_STATE_REBOOTING:
+        // Nobody answered for the cached address; do a full exchange instead
+        if (client->attempt >= DHCP_MAX_REBOOT) { dhcp_enter(client, DHCP_STATE_INIT); return client->state; }
+        client->state = DHCP_STATE_REBOOTING;
+        break;
+    default:
+        return client->state;
+    }
+
+    // Exponential backoff, randomized by +/- 1 second (RFC 2131 4.1)
+    client->timeout_ms *= 2;
+    if (client->timeout_ms > DHCP_MAX_TIMEOUT_MS) client->timeout_ms = DHCP_MAX_TIMEOUT_MS;
+    client->rng ^= client->rng << 13;
+    client->rng ^= client->rng >> 17;
+    client->rng ^= client->rng << 5;
+    client->timeout_ms = client->timeout_ms - 1000 + (client->rng % 2001);
+    return client->state;
+}
+
+enum dhcp_state dhcp_client_accept_ack(struct dhcp_client* client, const uint8_t* buf, int len) {
+    struct dhcp_lease reply;
+    uint8_t type = 0;
+
+    // The firmware's cached ACK belongs to its own transaction, so skip the xid check
+    if (dhcp_parse_packet(buf, len, 0, &type, &reply) != 0) return client->state;
+    if (type != DHCP_ACK || reply.client_ip == 0) return client->state;
+    if (memcmp(reply.client_mac, client->mac, 6) != 0) return client->state;
+
+    dhcp_bind(client, &reply);
+    return client->state;
+}
+
+int dhcp_client_run(struct dhcp_client* client) {
+    struct net_counters* stats = net_stats_phase(NET_PHASE_DHCP);
+    uint8_t pkt[DHCP_PACKET_MAX];
+    char src_ip[16];
+    uint16_t src_port;
+    int result = -1;
+
+    net_stats_phase_begin(NET_PHASE_DHCP);
+    while (client->state != DHCP_STATE_BOUND && client->state != DHCP_STATE_FAILED) {
+        if (client->transmissions >= DHCP_MAX_TRANSMIT) {
+            client->state = DHCP_STATE_FAILED;
+            break;
+        }
+        int len = dhcp_client_build(client, pkt, sizeof(pkt));
+        if (len < 0) goto out;
+        // Not bound yet, so 0.0.0.0:68 to the limited broadcast address (RFC 2131 4.1)
+        if (pxe_udp_broadcast(DHCP_CLIENT_PORT, DHCP_SERVER_PORT, pkt, len) < 0) goto out;
+        client->transmissions++;
+        net_counters_tx(stats, len);
+        if (client->attempt > 0) stats->retransmits++;
+
+        enum dhcp_state sent_in = client->state;
+        int first_try = client->attempt == 0;
+        uint32_t sent_at = net_stats_now();
+        uint32_t waited = 0;
+        while (waited < client->timeout_ms && client->state == sent_in) {
+            uint32_t slice = client->timeout_ms - waited;
+            if (slice > DHCP_POLL_SLICE_MS) slice = DHCP_POLL_SLICE_MS;
+            int n = pxe_udp_recv(src_ip, &src_port, pkt, sizeof(pkt), (int)slice);
+            // Replies from other clients' exchanges return early, so go by the clock
+            waited = net_stats_elapsed_ms(sent_at, net_stats_now());
+            if (n > 0 && src_port == DHCP_SERVER_PORT) {
+                net_counters_rx(stats, n);
+                dhcp_client_input(client, pkt, n);
+            }
+        }
+        client->elapsed_ms += waited;
+
+        // A state change means the reply moved us forward; send the next message at once
+        if (client->state == sent_in) {
+            stats->timeouts++;
+            dhcp_client_timeout(client);
+        } else if (first_try) {
+            net_counters_rtt(stats, net_stats_elapsed_ms(sent_at, net_stats_now()));
+        }
+    }
+    result = client->state == DHCP_STATE_BOUND ? 0 : -1;
+
+out:
+    net_stats_phase_end(NET_PHASE_DHCP);
+    return result;
+}
@@ -9,6 +9,105 @@
 #define BLOODHORN_DHCP_H
 #include <stdint.h>
 #include "compat.h"
+
+#define DHCP_SERVER_PORT        67
+#define DHCP_CLIENT_PORT        68
+
+// BOOTP minimum and the largest message we advertise via option 57
+#define DHCP_PACKET_MIN         300
+#define DHCP_PACKET_MAX         576
+
+// RFC 2131 4.1: 4s initial retransmission, doubling up to 64s
+#define DHCP_INITIAL_TIMEOUT_MS 4000
+#define DHCP_MAX_TIMEOUT_MS     64000
+#define DHCP_MAX_DISCOVER       5
+#define DHCP_MAX_REQUEST        3
+#define DHCP_MAX_REBOOT         2
+// Every message of one run, so NAKs and REQUEST timeouts sending us back to INIT still end
+#define DHCP_MAX_TRANSMIT       16
+
+#define DHCP_LEASE_VERSION      1
+
+// DHCP message types (option 53)
+enum dhcp_msg_type {
+    DHCP_DISCOVER = 1,
+    DHCP_OFFER    = 2,
+    DHCP_REQUEST  = 3,
+    DHCP_DECLINE  = 4,
+    DHCP_ACK      = 5,
+    DHCP_NAK      = 6,
+    DHCP_RELEASE  = 7,
+    DHCP_INFORM   = 8
+};
+
+// Client states (RFC 2131 figure 5, minus RENEWING/REBINDING which never
+// happen during a single boot)
+enum dhcp_state {
+    DHCP_STATE_INIT = 0,
+    DHCP_STATE_SELECTING,
+    DHCP_STATE_REQUESTING,
+    DHCP_STATE_INIT_REBOOT,
+    DHCP_STATE_REBOOTING,
+    DHCP_STATE_BOUND,
+    DHCP_STATE_FAILED
+};
+
+// Everything we keep from an OFFER/ACK. Addresses are stored exactly as they
+// appear on the wire (network byte order); timers are in host order seconds.
+// The layout is persisted in a UEFI variable, so only append fields and bump
+// DHCP_LEASE_VERSION when it changes.
+struct dhcp_lease {
+    uint32_t version;
+    uint32_t client_ip;
+    uint32_t server_id;
+    uint32_t next_server;
+    uint32_t subnet_mask;
+    uint32_t router_ip;
+    uint32_t dns_server;
+    uint32_t broadcast_ip;
+    uint32_t ntp_server;
+    int32_t time_offset;
+    uint32_t lease_time;
+    uint32_t renew_time;
+    uint32_t rebind_time;
+    uint8_t client_mac[6];
+    uint8_t vendor_opts_len;
+    uint8_t reserved;
+    char tftp_server[64];
+    char boot_file[128];
+    char domain_name[64];
+    char vendor_class[64];
+    uint8_t vendor_opts[64];
+};
+
+struct dhcp_client {
+    enum dhcp_state state;
+    uint32_t xid;
+    uint8_t mac[6];
+    uint16_t arch;              // Client system architecture (option 93)
+    uint32_t attempt;           // Transmissions in the current state
+    uint32_t transmissions;     // Transmissions since dhcp_client_init()
+    uint32_t timeout_ms;        // Current retransmission timeout
+    uint32_t elapsed_ms;        // Time since we started, for the secs field
+    uint32_t rng;               // Backoff jitter state
+    struct dhcp_lease offer;    // Selected OFFER while REQUESTING
+    struct dhcp_lease lease;    // Bound lease
+};
+
+// Packet level helpers
 int dhcp_build_discover(uint8_t* buf, int xid);
 int dhcp_parse_offer(const uint8_t* buf, uint32_t* offered_ip);
-#endif 
\ No newline at end of file
+int dhcp_renew(uint8_t* buf, int xid);
+int dhcp_release(uint8_t* buf, int xid);
+int dhcp_parse_packet(const uint8_t* buf, int len, uint32_t xid, uint8_t* msg_type, struct dhcp_lease* lease);
+
+// State machine
+void dhcp_client_init(struct dhcp_client* client, const uint8_t* mac, uint32_t xid, const struct dhcp_lease* cached);
+int dhcp_client_build(struct dhcp_client* client, uint8_t* buf, int maxlen);
+enum dhcp_state dhcp_client_input(struct dhcp_client* client, const uint8_t* buf, int len);
+enum dhcp_state dhcp_client_timeout(struct dhcp_client* client);
+enum dhcp_state dhcp_client_accept_ack(struct dhcp_client* client, const uint8_t* buf, int len);
+int dhcp_client_run(struct dhcp_client* client);
+int dhcp_lease_valid(const struct dhcp_lease* lease, const uint8_t* mac);
+
+#endif
@@ -0,0 +1,365 @@
+/*
+ * download.c
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#include "download.h"
+#include "compat.h"
+#include "compress/load.h"
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+extern int pxe_udp_send_from(uint16_t src_port, const char* dest_ip, uint16_t dest_port, const void* data, int len);
+extern int pxe_udp_recv_any(char* src_ip, uint16_t* src_port, uint16_t* dest_port, void* buf, int maxlen, int timeout_ms);
+
+#define NET_DOWNLOAD_INITIAL_CAPACITY (1024 * 1024)
+
+static int download_reserve(void* ctx, uint32_t size) {
+    struct net_download* dl = (struct net_download*)ctx;
+    if (size > NET_DOWNLOAD_MAX_SIZE) return -1;
+    // The buffer is sized on the first block, once we know whether it is compressed
+    dl->expected = size;
+    return 0;
+}
+
+// The decoder writes straight into dl->data; everything decoded so far is
+// also its match window, so the compressed bytes are never kept around
+static int download_decomp_start(struct net_download* dl, const uint8_t* data, int len) {
+    uint64_t cap = decomp_content_size(data, (uint32_t)len);
+    if (cap > NET_DOWNLOAD_MAX_SIZE) return -1;
+    if (cap == 0) {
+        cap = dl->expected ? (uint64_t)dl->expected * 4 : NET_DOWNLOAD_INITIAL_CAPACITY;
+        if (cap > NET_DOWNLOAD_MAX_SIZE) cap = NET_DOWNLOAD_MAX_SIZE;
+    }
+
+    dl->data = (uint8_t*)malloc((size_t)cap);
+    if (!dl->data) return -1;
+    dl->capacity = (uint32_t)cap;
+
+    dl->decomp = (struct decomp_stream*)malloc(sizeof(*dl->decomp));
+    if (!dl->decomp) return -1;
+    if (decomp_init(dl->decomp, dl->format, dl->data, cap, DECOMP_F_GROW) != DECOMP_OK) {
+        decomp_free(dl->decomp);
+        free(dl->decomp);
+        dl->decomp = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static void download_decomp_end(struct net_download* dl) {
+    if (!dl->decomp) return;
+    decomp_free(dl->decomp);
+    free(dl->decomp);
+    dl->decomp = NULL;
+}
+
+static int download_decomp_write(struct net_download* dl, const uint8_t* data, int len) {
+    struct decomp_stream* s = dl->decomp;
+    int r = decomp_feed(s, data, (uint32_t)len);
+
+    // The decoder may have moved the buffer even when it fails
+    dl->data = s->out;
+    dl->capacity = (uint32_t)s->out_cap;
+    if (r < 0 || s->out_pos > NET_DOWNLOAD_MAX_SIZE) return -1;
+    dl->size = (uint32_t)s->out_pos;
+    return 0;
+}
+
+// Ciphertext lands at its plaintext offset in dl->data and is decrypted
+// there as each chunk completes
+static int download_payload_start(struct net_download* dl, const uint8_t* data, int len) {
+    struct payload_header hdr;
+    if (payload_parse_header(data, (uint32_t)len, &hdr) != 0) return -1;
+    if (hdr.payload_size > NET_DOWNLOAD_MAX_SIZE) return -1;
+
+    dl->data = (uint8_t*)malloc((size_t)hdr.payload_size);
+    if (!dl->data) return -1;
+    dl->capacity = (uint32_t)hdr.payload_size;
+
+    dl->payload = (struct payload_stream*)malloc(sizeof(*dl->payload));
+    if (!dl->payload) return -1;
+    if (payload_stream_init(dl->payload, data, (uint32_t)len, dl->data) != 0) {
+        free(dl->payload);
+        dl->payload = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static void download_payload_end(struct net_download* dl) {
+    if (!dl->payload) return;
+    payload_stream_free(dl->payload);
+    free(dl->payload);
+    dl->payload = NULL;
+}
+
+// Every chunk must have verified; a compressed image inside is expanded now
+static int download_payload_finish(struct net_download* dl) {
+    if (payload_stream_finish(dl->payload) != 0) return -1;
+    dl->size = (uint32_t)dl->payload->hdr.payload_size;
+    download_payload_end(dl);
+
+    if (decomp_detect(dl->data, dl->size) == DECOMP_FORMAT_NONE) return 0;
+
+    uint8_t* out;
+    uint32_t out_size;
+    if (decomp_load_buffer(dl->data, dl->size, &out, &out_size, &dl->format) != 0) return -1;
+    free(dl->data);
+    dl->data = out;
+    dl->size = dl->capacity = out_size;
+    return 0;
+}
+
+// Everything below sees verified bytes only, each exactly once and in order
+static int download_accept(struct net_download* dl, uint32_t offset, const uint8_t* data, int len) {
+    uint64_t end = (uint64_t)offset + (uint32_t)len;
+    if (end > NET_DOWNLOAD_MAX_SIZE) return -1;
+
+    if (offset == 0) {
+        dl->format = dl->raw ? DECOMP_FORMAT_NONE : decomp_detect(data, (uint32_t)len);
+        if (!dl->raw && payload_detect(data, (uint32_t)len)) {
+            if (download_payload_start(dl, data, len) != 0) return -1;
+        } else if (dl->format != DECOMP_FORMAT_NONE) {
+            if (download_decomp_start(dl, data, len) != 0) return -1;
+        } else {
+            dl->capacity = dl->expected ? dl->expected : NET_DOWNLOAD_INITIAL_CAPACITY;
+            dl->data = (uint8_t*)malloc(dl->capacity);
+            if (!dl->data) return -1;
+        }
+    }
+    if (dl->decomp) return download_decomp_write(dl, data, len);
+    if (dl->payload) return payload_stream_feed(dl->payload, data, (uint32_t)len);
+
+    if (end > dl->capacity) {
+        // tsize was missing or wrong; grow geometrically, up to the limit
+        uint64_t cap = dl->capacity ? dl->capacity : NET_DOWNLOAD_INITIAL_CAPACITY;
+        while (cap < end) cap *= 2;
+        if (cap > NET_DOWNLOAD_MAX_SIZE) cap = NET_DOWNLOAD_MAX_SIZE;
+        uint8_t* grown = (uint8_t*)realloc(dl->data, (size_t)cap);
+        if (!grown) return -1;
+        dl->data = grown;
+        dl->capacity = (uint32_t)cap;
+    }
+    memcpy(dl->data + offset, data, len);
+    dl->size = (uint32_t)end;
+    return 0;
+}
+
+static int download_verified(void* ctx, uint64_t offset, const uint8_t* data, uint32_t len) {
+    return download_accept((struct net_download*)ctx, (uint32_t)offset, data, (int)len);
+}
+
+static int download_verify_start(struct net_download* dl) {
+    if (dl->manifest->hdr.image_size > NET_DOWNLOAD_MAX_SIZE) return -1;
+    dl->verify = (struct manifest_stream*)malloc(sizeof(*dl->verify));
+    if (!dl->verify) return -1;
+    if (manifest_stream_init(dl->verify, dl->manifest, download_verified, dl) != 0) {
+        free(dl->verify);
+        dl->verify = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static void download_verify_end(struct net_download* dl) {
+    if (!dl->verify) return;
+    manifest_stream_free(dl->verify);
+    free(dl->verify);
+    dl->verify = NULL;
+}
+
+static int download_write(void* ctx, uint32_t offset, const uint8_t* data, int len) {
+    struct net_download* dl = (struct net_download*)ctx;
+    dl->received = offset + (uint32_t)len;
+    if (!dl->verify) return download_accept(dl, offset, data, len);
+
+    // A retry starts over at offset 0; the stream skips what it already has
+    if (offset != dl->verify->pos) return -1;
+    return manifest_stream_feed(dl->verify, data, (uint32_t)len);
+}
+
+static int download_send(struct net_download* dl, const char* server, uint16_t port, int retransmit) {
+    uint8_t pkt[TFTP_MAX_PACKET];
+    int len = tftp_session_build(&dl->session, pkt, sizeof(pkt));
+    if (len < 0) return -1;
+    if (pxe_udp_send_from(dl->session.local_port, server, port, pkt, len) < 0) return -1;
+
+    net_counters_tx(dl->session.stats, len);
+    dl->rtt_pending = !retransmit;
+    dl->rtt_start = net_stats_now();
+    return 0;
+}
+
+static int download_start(struct net_download* dl, const char* server, int slot) {
+    struct tftp_sink sink = { download_reserve, download_write, dl };
+    if (tftp_session_init(&dl->session, server, dl->path, (uint16_t)(NET_DOWNLOAD_BASE_PORT + slot), &sink) != 0) {
+        return -1;
+    }
+    dl->session.stats = dl->stats ? &dl->stats->counters : NULL;
+    return download_send(dl, server, TFTP_SERVER_PORT, 0);
+}
+
+static void download_report(struct net_download* dl, net_download_progress_fn progress, void* ctx) {
+    if (!progress) return;
+    if (dl->status == NET_DOWNLOAD_ACTIVE && dl->received - dl->reported < NET_DOWNLOAD_PROGRESS_STEP) return;
+    dl->reported = dl->received;
+    progress(dl, ctx);
+}
+
+// Move a session that just finished or failed into its final status
+static int download_settle(struct net_download* dl, const char* server, int slot,
+                           net_download_progress_fn progress, void* ctx) {
+    if (dl->status != NET_DOWNLOAD_ACTIVE) return 0;
+    if (dl->session.state == TFTP_SESSION_DONE) {
+        // Every chunk of the manifest must have turned up and verified
+        if (dl->verify && manifest_stream_finish(dl->verify) != 0) {
+            dl->session.state = TFTP_SESSION_ERROR;
+        }
+        // A compressed file must also end on a complete, verified frame
+        if (dl->decomp && decomp_finish(dl->decomp) != DECOMP_DONE) {
+            dl->session.state = TFTP_SESSION_ERROR;
+        }
+        if (dl->payload && download_payload_finish(dl) != 0) {
+            dl->session.state = TFTP_SESSION_ERROR;
+        }
+        download_decomp_end(dl);
+        download_payload_end(dl);
+        download_verify_end(dl);
+    }
+    // What verified so far is kept; ask for the file again for the rest
+    if (dl->session.state == TFTP_SESSION_ERROR && dl->verify && dl->retries < NET_DOWNLOAD_RETRIES) {
+        dl->retries++;
+        dl->received = dl->reported = 0;
+        manifest_stream_restart(dl->verify);
+        if (download_start(dl, server, slot) == 0) return 0;
+        dl->session.state = TFTP_SESSION_ERROR;
+    }
+    if (dl->session.state == TFTP_SESSION_DONE) {
+        dl->status = NET_DOWNLOAD_DONE;
+    } else if (dl->session.state == TFTP_SESSION_ERROR) {
+        dl->status = NET_DOWNLOAD_FAILED;
+    } else {
+        return 0;
+    }
+    net_stats_transfer_close(dl->stats, dl->received, net_stats_elapsed_ms(dl->started, net_stats_now()),
+                             dl->status == NET_DOWNLOAD_DONE ? 0 : -1);
+    // Stray packets for a failed session no longer count against its record
+    if (dl->status == NET_DOWNLOAD_FAILED) {
+        dl->stats = NULL;
+        dl->session.stats = NULL;
+    }
+    download_report(dl, progress, ctx);
+    return 1;
+}
+
+int net_download_all(const char* server, struct net_download* files, int count,
+                     net_download_progress_fn progress, void* ctx) {
+    uint8_t pkt[TFTP_MAX_PACKET];
+    char src_ip[16];
+    uint16_t src_port, dst_port;
+    int active = 0;
+
+    if (!server || !files || count <= 0 || count > NET_DOWNLOAD_MAX_FILES) return -1;
+    net_stats_phase_begin(NET_PHASE_DOWNLOAD);
+
+    for (int i = 0; i < count; i++) {
+        struct net_download* dl = &files[i];
+
+        dl->data = NULL;
+        dl->decomp = NULL;
+        dl->payload = NULL;
+        dl->verify = NULL;
+        dl->format = DECOMP_FORMAT_NONE;
+        dl->size = dl->expected = dl->received = dl->capacity = dl->reported = 0;
+        dl->retries = 0;
+        dl->status = NET_DOWNLOAD_FAILED;
+        if (!dl->path || (dl->manifest && download_verify_start(dl) != 0)) continue;
+        dl->stats = net_stats_transfer_open(dl->path);
+        dl->started = net_stats_now();
+        if (download_start(dl, server, i) != 0) {
+            net_stats_transfer_close(dl->stats, 0, 0, -1);
+            download_verify_end(dl);
+            continue;
+        }
+        dl->status = NET_DOWNLOAD_ACTIVE;
+        active++;
+    }
+
+    clock_t last = clock();
+    while (active > 0) {
+        int n = pxe_udp_recv_any(src_ip, &src_port, &dst_port, pkt, sizeof(pkt), NET_DOWNLOAD_POLL_MS);
+
+        if (n > 0 && dst_port >= NET_DOWNLOAD_BASE_PORT && dst_port < NET_DOWNLOAD_BASE_PORT + count) {
+            int slot = dst_port - NET_DOWNLOAD_BASE_PORT;
+            struct net_download* dl = &files[slot];
+            if (dl->status == NET_DOWNLOAD_ACTIVE && strcmp(src_ip, server) == 0) {
+                net_counters_rx(dl->session.stats, n);
+                if (dl->rtt_pending && dl->session.stats) {
+                    net_counters_rtt(dl->session.stats, net_stats_elapsed_ms(dl->rtt_start, net_stats_now()));
+                    dl->rtt_pending = 0;
+                }
+                if (tftp_session_input(&dl->session, pkt, n, src_port) > 0) {
+                    download_send(dl, server, dl->session.server_port, 0);
+                }
+                if (download_settle(dl, server, slot, progress, ctx)) active--;
+                else download_report(dl, progress, ctx);
+            }
+        }
+
+        // Retransmissions are per session, so one stalled file never holds up the others
+        clock_t now = clock();
+        uint32_t elapsed = (uint32_t)(((now - last) * 1000) / CLOCKS_PER_SEC);
+        if (elapsed == 0) continue;
+        last = now;
+
+        for (int i = 0; i < count; i++) {
+            struct net_download* dl = &files[i];
+            if (dl->status != NET_DOWNLOAD_ACTIVE) continue;
+            if (tftp_session_tick(&dl->session, elapsed) > 0) {
+                uint16_t port = dl->session.state == TFTP_SESSION_RRQ ? TFTP_SERVER_PORT : dl->session.server_port;
+                download_send(dl, server, port, 1);
+            }
+            if (download_settle(dl, server, i, progress, ctx)) active--;
+        }
+    }
+
+    net_stats_phase_end(NET_PHASE_DOWNLOAD);
+
+    int result = 0;
+    for (int i = 0; i < count; i++) {
+        if (files[i].status != NET_DOWNLOAD_DONE) {
+            net_download_free(&files[i]);
+            files[i].status = NET_DOWNLOAD_FAILED;
+            result = -1;
+        }
+    }
+    return result;
+}
+
+void net_download_free(struct net_download* dl) {
+    if (!dl) return;
+    download_decomp_end(dl);
+    download_payload_end(dl);
+    download_verify_end(dl);
+    if (dl->data) {
+        free(dl->data);
+        dl->data = NULL;
+        dl->size = dl->capacity = 0;
+    }
+}
+
+int tftp_get_file(const char* server, const char* path, uint8_t** data, uint32_t* size) {
+    struct net_download dl;
+    memset(&dl, 0, sizeof(dl));
+    dl.path = path;
+    dl.raw = 1;
+    if (net_download_all(server, &dl, 1, NULL, NULL) != 0) return -1;
+    *data = dl.data;
+    *size = dl.size;
+    return 0;
+}
@@ -0,0 +1,86 @@
+/*
+ * download.h
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#ifndef BLOODHORN_DOWNLOAD_H
+#define BLOODHORN_DOWNLOAD_H
+#include <stdint.h>
+#include "compat.h"
+#include "tftp.h"
+#include "net_stats.h"
+#include "compress/decompress.h"
+#include "security/payload.h"
+#include "security/manifest.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NET_DOWNLOAD_MAX_FILES      8
+#define NET_DOWNLOAD_BASE_PORT      49200   // Local TIDs are BASE_PORT + slot
+#define NET_DOWNLOAD_POLL_MS        10
+#define NET_DOWNLOAD_PROGRESS_STEP  (256 * 1024)
+#define NET_DOWNLOAD_RETRIES        3       // Re-requests of a file with a manifest
+#define NET_DOWNLOAD_MAX_SIZE       0x80000000u     // Largest file, as served or decoded
+
+enum net_download_status {
+    NET_DOWNLOAD_PENDING = 0,
+    NET_DOWNLOAD_ACTIVE,
+    NET_DOWNLOAD_DONE,
+    NET_DOWNLOAD_FAILED
+};
+
+// One artifact of a boot entry. Fill in path (and raw, manifest); everything
+// else is output. data is allocated with malloc() and owned by the caller
+// afterwards. Compressed files (see compress/) are decoded block by block as
+// they arrive, so data/size describe the decompressed image unless raw is
+// set. Encrypted containers are likewise verified and decrypted chunk by
+// chunk in flight.
+//
+// With a manifest, the file as served is checked chunk by chunk against it
+// before anything else sees the bytes, and a transfer that breaks off or
+// delivers a bad chunk is requested again; chunks that already verified are
+// skipped rather than hashed and decoded a second time.
+struct net_download {
+    const char* path;
+    int raw;                    // Keep the bytes exactly as served
+    const struct manifest* manifest;    // Optional, must outlive the download
+    uint8_t* data;
+    uint32_t size;
+    uint32_t expected;          // Size announced by the server, 0 if unknown
+    uint32_t received;          // Bytes taken off the wire so far
+    enum decomp_format format;
+    struct decomp_stream* decomp;       // Only while a compressed file is in flight
+    struct payload_stream* payload;     // Only while an encrypted file is in flight
+    struct manifest_stream* verify;     // Only while a file with a manifest is in flight
+    int retries;
+    uint32_t capacity;
+    uint32_t reported;          // Bytes at the last progress callback
+    enum net_download_status status;
+    struct tftp_session session;
+    struct net_transfer_stats* stats;   // NULL once the stats table is full
+    uint32_t started;
+    uint32_t rtt_start;
+    int rtt_pending;                    // Karn: only time packets sent once
+};
+
+typedef void (*net_download_progress_fn)(const struct net_download* dl, void* ctx);
+
+// Fetch all files from one server concurrently, one TFTP session per file on
+// its own local port, all driven from a single receive loop. Returns 0 when
+// every file arrived, -1 otherwise (check each status).
+int net_download_all(const char* server, struct net_download* files, int count,
+                     net_download_progress_fn progress, void* ctx);
+void net_download_free(struct net_download* dl);
+
+// Single file convenience wrapper; never decompresses
+int tftp_get_file(const char* server, const char* path, uint8_t** data, uint32_t* size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
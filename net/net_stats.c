@@ -0,0 +1,160 @@
+/*
+ * net_stats.c
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#include "net_stats.h"
+#include "compat.h"
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+static struct net_stats stats = {
+    .magic = NET_STATS_MAGIC,
+    .version = NET_STATS_VERSION,
+    .size = sizeof(struct net_stats),
+};
+
+static const char* const phase_names[NET_PHASE_COUNT] = { "dhcp", "arp", "download" };
+
+struct net_stats* net_stats_get(void) {
+    return &stats;
+}
+
+void net_stats_reset(void) {
+    memset(&stats, 0, sizeof(stats));
+    stats.magic = NET_STATS_MAGIC;
+    stats.version = NET_STATS_VERSION;
+    stats.size = sizeof(stats);
+}
+
+uint32_t net_stats_now(void) {
+    return (uint32_t)clock();
+}
+
+uint32_t net_stats_elapsed_ms(uint32_t start, uint32_t end) {
+    return (uint32_t)(((uint64_t)(end - start) * 1000) / CLOCKS_PER_SEC);
+}
+
+void net_stats_phase_begin(enum net_phase phase) {
+    if (phase >= NET_PHASE_COUNT) return;
+    stats.phase[phase].runs++;
+    stats.phase[phase].started = net_stats_now();
+}
+
+void net_stats_phase_end(enum net_phase phase) {
+    if (phase >= NET_PHASE_COUNT) return;
+    stats.phase[phase].elapsed_ms += net_stats_elapsed_ms(stats.phase[phase].started, net_stats_now());
+}
+
+struct net_counters* net_stats_phase(enum net_phase phase) {
+    return phase < NET_PHASE_COUNT ? &stats.phase[phase].counters : NULL;
+}
+
+struct net_transfer_stats* net_stats_transfer_open(const char* name) {
+    if (stats.transfer_count >= NET_STATS_MAX_TRANSFERS) return NULL;
+    struct net_transfer_stats* xfer = &stats.transfers[stats.transfer_count++];
+    memset(xfer, 0, sizeof(*xfer));
+    if (name) strncpy(xfer->name, name, sizeof(xfer->name) - 1);
+    return xfer;
+}
+
+void net_stats_transfer_close(struct net_transfer_stats* xfer, uint32_t size, uint32_t elapsed_ms, int status) {
+    if (!xfer) return;
+    xfer->size = size;
+    xfer->elapsed_ms = elapsed_ms;
+    xfer->status = status;
+    net_counters_add(&stats.phase[NET_PHASE_DOWNLOAD].counters, &xfer->counters);
+}
+
+void net_counters_tx(struct net_counters* c, int bytes) {
+    if (!c || bytes < 0) return;
+    c->tx_packets++;
+    c->tx_bytes += (uint32_t)bytes;
+}
+
+void net_counters_rx(struct net_counters* c, int bytes) {
+    if (!c || bytes < 0) return;
+    c->rx_packets++;
+    c->rx_bytes += (uint32_t)bytes;
+}
+
+void net_counters_rtt(struct net_counters* c, uint32_t rtt_ms) {
+    if (!c) return;
+    int bucket = 0;
+    while (bucket < NET_STATS_RTT_BUCKETS - 1 && rtt_ms >= (1u << bucket)) bucket++;
+    c->rtt_hist[bucket]++;
+    if (c->rtt_samples == 0 || rtt_ms < c->rtt_min_ms) c->rtt_min_ms = rtt_ms;
+    if (rtt_ms > c->rtt_max_ms) c->rtt_max_ms = rtt_ms;
+    c->rtt_sum_ms += rtt_ms;
+    c->rtt_samples++;
+}
+
+void net_counters_add(struct net_counters* dst, const struct net_counters* src) {
+    if (!dst || !src) return;
+    dst->tx_packets += src->tx_packets;
+    dst->rx_packets += src->rx_packets;
+    dst->tx_bytes += src->tx_bytes;
+    dst->rx_bytes += src->rx_bytes;
+    dst->retransmits += src->retransmits;
+    dst->timeouts += src->timeouts;
+    dst->duplicates += src->duplicates;
+    dst->out_of_order += src->out_of_order;
+    if (src->rtt_samples) {
+        if (dst->rtt_samples == 0 || src->rtt_min_ms < dst->rtt_min_ms) dst->rtt_min_ms = src->rtt_min_ms;
+        if (src->rtt_max_ms > dst->rtt_max_ms) dst->rtt_max_ms = src->rtt_max_ms;
+    }
+    dst->rtt_samples += src->rtt_samples;
+    dst->rtt_sum_ms += src->rtt_sum_ms;
+    for (int i = 0; i < NET_STATS_RTT_BUCKETS; i++) dst->rtt_hist[i] += src->rtt_hist[i];
+}
+
+static int format_counters(char* out, int maxlen, const char* indent, const struct net_counters* c) {
+    int n = snprintf(out, maxlen,
+        "%stx %llu pkts %llu bytes  rx %llu pkts %llu bytes\n"
+        "%sretransmits %u  timeouts %u  duplicates %u  out-of-order %u\n",
+        indent, (unsigned long long)c->tx_packets, (unsigned long long)c->tx_bytes,
+        (unsigned long long)c->rx_packets, (unsigned long long)c->rx_bytes,
+        indent, c->retransmits, c->timeouts, c->duplicates, c->out_of_order);
+    if (n < 0 || n >= maxlen || c->rtt_samples == 0) return n;
+
+    n += snprintf(out + n, maxlen - n, "%srtt min/avg/max %u/%u/%u ms  hist",
+                  indent, c->rtt_min_ms, c->rtt_sum_ms / c->rtt_samples, c->rtt_max_ms);
+    for (int i = 0; i < NET_STATS_RTT_BUCKETS && n < maxlen; i++) {
+        if (!c->rtt_hist[i]) continue;
+        if (i == NET_STATS_RTT_BUCKETS - 1) {
+            n += snprintf(out + n, maxlen - n, " >=%u:%u", 1u << (i - 1), c->rtt_hist[i]);
+        } else {
+            n += snprintf(out + n, maxlen - n, " <%u:%u", 1u << i, c->rtt_hist[i]);
+        }
+    }
+    if (n < maxlen) n += snprintf(out + n, maxlen - n, "\n");
+    return n;
+}
+
+int net_stats_format(char* out, int maxlen) {
+    int n = 0;
+    if (!out || maxlen <= 0) return -1;
+    out[0] = 0;
+
+    for (int p = 0; p < NET_PHASE_COUNT && n < maxlen; p++) {
+        const struct net_phase_stats* ph = &stats.phase[p];
+        if (!ph->runs) continue;
+        n += snprintf(out + n, maxlen - n, "%s: %u run(s), %u ms\n", phase_names[p], ph->runs, ph->elapsed_ms);
+        if (n < maxlen) n += format_counters(out + n, maxlen - n, "  ", &ph->counters);
+    }
+
+    for (uint32_t i = 0; i < stats.transfer_count && n < maxlen; i++) {
+        const struct net_transfer_stats* x = &stats.transfers[i];
+        uint32_t kbps = x->elapsed_ms ? (uint32_t)(((uint64_t)x->size * 1000 / 1024) / x->elapsed_ms) : 0;
+        n += snprintf(out + n, maxlen - n, "%s: %u bytes in %u ms (%u KiB/s)%s\n",
+                      x->name, x->size, x->elapsed_ms, kbps, x->status ? " FAILED" : "");
+        if (n < maxlen) n += format_counters(out + n, maxlen - n, "  ", &x->counters);
+    }
+
+    if (n == 0) n = snprintf(out, maxlen, "No network activity recorded\n");
+    return n >= maxlen ? maxlen - 1 : n;
+}
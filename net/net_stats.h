@@ -0,0 +1,94 @@
+/*
+ * net_stats.h
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#ifndef BLOODHORN_NET_STATS_H
+#define BLOODHORN_NET_STATS_H
+#include <stdint.h>
+#include "compat.h"
+
+#define NET_STATS_MAGIC         0x5354454E  // "NETS"
+#define NET_STATS_VERSION       1
+#define NET_STATS_MAX_TRANSFERS 16
+#define NET_STATS_NAME_LEN      48
+
+// Bucket i counts RTTs below (1 << i) ms; the last bucket takes the rest
+#define NET_STATS_RTT_BUCKETS   12
+
+enum net_phase {
+    NET_PHASE_DHCP = 0,
+    NET_PHASE_ARP,
+    NET_PHASE_DOWNLOAD,
+    NET_PHASE_COUNT
+};
+
+struct net_counters {
+    uint64_t tx_packets;
+    uint64_t rx_packets;
+    uint64_t tx_bytes;
+    uint64_t rx_bytes;
+    uint32_t retransmits;
+    uint32_t timeouts;
+    uint32_t duplicates;
+    uint32_t out_of_order;
+    uint32_t rtt_samples;
+    uint32_t rtt_min_ms;
+    uint32_t rtt_max_ms;
+    uint32_t rtt_sum_ms;
+    uint32_t rtt_hist[NET_STATS_RTT_BUCKETS];
+};
+
+struct net_phase_stats {
+    struct net_counters counters;
+    uint32_t runs;
+    uint32_t elapsed_ms;
+    uint32_t started;           // clock() at begin, internal
+    uint32_t reserved;
+};
+
+struct net_transfer_stats {
+    char name[NET_STATS_NAME_LEN];
+    uint32_t size;
+    uint32_t elapsed_ms;
+    int32_t status;             // 0 complete, -1 failed
+    uint32_t reserved;
+    struct net_counters counters;
+};
+
+// Self-contained blob; handed to the OS unchanged as a BloodChain module
+struct net_stats {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t transfer_count;
+    struct net_phase_stats phase[NET_PHASE_COUNT];
+    struct net_transfer_stats transfers[NET_STATS_MAX_TRANSFERS];
+};
+
+struct net_stats* net_stats_get(void);
+void net_stats_reset(void);
+
+void net_stats_phase_begin(enum net_phase phase);
+void net_stats_phase_end(enum net_phase phase);
+struct net_counters* net_stats_phase(enum net_phase phase);
+
+// Returns NULL once NET_STATS_MAX_TRANSFERS have been recorded
+struct net_transfer_stats* net_stats_transfer_open(const char* name);
+void net_stats_transfer_close(struct net_transfer_stats* xfer, uint32_t size, uint32_t elapsed_ms, int status);
+
+// All counter helpers accept NULL so callers can pass an optional pointer
+void net_counters_tx(struct net_counters* c, int bytes);
+void net_counters_rx(struct net_counters* c, int bytes);
+void net_counters_rtt(struct net_counters* c, uint32_t rtt_ms);
+void net_counters_add(struct net_counters* dst, const struct net_counters* src);
+
+// Milliseconds between two clock() readings
+uint32_t net_stats_elapsed_ms(uint32_t start, uint32_t end);
+uint32_t net_stats_now(void);
+
+int net_stats_format(char* out, int maxlen);
+
+#endif
@@ -9,7 +9,20 @@
 #define BLOODHORN_NET_UTILS_H
 #include <stdint.h>
 #include "compat.h"
+// Internet checksum, returned in host byte order
 uint16_t net_checksum(const uint8_t* data, int len);
+
+// Building blocks shared by IP, UDP and ICMP. Partial sums and the folded
+// result are in memory byte order, so the folded value is stored into the
+// header as-is. Partial sums can be chained across fragments as long as
+// every fragment but the last has an even length.
+uint32_t net_csum_partial(const void* data, int len, uint32_t sum);
+uint16_t net_csum_fold(uint32_t sum);
+uint32_t net_csum_pseudo(uint32_t src_ip, uint32_t dst_ip, uint8_t proto, uint16_t len);
+
+// Incremental update after rewriting one header field (RFC 1624)
+uint16_t net_csum_update16(uint16_t check, uint16_t old_word, uint16_t new_word);
+uint16_t net_csum_update32(uint16_t check, uint32_t old_word, uint32_t new_word);
 void net_mac_copy(uint8_t* dst, const uint8_t* src);
 void net_ip_copy(uint8_t* dst, const uint8_t* src);
 #endif 
\ No newline at end of file
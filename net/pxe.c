@@ -8,13 +8,18 @@
 #include <stdint.h>
 #include "compat.h"
 #include <string.h>
+#include <stdlib.h>
 #include "pxe.h"
+#include "dhcp.h"
+#include "download.h"
+#include "net_utils.h"
 #include "boot/Arch32/linux.h"
 #include "boot/Arch32/limine.h"
 #include "boot/Arch32/multiboot1.h"
 #include "boot/Arch32/multiboot2.h"
 #include "boot/Arch32/chainload.h"
 #include <time.h>
+#include <stdio.h>
 #include <arpa/inet.h>
 
 extern int pxe_init(void);
@@ -24,24 +29,22 @@ extern int pxe_get_file_size(const char* filename);
 extern int pxe_cleanup(void);
 extern int pxe_udp_send(const char* dest_ip, uint16_t dest_port, const void* data, int len);
 extern int pxe_udp_recv(char* src_ip, uint16_t* src_port, void* buf, int maxlen, int timeout_ms);
-
-struct pxe_network_info {
-    uint32_t client_ip;
-    uint32_t server_ip;
-    uint32_t subnet_mask;
-    uint32_t router_ip;
-    uint32_t dns_server;
-    char tftp_server[64];
-    char boot_file[128];
-    char domain_name[64];
-    uint32_t broadcast_ip;
-    uint32_t ntp_server;
-    uint32_t time_offset;
-};
+extern int pxe_get_mac(uint8_t* mac);
+extern int pxe_get_cached_dhcp_ack(uint8_t* buf, int maxlen);
+extern int pxe_lease_load(struct dhcp_lease* lease);
+extern int pxe_lease_store(const struct dhcp_lease* lease);
 
 static struct pxe_network_info network_info;
 static int pxe_initialized = 0;
 
+struct pxe_module {
+    char path[PXE_MODULE_STRING];
+    char cmdline[PXE_MODULE_STRING];
+};
+
+static struct pxe_module pxe_modules[PXE_MAX_MODULES];
+static int pxe_module_count;
+
 struct icmp_echo {
     uint8_t type;
     uint8_t code;
@@ -51,17 +54,62 @@ struct icmp_echo {
     uint8_t payload[32];
 };
 
-static uint16_t icmp_checksum(const void* data, int len) {
-    uint32_t sum = 0;
-    const uint16_t* ptr = (const uint16_t*)data;
-    while (len > 1) {
-        sum += *ptr++;
-        len -= 2;
-    }
-    if (len == 1) sum += *(const uint8_t*)ptr;
-    sum = (sum >> 16) + (sum & 0xFFFF);
-    sum += (sum >> 16);
-    return ~sum;
+static void pxe_apply_lease(const struct dhcp_lease* lease) {
+    memset(&network_info, 0, sizeof(network_info));
+    network_info.client_ip = lease->client_ip;
+    network_info.server_ip = lease->next_server ? lease->next_server : lease->server_id;
+    network_info.subnet_mask = lease->subnet_mask;
+    network_info.router_ip = lease->router_ip;
+    network_info.dns_server = lease->dns_server;
+    network_info.broadcast_ip = lease->broadcast_ip;
+    network_info.ntp_server = lease->ntp_server;
+    network_info.time_offset = (uint32_t)lease->time_offset;
+    memcpy(network_info.boot_file, lease->boot_file, sizeof(network_info.boot_file));
+    memcpy(network_info.domain_name, lease->domain_name, sizeof(network_info.domain_name));
+
+    if (lease->tftp_server[0]) {
+        memcpy(network_info.tftp_server, lease->tftp_server, sizeof(network_info.tftp_server));
+    } else {
+        const uint8_t* ip = (const uint8_t*)&network_info.server_ip;
+        snprintf(network_info.tftp_server, sizeof(network_info.tftp_server), "%u.%u.%u.%u",
+                 ip[0], ip[1], ip[2], ip[3]);
+    }
+}
+
+// Cheapest source first: the ACK the firmware already received when it
+// PXE-booted us, then an INIT-REBOOT of the lease cached by the last boot,
+// and only then a full DISCOVER/OFFER/REQUEST/ACK exchange.
+static int pxe_dhcp_configure(void) {
+    static struct dhcp_client client;
+    struct dhcp_lease cached;
+    uint8_t ack[DHCP_PACKET_MAX];
+    uint8_t mac[6];
+
+    if (pxe_get_mac(mac) != 0) {
+        return -1;
+    }
+
+    uint32_t xid = (((uint32_t)mac[2] << 24) | ((uint32_t)mac[3] << 16) |
+                    ((uint32_t)mac[4] << 8) | mac[5]) ^ (uint32_t)clock();
+    int have_cached = pxe_lease_load(&cached) == 0;
+    dhcp_client_init(&client, mac, xid, have_cached ? &cached : NULL);
+
+    int n = pxe_get_cached_dhcp_ack(ack, sizeof(ack));
+    if (n > 0) {
+        dhcp_client_accept_ack(&client, ack, n);
+    }
+
+    if (client.state != DHCP_STATE_BOUND && dhcp_client_run(&client) != 0) {
+        return -1;
+    }
+
+    // Only worth a variable write when the lease actually changed
+    if (!have_cached || memcmp(&cached, &client.lease, sizeof(cached)) != 0) {
+        pxe_lease_store(&client.lease);
+    }
+
+    pxe_apply_lease(&client.lease);
+    return 0;
 }
 
 int pxe_network_init(void) {
@@ -74,8 +122,8 @@ int pxe_network_init(void) {
         return -1;
     }
     
-    result = pxe_dhcp_discover();
-    if (result != 0) {
+    // Fall back to the firmware's own DHCP if our client gets nowhere
+    if (pxe_dhcp_configure() != 0 && pxe_dhcp_discover() != 0) {
         pxe_cleanup();
         return -1;
     }
@@ -130,27 +178,189 @@ int pxe_load_initrd(const char* initrd_path, uint8_t** initrd_data, uint32_t* in
     return 0;
 }
 
+static void pxe_download_progress(const struct net_download* dl, void* ctx) {
+    (void)ctx;
+    if (dl->status == NET_DOWNLOAD_FAILED) {
+        printf("PXE: %s failed\n", dl->path);
+    } else if (dl->status == NET_DOWNLOAD_DONE && dl->format != DECOMP_FORMAT_NONE) {
+        printf("PXE: %s %u KiB %s -> %u KiB\n", dl->path, dl->received / 1024,
+               decomp_format_name(dl->format), dl->size / 1024);
+    } else if (dl->expected) {
+        printf("PXE: %s %u/%u KiB\n", dl->path, dl->received / 1024, dl->expected / 1024);
+    } else {
+        printf("PXE: %s %u KiB\n", dl->path, dl->received / 1024);
+    }
+}
+
+// option 66 may carry a host name we cannot resolve; siaddr always works
+static void pxe_server_address(char* out, int outlen) {
+    const char* name = network_info.tftp_server;
+    if (name[0] >= '0' && name[0] <= '9') {
+        strncpy(out, name, outlen - 1);
+        out[outlen - 1] = 0;
+        return;
+    }
+    const uint8_t* ip = (const uint8_t*)&network_info.server_ip;
+    snprintf(out, outlen, "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+}
+
+// The server may keep a manifest next to a file (<path>.bhm); the download
+// is then checked chunk by chunk against it. 0 with pm->data set if there
+// is a usable one, 0 with it NULL if there is none, -1 if it can't be used.
+struct pxe_manifest {
+    uint8_t* data;
+    uint32_t size;
+    struct manifest m;
+};
+
+static int pxe_fetch_manifest(const char* server, const char* path, struct pxe_manifest* pm) {
+    char name[256];
+    memset(pm, 0, sizeof(*pm));
+    if (snprintf(name, sizeof(name), "%s%s", path, MANIFEST_SUFFIX) >= (int)sizeof(name)) return -1;
+
+    if (tftp_get_file(server, name, &pm->data, &pm->size) != 0) {
+        pm->data = NULL;
+        return manifest_trust_required() ? -1 : 0;
+    }
+    if (manifest_parse(pm->data, pm->size, &pm->m) != 0 || manifest_check_trust(&pm->m) != 0) {
+        free(pm->data);
+        pm->data = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static void pxe_free_manifests(struct pxe_manifest* pm, int count) {
+    for (int i = 0; i < count; i++) {
+        free(pm[i].data);
+        pm[i].data = NULL;
+    }
+}
+
+int pxe_add_module(const char* path, const char* cmdline) {
+    if (!path || !path[0] || pxe_module_count >= PXE_MAX_MODULES) {
+        return -1;
+    }
+
+    struct pxe_module* m = &pxe_modules[pxe_module_count];
+    memset(m, 0, sizeof(*m));
+    strncpy(m->path, path, PXE_MODULE_STRING - 1);
+    if (cmdline) {
+        strncpy(m->cmdline, cmdline, PXE_MODULE_STRING - 1);
+    }
+
+    pxe_module_count++;
+    return 0;
+}
+
+// Modules are copied into the protocol's own tables; the downloads are
+// freed either way
+static int pxe_hand_over_modules(uint32_t magic, struct net_download* mods) {
+    int r = 0;
+    for (int i = 0; i < pxe_module_count && r == 0; i++) {
+        const struct pxe_module* m = &pxe_modules[i];
+        if (magic == 0x1BADB002) {
+            r = multiboot1_add_module(mods[i].data, mods[i].size, m->cmdline);
+        } else if (magic == 0xE85250D6) {
+            r = multiboot2_add_module(mods[i].data, mods[i].size, m->cmdline);
+        } else if (magic == 0x67cf3d9d) {
+            r = limine_add_module(m->path, mods[i].data, mods[i].size, m->cmdline);
+        } else {
+            printf("PXE: %s ignored, the kernel takes no modules\n", m->path);
+        }
+    }
+    for (int i = 0; i < pxe_module_count; i++) {
+        net_download_free(&mods[i]);
+    }
+    return r;
+}
+
 int pxe_boot_kernel(const char* kernel_path, const char* initrd_path, const char* cmdline) {
     uint8_t* kernel_data = NULL;
     uint32_t kernel_size = 0;
     uint8_t* initrd_data = NULL;
     uint32_t initrd_size = 0;
+    int have_initrd = initrd_path && strlen(initrd_path) > 0;
     
     if (pxe_network_init() != 0) {
         return -1;
     }
     
-    if (pxe_load_kernel(kernel_path, &kernel_data, &kernel_size) != 0) {
-        return -1;
+    // Fetch kernel, initrd and modules concurrently; each transfer is RTT
+    // bound, so running N side by side cuts the wall clock time close to N
+    // times
+    struct net_download files[NET_DOWNLOAD_MAX_FILES];
+    struct pxe_manifest manifests[NET_DOWNLOAD_MAX_FILES];
+    int first_module = have_initrd ? 2 : 1;
+    int count = first_module + pxe_module_count;
+    struct net_download* mods = &files[first_module];
+    char server[16];
+    memset(files, 0, sizeof(files));
+    memset(manifests, 0, sizeof(manifests));
+    files[0].path = kernel_path;
+    files[1].path = initrd_path;
+    for (int i = 0; i < pxe_module_count; i++) {
+        mods[i].path = pxe_modules[i].path;
     }
-    
-    if (initrd_path && strlen(initrd_path) > 0) {
-        if (pxe_load_initrd(initrd_path, &initrd_data, &initrd_size) != 0) {
+    pxe_server_address(server, sizeof(server));
+
+    for (int i = 0; i < count; i++) {
+        if (pxe_fetch_manifest(server, files[i].path, &manifests[i]) != 0) {
+            pxe_free_manifests(manifests, count);
             return -1;
         }
+        if (manifests[i].data) files[i].manifest = &manifests[i].m;
+    }
+
+    if (net_download_all(server, files, count, pxe_download_progress, NULL) == 0) {
+        kernel_data = files[0].data;
+        kernel_size = files[0].size;
+        if (have_initrd) {
+            initrd_data = files[1].data;
+            initrd_size = files[1].size;
+        }
+    } else {
+        // Firmware without multi-port UDP support: one blocking transfer at a
+        // time, checked against the manifests once it is all in
+        for (int i = 0; i < count; i++) {
+            net_download_free(&files[i]);
+        }
+        if (pxe_load_kernel(kernel_path, &kernel_data, &kernel_size) != 0 ||
+            (manifests[0].data && manifest_verify_image(&manifests[0].m, kernel_data, kernel_size) != 0)) {
+            pxe_free_manifests(manifests, count);
+            return -1;
+        }
+        if (have_initrd && (pxe_load_initrd(initrd_path, &initrd_data, &initrd_size) != 0 ||
+                            (manifests[1].data &&
+                             manifest_verify_image(&manifests[1].m, initrd_data, initrd_size) != 0))) {
+            pxe_free_manifests(manifests, count);
+            return -1;
+        }
+        for (int i = first_module; i < count; i++) {
+            if (tftp_get_file(server, files[i].path, &files[i].data, &files[i].size) != 0 ||
+                (manifests[i].data &&
+                 manifest_verify_image(&manifests[i].m, files[i].data, files[i].size) != 0)) {
+                for (int j = first_module; j <= i; j++) {
+                    net_download_free(&files[j]);
+                }
+                pxe_free_manifests(manifests, count);
+                return -1;
+            }
+        }
+    }
+    pxe_free_manifests(manifests, count);
+    
+    if (kernel_size < 4) {
+        for (int i = 0; i < pxe_module_count; i++) {
+            net_download_free(&mods[i]);
+        }
+        return -1;
     }
     
     uint32_t* kernel_header = (uint32_t*)kernel_data;
+    if (pxe_hand_over_modules(kernel_header[0], mods) != 0) {
+        return -1;
+    }
     
     if (kernel_header[0] == 0x53726448) {
         return boot_linux_kernel(kernel_data, kernel_size, initrd_data, initrd_size, cmdline);
@@ -183,17 +393,32 @@ struct pxe_network_info* pxe_get_network_info(void) {
     return &network_info;
 } 
 
-// ICMP echo (ping) using PXE stack
+// ICMP echo (ping) using PXE stack. The request is summed once; each ping
+// after that only rewrites the sequence number and patches the checksum
+// (RFC 1624).
+static struct icmp_echo echo_req;
+
+static uint16_t icmp_type_code(const struct icmp_echo* e) {
+    uint16_t w;
+    memcpy(&w, &e->type, sizeof(w));
+    return w;
+}
+
 // Returns 0 on success, -1 on failure
 int pxe_icmp_echo(const char* host, int* rtt_ms) {
-    struct icmp_echo req = {0};
-    req.type = 8; // Echo request
-    req.code = 0;
-    req.id = htons(0x1234);
-    req.seq = htons(1);
-    memset(req.payload, 0xAA, sizeof(req.payload));
-    req.checksum = 0;
-    req.checksum = icmp_checksum(&req, sizeof(req));
+    if (echo_req.type == 0) {
+        echo_req.type = 8; // Echo request
+        echo_req.code = 0;
+        echo_req.id = htons(0x1234);
+        echo_req.seq = htons(0);
+        memset(echo_req.payload, 0xAA, sizeof(echo_req.payload));
+        echo_req.checksum = 0;
+        echo_req.checksum = net_csum_fold(net_csum_partial(&echo_req, sizeof(echo_req), 0));
+    }
+    uint16_t seq = htons((uint16_t)(ntohs(echo_req.seq) + 1));
+    echo_req.checksum = net_csum_update16(echo_req.checksum, echo_req.seq, seq);
+    echo_req.seq = seq;
+    struct icmp_echo req = echo_req;
 
     uint16_t dest_port = 33434; // Arbitrary unused port
     uint32_t start = (uint32_t)clock();
@@ -206,6 +431,10 @@ int pxe_icmp_echo(const char* host, int* rtt_ms) {
     int n = pxe_udp_recv(src_ip, &src_port, &resp, sizeof(resp), timeout);
     if (n < (int)sizeof(resp)) return -1;
     if (resp.type != 0 || resp.id != req.id || resp.seq != req.seq) return -1;
+    // The reply is the request with its type rewritten, so its checksum
+    // follows from ours
+    if (resp.checksum != net_csum_update16(req.checksum, icmp_type_code(&req), icmp_type_code(&resp)) ||
+        memcmp(resp.payload, req.payload, sizeof(req.payload)) != 0) return -1;
     uint32_t end = (uint32_t)clock();
     *rtt_ms = (int)(((end - start) * 1000) / CLOCKS_PER_SEC);
     return 0;
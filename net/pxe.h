@@ -24,9 +24,15 @@ struct pxe_network_info {
     uint32_t time_offset;
 };
 
+#define PXE_MAX_MODULES     6       // The download slots the kernel and initrd leave
+#define PXE_MODULE_STRING   128
+
 int pxe_network_init(void);
 int pxe_load_kernel(const char* kernel_path, uint8_t** kernel_data, uint32_t* kernel_size);
 int pxe_load_initrd(const char* initrd_path, uint8_t** initrd_data, uint32_t* initrd_size);
+// Queue a module to be fetched with the kernel by the next pxe_boot_kernel()
+// and handed over through its boot protocol; cmdline may be NULL
+int pxe_add_module(const char* path, const char* cmdline);
 int pxe_boot_kernel(const char* kernel_path, const char* initrd_path, const char* cmdline);
 int pxe_cleanup_network(void);
 struct pxe_network_info* pxe_get_network_info(void);
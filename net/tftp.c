@@ -9,6 +9,7 @@
 #include "compat.h"
 #include <stdint.h>
 #include <string.h>
+#include <stdio.h>
 static int tftp_send_rrq(const char* filename, uint8_t* buf, int blksize) {
     buf[0] = 0; buf[1] = 1;
     int len = strlen(filename);
@@ -46,4 +47,202 @@ int tftp_parse_oack(const uint8_t* buf, int* blksize) {
         while (buf[i++]);
     }
     return 0;
-} 
\ No newline at end of file
+} 
+static int tftp_put_string(uint8_t* buf, int pos, int maxlen, const char* str) {
+    int len = (int)strlen(str);
+    if (pos + len + 1 > maxlen) return -1;
+    memcpy(buf + pos, str, len + 1);
+    return pos + len + 1;
+}
+
+static uint32_t tftp_parse_uint(const char* str) {
+    uint32_t v = 0;
+    while (*str >= '0' && *str <= '9') v = v * 10 + (uint32_t)(*str++ - '0');
+    return v;
+}
+
+static int tftp_strcaseeq(const char* a, const char* b) {
+    while (*a && *b) {
+        char ca = (*a >= 'A' && *a <= 'Z') ? (char)(*a + 32) : *a;
+        char cb = (*b >= 'A' && *b <= 'Z') ? (char)(*b + 32) : *b;
+        if (ca != cb) return 0;
+        a++; b++;
+    }
+    return *a == *b;
+}
+
+int tftp_session_init(struct tftp_session* s, const char* server, const char* filename,
+                      uint16_t local_port, const struct tftp_sink* sink) {
+    if (!s || !server || !filename || !sink || !sink->write) return -1;
+    memset(s, 0, sizeof(*s));
+    strncpy(s->server, server, sizeof(s->server) - 1);
+    s->filename = filename;
+    s->local_port = local_port;
+    s->blksize = TFTP_MAX_BLKSIZE;
+    s->windowsize = TFTP_DEFAULT_WINDOW;
+    s->error_code = -1;
+    s->sink = *sink;
+    s->state = TFTP_SESSION_RRQ;
+    return 0;
+}
+
+int tftp_session_build(struct tftp_session* s, uint8_t* buf, int maxlen) {
+    char num[12];
+    int pos;
+
+    switch (s->state) {
+    case TFTP_SESSION_RRQ:
+        // RFC 2347 options: ask for large blocks, the size up front and a window
+        buf[0] = 0; buf[1] = TFTP_OP_RRQ;
+        pos = tftp_put_string(buf, 2, maxlen, s->filename);
+        if (pos < 0) return -1;
+        pos = tftp_put_string(buf, pos, maxlen, "octet");
+        pos = pos < 0 ? -1 : tftp_put_string(buf, pos, maxlen, "blksize");
+        snprintf(num, sizeof(num), "%d", TFTP_MAX_BLKSIZE);
+        pos = pos < 0 ? -1 : tftp_put_string(buf, pos, maxlen, num);
+        pos = pos < 0 ? -1 : tftp_put_string(buf, pos, maxlen, "tsize");
+        pos = pos < 0 ? -1 : tftp_put_string(buf, pos, maxlen, "0");
+        pos = pos < 0 ? -1 : tftp_put_string(buf, pos, maxlen, "windowsize");
+        snprintf(num, sizeof(num), "%d", TFTP_DEFAULT_WINDOW);
+        pos = pos < 0 ? -1 : tftp_put_string(buf, pos, maxlen, num);
+        return pos;
+    case TFTP_SESSION_DATA:
+    case TFTP_SESSION_DONE:
+        if (maxlen < 4) return -1;
+        buf[0] = 0; buf[1] = TFTP_OP_ACK;
+        buf[2] = (uint8_t)(s->last_block >> 8); buf[3] = (uint8_t)s->last_block;
+        return 4;
+    default:
+        return -1;
+    }
+}
+
+static int tftp_session_oack(struct tftp_session* s, const uint8_t* pkt, int len) {
+    int i = 2;
+    // Options the server leaves out fall back to the RFC 1350 defaults
+    s->blksize = TFTP_DEFAULT_BLKSIZE;
+    s->windowsize = 1;
+
+    while (i < len) {
+        const char* name = (const char*)pkt + i;
+        int nlen = (int)strnlen(name, len - i);
+        if (i + nlen + 1 >= len) break;
+        const char* value = name + nlen + 1;
+        int vlen = (int)strnlen(value, len - (i + nlen + 1));
+        if (i + nlen + 1 + vlen >= len) break;
+
+        uint32_t v = tftp_parse_uint(value);
+        if (tftp_strcaseeq(name, "blksize")) {
+            if (v < 8 || v > TFTP_MAX_BLKSIZE) return -1;
+            s->blksize = (int)v;
+        } else if (tftp_strcaseeq(name, "tsize")) {
+            s->tsize = v;
+        } else if (tftp_strcaseeq(name, "windowsize")) {
+            if (v < 1 || v > TFTP_DEFAULT_WINDOW) return -1;
+            s->windowsize = (int)v;
+        }
+        i += nlen + vlen + 2;
+    }
+
+    if (s->sink.reserve && s->sink.reserve(s->sink.ctx, s->tsize) != 0) return -1;
+    return 0;
+}
+
+int tftp_session_input(struct tftp_session* s, const uint8_t* pkt, int len, uint16_t src_port) {
+    if (s->state == TFTP_SESSION_DONE || s->state == TFTP_SESSION_ERROR) return 0;
+    if (len < 4 || pkt[0] != 0) return 0;
+
+    if (s->state == TFTP_SESSION_RRQ) {
+        s->server_port = src_port;
+    } else if (src_port != s->server_port) {
+        return 0; // Stray packet from another transfer ID
+    }
+
+    switch (pkt[1]) {
+    case TFTP_OP_ERROR:
+        s->error_code = (pkt[2] << 8) | pkt[3];
+        s->state = TFTP_SESSION_ERROR;
+        return 0;
+
+    case TFTP_OP_OACK:
+        if (s->state != TFTP_SESSION_RRQ) return 0;
+        if (tftp_session_oack(s, pkt, len) != 0) {
+            s->state = TFTP_SESSION_ERROR;
+            return 0;
+        }
+        s->state = TFTP_SESSION_DATA;
+        s->idle_ms = 0; s->retries = 0;
+        return 1; // ACK block 0 starts the transfer
+
+    case TFTP_OP_DATA: {
+        if (s->state == TFTP_SESSION_RRQ) {
+            // Server ignored our options: plain RFC 1350 lock-step
+            s->blksize = TFTP_DEFAULT_BLKSIZE;
+            s->windowsize = 1;
+            if (s->sink.reserve && s->sink.reserve(s->sink.ctx, 0) != 0) {
+                s->state = TFTP_SESSION_ERROR;
+                return 0;
+            }
+            s->state = TFTP_SESSION_DATA;
+        }
+
+        uint16_t block = (uint16_t)((pkt[2] << 8) | pkt[3]);
+        int datalen = len - 4;
+        if (datalen > s->blksize) return 0;
+        s->idle_ms = 0;
+
+        if (block != (uint16_t)(s->last_block + 1)) {
+            if (s->stats) {
+                // Anything up to half the sequence space behind us is a resend
+                if ((uint16_t)(s->last_block - block) < 0x8000) s->stats->duplicates++;
+                else s->stats->out_of_order++;
+            }
+            // RFC 7440: re-ACK the last in-order block once per gap so the
+            // server restarts the window from there
+            if (s->nak_sent) return 0;
+            s->nak_sent = 1;
+            s->window_pos = 0;
+            return 1;
+        }
+
+        if (datalen > 0 && s->sink.write(s->sink.ctx, s->received, pkt + 4, datalen) != 0) {
+            s->state = TFTP_SESSION_ERROR;
+            return 0;
+        }
+        s->received += (uint32_t)datalen;
+        s->last_block = block;
+        s->nak_sent = 0;
+        s->retries = 0;
+
+        if (datalen < s->blksize) {
+            s->state = TFTP_SESSION_DONE;
+            return 1;
+        }
+        if (++s->window_pos >= s->windowsize) {
+            s->window_pos = 0;
+            return 1;
+        }
+        return 0;
+    }
+
+    default:
+        return 0;
+    }
+}
+
+int tftp_session_tick(struct tftp_session* s, uint32_t elapsed_ms) {
+    if (s->state == TFTP_SESSION_DONE || s->state == TFTP_SESSION_ERROR) return 0;
+    s->idle_ms += elapsed_ms;
+    if (s->idle_ms < TFTP_TIMEOUT_MS) return 0;
+
+    s->idle_ms = 0;
+    if (s->stats) s->stats->timeouts++;
+    if (++s->retries > TFTP_MAX_RETRIES) {
+        s->state = TFTP_SESSION_ERROR;
+        return 0;
+    }
+    if (s->stats) s->stats->retransmits++;
+    s->window_pos = 0;
+    s->nak_sent = 0;
+    return 1;
+}
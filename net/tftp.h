@@ -9,6 +9,69 @@
 #define BLOODHORN_TFTP_H
 #include <stdint.h>
 #include "compat.h"
+#include "net_stats.h"
+
+#define TFTP_SERVER_PORT        69
+#define TFTP_DEFAULT_BLKSIZE    512
+#define TFTP_MAX_BLKSIZE        1468    // Largest block that fits a 1500 byte MTU
+#define TFTP_DEFAULT_WINDOW     8       // RFC 7440 windowsize we ask for
+#define TFTP_TIMEOUT_MS         1000
+#define TFTP_MAX_RETRIES        5
+#define TFTP_MAX_PACKET         (4 + TFTP_MAX_BLKSIZE)
+
+// Opcodes
+#define TFTP_OP_RRQ             1
+#define TFTP_OP_WRQ             2
+#define TFTP_OP_DATA            3
+#define TFTP_OP_ACK             4
+#define TFTP_OP_ERROR           5
+#define TFTP_OP_OACK            6
+
+enum tftp_session_state {
+    TFTP_SESSION_RRQ = 0,       // Request sent, waiting for OACK or first DATA
+    TFTP_SESSION_DATA,          // Receiving blocks
+    TFTP_SESSION_DONE,
+    TFTP_SESSION_ERROR
+};
+
+// Where received data goes. reserve() is called once with the size the
+// server announced through tsize (0 when it did not); write() receives every
+// block in order.
+struct tftp_sink {
+    int (*reserve)(void* ctx, uint32_t size);
+    int (*write)(void* ctx, uint32_t offset, const uint8_t* data, int len);
+    void* ctx;
+};
+
+struct tftp_session {
+    enum tftp_session_state state;
+    char server[16];            // Dotted quad
+    const char* filename;
+    uint16_t local_port;        // Our TID
+    uint16_t server_port;       // Server TID once the first reply arrived
+    int blksize;
+    int windowsize;
+    uint32_t tsize;             // Announced file size, 0 if unknown
+    uint16_t last_block;        // Last block delivered in order
+    int window_pos;             // Blocks received since our last ACK
+    int nak_sent;               // Already re-ACKed the current gap
+    uint32_t received;          // Bytes delivered to the sink
+    uint32_t idle_ms;
+    int retries;
+    int error_code;             // TFTP error code from the server, or -1
+    struct tftp_sink sink;
+    struct net_counters* stats; // Optional, may be NULL
+};
+
 int tftp_build_rrq(const char* filename, uint8_t* buf);
 int tftp_parse_data(const uint8_t* buf, uint16_t* block, uint8_t* data, int* datalen);
+int tftp_parse_oack(const uint8_t* buf, int* blksize);
+
+// Session API. build() returns the packet to (re)send for the current state;
+// input() and tick() return 1 when that packet should be sent now.
+int tftp_session_init(struct tftp_session* s, const char* server, const char* filename,
+                      uint16_t local_port, const struct tftp_sink* sink);
+int tftp_session_build(struct tftp_session* s, uint8_t* buf, int maxlen);
+int tftp_session_input(struct tftp_session* s, const uint8_t* pkt, int len, uint16_t src_port);
+int tftp_session_tick(struct tftp_session* s, uint32_t elapsed_ms);
 #endif 
\ No newline at end of file
@@ -13,6 +13,7 @@
 #include "arp.h"
 #include "dhcp.h"
 #include "tftp.h"
+#include "download.h"
 #include "pxe.h"
 
 namespace BloodHorn::Net {
@@ -184,20 +185,13 @@ std::error_code PXEClient::downloadFile(const std::string& path, std::vector<uin
 std::error_code PXEClient::bootKernel(const std::string& kernel_path, 
                                     const std::string& initrd_path,
                                     const std::string& cmdline) {
-    std::vector<uint8_t> kernel_data;
-    std::vector<uint8_t> initrd_data;
-    
-    // Download kernel
-    auto ec = downloadFile(kernel_path, kernel_data);
-    if (ec) return ec;
-    
-    // Download initrd if specified
-    if (!initrd_path.empty()) {
-        ec = downloadFile(initrd_path, initrd_data);
+    if (!initialized_) {
+        auto ec = discoverNetwork();
         if (ec) return ec;
     }
     
-    // Boot the kernel
+    // pxe_boot_kernel() fetches kernel and initrd itself (concurrently, with
+    // per-transfer statistics); downloading them here first doubled the traffic
     int result = pxe_boot_kernel(kernel_path.c_str(), 
                                 initrd_path.empty() ? nullptr : initrd_path.c_str(),
                                 cmdline.c_str());
@@ -210,3 +204,169 @@ std::error_code PXEClient::bootKernel(const std::string& kernel_path,
 }
 
 } // namespace BloodHorn::Net
+
+// Firmware hooks used by the C DHCP client in pxe.c
+
+static EFI_GUID gBloodHornNetVariableGuid =
+    { 0x6c1b7a42, 0x9f0e, 0x4d57, { 0xa3, 0x1c, 0x2e, 0x84, 0x5b, 0x90, 0xd7, 0x16 } };
+static CHAR16 kDhcpLeaseVariable[] = L"BloodHornDhcpLease";
+
+extern "C" int pxe_get_mac(uint8_t* mac) {
+    EFI_SIMPLE_NETWORK* snp = nullptr;
+    EFI_STATUS status = gBS->LocateProtocol(&gEfiSimpleNetworkProtocolGuid, nullptr, (void**)&snp);
+    if (EFI_ERROR(status) || !snp || !snp->Mode) {
+        return -1;
+    }
+    CopyMem(mac, snp->Mode->CurrentAddress.Addr, 6);
+    return 0;
+}
+
+// When the firmware PXE-booted us it already holds a DHCP ACK for this NIC;
+// reusing it saves the whole exchange.
+extern "C" int pxe_get_cached_dhcp_ack(uint8_t* buf, int maxlen) {
+    EFI_PXE_BASE_CODE* pxe = nullptr;
+    EFI_STATUS status = gBS->LocateProtocol(&PxeBaseCodeProtocol, nullptr, (void**)&pxe);
+    if (EFI_ERROR(status) || !pxe || !pxe->Mode || !pxe->Mode->Started) {
+        return -1;
+    }
+    if (!pxe->Mode->DhcpAckReceived || pxe->Mode->UsingIpv6) {
+        return -1;
+    }
+
+    int len = (int)sizeof(pxe->Mode->DhcpAck.Raw);
+    if (len > maxlen) len = maxlen;
+    CopyMem(buf, pxe->Mode->DhcpAck.Raw, len);
+    return len;
+}
+
+extern "C" int pxe_lease_load(struct dhcp_lease* lease) {
+    UINTN size = sizeof(*lease);
+    EFI_STATUS status = gRT->GetVariable(kDhcpLeaseVariable, &gBloodHornNetVariableGuid,
+                                         nullptr, &size, lease);
+    if (EFI_ERROR(status) || size != sizeof(*lease) || lease->version != DHCP_LEASE_VERSION) {
+        return -1;
+    }
+    return 0;
+}
+
+extern "C" int pxe_lease_store(const struct dhcp_lease* lease) {
+    EFI_STATUS status = gRT->SetVariable(kDhcpLeaseVariable, &gBloodHornNetVariableGuid,
+                                         EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS,
+                                         sizeof(*lease), (void*)lease);
+    return EFI_ERROR(status) ? -1 : 0;
+}
+
+// UDP for the C clients (DHCP, TFTP), over the firmware's PXE Base Code.
+// UdpRead() gives up after a few milliseconds on its own, so longer waits
+// are a loop against a timer event.
+
+static EFI_PXE_BASE_CODE* pxe_udp_base_code() {
+    EFI_PXE_BASE_CODE* pxe = nullptr;
+    EFI_STATUS status = gBS->LocateProtocol(&PxeBaseCodeProtocol, nullptr, (void**)&pxe);
+    if (EFI_ERROR(status) || !pxe || !pxe->Mode || !pxe->Mode->Started || pxe->Mode->UsingIpv6) {
+        return nullptr;
+    }
+    return pxe;
+}
+
+static int pxe_udp_parse_ip(const char* str, EFI_IP_ADDRESS* ip) {
+    unsigned a, b, c, d;
+    if (!str || sscanf(str, "%u.%u.%u.%u", &a, &b, &c, &d) != 4 || a > 255 || b > 255 || c > 255 || d > 255) {
+        return -1;
+    }
+    SetMem(ip, sizeof(*ip), 0);
+    ip->v4.Addr[0] = (UINT8)a;
+    ip->v4.Addr[1] = (UINT8)b;
+    ip->v4.Addr[2] = (UINT8)c;
+    ip->v4.Addr[3] = (UINT8)d;
+    return 0;
+}
+
+// A null src_ip sends from the station address
+static int pxe_udp_write(UINT16 op_flags, EFI_IP_ADDRESS* src_ip, uint16_t src_port, const char* dest_ip,
+                         uint16_t dest_port, const void* data, int len) {
+    EFI_PXE_BASE_CODE* pxe = pxe_udp_base_code();
+    EFI_IP_ADDRESS dest;
+    if (!pxe || len < 0 || pxe_udp_parse_ip(dest_ip, &dest) != 0) {
+        return -1;
+    }
+
+    EFI_PXE_BASE_CODE_UDP_PORT dport = dest_port;
+    EFI_PXE_BASE_CODE_UDP_PORT sport = src_port;
+    UINTN size = (UINTN)len;
+    EFI_STATUS status = pxe->UdpWrite(pxe, op_flags, &dest, &dport, nullptr, src_ip, &sport,
+                                      nullptr, nullptr, &size, (VOID*)data);
+    return EFI_ERROR(status) ? -1 : len;
+}
+
+// Any source, and any destination address so broadcast replies (DHCP OFFER
+// and ACK before we are bound) get through; any of our ports when dest_port
+// is wanted back
+static int pxe_udp_read(char* src_ip, uint16_t* src_port, uint16_t* dest_port, void* buf, int maxlen, int timeout_ms) {
+    EFI_PXE_BASE_CODE* pxe = pxe_udp_base_code();
+    if (!pxe || maxlen <= 0) {
+        return -1;
+    }
+
+    EFI_EVENT timer = nullptr;
+    if (timeout_ms > 0) {
+        if (EFI_ERROR(gBS->CreateEvent(EVT_TIMER, 0, nullptr, nullptr, &timer))) {
+            return -1;
+        }
+        gBS->SetTimer(timer, TimerRelative, (UINT64)timeout_ms * 10000);
+    }
+
+    int got = 0;
+    for (;;) {
+        EFI_IP_ADDRESS sip, dip;
+        EFI_PXE_BASE_CODE_UDP_PORT sport = 0, dport = 0;
+        UINTN size = (UINTN)maxlen;
+        CopyMem(&dip, &pxe->Mode->StationIp, sizeof(dip));
+        EFI_STATUS status = pxe->UdpRead(pxe,
+                                         EFI_PXE_BASE_CODE_UDP_OPFLAGS_ANY_SRC_IP |
+                                         EFI_PXE_BASE_CODE_UDP_OPFLAGS_ANY_SRC_PORT |
+                                         EFI_PXE_BASE_CODE_UDP_OPFLAGS_ANY_DEST_IP |
+                                         EFI_PXE_BASE_CODE_UDP_OPFLAGS_ANY_DEST_PORT,
+                                         &dip, &dport, &sip, &sport, nullptr, nullptr, &size, buf);
+        if (!EFI_ERROR(status)) {
+            if (src_ip) {
+                snprintf(src_ip, 16, "%u.%u.%u.%u", sip.v4.Addr[0], sip.v4.Addr[1], sip.v4.Addr[2], sip.v4.Addr[3]);
+            }
+            if (src_port) *src_port = sport;
+            if (dest_port) *dest_port = dport;
+            got = (int)size;
+            break;
+        }
+        if (status != EFI_TIMEOUT || !timer || gBS->CheckEvent(timer) == EFI_SUCCESS) {
+            got = status == EFI_TIMEOUT ? 0 : -1;
+            break;
+        }
+    }
+
+    if (timer) gBS->CloseEvent(timer);
+    return got;
+}
+
+extern "C" int pxe_udp_send(const char* dest_ip, uint16_t dest_port, const void* data, int len) {
+    return pxe_udp_write(EFI_PXE_BASE_CODE_UDP_OPFLAGS_ANY_SRC_PORT, nullptr, 0, dest_ip, dest_port, data, len);
+}
+
+// DHCP before a lease: from 0.0.0.0 on a fixed port, to 255.255.255.255
+extern "C" int pxe_udp_broadcast(uint16_t src_port, uint16_t dest_port, const void* data, int len) {
+    EFI_IP_ADDRESS any;
+    SetMem(&any, sizeof(any), 0);
+    return pxe_udp_write(0, &any, src_port, "255.255.255.255", dest_port, data, len);
+}
+
+extern "C" int pxe_udp_recv(char* src_ip, uint16_t* src_port, void* buf, int maxlen, int timeout_ms) {
+    return pxe_udp_read(src_ip, src_port, nullptr, buf, maxlen, timeout_ms);
+}
+
+// TFTP sessions are told apart by our port, so each sends from its own
+extern "C" int pxe_udp_send_from(uint16_t src_port, const char* dest_ip, uint16_t dest_port, const void* data, int len) {
+    return pxe_udp_write(0, nullptr, src_port, dest_ip, dest_port, data, len);
+}
+
+extern "C" int pxe_udp_recv_any(char* src_ip, uint16_t* src_port, uint16_t* dest_port, void* buf, int maxlen, int timeout_ms) {
+    return pxe_udp_read(src_ip, src_port, dest_port, buf, maxlen, timeout_ms);
+}
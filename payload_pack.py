@@ -0,0 +1,156 @@
+# payload_pack.py
+#
+# This file is part of BloodHorn and is licensed under the BSD License.
+# See the root of the repository for license details.
+#
+
+"""
+BloodHorn Encrypted Payload Packer
+
+Wraps a kernel or initrd in the chunked AEAD container read by
+security/payload.c, so it can be kept encrypted on disk or on a TFTP server
+and is decrypted and verified chunk by chunk while the bootloader loads it.
+Compress the image first if you want it compressed; the container is
+opaque to compression.
+
+    python3 payload_pack.py pack --key key.bin vmlinuz.zst vmlinuz.bhp
+    python3 payload_pack.py unpack --key key.bin vmlinuz.bhp vmlinuz.zst
+
+The key is 32 raw bytes (or 64 hex digits). Its ID defaults to the first 16
+bytes of SHA-256 of the key, which is what the bootloader assumes for a
+key file named by payload_key in the [security] config section; keys with
+another ID have to be registered with payload_add_key() by platform code.
+"""
+
+import argparse
+import hashlib
+import os
+import struct
+import sys
+
+try:
+    from cryptography.hazmat.primitives.ciphers.aead import AESGCM, ChaCha20Poly1305
+except ImportError:
+    sys.exit("payload_pack.py needs the 'cryptography' package (pip install cryptography)")
+
+MAGIC = b"BHPK"
+VERSION = 1
+HEADER_SIZE = 64
+TAG_SIZE = 16
+MIN_CHUNK = 4096
+MAX_CHUNK = 16 * 1024 * 1024
+DEFAULT_CHUNK = 256 * 1024
+
+ALGORITHMS = {
+    "aes256-gcm": (1, AESGCM),
+    "chacha20-poly1305": (2, ChaCha20Poly1305),
+}
+
+# magic, version, alg, reserved, chunk_size, chunk_count, payload_size,
+# key_id, nonce, reserved
+HEADER = struct.Struct("<4sHBBIIQ16s12s12s")
+
+
+def read_key(path):
+    with open(path, "rb") as f:
+        raw = f.read()
+    text = raw.strip()
+    if len(text) == 64:
+        try:
+            return bytes.fromhex(text.decode("ascii"))
+        except ValueError:
+            pass
+    if len(raw) != 32:
+        sys.exit(f"{path}: expected 32 raw bytes or 64 hex digits")
+    return raw
+
+
+def chunk_nonce(nonce, index):
+    tail = struct.unpack(">I", nonce[8:])[0] ^ index
+    return nonce[:8] + struct.pack(">I", tail)
+
+
+def pack(data, key, key_id, alg, chunk_size):
+    if not data:
+        sys.exit("refusing to pack an empty file")
+    if len(data) > 0xFFFFFFFF:
+        sys.exit("payloads are limited to 4 GiB")
+    alg_id, cipher_cls = ALGORITHMS[alg]
+    cipher = cipher_cls(key)
+    count = (len(data) + chunk_size - 1) // chunk_size
+    nonce = os.urandom(12)
+    header = HEADER.pack(MAGIC, VERSION, alg_id, 0, chunk_size, count, len(data),
+                         key_id, nonce, bytes(12))
+
+    tags, chunks = [], []
+    for i in range(count):
+        sealed = cipher.encrypt(chunk_nonce(nonce, i), data[i * chunk_size:(i + 1) * chunk_size], header)
+        chunks.append(sealed[:-TAG_SIZE])
+        tags.append(sealed[-TAG_SIZE:])
+    return header + b"".join(tags) + b"".join(chunks)
+
+
+def unpack(blob, key):
+    if len(blob) < HEADER_SIZE:
+        sys.exit("not a BloodHorn payload")
+    header = blob[:HEADER_SIZE]
+    magic, version, alg_id, _, chunk_size, count, size, _, nonce, _ = HEADER.unpack(header)
+    if magic != MAGIC or version != VERSION:
+        sys.exit("not a BloodHorn payload")
+    cipher_cls = next((cls for aid, cls in ALGORITHMS.values() if aid == alg_id), None)
+    if cipher_cls is None or len(blob) != HEADER_SIZE + count * TAG_SIZE + size:
+        sys.exit("malformed payload")
+
+    cipher = cipher_cls(key)
+    tags = blob[HEADER_SIZE:HEADER_SIZE + count * TAG_SIZE]
+    body = blob[HEADER_SIZE + count * TAG_SIZE:]
+    out = []
+    for i in range(count):
+        chunk = body[i * chunk_size:(i + 1) * chunk_size]
+        tag = tags[i * TAG_SIZE:(i + 1) * TAG_SIZE]
+        try:
+            out.append(cipher.decrypt(chunk_nonce(nonce, i), chunk + tag, header))
+        except Exception:
+            sys.exit(f"chunk {i} failed authentication")
+    return b"".join(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Pack or unpack BloodHorn encrypted payloads")
+    sub = parser.add_subparsers(dest="command", required=True)
+
+    p = sub.add_parser("pack", help="encrypt an image")
+    p.add_argument("--key", required=True, help="file with the 32-byte key")
+    p.add_argument("--key-id", help="16-byte key ID in hex (default: SHA-256 of the key)")
+    p.add_argument("--alg", choices=sorted(ALGORITHMS), default="aes256-gcm")
+    p.add_argument("--chunk-size", type=int, default=DEFAULT_CHUNK)
+    p.add_argument("input")
+    p.add_argument("output")
+
+    u = sub.add_parser("unpack", help="decrypt and verify a payload")
+    u.add_argument("--key", required=True, help="file with the 32-byte key")
+    u.add_argument("input")
+    u.add_argument("output")
+
+    args = parser.parse_args()
+    key = read_key(args.key)
+    with open(args.input, "rb") as f:
+        data = f.read()
+
+    if args.command == "pack":
+        if not MIN_CHUNK <= args.chunk_size <= MAX_CHUNK:
+            sys.exit(f"chunk size must be between {MIN_CHUNK} and {MAX_CHUNK}")
+        key_id = bytes.fromhex(args.key_id) if args.key_id else hashlib.sha256(key).digest()[:16]
+        if len(key_id) != 16:
+            sys.exit("key ID must be 16 bytes")
+        result = pack(data, key, key_id, args.alg, args.chunk_size)
+    else:
+        result = unpack(data, key)
+
+    with open(args.output, "wb") as f:
+        f.write(result)
+    print(f"{args.input}: {len(data)} -> {args.output}: {len(result)} bytes")
+
+
+if __name__ == "__main__":
+    main()
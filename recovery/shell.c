@@ -9,9 +9,11 @@
 #include "compat.h"
 #include <string.h>
 #include "shell.h"
+#include "shell_net.h"
 
 #define MAX_CMD_LEN 256
 #define MAX_ARGS 16
+#define MAX_OUTPUT 4096
 
 static char cmd_buffer[MAX_CMD_LEN];
 static char* args[MAX_ARGS];
@@ -42,6 +44,8 @@ void shell_execute_command(void) {
         printf("  cat <file> - Show file contents\n");
         printf("  reboot   - Reboot system\n");
         printf("  clear    - Clear screen\n");
+        printf("  ifconfig - Show network configuration\n");
+        printf("  netstat  - Show network boot statistics\n");
     } else if (strcmp(args[0], "ls") == 0) {
         printf("Filesystem not mounted\n");
     } else if (strcmp(args[0], "cat") == 0) {
@@ -55,6 +59,11 @@ void shell_execute_command(void) {
         // Call reboot function
     } else if (strcmp(args[0], "clear") == 0) {
         printf("\033[2J\033[H");
+    } else if (strcmp(args[0], "ifconfig") == 0 || strcmp(args[0], "netstat") == 0) {
+        static char output[MAX_OUTPUT];
+        if (args[0][0] == 'i') shell_cmd_ifconfig(output, sizeof(output));
+        else shell_cmd_netstat(output, sizeof(output));
+        printf("%s", output);
     } else {
         printf("Unknown command: %s\n", args[0]);
     }
@@ -11,7 +11,7 @@
 #include <stdio.h>
 
 int shell_cmd_help(char* out, int maxlen) {
-    const char* help = "help clear reboot ls cat exit";
+    const char* help = "help clear reboot ls cat ifconfig netstat exit";
     int len = strlen(help);
     if (len > maxlen - 1) len = maxlen - 1;
     memcpy(out, help, len); out[len] = 0;
@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include "net/pxe.h"
+#include "net/net_stats.h"
 
 // Minimal ICMP echo implementation using PXE stack (if supported)
 // Returns 0 on success, -1 on failure
@@ -39,14 +40,28 @@ int shell_cmd_ifconfig(char* out, int maxlen) {
     uint8_t* mask = (uint8_t*)&info->subnet_mask;
     uint8_t* gw = (uint8_t*)&info->router_ip;
     uint8_t* dns = (uint8_t*)&info->dns_server;
+    struct net_counters total;
+    memset(&total, 0, sizeof(total));
+    for (int p = 0; p < NET_PHASE_COUNT; p++) {
+        net_counters_add(&total, net_stats_phase((enum net_phase)p));
+    }
     snprintf(out, maxlen,
-        "eth0: %u.%u.%u.%u\n  netmask: %u.%u.%u.%u\n  gateway: %u.%u.%u.%u\n  dns: %u.%u.%u.%u\n  tftp: %s\n  bootfile: %s\n  domain: %s\n",
+        "eth0: %u.%u.%u.%u\n  netmask: %u.%u.%u.%u\n  gateway: %u.%u.%u.%u\n  dns: %u.%u.%u.%u\n  tftp: %s\n  bootfile: %s\n  domain: %s\n"
+        "  RX packets %llu  bytes %llu\n  TX packets %llu  bytes %llu\n  retransmits %u  timeouts %u\n",
         ip[0], ip[1], ip[2], ip[3],
         mask[0], mask[1], mask[2], mask[3],
         gw[0], gw[1], gw[2], gw[3],
         dns[0], dns[1], dns[2], dns[3],
         info->tftp_server,
         info->boot_file,
-        info->domain_name);
+        info->domain_name,
+        (unsigned long long)total.rx_packets, (unsigned long long)total.rx_bytes,
+        (unsigned long long)total.tx_packets, (unsigned long long)total.tx_bytes,
+        total.retransmits, total.timeouts);
     return 0;
+}
+
+// Per-phase and per-transfer counters with RTT histograms
+int shell_cmd_netstat(char* out, int maxlen) {
+    return net_stats_format(out, maxlen) < 0 ? -1 : 0;
 } 
\ No newline at end of file
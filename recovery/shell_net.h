@@ -9,4 +9,5 @@
 #define BLOODHORN_SHELL_NET_H
 int shell_cmd_ping(const char* host, char* out, int maxlen);
 int shell_cmd_ifconfig(char* out, int maxlen);
+int shell_cmd_netstat(char* out, int maxlen);
 #endif 
\ No newline at end of file
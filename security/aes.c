@@ -299,51 +299,129 @@ int crypto_aes_cbc_decrypt(const crypto_aes_ctx_t* ctx, const uint8_t* iv, const
 }
 
 // GCM mode helper functions
+static uint64_t gcm_load_be64(const uint8_t* p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) v = (v << 8) | p[i];
+    return v;
+}
+
+static void gcm_store_be64(uint8_t* p, uint64_t v) {
+    for (int i = 7; i >= 0; i--) {
+        p[i] = (uint8_t)v;
+        v >>= 8;
+    }
+}
+
 void aes_gcm_gf_mult(const uint8_t* a, const uint8_t* b, uint8_t* result) {
-    uint8_t z[16] = {0};
-    uint8_t v[16];
-    memcpy(v, b, 16);
-    
-    for (int i = 0; i < 16; i++) {
-        for (int j = 0; j < 8; j++) {
-            if (a[i] & (1 << (7-j))) {
-                for (int k = 0; k < 16; k++) {
-                    z[k] ^= v[k];
-                }
-            }
-            
-            int lsb = v[15] & 1;
-            for (int k = 15; k > 0; k--) {
-                v[k] = (v[k] >> 1) | ((v[k-1] & 1) << 7);
-            }
-            v[0] >>= 1;
-            if (lsb) v[0] ^= 0xe1;
+    uint64_t xh = gcm_load_be64(a), xl = gcm_load_be64(a + 8);
+    uint64_t vh = gcm_load_be64(b), vl = gcm_load_be64(b + 8);
+    uint64_t zh = 0, zl = 0;
+
+    for (int i = 0; i < 128; i++) {
+        uint64_t bit = (i < 64) ? (xh >> (63 - i)) & 1 : (xl >> (127 - i)) & 1;
+        uint64_t mask = 0 - bit;
+        zh ^= vh & mask;
+        zl ^= vl & mask;
+        uint64_t lsb = 0 - (vl & 1);
+        vl = (vl >> 1) | (vh << 63);
+        vh = (vh >> 1) ^ (0xE100000000000000ULL & lsb);
+    }
+
+    gcm_store_be64(result, zh);
+    gcm_store_be64(result + 8, zl);
+}
+
+// Per-key GHASH state: multiples of H for every 4-bit value, so one block
+// costs 32 table lookups instead of 128 shift-and-adds
+typedef struct {
+    uint64_t hl[16];
+    uint64_t hh[16];
+    uint8_t y[16];
+} aes_gcm_hash_t;
+
+static const uint64_t gcm_last4[16] = {
+    0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+    0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0
+};
+
+static void gcm_hash_init(aes_gcm_hash_t* g, const uint8_t h[16]) {
+    uint64_t vh = gcm_load_be64(h), vl = gcm_load_be64(h + 8);
+
+    g->hl[0] = 0;
+    g->hh[0] = 0;
+    g->hl[8] = vl;
+    g->hh[8] = vh;
+    for (int i = 4; i > 0; i >>= 1) {
+        uint64_t t = (vl & 1) * 0xE1000000ULL;
+        vl = (vh << 63) | (vl >> 1);
+        vh = (vh >> 1) ^ (t << 32);
+        g->hl[i] = vl;
+        g->hh[i] = vh;
+    }
+    for (int i = 2; i <= 8; i *= 2) {
+        for (int j = 1; j < i; j++) {
+            g->hh[i + j] = g->hh[i] ^ g->hh[j];
+            g->hl[i + j] = g->hl[i] ^ g->hl[j];
         }
     }
-    
-    memcpy(result, z, 16);
+    memset(g->y, 0, 16);
 }
 
-void aes_gcm_ghash(const uint8_t* h, const uint8_t* data, uint32_t len, uint8_t* result) {
-    uint8_t y[16] = {0};
-    
-    for (uint32_t i = 0; i < len; i += 16) {
-        uint8_t block[16] = {0};
-        uint32_t block_len = (len - i < 16) ? (len - i) : 16;
-        memcpy(block, data + i, block_len);
-        
-        for (int j = 0; j < 16; j++) {
-            y[j] ^= block[j];
+static void gcm_hash_mult(const aes_gcm_hash_t* g, uint8_t x[16]) {
+    uint8_t lo = x[15] & 0x0F;
+    uint64_t zh = g->hh[lo], zl = g->hl[lo];
+
+    for (int i = 15; i >= 0; i--) {
+        uint8_t hi = x[i] >> 4;
+        uint8_t rem;
+
+        if (i != 15) {
+            lo = x[i] & 0x0F;
+            rem = (uint8_t)(zl & 0x0F);
+            zl = (zh << 60) | (zl >> 4);
+            zh = (zh >> 4) ^ (gcm_last4[rem] << 48);
+            zh ^= g->hh[lo];
+            zl ^= g->hl[lo];
         }
-        
-        aes_gcm_gf_mult(y, h, y);
+        rem = (uint8_t)(zl & 0x0F);
+        zl = (zh << 60) | (zl >> 4);
+        zh = (zh >> 4) ^ (gcm_last4[rem] << 48);
+        zh ^= g->hh[hi];
+        zl ^= g->hl[hi];
     }
-    
-    memcpy(result, y, 16);
+
+    gcm_store_be64(x, zh);
+    gcm_store_be64(x + 8, zl);
+}
+
+// Absorb data zero-padded to whole blocks, continuing from g->y
+static void gcm_hash_update(aes_gcm_hash_t* g, const uint8_t* data, uint32_t len) {
+    while (len > 0) {
+        uint32_t n = len < 16 ? len : 16;
+        for (uint32_t i = 0; i < n; i++) g->y[i] ^= data[i];
+        gcm_hash_mult(g, g->y);
+        data += n;
+        len -= n;
+    }
+}
+
+static void gcm_hash_lengths(aes_gcm_hash_t* g, uint64_t a_bytes, uint64_t c_bytes) {
+    uint8_t len_block[16];
+    gcm_store_be64(len_block, a_bytes * 8);
+    gcm_store_be64(len_block + 8, c_bytes * 8);
+    gcm_hash_update(g, len_block, 16);
+}
+
+void aes_gcm_ghash(const uint8_t* h, const uint8_t* data, uint32_t len, uint8_t* result) {
+    aes_gcm_hash_t g;
+    gcm_hash_init(&g, h);
+    gcm_hash_update(&g, data, len);
+    memcpy(result, g.y, 16);
+    crypto_memzero_secure(&g, sizeof(g));
 }
 
 void aes_gcm_inc32(uint8_t* block) {
-    uint32_t counter = (block[12] << 24) | (block[13] << 16) | (block[14] << 8) | block[15];
+    uint32_t counter = ((uint32_t)block[12] << 24) | ((uint32_t)block[13] << 16) | ((uint32_t)block[14] << 8) | block[15];
     counter++;
     block[12] = (counter >> 24) & 0xFF;
     block[13] = (counter >> 16) & 0xFF;
@@ -351,162 +429,102 @@ void aes_gcm_inc32(uint8_t* block) {
     block[15] = counter & 0xFF;
 }
 
-// GCM mode implementation
-int crypto_aes_gcm_encrypt(const crypto_aes_ctx_t* ctx, const uint8_t* iv, uint32_t iv_len, const uint8_t* aad, uint32_t aad_len, const uint8_t* plaintext, uint32_t len, uint8_t* ciphertext, uint8_t* tag) {
-    if (!ctx || !iv || !ciphertext || !tag) return CRYPTO_ERROR_INVALID_PARAM;
-    
+// H = E(K, 0^128) and the pre-counter block J0 (SP 800-38D 7.1)
+static void gcm_setup(const crypto_aes_ctx_t* ctx, const uint8_t* iv, uint32_t iv_len, aes_gcm_hash_t* g, uint8_t j0[16]) {
     uint8_t h[16] = {0};
-    uint8_t j0[16] = {0};
-    uint8_t ghash_result[16] = {0};
-    
-    // Calculate H = E(K, 0^128)
+
     crypto_aes_encrypt_block(ctx, h, h);
-    
-    // Calculate J0
+    gcm_hash_init(g, h);
+    crypto_memzero_secure(h, sizeof(h));
+
     if (iv_len == 12) {
         memcpy(j0, iv, 12);
+        j0[12] = 0;
+        j0[13] = 0;
+        j0[14] = 0;
         j0[15] = 1;
     } else {
-        // For IV lengths != 12, use GHASH
-        aes_gcm_ghash(h, iv, iv_len, j0);
-        uint8_t len_block[16] = {0};
-        uint64_t iv_bits = iv_len * 8;
-        len_block[8] = (iv_bits >> 56) & 0xFF;
-        len_block[9] = (iv_bits >> 48) & 0xFF;
-        len_block[10] = (iv_bits >> 40) & 0xFF;
-        len_block[11] = (iv_bits >> 32) & 0xFF;
-        len_block[12] = (iv_bits >> 24) & 0xFF;
-        len_block[13] = (iv_bits >> 16) & 0xFF;
-        len_block[14] = (iv_bits >> 8) & 0xFF;
-        len_block[15] = iv_bits & 0xFF;
-        aes_gcm_gf_mult(j0, h, j0);
-        for (int i = 0; i < 16; i++) j0[i] ^= len_block[i];
-        aes_gcm_gf_mult(j0, h, j0);
+        gcm_hash_update(g, iv, iv_len);
+        gcm_hash_lengths(g, 0, iv_len);
+        memcpy(j0, g->y, 16);
+        memset(g->y, 0, 16);
     }
-    
-    // Encrypt plaintext
+}
+
+static void gcm_ctr(const crypto_aes_ctx_t* ctx, const uint8_t j0[16], const uint8_t* in, uint32_t len, uint8_t* out) {
     uint8_t counter[16];
+    uint8_t keystream[16];
+
     memcpy(counter, j0, 16);
-    aes_gcm_inc32(counter);
-    
     for (uint32_t i = 0; i < len; i += AES_BLOCK_SIZE) {
-        uint8_t keystream[16];
+        aes_gcm_inc32(counter);
         crypto_aes_encrypt_block(ctx, counter, keystream);
-        
+
         uint32_t block_len = (len - i < AES_BLOCK_SIZE) ? (len - i) : AES_BLOCK_SIZE;
         for (uint32_t j = 0; j < block_len; j++) {
-            ciphertext[i + j] = plaintext[i + j] ^ keystream[j];
+            out[i + j] = in[i + j] ^ keystream[j];
         }
-        
-        aes_gcm_inc32(counter);
-        crypto_memzero_secure(keystream, sizeof(keystream));
-    }
-    
-    // Calculate authentication tag
-    uint8_t s[16] = {0};
-    
-    // GHASH(H, A)
-    if (aad && aad_len > 0) {
-        aes_gcm_ghash(h, aad, aad_len, s);
-    }
-    
-    // GHASH(H, C)
-    if (len > 0) {
-        aes_gcm_ghash(h, ciphertext, len, ghash_result);
-        for (int i = 0; i < 16; i++) s[i] ^= ghash_result[i];
-        aes_gcm_gf_mult(s, h, s);
     }
-    
-    // Add length block
-    uint8_t len_block[16] = {0};
-    uint64_t aad_bits = aad_len * 8;
-    uint64_t c_bits = len * 8;
-    len_block[0] = (aad_bits >> 56) & 0xFF;
-    len_block[1] = (aad_bits >> 48) & 0xFF;
-    len_block[2] = (aad_bits >> 40) & 0xFF;
-    len_block[3] = (aad_bits >> 32) & 0xFF;
-    len_block[4] = (aad_bits >> 24) & 0xFF;
-    len_block[5] = (aad_bits >> 16) & 0xFF;
-    len_block[6] = (aad_bits >> 8) & 0xFF;
-    len_block[7] = aad_bits & 0xFF;
-    len_block[8] = (c_bits >> 56) & 0xFF;
-    len_block[9] = (c_bits >> 48) & 0xFF;
-    len_block[10] = (c_bits >> 40) & 0xFF;
-    len_block[11] = (c_bits >> 32) & 0xFF;
-    len_block[12] = (c_bits >> 24) & 0xFF;
-    len_block[13] = (c_bits >> 16) & 0xFF;
-    len_block[14] = (c_bits >> 8) & 0xFF;
-    len_block[15] = c_bits & 0xFF;
-    
-    for (int i = 0; i < 16; i++) s[i] ^= len_block[i];
-    aes_gcm_gf_mult(s, h, s);
-    
-    // Final tag = E(K, J0) XOR S
-    uint8_t j0_encrypted[16];
-    crypto_aes_encrypt_block(ctx, j0, j0_encrypted);
+
+    crypto_memzero_secure(counter, sizeof(counter));
+    crypto_memzero_secure(keystream, sizeof(keystream));
+}
+
+// T = E(K, J0) XOR GHASH(A || C || len(A) || len(C))
+static void gcm_tag(const crypto_aes_ctx_t* ctx, aes_gcm_hash_t* g, const uint8_t j0[16], const uint8_t* aad, uint32_t aad_len, const uint8_t* ciphertext, uint32_t len, uint8_t tag[16]) {
+    uint8_t ek_j0[16];
+
+    if (aad && aad_len > 0) gcm_hash_update(g, aad, aad_len);
+    gcm_hash_update(g, ciphertext, len);
+    gcm_hash_lengths(g, aad ? aad_len : 0, len);
+
+    crypto_aes_encrypt_block(ctx, j0, ek_j0);
     for (int i = 0; i < 16; i++) {
-        tag[i] = s[i] ^ j0_encrypted[i];
+        tag[i] = g->y[i] ^ ek_j0[i];
     }
-    
-    crypto_memzero_secure(counter, sizeof(counter));
-    crypto_memzero_secure(j0_encrypted, sizeof(j0_encrypted));
-    crypto_memzero_secure(s, sizeof(s));
-    
+    crypto_memzero_secure(ek_j0, sizeof(ek_j0));
+}
+
+// GCM mode implementation. Both directions work in place.
+int crypto_aes_gcm_encrypt(const crypto_aes_ctx_t* ctx, const uint8_t* iv, uint32_t iv_len, const uint8_t* aad, uint32_t aad_len, const uint8_t* plaintext, uint32_t len, uint8_t* ciphertext, uint8_t* tag) {
+    if (!ctx || !iv || iv_len == 0 || !tag) return CRYPTO_ERROR_INVALID_PARAM;
+    if (len > 0 && (!plaintext || !ciphertext)) return CRYPTO_ERROR_INVALID_PARAM;
+
+    aes_gcm_hash_t g;
+    uint8_t j0[16];
+
+    gcm_setup(ctx, iv, iv_len, &g, j0);
+    gcm_ctr(ctx, j0, plaintext, len, ciphertext);
+    gcm_tag(ctx, &g, j0, aad, aad_len, ciphertext, len, tag);
+
+    crypto_memzero_secure(&g, sizeof(g));
+    crypto_memzero_secure(j0, sizeof(j0));
     return CRYPTO_SUCCESS;
 }
 
 int crypto_aes_gcm_decrypt(const crypto_aes_ctx_t* ctx, const uint8_t* iv, uint32_t iv_len, const uint8_t* aad, uint32_t aad_len, const uint8_t* ciphertext, uint32_t len, const uint8_t* tag, uint8_t* plaintext) {
-    if (!ctx || !iv || !ciphertext || !tag || !plaintext) return CRYPTO_ERROR_INVALID_PARAM;
-    
-    // First verify the tag
+    if (!ctx || !iv || iv_len == 0 || !tag) return CRYPTO_ERROR_INVALID_PARAM;
+    if (len > 0 && (!plaintext || !ciphertext)) return CRYPTO_ERROR_INVALID_PARAM;
+
+    aes_gcm_hash_t g;
+    uint8_t j0[16];
     uint8_t computed_tag[16];
-    
-    // Temporarily decrypt to compute tag (we'll do it again if verification passes)
-    uint8_t temp_plaintext[len];
-    
-    uint8_t h[16] = {0};
-    crypto_aes_encrypt_block(ctx, h, h);
-    
-    uint8_t j0[16] = {0};
-    if (iv_len == 12) {
-        memcpy(j0, iv, 12);
-        j0[15] = 1;
-    }
-    
-    uint8_t counter[16];
-    memcpy(counter, j0, 16);
-    aes_gcm_inc32(counter);
-    
-    // Decrypt for tag verification
-    for (uint32_t i = 0; i < len; i += AES_BLOCK_SIZE) {
-        uint8_t keystream[16];
-        crypto_aes_encrypt_block(ctx, counter, keystream);
-        
-        uint32_t block_len = (len - i < AES_BLOCK_SIZE) ? (len - i) : AES_BLOCK_SIZE;
-        for (uint32_t j = 0; j < block_len; j++) {
-            temp_plaintext[i + j] = ciphertext[i + j] ^ keystream[j];
-        }
-        
-        aes_gcm_inc32(counter);
-        crypto_memzero_secure(keystream, sizeof(keystream));
-    }
-    
-    // Compute tag using the decrypted plaintext
-    crypto_aes_gcm_encrypt(ctx, iv, iv_len, aad, aad_len, temp_plaintext, len, (uint8_t*)ciphertext, computed_tag);
-    
-    // Verify tag
+    int ret = CRYPTO_SUCCESS;
+
+    // Authenticate the ciphertext before any plaintext is produced
+    gcm_setup(ctx, iv, iv_len, &g, j0);
+    gcm_tag(ctx, &g, j0, aad, aad_len, ciphertext, len, computed_tag);
+
     if (crypto_memcmp_constant_time(tag, computed_tag, 16) != 0) {
-        crypto_memzero_secure(temp_plaintext, len);
-        crypto_memzero_secure(computed_tag, sizeof(computed_tag));
-        return CRYPTO_ERROR_VERIFICATION_FAILED;
+        ret = CRYPTO_ERROR_VERIFICATION_FAILED;
+    } else {
+        gcm_ctr(ctx, j0, ciphertext, len, plaintext);
     }
-    
-    // Tag verified, copy plaintext
-    memcpy(plaintext, temp_plaintext, len);
-    crypto_memzero_secure(temp_plaintext, len);
+
+    crypto_memzero_secure(&g, sizeof(g));
+    crypto_memzero_secure(j0, sizeof(j0));
     crypto_memzero_secure(computed_tag, sizeof(computed_tag));
-    
-    return CRYPTO_SUCCESS;
+    return ret;
 }
 
 // Hardware acceleration functions
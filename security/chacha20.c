@@ -0,0 +1,556 @@
+/*
+ * chacha20.c
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#include <stdint.h>
+#include "compat.h"
+#include <string.h>
+#include "crypto.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+// ChaCha20 and Poly1305 as in RFC 8439. Both have a scalar path that every
+// architecture uses; the vector paths below only take whole batches of
+// blocks and are chosen at compile time, like the checksum in net_utils.c.
+
+static uint32_t load_le32(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void store_le32(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static void store_le64(uint8_t* p, uint64_t v) {
+    store_le32(p, (uint32_t)v);
+    store_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+// ChaCha20
+
+#define CHACHA_ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define CHACHA_QR(a, b, c, d)                         \
+    a += b; d ^= a; d = CHACHA_ROTL(d, 16);           \
+    c += d; b ^= c; b = CHACHA_ROTL(b, 12);           \
+    a += b; d ^= a; d = CHACHA_ROTL(d, 8);            \
+    c += d; b ^= c; b = CHACHA_ROTL(b, 7)
+
+static void chacha20_block(const uint32_t input[16], uint8_t out[64]) {
+    uint32_t x[16];
+    memcpy(x, input, sizeof(x));
+
+    for (int i = 0; i < 10; i++) {
+        CHACHA_QR(x[0], x[4], x[8],  x[12]);
+        CHACHA_QR(x[1], x[5], x[9],  x[13]);
+        CHACHA_QR(x[2], x[6], x[10], x[14]);
+        CHACHA_QR(x[3], x[7], x[11], x[15]);
+        CHACHA_QR(x[0], x[5], x[10], x[15]);
+        CHACHA_QR(x[1], x[6], x[11], x[12]);
+        CHACHA_QR(x[2], x[7], x[8],  x[13]);
+        CHACHA_QR(x[3], x[4], x[9],  x[14]);
+    }
+
+    for (int i = 0; i < 16; i++) {
+        store_le32(out + i * 4, x[i] + input[i]);
+    }
+    crypto_memzero_secure(x, sizeof(x));
+}
+
+#if defined(__AVX2__) || defined(__SSE2__) || defined(__ARM_NEON) || defined(__ARM_NEON__)
+// Several consecutive blocks at once: vector i holds state word i of every
+// block, and lane k is the block with counter + k
+#if defined(__AVX2__)
+#define CHACHA_LANES 8
+typedef __m256i chacha_vec;
+#define CV_SET1(x)          _mm256_set1_epi32((int)(x))
+#define CV_ADD(a, b)        _mm256_add_epi32(a, b)
+#define CV_XOR(a, b)        _mm256_xor_si256(a, b)
+#define CV_ROTL(a, n)       _mm256_or_si256(_mm256_slli_epi32(a, n), _mm256_srli_epi32(a, 32 - (n)))
+#define CV_STORE(p, v)      _mm256_storeu_si256((__m256i*)(p), v)
+#define CV_LANE_INDEX()     _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)
+#elif defined(__SSE2__)
+#define CHACHA_LANES 4
+typedef __m128i chacha_vec;
+#define CV_SET1(x)          _mm_set1_epi32((int)(x))
+#define CV_ADD(a, b)        _mm_add_epi32(a, b)
+#define CV_XOR(a, b)        _mm_xor_si128(a, b)
+#define CV_ROTL(a, n)       _mm_or_si128(_mm_slli_epi32(a, n), _mm_srli_epi32(a, 32 - (n)))
+#define CV_STORE(p, v)      _mm_storeu_si128((__m128i*)(p), v)
+#define CV_LANE_INDEX()     _mm_setr_epi32(0, 1, 2, 3)
+#else
+#define CHACHA_LANES 4
+typedef uint32x4_t chacha_vec;
+static const uint32_t chacha_lane_index[4] = { 0, 1, 2, 3 };
+#define CV_SET1(x)          vdupq_n_u32(x)
+#define CV_ADD(a, b)        vaddq_u32(a, b)
+#define CV_XOR(a, b)        veorq_u32(a, b)
+#define CV_ROTL(a, n)       vsriq_n_u32(vshlq_n_u32(a, n), a, 32 - (n))
+#define CV_STORE(p, v)      vst1q_u32(p, v)
+#define CV_LANE_INDEX()     vld1q_u32(chacha_lane_index)
+#endif
+
+#define CHACHA_VQR(a, b, c, d)                                        \
+    a = CV_ADD(a, b); d = CV_XOR(d, a); d = CV_ROTL(d, 16);           \
+    c = CV_ADD(c, d); b = CV_XOR(b, c); b = CV_ROTL(b, 12);           \
+    a = CV_ADD(a, b); d = CV_XOR(d, a); d = CV_ROTL(d, 8);            \
+    c = CV_ADD(c, d); b = CV_XOR(b, c); b = CV_ROTL(b, 7)
+
+// XOR CHACHA_LANES blocks of keystream over in; in and out may be the same
+static void chacha20_blocks_vec(const uint32_t input[16], const uint8_t* in, uint8_t* out) {
+    chacha_vec init[16], x[16];
+    uint32_t words[16][CHACHA_LANES];
+
+    for (int i = 0; i < 16; i++) init[i] = CV_SET1(input[i]);
+    init[12] = CV_ADD(init[12], CV_LANE_INDEX());
+    for (int i = 0; i < 16; i++) x[i] = init[i];
+
+    for (int i = 0; i < 10; i++) {
+        CHACHA_VQR(x[0], x[4], x[8],  x[12]);
+        CHACHA_VQR(x[1], x[5], x[9],  x[13]);
+        CHACHA_VQR(x[2], x[6], x[10], x[14]);
+        CHACHA_VQR(x[3], x[7], x[11], x[15]);
+        CHACHA_VQR(x[0], x[5], x[10], x[15]);
+        CHACHA_VQR(x[1], x[6], x[11], x[12]);
+        CHACHA_VQR(x[2], x[7], x[8],  x[13]);
+        CHACHA_VQR(x[3], x[4], x[9],  x[14]);
+    }
+
+    for (int i = 0; i < 16; i++) {
+        CV_STORE(words[i], CV_ADD(x[i], init[i]));
+    }
+
+    for (int k = 0; k < CHACHA_LANES; k++) {
+        for (int i = 0; i < 16; i++) {
+            uint32_t off = k * 64 + i * 4;
+            store_le32(out + off, load_le32(in + off) ^ words[i][k]);
+        }
+    }
+    crypto_memzero_secure(words, sizeof(words));
+}
+#endif
+
+int crypto_chacha20_init(crypto_chacha20_ctx_t* ctx, const uint8_t* key, const uint8_t* nonce) {
+    if (!ctx || !key || !nonce) return CRYPTO_ERROR_INVALID_PARAM;
+
+    // "expand 32-byte k"
+    ctx->state[0] = 0x61707865;
+    ctx->state[1] = 0x3320646e;
+    ctx->state[2] = 0x79622d32;
+    ctx->state[3] = 0x6b206574;
+    for (int i = 0; i < 8; i++) {
+        ctx->state[4 + i] = load_le32(key + i * 4);
+    }
+    ctx->state[12] = 0;
+    for (int i = 0; i < 3; i++) {
+        ctx->state[13 + i] = load_le32(nonce + i * 4);
+    }
+    ctx->keystream_len = 0;
+    return CRYPTO_SUCCESS;
+}
+
+// Streams: a call may end mid-block, and the next one picks up the rest of
+// that block's keystream
+void crypto_chacha20_encrypt(crypto_chacha20_ctx_t* ctx, const uint8_t* plaintext, uint32_t len, uint8_t* ciphertext) {
+    if (!ctx || (len && (!plaintext || !ciphertext))) return;
+
+    while (ctx->keystream_len > 0 && len > 0) {
+        *ciphertext++ = *plaintext++ ^ ctx->keystream[64 - ctx->keystream_len--];
+        len--;
+    }
+
+#ifdef CHACHA_LANES
+    while (len >= CHACHA_LANES * 64) {
+        chacha20_blocks_vec(ctx->state, plaintext, ciphertext);
+        ctx->state[12] += CHACHA_LANES;
+        plaintext += CHACHA_LANES * 64;
+        ciphertext += CHACHA_LANES * 64;
+        len -= CHACHA_LANES * 64;
+    }
+#endif
+
+    while (len > 0) {
+        chacha20_block(ctx->state, ctx->keystream);
+        ctx->state[12]++;
+
+        uint32_t n = len < 64 ? len : 64;
+        for (uint32_t i = 0; i < n; i++) {
+            ciphertext[i] = plaintext[i] ^ ctx->keystream[i];
+        }
+        ctx->keystream_len = 64 - n;
+        plaintext += n;
+        ciphertext += n;
+        len -= n;
+    }
+}
+
+void crypto_chacha20_decrypt(crypto_chacha20_ctx_t* ctx, const uint8_t* ciphertext, uint32_t len, uint8_t* plaintext) {
+    crypto_chacha20_encrypt(ctx, ciphertext, len, plaintext);
+}
+
+// Poly1305, five 26-bit limbs
+
+#define POLY_MASK26 0x3ffffff
+
+// h = h * r mod 2^130 - 5, leaving every limb below 2^26 + 5 * 2^6
+static void poly1305_mul(uint32_t h[5], const uint32_t r[5]) {
+    uint32_t s1 = r[1] * 5, s2 = r[2] * 5, s3 = r[3] * 5, s4 = r[4] * 5;
+    uint64_t d0 = (uint64_t)h[0] * r[0] + (uint64_t)h[1] * s4 + (uint64_t)h[2] * s3 + (uint64_t)h[3] * s2 + (uint64_t)h[4] * s1;
+    uint64_t d1 = (uint64_t)h[0] * r[1] + (uint64_t)h[1] * r[0] + (uint64_t)h[2] * s4 + (uint64_t)h[3] * s3 + (uint64_t)h[4] * s2;
+    uint64_t d2 = (uint64_t)h[0] * r[2] + (uint64_t)h[1] * r[1] + (uint64_t)h[2] * r[0] + (uint64_t)h[3] * s4 + (uint64_t)h[4] * s3;
+    uint64_t d3 = (uint64_t)h[0] * r[3] + (uint64_t)h[1] * r[2] + (uint64_t)h[2] * r[1] + (uint64_t)h[3] * r[0] + (uint64_t)h[4] * s4;
+    uint64_t d4 = (uint64_t)h[0] * r[4] + (uint64_t)h[1] * r[3] + (uint64_t)h[2] * r[2] + (uint64_t)h[3] * r[1] + (uint64_t)h[4] * r[0];
+
+    uint32_t c;
+    c = (uint32_t)(d0 >> 26); h[0] = (uint32_t)d0 & POLY_MASK26;
+    d1 += c; c = (uint32_t)(d1 >> 26); h[1] = (uint32_t)d1 & POLY_MASK26;
+    d2 += c; c = (uint32_t)(d2 >> 26); h[2] = (uint32_t)d2 & POLY_MASK26;
+    d3 += c; c = (uint32_t)(d3 >> 26); h[3] = (uint32_t)d3 & POLY_MASK26;
+    d4 += c; c = (uint32_t)(d4 >> 26); h[4] = (uint32_t)d4 & POLY_MASK26;
+    h[0] += c * 5; c = h[0] >> 26; h[0] &= POLY_MASK26;
+    h[1] += c;
+}
+
+// Add one 16-byte block as 26-bit limbs; hibit is 2^128 for full blocks
+static void poly1305_add_block(uint32_t h[5], const uint8_t* m, uint32_t hibit) {
+    h[0] += load_le32(m) & POLY_MASK26;
+    h[1] += (load_le32(m + 3) >> 2) & POLY_MASK26;
+    h[2] += (load_le32(m + 6) >> 4) & POLY_MASK26;
+    h[3] += (load_le32(m + 9) >> 6) & POLY_MASK26;
+    h[4] += (load_le32(m + 12) >> 8) | hibit;
+}
+
+static void poly1305_blocks(crypto_poly1305_ctx_t* ctx, const uint8_t* m, uint32_t blocks, uint32_t hibit) {
+    for (uint32_t i = 0; i < blocks; i++, m += 16) {
+        poly1305_add_block(ctx->h, m, hibit);
+        poly1305_mul(ctx->h, ctx->r);
+    }
+}
+
+#if defined(__SSE2__) || defined(__ARM_NEON) || defined(__ARM_NEON__)
+// Two interleaved accumulators, one per 64-bit lane: A takes the even
+// blocks and B the odd ones, both multiplied by r^2 per pair. On the last
+// pair B uses r instead, so A + B equals the serial result. Products are
+// 32x32->64 multiplies of the low halves, which both ISAs do two at a time.
+#if defined(__SSE2__)
+typedef __m128i poly_vec;
+#define PV_PAIR(a, b)       _mm_set_epi32(0, (int)(b), 0, (int)(a))
+#define PV_MUL(a, b)        _mm_mul_epu32(a, b)
+#define PV_ADD(a, b)        _mm_add_epi64(a, b)
+#define PV_AND(a, b)        _mm_and_si128(a, b)
+#define PV_SHR(a, n)        _mm_srli_epi64(a, n)
+#define PV_SHL(a, n)        _mm_slli_epi64(a, n)
+#define PV_LANES(v, out)    _mm_storeu_si128((__m128i*)(out), v)
+#else
+typedef uint64x2_t poly_vec;
+static inline poly_vec pv_pair(uint32_t a, uint32_t b) {
+    uint64_t lanes[2] = { a, b };
+    return vld1q_u64(lanes);
+}
+#define PV_PAIR(a, b)       pv_pair(a, b)
+#define PV_MUL(a, b)        vmull_u32(vmovn_u64(a), vmovn_u64(b))
+#define PV_ADD(a, b)        vaddq_u64(a, b)
+#define PV_AND(a, b)        vandq_u64(a, b)
+#define PV_SHR(a, n)        vshrq_n_u64(a, n)
+#define PV_SHL(a, n)        vshlq_n_u64(a, n)
+#define PV_LANES(v, out)    vst1q_u64(out, v)
+#endif
+
+#define POLY_VEC_MIN_BLOCKS 8
+
+// blocks must be even and at least 2
+static void poly1305_blocks_x2(crypto_poly1305_ctx_t* ctx, const uint8_t* m, uint32_t blocks) {
+    poly_vec h[5], r[5], s[5], last_r[5], last_s[5];
+    poly_vec mask = PV_PAIR(POLY_MASK26, POLY_MASK26);
+    uint32_t a[5] = {0}, b[5] = {0};
+
+    for (int i = 0; i < 5; i++) {
+        r[i] = PV_PAIR(ctx->r2[i], ctx->r2[i]);
+        s[i] = PV_PAIR(ctx->r2[i] * 5, ctx->r2[i] * 5);
+        last_r[i] = PV_PAIR(ctx->r2[i], ctx->r[i]);
+        last_s[i] = PV_PAIR(ctx->r2[i] * 5, ctx->r[i] * 5);
+    }
+
+    memcpy(a, ctx->h, sizeof(a));
+    for (int i = 0; i < 5; i++) h[i] = PV_PAIR(a[i], 0);
+
+    for (uint32_t pair = 0; pair < blocks / 2; pair++, m += 32) {
+        memset(a, 0, sizeof(a));
+        memset(b, 0, sizeof(b));
+        poly1305_add_block(a, m, 1 << 24);
+        poly1305_add_block(b, m + 16, 1 << 24);
+        for (int i = 0; i < 5; i++) h[i] = PV_ADD(h[i], PV_PAIR(a[i], b[i]));
+
+        const poly_vec* rr = pair + 1 < blocks / 2 ? r : last_r;
+        const poly_vec* ss = pair + 1 < blocks / 2 ? s : last_s;
+
+        poly_vec d0 = PV_ADD(PV_ADD(PV_MUL(h[0], rr[0]), PV_MUL(h[1], ss[4])), PV_ADD(PV_MUL(h[2], ss[3]), PV_ADD(PV_MUL(h[3], ss[2]), PV_MUL(h[4], ss[1]))));
+        poly_vec d1 = PV_ADD(PV_ADD(PV_MUL(h[0], rr[1]), PV_MUL(h[1], rr[0])), PV_ADD(PV_MUL(h[2], ss[4]), PV_ADD(PV_MUL(h[3], ss[3]), PV_MUL(h[4], ss[2]))));
+        poly_vec d2 = PV_ADD(PV_ADD(PV_MUL(h[0], rr[2]), PV_MUL(h[1], rr[1])), PV_ADD(PV_MUL(h[2], rr[0]), PV_ADD(PV_MUL(h[3], ss[4]), PV_MUL(h[4], ss[3]))));
+        poly_vec d3 = PV_ADD(PV_ADD(PV_MUL(h[0], rr[3]), PV_MUL(h[1], rr[2])), PV_ADD(PV_MUL(h[2], rr[1]), PV_ADD(PV_MUL(h[3], rr[0]), PV_MUL(h[4], ss[4]))));
+        poly_vec d4 = PV_ADD(PV_ADD(PV_MUL(h[0], rr[4]), PV_MUL(h[1], rr[3])), PV_ADD(PV_MUL(h[2], rr[2]), PV_ADD(PV_MUL(h[3], rr[1]), PV_MUL(h[4], rr[0]))));
+
+        poly_vec c;
+        c = PV_SHR(d0, 26); h[0] = PV_AND(d0, mask);
+        d1 = PV_ADD(d1, c); c = PV_SHR(d1, 26); h[1] = PV_AND(d1, mask);
+        d2 = PV_ADD(d2, c); c = PV_SHR(d2, 26); h[2] = PV_AND(d2, mask);
+        d3 = PV_ADD(d3, c); c = PV_SHR(d3, 26); h[3] = PV_AND(d3, mask);
+        d4 = PV_ADD(d4, c); c = PV_SHR(d4, 26); h[4] = PV_AND(d4, mask);
+        h[0] = PV_ADD(h[0], PV_ADD(c, PV_SHL(c, 2)));
+        c = PV_SHR(h[0], 26); h[0] = PV_AND(h[0], mask);
+        h[1] = PV_ADD(h[1], c);
+    }
+
+    // Fold the lanes; limbs stay far below 2^32, so plain adds are enough
+    for (int i = 0; i < 5; i++) {
+        uint64_t lanes[2];
+        PV_LANES(h[i], lanes);
+        ctx->h[i] = (uint32_t)(lanes[0] + lanes[1]);
+    }
+    uint32_t carry = 0;
+    for (int i = 0; i < 5; i++) {
+        ctx->h[i] += carry;
+        carry = ctx->h[i] >> 26;
+        ctx->h[i] &= POLY_MASK26;
+    }
+    ctx->h[0] += carry * 5;
+
+    crypto_memzero_secure(a, sizeof(a));
+    crypto_memzero_secure(b, sizeof(b));
+}
+#endif
+
+int crypto_poly1305_init(crypto_poly1305_ctx_t* ctx, const uint8_t* key) {
+    if (!ctx || !key) return CRYPTO_ERROR_INVALID_PARAM;
+
+    // r with the clamping from RFC 8439 2.5, split into 26-bit limbs
+    ctx->r[0] = load_le32(key) & 0x3ffffff;
+    ctx->r[1] = (load_le32(key + 3) >> 2) & 0x3ffff03;
+    ctx->r[2] = (load_le32(key + 6) >> 4) & 0x3ffc0ff;
+    ctx->r[3] = (load_le32(key + 9) >> 6) & 0x3f03fff;
+    ctx->r[4] = (load_le32(key + 12) >> 8) & 0x00fffff;
+
+    memcpy(ctx->r2, ctx->r, sizeof(ctx->r2));
+    poly1305_mul(ctx->r2, ctx->r);
+
+    for (int i = 0; i < 4; i++) {
+        ctx->pad[i] = load_le32(key + 16 + i * 4);
+    }
+    memset(ctx->h, 0, sizeof(ctx->h));
+    ctx->buf_len = 0;
+    return CRYPTO_SUCCESS;
+}
+
+int crypto_poly1305_update(crypto_poly1305_ctx_t* ctx, const uint8_t* data, uint32_t len) {
+    if (!ctx || (!data && len)) return CRYPTO_ERROR_INVALID_PARAM;
+
+    if (ctx->buf_len > 0) {
+        uint32_t take = 16 - ctx->buf_len;
+        if (take > len) take = len;
+        memcpy(ctx->buf + ctx->buf_len, data, take);
+        ctx->buf_len += take;
+        data += take;
+        len -= take;
+        if (ctx->buf_len < 16) return CRYPTO_SUCCESS;
+        poly1305_blocks(ctx, ctx->buf, 1, 1 << 24);
+        ctx->buf_len = 0;
+    }
+
+    uint32_t blocks = len / 16;
+#if defined(__SSE2__) || defined(__ARM_NEON) || defined(__ARM_NEON__)
+    if (blocks >= POLY_VEC_MIN_BLOCKS) {
+        uint32_t even = blocks & ~1u;
+        poly1305_blocks_x2(ctx, data, even);
+        data += even * 16;
+        len -= even * 16;
+        blocks -= even;
+    }
+#endif
+    poly1305_blocks(ctx, data, blocks, 1 << 24);
+    data += blocks * 16;
+    len -= blocks * 16;
+
+    if (len > 0) {
+        memcpy(ctx->buf, data, len);
+        ctx->buf_len = len;
+    }
+    return CRYPTO_SUCCESS;
+}
+
+int crypto_poly1305_final(crypto_poly1305_ctx_t* ctx, uint8_t* tag) {
+    if (!ctx || !tag) return CRYPTO_ERROR_INVALID_PARAM;
+
+    // A short last block gets its 1 byte inside the block instead of at 2^128
+    if (ctx->buf_len > 0) {
+        ctx->buf[ctx->buf_len] = 1;
+        memset(ctx->buf + ctx->buf_len + 1, 0, 16 - ctx->buf_len - 1);
+        poly1305_blocks(ctx, ctx->buf, 1, 0);
+    }
+
+    uint32_t* h = ctx->h;
+    uint32_t c;
+    c = h[1] >> 26; h[1] &= POLY_MASK26;
+    h[2] += c; c = h[2] >> 26; h[2] &= POLY_MASK26;
+    h[3] += c; c = h[3] >> 26; h[3] &= POLY_MASK26;
+    h[4] += c; c = h[4] >> 26; h[4] &= POLY_MASK26;
+    h[0] += c * 5; c = h[0] >> 26; h[0] &= POLY_MASK26;
+    h[1] += c;
+
+    // g = h + 5 - 2^130; keep g if that didn't go negative, in constant time
+    uint32_t g[5];
+    g[0] = h[0] + 5; c = g[0] >> 26; g[0] &= POLY_MASK26;
+    g[1] = h[1] + c; c = g[1] >> 26; g[1] &= POLY_MASK26;
+    g[2] = h[2] + c; c = g[2] >> 26; g[2] &= POLY_MASK26;
+    g[3] = h[3] + c; c = g[3] >> 26; g[3] &= POLY_MASK26;
+    g[4] = h[4] + c - (1UL << 26);
+
+    uint32_t mask = (g[4] >> 31) - 1;
+    for (int i = 0; i < 5; i++) {
+        h[i] = (h[i] & ~mask) | (g[i] & mask);
+    }
+
+    // Back to four 32-bit words, then add s modulo 2^128
+    uint32_t w0 = h[0] | (h[1] << 26);
+    uint32_t w1 = (h[1] >> 6) | (h[2] << 20);
+    uint32_t w2 = (h[2] >> 12) | (h[3] << 14);
+    uint32_t w3 = (h[3] >> 18) | (h[4] << 8);
+
+    uint64_t f;
+    f = (uint64_t)w0 + ctx->pad[0];             store_le32(tag, (uint32_t)f);
+    f = (uint64_t)w1 + ctx->pad[1] + (f >> 32); store_le32(tag + 4, (uint32_t)f);
+    f = (uint64_t)w2 + ctx->pad[2] + (f >> 32); store_le32(tag + 8, (uint32_t)f);
+    f = (uint64_t)w3 + ctx->pad[3] + (f >> 32); store_le32(tag + 12, (uint32_t)f);
+
+    crypto_memzero_secure(g, sizeof(g));
+    crypto_zeroize_context(ctx, sizeof(*ctx));
+    return CRYPTO_SUCCESS;
+}
+
+// ChaCha20-Poly1305 AEAD (RFC 8439 2.8)
+
+// Decryption MACs and decrypts in pieces of this size, so each piece is
+// still in cache for the second pass
+#define AEAD_CHUNK (16 * 1024)
+
+static const uint8_t aead_zero_pad[16];
+
+// Block 0 of the key stream is the one-time Poly1305 key; the payload
+// starts at block 1. The MAC covers AAD, then the ciphertext.
+static void aead_setup(crypto_chacha20_ctx_t* chacha, crypto_poly1305_ctx_t* poly, const uint8_t* key, const uint8_t* nonce,
+                       const uint8_t* aad, uint32_t aad_len) {
+    uint8_t block0[64];
+    memset(block0, 0, sizeof(block0));
+    crypto_chacha20_init(chacha, key, nonce);
+    crypto_chacha20_encrypt(chacha, block0, sizeof(block0), block0);
+    crypto_poly1305_init(poly, block0);
+    crypto_memzero_secure(block0, sizeof(block0));
+
+    crypto_poly1305_update(poly, aad, aad_len);
+    crypto_poly1305_update(poly, aead_zero_pad, (16 - aad_len % 16) % 16);
+}
+
+static void aead_finish(crypto_poly1305_ctx_t* poly, uint32_t aad_len, uint32_t len, uint8_t* tag) {
+    uint8_t lengths[16];
+    crypto_poly1305_update(poly, aead_zero_pad, (16 - len % 16) % 16);
+    store_le64(lengths, aad_len);
+    store_le64(lengths + 8, len);
+    crypto_poly1305_update(poly, lengths, sizeof(lengths));
+    crypto_poly1305_final(poly, tag);
+}
+
+int crypto_chacha20_poly1305_encrypt(const uint8_t* key, const uint8_t* nonce, const uint8_t* aad, uint32_t aad_len, const uint8_t* plaintext, uint32_t len, uint8_t* ciphertext, uint8_t* tag) {
+    if (!key || !nonce || !tag || (!aad && aad_len) || (len && (!plaintext || !ciphertext))) {
+        return CRYPTO_ERROR_INVALID_PARAM;
+    }
+
+    crypto_chacha20_ctx_t chacha;
+    crypto_poly1305_ctx_t poly;
+    aead_setup(&chacha, &poly, key, nonce, aad, aad_len);
+
+    for (uint32_t off = 0; off < len; off += AEAD_CHUNK) {
+        uint32_t n = len - off < AEAD_CHUNK ? len - off : AEAD_CHUNK;
+        crypto_chacha20_encrypt(&chacha, plaintext + off, n, ciphertext + off);
+        crypto_poly1305_update(&poly, ciphertext + off, n);
+    }
+
+    aead_finish(&poly, aad_len, len, tag);
+    crypto_zeroize_context(&chacha, sizeof(chacha));
+    return CRYPTO_SUCCESS;
+}
+
+// Nothing decrypted is left in plaintext unless the tag matches
+int crypto_chacha20_poly1305_decrypt(const uint8_t* key, const uint8_t* nonce, const uint8_t* aad, uint32_t aad_len, const uint8_t* ciphertext, uint32_t len, const uint8_t* tag, uint8_t* plaintext) {
+    if (!key || !nonce || !tag || (!aad && aad_len) || (len && (!plaintext || !ciphertext))) {
+        return CRYPTO_ERROR_INVALID_PARAM;
+    }
+
+    crypto_chacha20_ctx_t chacha;
+    crypto_poly1305_ctx_t poly;
+    aead_setup(&chacha, &poly, key, nonce, aad, aad_len);
+
+    for (uint32_t off = 0; off < len; off += AEAD_CHUNK) {
+        uint32_t n = len - off < AEAD_CHUNK ? len - off : AEAD_CHUNK;
+        crypto_poly1305_update(&poly, ciphertext + off, n);
+        crypto_chacha20_decrypt(&chacha, ciphertext + off, n, plaintext + off);
+    }
+
+    uint8_t computed[16];
+    aead_finish(&poly, aad_len, len, computed);
+    crypto_zeroize_context(&chacha, sizeof(chacha));
+
+    if (crypto_memcmp_constant_time(computed, tag, sizeof(computed)) != 0) {
+        crypto_memzero_secure(plaintext, len);
+        return CRYPTO_ERROR_VERIFICATION_FAILED;
+    }
+    return CRYPTO_SUCCESS;
+}
+
+int crypto_self_test_chacha20_poly1305(void) {
+    // RFC 8439 2.8.2
+    static const char plaintext[] = "Ladies and Gentlemen of the class of '99: If I could offer you only one tip "
+                                    "for the future, sunscreen would be it.";
+    static const uint8_t nonce[12] = { 0x07, 0x00, 0x00, 0x00, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47 };
+    static const uint8_t aad[12] = { 0x50, 0x51, 0x52, 0x53, 0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7 };
+    static const uint8_t expected_ct_head[16] = {
+        0xd3, 0x1a, 0x8d, 0x34, 0x64, 0x8e, 0x60, 0xdb, 0x7b, 0x86, 0xaf, 0xbc, 0x53, 0xef, 0x7e, 0xc2
+    };
+    static const uint8_t expected_tag[16] = {
+        0x1a, 0xe1, 0x0b, 0x59, 0x4f, 0x09, 0xe2, 0x6a, 0x7e, 0x90, 0x2e, 0xcb, 0xd0, 0x60, 0x06, 0x91
+    };
+
+    uint8_t key[32];
+    for (int i = 0; i < 32; i++) key[i] = (uint8_t)(0x80 + i);
+
+    uint32_t len = sizeof(plaintext) - 1;
+    uint8_t ciphertext[sizeof(plaintext)], decrypted[sizeof(plaintext)], tag[16];
+
+    if (crypto_chacha20_poly1305_encrypt(key, nonce, aad, sizeof(aad), (const uint8_t*)plaintext, len, ciphertext, tag) != CRYPTO_SUCCESS ||
+        crypto_memcmp_constant_time(ciphertext, expected_ct_head, sizeof(expected_ct_head)) != 0 ||
+        crypto_memcmp_constant_time(tag, expected_tag, sizeof(tag)) != 0) {
+        return CRYPTO_ERROR_VERIFICATION_FAILED;
+    }
+
+    if (crypto_chacha20_poly1305_decrypt(key, nonce, aad, sizeof(aad), ciphertext, len, tag, decrypted) != CRYPTO_SUCCESS ||
+        memcmp(decrypted, plaintext, len) != 0) {
+        return CRYPTO_ERROR_VERIFICATION_FAILED;
+    }
+
+    // A flipped bit must be rejected
+    ciphertext[0] ^= 1;
+    if (crypto_chacha20_poly1305_decrypt(key, nonce, aad, sizeof(aad), ciphertext, len, tag, decrypted) != CRYPTO_ERROR_VERIFICATION_FAILED) {
+        return CRYPTO_ERROR_VERIFICATION_FAILED;
+    }
+    return CRYPTO_SUCCESS;
+}
@@ -11,6 +11,12 @@
 #include "crypto.h"
 #include "entropy.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
 // Global hardware support flags
 static crypto_hw_support_t g_hw_support = CRYPTO_HW_NONE;
 
@@ -106,6 +112,48 @@ void crypto_cleanup_hardware(void) {
     g_hw_support = CRYPTO_HW_NONE;
 }
 
+static uint32_t load_be32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void store_be32(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+// One compression, with the block already loaded as big-endian words
+static void sha256_transform(uint32_t state[8], const uint32_t block[16]) {
+    uint32_t w[64];
+
+    memcpy(w, block, 16 * sizeof(uint32_t));
+    for (int j = 16; j < 64; j++) {
+        w[j] = gamma1(w[j-2]) + w[j-7] + gamma0(w[j-15]) + w[j-16];
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h_val = state[7];
+
+    for (int j = 0; j < 64; j++) {
+        uint32_t temp1 = h_val + sigma1(e) + ch(e, f, g) + sha256_k[j] + w[j];
+        uint32_t temp2 = sigma0(a) + maj(a, b, c);
+        h_val = g; g = f; f = e; e = d + temp1;
+        d = c; c = b; b = a; a = temp1 + temp2;
+    }
+
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h_val;
+}
+
+void crypto_sha256_compress(uint32_t state[8], const uint8_t block[64]) {
+    uint32_t w[16];
+    for (int j = 0; j < 16; j++) {
+        w[j] = load_be32(block + j * 4);
+    }
+    sha256_transform(state, w);
+}
+
 // Enhanced SHA-256 with streaming support
 int crypto_sha256_init(crypto_sha256_ctx_t* ctx) {
     if (!ctx) return CRYPTO_ERROR_INVALID_PARAM;
@@ -118,45 +166,34 @@ int crypto_sha256_init(crypto_sha256_ctx_t* ctx) {
     return CRYPTO_SUCCESS;
 }
 
+// Whole blocks are compressed straight from the caller's buffer; only a
+// partial block at either end goes through ctx->buf
 int crypto_sha256_update(crypto_sha256_ctx_t* ctx, const uint8_t* data, uint32_t len) {
-    if (!ctx || !data) return CRYPTO_ERROR_INVALID_PARAM;
+    if (!ctx || (!data && len)) return CRYPTO_ERROR_INVALID_PARAM;
     
     ctx->len += len;
     
-    while (len > 0) {
-        uint32_t chunk_size = (ctx->buf_len + len > 64) ? (64 - ctx->buf_len) : len;
-        memcpy(ctx->buf + ctx->buf_len, data, chunk_size);
-        ctx->buf_len += chunk_size;
-        data += chunk_size;
-        len -= chunk_size;
-        
-        if (ctx->buf_len == 64) {
-            // Process block
-            uint32_t w[64];
-            
-            for (int j = 0; j < 16; j++) {
-                w[j] = (ctx->buf[j*4] << 24) | (ctx->buf[j*4 + 1] << 16) |
-                       (ctx->buf[j*4 + 2] << 8) | ctx->buf[j*4 + 3];
-            }
-            for (int j = 16; j < 64; j++) {
-                w[j] = gamma1(w[j-2]) + w[j-7] + gamma0(w[j-15]) + w[j-16];
-            }
-            
-            uint32_t a = ctx->h[0], b = ctx->h[1], c = ctx->h[2], d = ctx->h[3];
-            uint32_t e = ctx->h[4], f = ctx->h[5], g = ctx->h[6], h_val = ctx->h[7];
-            
-            for (int j = 0; j < 64; j++) {
-                uint32_t temp1 = h_val + sigma1(e) + ch(e, f, g) + sha256_k[j] + w[j];
-                uint32_t temp2 = sigma0(a) + maj(a, b, c);
-                h_val = g; g = f; f = e; e = d + temp1;
-                d = c; c = b; b = a; a = temp1 + temp2;
-            }
-            
-            ctx->h[0] += a; ctx->h[1] += b; ctx->h[2] += c; ctx->h[3] += d;
-            ctx->h[4] += e; ctx->h[5] += f; ctx->h[6] += g; ctx->h[7] += h_val;
-            
-            ctx->buf_len = 0;
-        }
+    if (ctx->buf_len > 0) {
+        uint32_t take = 64 - ctx->buf_len;
+        if (take > len) take = len;
+        memcpy(ctx->buf + ctx->buf_len, data, take);
+        ctx->buf_len += take;
+        data += take;
+        len -= take;
+        if (ctx->buf_len < 64) return CRYPTO_SUCCESS;
+        crypto_sha256_compress(ctx->h, ctx->buf);
+        ctx->buf_len = 0;
+    }
+    
+    while (len >= 64) {
+        crypto_sha256_compress(ctx->h, data);
+        data += 64;
+        len -= 64;
+    }
+    
+    if (len > 0) {
+        memcpy(ctx->buf, data, len);
+        ctx->buf_len = len;
     }
     
     return CRYPTO_SUCCESS;
@@ -165,36 +202,25 @@ int crypto_sha256_update(crypto_sha256_ctx_t* ctx, const uint8_t* data, uint32_t
 int crypto_sha256_final(crypto_sha256_ctx_t* ctx, uint8_t* hash) {
     if (!ctx || !hash) return CRYPTO_ERROR_INVALID_PARAM;
     
-    // Pre-processing: adding padding bits
-    uint64_t msg_len = ctx->len;
-    uint64_t bit_len = msg_len * 8;
+    uint64_t bit_len = ctx->len * 8;
     
-    // Append '1' bit
+    // Append the '1' bit; if the length no longer fits, pad out this block
     ctx->buf[ctx->buf_len++] = 0x80;
-    
-    // Append '0' bits until message length ≡ 448 (mod 512)
-    while (ctx->buf_len % 64 != 56) {
-        if (ctx->buf_len == 64) {
-            crypto_sha256_update(ctx, ctx->buf, 64);
-            ctx->buf_len = 0;
-        }
-        ctx->buf[ctx->buf_len++] = 0x00;
+    if (ctx->buf_len > 56) {
+        memset(ctx->buf + ctx->buf_len, 0, 64 - ctx->buf_len);
+        crypto_sha256_compress(ctx->h, ctx->buf);
+        ctx->buf_len = 0;
     }
     
-    // Append original length in bits as 64-bit big-endian integer
-    for (int i = 7; i >= 0; i--) {
-        ctx->buf[ctx->buf_len++] = (bit_len >> (i * 8)) & 0xFF;
-    }
-    
-    // Process final block
-    crypto_sha256_update(ctx, ctx->buf, ctx->buf_len);
+    // Zero fill, then the message length in bits as a 64-bit big-endian integer
+    memset(ctx->buf + ctx->buf_len, 0, 56 - ctx->buf_len);
+    store_be32(ctx->buf + 56, (uint32_t)(bit_len >> 32));
+    store_be32(ctx->buf + 60, (uint32_t)bit_len);
+    crypto_sha256_compress(ctx->h, ctx->buf);
+    ctx->buf_len = 0;
     
-    // Produce final hash value
     for (int i = 0; i < 8; i++) {
-        hash[i*4] = (ctx->h[i] >> 24) & 0xFF;
-        hash[i*4 + 1] = (ctx->h[i] >> 16) & 0xFF;
-        hash[i*4 + 2] = (ctx->h[i] >> 8) & 0xFF;
-        hash[i*4 + 3] = ctx->h[i] & 0xFF;
+        store_be32(hash + i * 4, ctx->h[i]);
     }
     
     return CRYPTO_SUCCESS;
@@ -208,137 +234,443 @@ void sha256_hash(const uint8_t* data, uint32_t len, uint8_t* hash) {
     crypto_zeroize_context(&ctx, sizeof(ctx));
 }
 
-// HMAC-SHA256 implementation (needed for encrypted filesystems)
-void crypto_hmac_sha256(const uint8_t* key, uint32_t key_len, const uint8_t* data, uint32_t data_len, uint8_t* mac) {
-    uint8_t k_pad[64];
-    uint8_t inner_hash[32];
+// HMAC-SHA256. The key only ever enters the hash as the ipad and opad
+// blocks, so init hashes those once and keeps both midstates; every message
+// after that costs just its own blocks plus one outer block.
+int crypto_hmac_sha256_init(crypto_hmac_sha256_ctx_t* ctx, const uint8_t* key, uint32_t key_len) {
+    if (!ctx || (!key && key_len)) return CRYPTO_ERROR_INVALID_PARAM;
     
-    // Prepare key
-    memset(k_pad, 0, 64);
+    uint8_t k_pad[64];
+    memset(k_pad, 0, sizeof(k_pad));
     if (key_len > 64) {
         sha256_hash(key, key_len, k_pad);
-    } else {
+    } else if (key_len > 0) {
         memcpy(k_pad, key, key_len);
     }
     
-    // Inner hash: SHA256(k_pad XOR 0x36 || data)
     for (int i = 0; i < 64; i++) k_pad[i] ^= 0x36;
+    crypto_sha256_init(&ctx->inner_ctx);
+    crypto_sha256_update(&ctx->inner_ctx, k_pad, 64);
     
-    crypto_sha256_ctx_t ctx;
-    crypto_sha256_init(&ctx);
-    crypto_sha256_update(&ctx, k_pad, 64);
-    crypto_sha256_update(&ctx, data, data_len);
-    crypto_sha256_final(&ctx, inner_hash);
-    
-    // Outer hash: SHA256(k_pad XOR 0x5c || inner_hash)
     for (int i = 0; i < 64; i++) k_pad[i] ^= 0x36 ^ 0x5c; // Undo 0x36, apply 0x5c
+    crypto_sha256_init(&ctx->outer_ctx);
+    crypto_sha256_update(&ctx->outer_ctx, k_pad, 64);
     
-    crypto_sha256_init(&ctx);
-    crypto_sha256_update(&ctx, k_pad, 64);
-    crypto_sha256_update(&ctx, inner_hash, 32);
-    crypto_sha256_final(&ctx, mac);
-    
+    ctx->msg_ctx = ctx->inner_ctx;
     crypto_memzero_secure(k_pad, sizeof(k_pad));
+    return CRYPTO_SUCCESS;
+}
+
+int crypto_hmac_sha256_update(crypto_hmac_sha256_ctx_t* ctx, const uint8_t* data, uint32_t len) {
+    if (!ctx) return CRYPTO_ERROR_INVALID_PARAM;
+    return crypto_sha256_update(&ctx->msg_ctx, data, len);
+}
+
+// Leaves the context keyed and empty, ready for the next message
+int crypto_hmac_sha256_final(crypto_hmac_sha256_ctx_t* ctx, uint8_t* mac) {
+    if (!ctx || !mac) return CRYPTO_ERROR_INVALID_PARAM;
+    
+    uint8_t inner_hash[32];
+    crypto_sha256_final(&ctx->msg_ctx, inner_hash);
+    
+    ctx->msg_ctx = ctx->outer_ctx;
+    crypto_sha256_update(&ctx->msg_ctx, inner_hash, 32);
+    crypto_sha256_final(&ctx->msg_ctx, mac);
+    
+    ctx->msg_ctx = ctx->inner_ctx;
     crypto_memzero_secure(inner_hash, sizeof(inner_hash));
+    return CRYPTO_SUCCESS;
+}
+
+// HMAC-SHA256 implementation (needed for encrypted filesystems)
+void crypto_hmac_sha256(const uint8_t* key, uint32_t key_len, const uint8_t* data, uint32_t data_len, uint8_t* mac) {
+    crypto_hmac_sha256_ctx_t ctx;
+    if (crypto_hmac_sha256_init(&ctx, key, key_len) == CRYPTO_SUCCESS &&
+        crypto_hmac_sha256_update(&ctx, data, data_len) == CRYPTO_SUCCESS) {
+        crypto_hmac_sha256_final(&ctx, mac);
+    }
     crypto_zeroize_context(&ctx, sizeof(ctx));
 }
 
+// Every PBKDF2 iteration after the first is HMAC(P, U) with a 32-byte U.
+// From the cached midstates that is exactly one inner and one outer
+// compression, and the padding half of both blocks never changes.
+#define PBKDF2_U_BITS ((64 + 32) * 8)
+
+static void pbkdf2_sha256_iterate(const uint32_t inner[8], const uint32_t outer[8],
+                                  uint32_t u[8], uint32_t f[8], uint32_t iterations) {
+    uint32_t block[16] = {0};
+    block[8] = 0x80000000;
+    block[15] = PBKDF2_U_BITS;
+    
+    for (uint32_t i = 1; i < iterations; i++) {
+        memcpy(block, u, 32);
+        memcpy(u, inner, 32);
+        sha256_transform(u, block);
+        
+        memcpy(block, u, 32);
+        memcpy(u, outer, 32);
+        sha256_transform(u, block);
+        
+        for (int j = 0; j < 8; j++) f[j] ^= u[j];
+    }
+    
+    crypto_memzero_secure(block, sizeof(block));
+}
+
+#if defined(__SSE2__) || defined(__ARM_NEON) || defined(__ARM_NEON__)
+// Output blocks of a long derived key are independent, so four of them run
+// side by side, one per 32-bit vector lane. Lane k of word j is stored at
+// [j][k], which lets a whole word load as one vector.
+#define PBKDF2_LANES 4
+
+#if defined(__SSE2__)
+typedef __m128i sha256_vec;
+#define VEC_LOAD(p)         _mm_loadu_si128((const __m128i*)(p))
+#define VEC_STORE(p, v)     _mm_storeu_si128((__m128i*)(p), v)
+#define VEC_SET1(x)         _mm_set1_epi32((int)(x))
+#define VEC_ADD(a, b)       _mm_add_epi32(a, b)
+#define VEC_XOR(a, b)       _mm_xor_si128(a, b)
+#define VEC_AND(a, b)       _mm_and_si128(a, b)
+#define VEC_ANDNOT(a, b)    _mm_andnot_si128(a, b)      // ~a & b
+#define VEC_SHR(a, n)       _mm_srli_epi32(a, n)
+#define VEC_ROTR(a, n)      _mm_or_si128(_mm_srli_epi32(a, n), _mm_slli_epi32(a, 32 - (n)))
+#else
+typedef uint32x4_t sha256_vec;
+#define VEC_LOAD(p)         vld1q_u32(p)
+#define VEC_STORE(p, v)     vst1q_u32(p, v)
+#define VEC_SET1(x)         vdupq_n_u32(x)
+#define VEC_ADD(a, b)       vaddq_u32(a, b)
+#define VEC_XOR(a, b)       veorq_u32(a, b)
+#define VEC_AND(a, b)       vandq_u32(a, b)
+#define VEC_ANDNOT(a, b)    vbicq_u32(b, a)             // ~a & b
+#define VEC_SHR(a, n)       vshrq_n_u32(a, n)
+#define VEC_ROTR(a, n)      vsriq_n_u32(vshlq_n_u32(a, 32 - (n)), a, n)
+#endif
+
+static void sha256_transform_x4(sha256_vec state[8], const sha256_vec block[16]) {
+    sha256_vec w[64];
+
+    for (int j = 0; j < 16; j++) w[j] = block[j];
+    for (int j = 16; j < 64; j++) {
+        sha256_vec s0 = VEC_XOR(VEC_XOR(VEC_ROTR(w[j-15], 7), VEC_ROTR(w[j-15], 18)), VEC_SHR(w[j-15], 3));
+        sha256_vec s1 = VEC_XOR(VEC_XOR(VEC_ROTR(w[j-2], 17), VEC_ROTR(w[j-2], 19)), VEC_SHR(w[j-2], 10));
+        w[j] = VEC_ADD(VEC_ADD(s1, w[j-7]), VEC_ADD(s0, w[j-16]));
+    }
+
+    sha256_vec a = state[0], b = state[1], c = state[2], d = state[3];
+    sha256_vec e = state[4], f = state[5], g = state[6], h_val = state[7];
+
+    for (int j = 0; j < 64; j++) {
+        sha256_vec s1 = VEC_XOR(VEC_XOR(VEC_ROTR(e, 6), VEC_ROTR(e, 11)), VEC_ROTR(e, 25));
+        sha256_vec ch_v = VEC_XOR(VEC_AND(e, f), VEC_ANDNOT(e, g));
+        sha256_vec temp1 = VEC_ADD(VEC_ADD(h_val, s1), VEC_ADD(ch_v, VEC_ADD(VEC_SET1(sha256_k[j]), w[j])));
+        sha256_vec s0 = VEC_XOR(VEC_XOR(VEC_ROTR(a, 2), VEC_ROTR(a, 13)), VEC_ROTR(a, 22));
+        sha256_vec maj_v = VEC_XOR(VEC_AND(a, VEC_XOR(b, c)), VEC_AND(b, c));
+        sha256_vec temp2 = VEC_ADD(s0, maj_v);
+        h_val = g; g = f; f = e; e = VEC_ADD(d, temp1);
+        d = c; c = b; b = a; a = VEC_ADD(temp1, temp2);
+    }
+
+    state[0] = VEC_ADD(state[0], a); state[1] = VEC_ADD(state[1], b);
+    state[2] = VEC_ADD(state[2], c); state[3] = VEC_ADD(state[3], d);
+    state[4] = VEC_ADD(state[4], e); state[5] = VEC_ADD(state[5], f);
+    state[6] = VEC_ADD(state[6], g); state[7] = VEC_ADD(state[7], h_val);
+}
+
+static void pbkdf2_sha256_iterate_x4(const uint32_t inner[8], const uint32_t outer[8],
+                                     uint32_t u[8][PBKDF2_LANES], uint32_t f[8][PBKDF2_LANES], uint32_t iterations) {
+    sha256_vec vin[8], vout[8], vu[8], vf[8], block[16];
+
+    for (int j = 0; j < 8; j++) {
+        vin[j] = VEC_SET1(inner[j]);
+        vout[j] = VEC_SET1(outer[j]);
+        vu[j] = VEC_LOAD(u[j]);
+        vf[j] = VEC_LOAD(f[j]);
+    }
+    block[8] = VEC_SET1(0x80000000);
+    for (int j = 9; j < 15; j++) block[j] = VEC_SET1(0);
+    block[15] = VEC_SET1(PBKDF2_U_BITS);
+
+    for (uint32_t i = 1; i < iterations; i++) {
+        for (int j = 0; j < 8; j++) { block[j] = vu[j]; vu[j] = vin[j]; }
+        sha256_transform_x4(vu, block);
+
+        for (int j = 0; j < 8; j++) { block[j] = vu[j]; vu[j] = vout[j]; }
+        sha256_transform_x4(vu, block);
+
+        for (int j = 0; j < 8; j++) vf[j] = VEC_XOR(vf[j], vu[j]);
+    }
+
+    for (int j = 0; j < 8; j++) VEC_STORE(f[j], vf[j]);
+    crypto_memzero_secure(block, sizeof(block));
+    crypto_memzero_secure(vu, sizeof(vu));
+}
+#endif
+
 // PBKDF2-SHA256 for key derivation (needed for encrypted filesystems)
 int crypto_pbkdf2_sha256(const uint8_t* password, uint32_t password_len, const uint8_t* salt, uint32_t salt_len, uint32_t iterations, uint8_t* derived_key, uint32_t key_len) {
-    if (!password || !salt || !derived_key || iterations == 0 || key_len == 0) {
+    if ((!password && password_len) || (!salt && salt_len) || !derived_key || iterations == 0 || key_len == 0) {
         return CRYPTO_ERROR_INVALID_PARAM;
     }
     
+    crypto_hmac_sha256_ctx_t prf;
+    crypto_hmac_sha256_init(&prf, password, password_len);
+    const uint32_t* inner = prf.inner_ctx.h;
+    const uint32_t* outer = prf.outer_ctx.h;
+    
     uint32_t blocks_needed = (key_len + 31) / 32;
+    uint32_t block = 1;
     
-    for (uint32_t block = 1; block <= blocks_needed; block++) {
-        uint8_t u[32], f[32];
+    while (block <= blocks_needed) {
+        uint8_t u1[32];
+        uint8_t out[32];
+        uint32_t u[8], f[8];
         
-        // First iteration: U1 = HMAC(password, salt || block_number)
-        uint8_t salt_block[salt_len + 4];
-        memcpy(salt_block, salt, salt_len);
-        salt_block[salt_len] = (block >> 24) & 0xFF;
-        salt_block[salt_len + 1] = (block >> 16) & 0xFF;
-        salt_block[salt_len + 2] = (block >> 8) & 0xFF;
-        salt_block[salt_len + 3] = block & 0xFF;
+#if defined(__SSE2__) || defined(__ARM_NEON) || defined(__ARM_NEON__)
+        uint32_t lanes = blocks_needed - block + 1;
+        if (lanes > PBKDF2_LANES) lanes = PBKDF2_LANES;
+        if (lanes > 1) {
+            // Unused lanes just compute garbage alongside
+            uint32_t u_x4[8][PBKDF2_LANES] = {{0}}, f_x4[8][PBKDF2_LANES];
+            for (uint32_t k = 0; k < lanes; k++) {
+                uint8_t counter[4];
+                store_be32(counter, block + k);
+                crypto_hmac_sha256_update(&prf, salt, salt_len);
+                crypto_hmac_sha256_update(&prf, counter, 4);
+                crypto_hmac_sha256_final(&prf, u1);
+                for (int j = 0; j < 8; j++) u_x4[j][k] = load_be32(u1 + j * 4);
+            }
+            memcpy(f_x4, u_x4, sizeof(f_x4));
+            pbkdf2_sha256_iterate_x4(inner, outer, u_x4, f_x4, iterations);
+            
+            for (uint32_t k = 0; k < lanes; k++, block++) {
+                for (int j = 0; j < 8; j++) store_be32(out + j * 4, f_x4[j][k]);
+                uint32_t copy_len = key_len < 32 ? key_len : 32;
+                memcpy(derived_key + (block - 1) * 32, out, copy_len);
+                key_len -= copy_len;
+            }
+            crypto_memzero_secure(u1, sizeof(u1));
+            crypto_memzero_secure(u_x4, sizeof(u_x4));
+            crypto_memzero_secure(f_x4, sizeof(f_x4));
+            crypto_memzero_secure(out, sizeof(out));
+            continue;
+        }
+#endif
         
-        crypto_hmac_sha256(password, password_len, salt_block, salt_len + 4, u);
-        memcpy(f, u, 32);
+        // First iteration: U1 = HMAC(password, salt || block_number)
+        uint8_t counter[4];
+        store_be32(counter, block);
+        crypto_hmac_sha256_update(&prf, salt, salt_len);
+        crypto_hmac_sha256_update(&prf, counter, 4);
+        crypto_hmac_sha256_final(&prf, u1);
+        for (int j = 0; j < 8; j++) u[j] = load_be32(u1 + j * 4);
+        memcpy(f, u, sizeof(f));
         
         // Remaining iterations: Ui = HMAC(password, Ui-1), F = F XOR Ui
-        for (uint32_t i = 2; i <= iterations; i++) {
-            crypto_hmac_sha256(password, password_len, u, 32, u);
-            for (int j = 0; j < 32; j++) {
-                f[j] ^= u[j];
-            }
-        }
+        pbkdf2_sha256_iterate(inner, outer, u, f, iterations);
         
-        // Copy result to output
-        uint32_t copy_len = (key_len < 32) ? key_len : 32;
-        if (block == blocks_needed && key_len % 32 != 0) {
-            copy_len = key_len % 32;
-        }
-        memcpy(derived_key + (block - 1) * 32, f, copy_len);
+        for (int j = 0; j < 8; j++) store_be32(out + j * 4, f[j]);
+        uint32_t copy_len = key_len < 32 ? key_len : 32;
+        memcpy(derived_key + (block - 1) * 32, out, copy_len);
         key_len -= copy_len;
+        block++;
         
+        crypto_memzero_secure(u1, sizeof(u1));
         crypto_memzero_secure(u, sizeof(u));
         crypto_memzero_secure(f, sizeof(f));
+        crypto_memzero_secure(out, sizeof(out));
     }
     
+    crypto_zeroize_context(&prf, sizeof(prf));
     return CRYPTO_SUCCESS;
 }
 
-// Secure random number generation
-static uint32_t g_rng_state[4] = {0};
-static int g_rng_initialized = 0;
+// HMAC_DRBG (SP 800-90A 10.1.2). provided_data is passed in two pieces
+// (entropy and additional input) so callers never concatenate into a copy.
+static void hmac_drbg_update(crypto_hmac_drbg_t* drbg, const uint8_t* a, uint32_t a_len,
+                             const uint8_t* b, uint32_t b_len) {
+    crypto_hmac_sha256_ctx_t ctx;
+
+    for (uint8_t round = 0; round < 2; round++) {
+        crypto_hmac_sha256_init(&ctx, drbg->k, 32);
+        crypto_hmac_sha256_update(&ctx, drbg->v, 32);
+        crypto_hmac_sha256_update(&ctx, &round, 1);
+        if (a_len) crypto_hmac_sha256_update(&ctx, a, a_len);
+        if (b_len) crypto_hmac_sha256_update(&ctx, b, b_len);
+        crypto_hmac_sha256_final(&ctx, drbg->k);
+
+        crypto_hmac_sha256_init(&ctx, drbg->k, 32);
+        crypto_hmac_sha256_update(&ctx, drbg->v, 32);
+        crypto_hmac_sha256_final(&ctx, drbg->v);
+
+        if (a_len + b_len == 0) break;
+    }
+    crypto_zeroize_context(&ctx, sizeof(ctx));
+}
 
-int crypto_random_init(void) {
-    // Seed from hardware entropy and current time
-    g_rng_state[0] = entropy_get();
-    g_rng_state[1] = entropy_get() ^ 0xDEADBEEF;
-    g_rng_state[2] = entropy_get() ^ 0xCAFEBABE;
-    g_rng_state[3] = entropy_get() ^ 0xFEEDFACE;
-    
-    g_rng_initialized = 1;
+int crypto_hmac_drbg_instantiate(crypto_hmac_drbg_t* drbg, const uint8_t* seed, uint32_t seed_len, const uint8_t* pers, uint32_t pers_len) {
+    if (!drbg || !seed || seed_len < CRYPTO_DRBG_SEED_BITS / 8 || (!pers && pers_len)) {
+        return CRYPTO_ERROR_INVALID_PARAM;
+    }
+
+    memset(drbg->k, 0x00, sizeof(drbg->k));
+    memset(drbg->v, 0x01, sizeof(drbg->v));
+    hmac_drbg_update(drbg, seed, seed_len, pers, pers_len);
+    drbg->reseed_counter = 1;
+    drbg->instantiated = 1;
     return CRYPTO_SUCCESS;
 }
 
-int crypto_random_uint32(uint32_t* value) {
-    if (!g_rng_initialized || !value) return CRYPTO_ERROR_INVALID_PARAM;
-    
-    // XORShift128 PRNG
-    uint32_t t = g_rng_state[3];
-    uint32_t s = g_rng_state[0];
-    g_rng_state[3] = g_rng_state[2];
-    g_rng_state[2] = g_rng_state[1];
-    g_rng_state[1] = s;
-    
-    t ^= t << 11;
-    t ^= t >> 8;
-    g_rng_state[0] = t ^ s ^ (s >> 19);
-    
-    *value = g_rng_state[0];
+int crypto_hmac_drbg_reseed(crypto_hmac_drbg_t* drbg, const uint8_t* entropy, uint32_t entropy_len, const uint8_t* addl, uint32_t addl_len) {
+    if (!drbg || !drbg->instantiated || !entropy || entropy_len < CRYPTO_DRBG_RESEED_BITS / 8 || (!addl && addl_len)) {
+        return CRYPTO_ERROR_INVALID_PARAM;
+    }
+
+    hmac_drbg_update(drbg, entropy, entropy_len, addl, addl_len);
+    drbg->reseed_counter = 1;
     return CRYPTO_SUCCESS;
 }
 
+// With K fixed for the whole request, V = HMAC(K, V) is the same step as a
+// PBKDF2 iteration: one inner and one outer compression from the midstates
+int crypto_hmac_drbg_generate(crypto_hmac_drbg_t* drbg, uint8_t* out, uint32_t len, const uint8_t* addl, uint32_t addl_len) {
+    if (!drbg || !drbg->instantiated || (!out && len) || len > CRYPTO_DRBG_MAX_REQUEST || (!addl && addl_len)) {
+        return CRYPTO_ERROR_INVALID_PARAM;
+    }
+    if (drbg->reseed_counter > CRYPTO_DRBG_RESEED_INTERVAL) return CRYPTO_ERROR_RESEED_REQUIRED;
+
+    if (addl_len) hmac_drbg_update(drbg, addl, addl_len, NULL, 0);
+
+    crypto_hmac_sha256_ctx_t ctx;
+    uint32_t v[8];
+    uint32_t block[16] = {0};
+    block[8] = 0x80000000;
+    block[15] = PBKDF2_U_BITS;
+
+    crypto_hmac_sha256_init(&ctx, drbg->k, 32);
+    for (int j = 0; j < 8; j++) v[j] = load_be32(drbg->v + 4 * j);
+    while (len > 0) {
+        memcpy(block, v, 32);
+        memcpy(v, ctx.inner_ctx.h, 32);
+        sha256_transform(v, block);
+
+        memcpy(block, v, 32);
+        memcpy(v, ctx.outer_ctx.h, 32);
+        sha256_transform(v, block);
+
+        uint32_t n = len < 32 ? len : 32;
+        if (n == 32) {
+            for (int j = 0; j < 8; j++) store_be32(out + 4 * j, v[j]);
+        } else {
+            uint8_t tail[32];
+            for (int j = 0; j < 8; j++) store_be32(tail + 4 * j, v[j]);
+            memcpy(out, tail, n);
+            crypto_memzero_secure(tail, sizeof(tail));
+        }
+        out += n;
+        len -= n;
+    }
+    for (int j = 0; j < 8; j++) store_be32(drbg->v + 4 * j, v[j]);
+    crypto_zeroize_context(&ctx, sizeof(ctx));
+    crypto_memzero_secure(v, sizeof(v));
+    crypto_memzero_secure(block, sizeof(block));
+
+    hmac_drbg_update(drbg, addl, addl_len, NULL, 0);
+    drbg->reseed_counter++;
+    return CRYPTO_SUCCESS;
+}
+
+// Secure random number generation
+static crypto_hmac_drbg_t g_drbg;
+static uint8_t g_rng_buffer[CRYPTO_RNG_BUFFER];
+static uint32_t g_rng_buffered = 0;     // Unused bytes at the end of g_rng_buffer
+
+static const char g_drbg_personalization[] = "BloodHorn HMAC_DRBG";
+
+static int random_seed(int reseed) {
+    uint8_t pool[ENTROPY_POOL_MAX];
+    int result;
+
+    int len = entropy_gather(pool, sizeof(pool), reseed ? CRYPTO_DRBG_RESEED_BITS : CRYPTO_DRBG_SEED_BITS);
+    if (len < 0) {
+        result = CRYPTO_ERROR_HARDWARE_UNAVAILABLE;
+    } else if (reseed) {
+        result = crypto_hmac_drbg_reseed(&g_drbg, pool, (uint32_t)len, NULL, 0);
+    } else {
+        result = crypto_hmac_drbg_instantiate(&g_drbg, pool, (uint32_t)len,
+                                              (const uint8_t*)g_drbg_personalization,
+                                              sizeof(g_drbg_personalization) - 1);
+    }
+    crypto_memzero_secure(pool, sizeof(pool));
+    return result;
+}
+
+static int random_generate(uint8_t* out, uint32_t len) {
+    int result = crypto_hmac_drbg_generate(&g_drbg, out, len, NULL, 0);
+    if (result == CRYPTO_ERROR_RESEED_REQUIRED) {
+        result = random_seed(1);
+        if (result == CRYPTO_SUCCESS) result = crypto_hmac_drbg_generate(&g_drbg, out, len, NULL, 0);
+    }
+    return result;
+}
+
+int crypto_random_init(void) {
+    if (g_drbg.instantiated) return CRYPTO_SUCCESS;
+    return random_seed(0);
+}
+
+// Requests smaller than the buffer are carved from one generate call, so a
+// stream of nonces and 32-bit values doesn't pay a DRBG round each. Served
+// bytes are wiped from the buffer straight away.
 int crypto_random_bytes(uint8_t* buf, uint32_t len) {
     if (!buf || len == 0) return CRYPTO_ERROR_INVALID_PARAM;
-    
-    for (uint32_t i = 0; i < len; i += 4) {
-        uint32_t rand_val;
-        int result = crypto_random_uint32(&rand_val);
-        if (result != CRYPTO_SUCCESS) return result;
-        
-        uint32_t copy_len = (len - i < 4) ? (len - i) : 4;
-        memcpy(buf + i, &rand_val, copy_len);
+
+    int result = crypto_random_init();
+    if (result != CRYPTO_SUCCESS) return result;
+
+    if (len >= CRYPTO_RNG_BUFFER / 2) {
+        while (len > 0) {
+            uint32_t n = len < CRYPTO_DRBG_MAX_REQUEST ? len : CRYPTO_DRBG_MAX_REQUEST;
+            result = random_generate(buf, n);
+            if (result != CRYPTO_SUCCESS) return result;
+            buf += n;
+            len -= n;
+        }
+        return CRYPTO_SUCCESS;
+    }
+
+    while (len > 0) {
+        if (g_rng_buffered == 0) {
+            result = random_generate(g_rng_buffer, sizeof(g_rng_buffer));
+            if (result != CRYPTO_SUCCESS) return result;
+            g_rng_buffered = sizeof(g_rng_buffer);
+        }
+        uint32_t n = len < g_rng_buffered ? len : g_rng_buffered;
+        uint8_t* src = g_rng_buffer + sizeof(g_rng_buffer) - g_rng_buffered;
+        memcpy(buf, src, n);
+        crypto_memzero_secure(src, n);
+        g_rng_buffered -= n;
+        buf += n;
+        len -= n;
     }
-    
     return CRYPTO_SUCCESS;
 }
 
+int crypto_random_uint32(uint32_t* value) {
+    if (!value) return CRYPTO_ERROR_INVALID_PARAM;
+    return crypto_random_bytes((uint8_t*)value, sizeof(*value));
+}
+
+int crypto_random_uint64(uint64_t* value) {
+    if (!value) return CRYPTO_ERROR_INVALID_PARAM;
+    return crypto_random_bytes((uint8_t*)value, sizeof(*value));
+}
+
 void crypto_random_cleanup(void) {
-    crypto_memzero_secure(g_rng_state, sizeof(g_rng_state));
-    g_rng_initialized = 0;
+    crypto_zeroize_context(&g_drbg, sizeof(g_drbg));
+    crypto_memzero_secure(g_rng_buffer, sizeof(g_rng_buffer));
+    g_rng_buffered = 0;
 }
 
 // Constant-time operations for side-channel resistance
@@ -380,6 +712,23 @@ int crypto_self_test_sha256(void) {
     return crypto_memcmp_constant_time(computed_hash, expected_hash, 32) == 0 ? CRYPTO_SUCCESS : CRYPTO_ERROR_VERIFICATION_FAILED;
 }
 
+int crypto_self_test_pbkdf2(void) {
+    // RFC 7914 section 11: P = "passwd", S = "salt", c = 1, dkLen = 64
+    const uint8_t expected[64] = {
+        0x55, 0xac, 0x04, 0x6e, 0x56, 0xe3, 0x08, 0x9f, 0xec, 0x16, 0x91, 0xc2, 0x25, 0x44, 0xb6, 0x05,
+        0xf9, 0x41, 0x85, 0x21, 0x6d, 0xde, 0x04, 0x65, 0xe6, 0x8b, 0x9d, 0x57, 0xc2, 0x0d, 0xac, 0xbc,
+        0x49, 0xca, 0x9c, 0xcc, 0xf1, 0x79, 0xb6, 0x45, 0x99, 0x16, 0x64, 0xb3, 0x9d, 0x77, 0xef, 0x31,
+        0x7c, 0x71, 0xb8, 0x45, 0xb1, 0xe3, 0x0b, 0xd5, 0x09, 0x11, 0x20, 0x41, 0xd3, 0xa1, 0x97, 0x83
+    };
+    
+    uint8_t derived[64];
+    if (crypto_pbkdf2_sha256((const uint8_t*)"passwd", 6, (const uint8_t*)"salt", 4, 1, derived, sizeof(derived)) != CRYPTO_SUCCESS) {
+        return CRYPTO_ERROR_VERIFICATION_FAILED;
+    }
+    
+    return crypto_memcmp_constant_time(derived, expected, sizeof(expected)) == 0 ? CRYPTO_SUCCESS : CRYPTO_ERROR_VERIFICATION_FAILED;
+}
+
 int crypto_self_test_aes(void) {
     // AES-128 test vector
     const uint8_t key[16] = {
@@ -404,48 +753,163 @@ int crypto_self_test_aes(void) {
     return result;
 }
 
+int crypto_self_test_hmac_drbg(void) {
+    // NIST CAVP HMAC_DRBG SHA-256, no prediction resistance, COUNT 0:
+    // instantiate, generate 1024 bits twice, check the second
+    static const uint8_t seed[48] = {
+        0xca, 0x85, 0x19, 0x11, 0x34, 0x93, 0x84, 0xbf, 0xfe, 0x89, 0xde, 0x1c, 0xbd, 0xc4, 0x6e, 0x68,
+        0x31, 0xe4, 0x4d, 0x34, 0xa4, 0xfb, 0x93, 0x5e, 0xe2, 0x85, 0xdd, 0x14, 0xb7, 0x1a, 0x74, 0x88,
+        0x65, 0x9b, 0xa9, 0x6c, 0x60, 0x1d, 0xc6, 0x9f, 0xc9, 0x02, 0x94, 0x08, 0x05, 0xec, 0x0c, 0xa8
+    };
+    static const uint8_t expected_head[32] = {
+        0xe5, 0x28, 0xe9, 0xab, 0xf2, 0xde, 0xce, 0x54, 0xd4, 0x7c, 0x7e, 0x75, 0xe5, 0xfe, 0x30, 0x21,
+        0x49, 0xf8, 0x17, 0xea, 0x9f, 0xb4, 0xbe, 0xe6, 0xf4, 0x19, 0x96, 0x97, 0xd0, 0x4d, 0x5b, 0x89
+    };
+
+    crypto_hmac_drbg_t drbg;
+    uint8_t out[128];
+    int result = CRYPTO_ERROR_VERIFICATION_FAILED;
+
+    if (crypto_hmac_drbg_instantiate(&drbg, seed, sizeof(seed), NULL, 0) == CRYPTO_SUCCESS &&
+        crypto_hmac_drbg_generate(&drbg, out, sizeof(out), NULL, 0) == CRYPTO_SUCCESS &&
+        crypto_hmac_drbg_generate(&drbg, out, sizeof(out), NULL, 0) == CRYPTO_SUCCESS &&
+        crypto_memcmp_constant_time(out, expected_head, sizeof(expected_head)) == 0) {
+        result = CRYPTO_SUCCESS;
+    }
+    crypto_zeroize_context(&drbg, sizeof(drbg));
+    crypto_memzero_secure(out, sizeof(out));
+    return result;
+}
+
 int crypto_run_all_self_tests(void) {
     if (crypto_self_test_sha256() != CRYPTO_SUCCESS) return CRYPTO_ERROR_VERIFICATION_FAILED;
+    if (crypto_self_test_pbkdf2() != CRYPTO_SUCCESS) return CRYPTO_ERROR_VERIFICATION_FAILED;
     if (crypto_self_test_aes() != CRYPTO_SUCCESS) return CRYPTO_ERROR_VERIFICATION_FAILED;
+    if (crypto_self_test_chacha20_poly1305() != CRYPTO_SUCCESS) return CRYPTO_ERROR_VERIFICATION_FAILED;
+    if (crypto_self_test_hmac_drbg() != CRYPTO_SUCCESS) return CRYPTO_ERROR_VERIFICATION_FAILED;
     return CRYPTO_SUCCESS;
 }
 
-// RSA implementation (basic, for signature verification only)
-static int mod_exp(const uint8_t* base, const uint8_t* exp, int exp_len, const uint8_t* mod, int mod_len, uint8_t* out, int out_len) {
-    uint8_t result[512] = {0};
-    result[out_len - 1] = 1;
-    for (int i = 0; i < exp_len * 8; i++) {
-        int bit = (exp[i / 8] >> (7 - (i % 8))) & 1;
-        for (int j = 0; j < out_len; j++) {
-            result[j] = (result[j] * result[j]) % mod[j];
+// RSA implementation (public-key operation only, for signature verification)
+//
+// Keys are CRYPTO_RSA2048_PUBKEY_SIZE bytes: a little-endian modulus bit count (2048),
+// then the public exponent and the modulus, each 256 bytes big-endian.
+#define RSA_LIMBS (CRYPTO_RSA2048_KEY_LENGTH / 4)
+
+static void rsa_load(uint32_t* r, const uint8_t* be) {
+    for (int i = 0; i < RSA_LIMBS; i++) r[i] = load_be32(be + CRYPTO_RSA2048_KEY_LENGTH - 4 * (i + 1));
+}
+
+static void rsa_store(uint8_t* be, const uint32_t* a) {
+    for (int i = 0; i < RSA_LIMBS; i++) {
+        uint8_t* p = be + CRYPTO_RSA2048_KEY_LENGTH - 4 * (i + 1);
+        p[0] = (uint8_t)(a[i] >> 24); p[1] = (uint8_t)(a[i] >> 16);
+        p[2] = (uint8_t)(a[i] >> 8);  p[3] = (uint8_t)a[i];
+    }
+}
+
+static int rsa_cmp(const uint32_t* a, const uint32_t* b) {
+    for (int i = RSA_LIMBS - 1; i >= 0; i--) {
+        if (a[i] != b[i]) return a[i] > b[i] ? 1 : -1;
+    }
+    return 0;
+}
+
+static void rsa_sub(uint32_t* a, const uint32_t* b) {
+    uint64_t borrow = 0;
+    for (int i = 0; i < RSA_LIMBS; i++) {
+        uint64_t d = (uint64_t)a[i] - b[i] - borrow;
+        a[i] = (uint32_t)d;
+        borrow = (d >> 32) & 1;
+    }
+}
+
+// r = a * b / 2^2048 mod n (Montgomery product, CIOS); r may alias a or b
+static void rsa_mont_mul(uint32_t* r, const uint32_t* a, const uint32_t* b, const uint32_t* n, uint32_t n0inv) {
+    uint32_t t[RSA_LIMBS + 2] = {0};
+    for (int i = 0; i < RSA_LIMBS; i++) {
+        uint64_t c = 0;
+        for (int j = 0; j < RSA_LIMBS; j++) {
+            c += (uint64_t)a[j] * b[i] + t[j];
+            t[j] = (uint32_t)c;
+            c >>= 32;
         }
-        if (bit) {
-            for (int j = 0; j < out_len; j++) {
-                result[j] = (result[j] * base[j]) % mod[j];
-            }
+        c += t[RSA_LIMBS];
+        t[RSA_LIMBS] = (uint32_t)c;
+        t[RSA_LIMBS + 1] = (uint32_t)(c >> 32);
+
+        uint32_t m = t[0] * n0inv;
+        c = ((uint64_t)m * n[0] + t[0]) >> 32;
+        for (int j = 1; j < RSA_LIMBS; j++) {
+            c += (uint64_t)m * n[j] + t[j];
+            t[j - 1] = (uint32_t)c;
+            c >>= 32;
         }
+        c += t[RSA_LIMBS];
+        t[RSA_LIMBS - 1] = (uint32_t)c;
+        t[RSA_LIMBS] = t[RSA_LIMBS + 1] + (uint32_t)(c >> 32);
+    }
+    if (t[RSA_LIMBS] || rsa_cmp(t, n) >= 0) rsa_sub(t, n);
+    memcpy(r, t, RSA_LIMBS * sizeof(uint32_t));
+}
+
+// out = base^exp mod n; -1 for a malformed key or a base that isn't reduced
+static int rsa_public(const uint8_t* base, const uint8_t* exp, const uint8_t* mod, uint8_t* out) {
+    uint32_t n[RSA_LIMBS], e[RSA_LIMBS], x[RSA_LIMBS], r2[RSA_LIMBS], acc[RSA_LIMBS], one[RSA_LIMBS] = {1};
+    rsa_load(n, mod);
+    rsa_load(e, exp);
+    rsa_load(x, base);
+    if (!(n[0] & 1) || !(n[RSA_LIMBS - 1] >> 31)) return -1;    // full 2048-bit odd modulus
+    if (!(e[0] & 1) || (e[0] == 1 && rsa_cmp(e, one) == 0)) return -1;
+    if (rsa_cmp(x, n) >= 0) return -1;
+
+    // -n^-1 mod 2^32 by Newton iteration, each step doubling the correct bits
+    uint32_t inv = 1;
+    for (int i = 0; i < 5; i++) inv *= 2 - n[0] * inv;
+    uint32_t n0inv = (uint32_t)0 - inv;
+
+    // 2^4096 mod n by doubling, to move operands into Montgomery form
+    memcpy(r2, one, sizeof(r2));
+    for (int i = 0; i < 2 * 32 * RSA_LIMBS; i++) {
+        uint32_t carry = r2[RSA_LIMBS - 1] >> 31;
+        for (int j = RSA_LIMBS - 1; j > 0; j--) r2[j] = (r2[j] << 1) | (r2[j - 1] >> 31);
+        r2[0] <<= 1;
+        if (carry || rsa_cmp(r2, n) >= 0) rsa_sub(r2, n);
+    }
+
+    rsa_mont_mul(x, x, r2, n, n0inv);
+    int top = 32 * RSA_LIMBS - 1;
+    while (!((e[top / 32] >> (top % 32)) & 1)) top--;
+    memcpy(acc, x, sizeof(acc));
+    for (int bit = top - 1; bit >= 0; bit--) {
+        rsa_mont_mul(acc, acc, acc, n, n0inv);
+        if ((e[bit / 32] >> (bit % 32)) & 1) rsa_mont_mul(acc, acc, x, n, n0inv);
     }
-    memcpy(out, result, out_len);
+    rsa_mont_mul(acc, acc, one, n, n0inv);
+    rsa_store(out, acc);
     return 0;
 }
 
 int verify_signature(const uint8_t* data, uint32_t len, const uint8_t* signature, const uint8_t* public_key) {
-    uint8_t hash[32];
-    sha256_hash(data, len, hash);
-    int mod_len = 256;
-    uint8_t decrypted[256];
-    mod_exp(signature, public_key + 4, 256, public_key + 260, 256, decrypted, 256);
-    if (decrypted[0] != 0x00 || decrypted[1] != 0x01) return 0;
-    int i = 2;
-    while (i < 256 && decrypted[i] == 0xFF) i++;
-    if (decrypted[i++] != 0x00) return 0;
     static const uint8_t sha256_prefix[] = {
         0x30,0x31,0x30,0x0d,0x06,0x09,0x60,0x86,0x48,0x01,0x65,0x03,0x04,0x02,0x01,0x05,0x00,0x04,0x20
     };
-    if (memcmp(decrypted + i, sha256_prefix, sizeof(sha256_prefix)) != 0) return 0;
-    i += sizeof(sha256_prefix);
-    if (memcmp(decrypted + i, hash, 32) != 0) return 0;
-    return 1;
+    uint8_t decrypted[CRYPTO_RSA2048_KEY_LENGTH];
+    uint8_t expected[CRYPTO_RSA2048_KEY_LENGTH];
+    uint32_t bits = public_key[0] | (uint32_t)public_key[1] << 8 |
+                    (uint32_t)public_key[2] << 16 | (uint32_t)public_key[3] << 24;
+    if (bits != CRYPTO_RSA2048_KEY_LENGTH * 8) return 0;
+    if (rsa_public(signature, public_key + 4, public_key + 4 + CRYPTO_RSA2048_KEY_LENGTH, decrypted) != 0) return 0;
+
+    // EMSA-PKCS1-v1_5: rebuild the one valid encoding and compare it whole
+    size_t tail = sizeof(sha256_prefix) + 32;
+    expected[0] = 0x00;
+    expected[1] = 0x01;
+    memset(expected + 2, 0xFF, sizeof(expected) - tail - 3);
+    expected[sizeof(expected) - tail - 1] = 0x00;
+    memcpy(expected + sizeof(expected) - tail, sha256_prefix, sizeof(sha256_prefix));
+    sha256_hash(data, len, expected + sizeof(expected) - 32);
+    return crypto_memcmp_constant_time(decrypted, expected, sizeof(expected)) == 0;
 }
 
 void crypto_cleanup_all_contexts(void) {
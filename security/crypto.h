@@ -12,12 +12,15 @@
 #include "compat.h"
 
 // Cryptographic Constants
+#define CRYPTO_SHA1_DIGEST_LENGTH       20
 #define CRYPTO_SHA256_DIGEST_LENGTH     32
+#define CRYPTO_SHA384_DIGEST_LENGTH     48
 #define CRYPTO_SHA512_DIGEST_LENGTH     64
 #define CRYPTO_AES128_KEY_LENGTH        16
 #define CRYPTO_AES256_KEY_LENGTH        32
 #define CRYPTO_RSA2048_KEY_LENGTH       256
 #define CRYPTO_RSA4096_KEY_LENGTH       512
+#define CRYPTO_RSA2048_PUBKEY_SIZE      (4 + 2 * CRYPTO_RSA2048_KEY_LENGTH)  // bit count, exponent, modulus
 #define CRYPTO_ECDSA_P256_KEY_LENGTH    32
 #define CRYPTO_ECDSA_P384_KEY_LENGTH    48
 #define CRYPTO_ECDSA_P521_KEY_LENGTH    66
@@ -32,6 +35,7 @@
 #define CRYPTO_ERROR_VERIFICATION_FAILED -3
 #define CRYPTO_ERROR_NOT_SUPPORTED      -4
 #define CRYPTO_ERROR_HARDWARE_UNAVAILABLE -5
+#define CRYPTO_ERROR_RESEED_REQUIRED    -6
 
 // Hardware acceleration support
 typedef enum {
@@ -63,25 +67,41 @@ typedef struct {
 } crypto_aes_ctx_t;
 
 typedef struct {
-    uint8_t key[CRYPTO_CHACHA20_KEY_LENGTH];
-    uint8_t nonce[12];
-    uint32_t counter;
+    uint32_t state[16];         // Constants, key, block counter, nonce
+    uint8_t keystream[64];      // Current block, for calls that end mid-block
+    uint32_t keystream_len;     // Unused bytes at the end of keystream
 } crypto_chacha20_ctx_t;
 
 typedef struct {
-    uint32_t r[5];
+    uint32_t r[5];              // Clamped key, 26-bit limbs
+    uint32_t r2[5];             // r^2, for two blocks per step
     uint32_t h[5];
+    uint32_t pad[4];            // s, added at the end
     uint8_t buf[16];
     uint32_t buf_len;
 } crypto_poly1305_ctx_t;
 
+// The key itself is not kept, only the hash state after each pad block
 typedef struct {
-    uint8_t key[CRYPTO_HMAC_MAX_KEY_LENGTH];
-    uint32_t key_len;
-    crypto_sha256_ctx_t inner_ctx;
-    crypto_sha256_ctx_t outer_ctx;
+    crypto_sha256_ctx_t inner_ctx;      // After the ipad block
+    crypto_sha256_ctx_t outer_ctx;      // After the opad block
+    crypto_sha256_ctx_t msg_ctx;        // Inner hash of the message so far
 } crypto_hmac_sha256_ctx_t;
 
+// HMAC_DRBG with SHA-256 (SP 800-90A 10.1.2), 256-bit security strength
+#define CRYPTO_DRBG_SEED_BITS           384         // Entropy plus nonce at instantiation
+#define CRYPTO_DRBG_RESEED_BITS         256
+#define CRYPTO_DRBG_MAX_REQUEST         65536       // Bytes per generate call
+#define CRYPTO_DRBG_RESEED_INTERVAL     4096        // Generate calls between reseeds
+#define CRYPTO_RNG_BUFFER               512         // Small requests are served from here
+
+typedef struct {
+    uint8_t k[32];
+    uint8_t v[32];
+    uint32_t reseed_counter;
+    int instantiated;
+} crypto_hmac_drbg_t;
+
 // RSA key structures
 typedef struct {
     uint8_t n[CRYPTO_RSA4096_KEY_LENGTH];  // Modulus
@@ -125,7 +145,9 @@ int crypto_init_hardware_acceleration(crypto_hw_support_t hw_mask);
 void crypto_cleanup_hardware(void);
 
 // Hash functions
+void sha1_hash(const uint8_t* data, uint32_t len, uint8_t* hash);      // TPM SHA-1 banks only
 void sha256_hash(const uint8_t* data, uint32_t len, uint8_t* hash);
+void sha384_hash(const uint8_t* data, uint32_t len, uint8_t* hash);
 void sha512_hash(const uint8_t* data, uint32_t len, uint8_t* hash);
 void sha3_256_hash(const uint8_t* data, uint32_t len, uint8_t* hash);
 void blake2b_hash(const uint8_t* data, uint32_t len, uint8_t* hash, uint32_t hash_len);
@@ -134,14 +156,21 @@ void blake2b_hash(const uint8_t* data, uint32_t len, uint8_t* hash, uint32_t has
 int crypto_sha256_init(crypto_sha256_ctx_t* ctx);
 int crypto_sha256_update(crypto_sha256_ctx_t* ctx, const uint8_t* data, uint32_t len);
 int crypto_sha256_final(crypto_sha256_ctx_t* ctx, uint8_t* hash);
+// Raw compression of one 64-byte block into state, for callers that manage
+// their own padding (midstates, tree hashes)
+void crypto_sha256_compress(uint32_t state[8], const uint8_t block[64]);
 
 int crypto_sha512_init(crypto_sha512_ctx_t* ctx);
 int crypto_sha512_update(crypto_sha512_ctx_t* ctx, const uint8_t* data, uint32_t len);
 int crypto_sha512_final(crypto_sha512_ctx_t* ctx, uint8_t* hash);
+// SHA-384 runs on the SHA-512 context and update
+int crypto_sha384_init(crypto_sha512_ctx_t* ctx);
+int crypto_sha384_final(crypto_sha512_ctx_t* ctx, uint8_t* hash);
 
 // HMAC functions
 int crypto_hmac_sha256_init(crypto_hmac_sha256_ctx_t* ctx, const uint8_t* key, uint32_t key_len);
 int crypto_hmac_sha256_update(crypto_hmac_sha256_ctx_t* ctx, const uint8_t* data, uint32_t len);
+// Resets to the keyed state, so one init serves many messages
 int crypto_hmac_sha256_final(crypto_hmac_sha256_ctx_t* ctx, uint8_t* mac);
 void crypto_hmac_sha256(const uint8_t* key, uint32_t key_len, const uint8_t* data, uint32_t data_len, uint8_t* mac);
 void crypto_hmac_sha512(const uint8_t* key, uint32_t key_len, const uint8_t* data, uint32_t data_len, uint8_t* mac);
@@ -159,7 +188,8 @@ int crypto_aes_gcm_decrypt(const crypto_aes_ctx_t* ctx, const uint8_t* iv, uint3
 int crypto_aes_xts_encrypt(const crypto_aes_ctx_t* ctx1, const crypto_aes_ctx_t* ctx2, const uint8_t* tweak, const uint8_t* plaintext, uint32_t len, uint8_t* ciphertext);
 int crypto_aes_xts_decrypt(const crypto_aes_ctx_t* ctx1, const crypto_aes_ctx_t* ctx2, const uint8_t* tweak, const uint8_t* ciphertext, uint32_t len, uint8_t* plaintext);
 
-// ChaCha20-Poly1305 AEAD
+// ChaCha20-Poly1305 AEAD (chacha20.c, RFC 8439). The block counter starts
+// at 0 and is 32 bits, so one nonce covers at most 256 GiB.
 int crypto_chacha20_init(crypto_chacha20_ctx_t* ctx, const uint8_t* key, const uint8_t* nonce);
 void crypto_chacha20_encrypt(crypto_chacha20_ctx_t* ctx, const uint8_t* plaintext, uint32_t len, uint8_t* ciphertext);
 void crypto_chacha20_decrypt(crypto_chacha20_ctx_t* ctx, const uint8_t* ciphertext, uint32_t len, uint8_t* plaintext);
@@ -215,7 +245,14 @@ int crypto_aes_hw_encrypt_block(const uint8_t* key, uint32_t key_bits, const uin
 int crypto_aes_hw_decrypt_block(const uint8_t* key, uint32_t key_bits, const uint8_t* ciphertext, uint8_t* plaintext);
 int crypto_sha256_hw_hash(const uint8_t* data, uint32_t len, uint8_t* hash);
 
-// Secure random number generation
+// Deterministic random bit generator; entropy comes from the caller
+int crypto_hmac_drbg_instantiate(crypto_hmac_drbg_t* drbg, const uint8_t* seed, uint32_t seed_len, const uint8_t* pers, uint32_t pers_len);
+int crypto_hmac_drbg_reseed(crypto_hmac_drbg_t* drbg, const uint8_t* entropy, uint32_t entropy_len, const uint8_t* addl, uint32_t addl_len);
+int crypto_hmac_drbg_generate(crypto_hmac_drbg_t* drbg, uint8_t* out, uint32_t len, const uint8_t* addl, uint32_t addl_len);
+
+// Secure random number generation. A global HMAC_DRBG seeded from the
+// health-tested sources in entropy.c on first use and reseeded every
+// CRYPTO_DRBG_RESEED_INTERVAL requests.
 int crypto_random_init(void);
 int crypto_random_bytes(uint8_t* buf, uint32_t len);
 int crypto_random_uint32(uint32_t* value);
@@ -227,14 +264,17 @@ int crypto_memcmp_constant_time(const void* a, const void* b, size_t len);
 void crypto_memzero_secure(void* ptr, size_t len);
 
 // Legacy functions (for backward compatibility)
+// RSA-2048 PKCS#1 v1.5 SHA-256 check against a CRYPTO_RSA2048_PUBKEY_SIZE key; 1 if valid
 int verify_signature(const uint8_t* data, uint32_t len, const uint8_t* signature, const uint8_t* public_key);
 
 // Cryptographic self-tests
 int crypto_self_test_sha256(void);
+int crypto_self_test_pbkdf2(void);
 int crypto_self_test_aes(void);
 int crypto_self_test_rsa(void);
 int crypto_self_test_ecdsa(void);
 int crypto_self_test_chacha20_poly1305(void);
+int crypto_self_test_hmac_drbg(void);
 int crypto_run_all_self_tests(void);
 
 // Zeroization and cleanup
@@ -9,41 +9,275 @@
 #include "compat.h"
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
 #include "crypto.h"
-static int rdrand(uint32_t* out) {
-    int ok;
-    asm volatile ("rdrand %0; setc %1" : "=r"(*out), "=qm"(ok));
+
+// EFI_RNG_PROTOCOL with the platform's default algorithm, provided by main.c
+extern int firmware_get_rng(uint8_t* buf, uint32_t len);
+
+static struct entropy_health g_health[ENTROPY_SRC_COUNT];
+static int g_probed = 0;
+static int g_have_rdrand = 0;
+static int g_have_rdseed = 0;
+static int g_firmware_gone = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+static void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d) {
+    asm volatile ("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(subleaf));
+}
+
+static void probe_cpu(void) {
+    uint32_t a, b, c, d;
+    cpuid(0, 0, &a, &b, &c, &d);
+    uint32_t max_leaf = a;
+    cpuid(1, 0, &a, &b, &c, &d);
+    g_have_rdrand = (c >> 30) & 1;
+    if (max_leaf >= 7) {
+        cpuid(7, 0, &a, &b, &c, &d);
+        g_have_rdseed = (b >> 18) & 1;
+    }
+}
+
+#if defined(__x86_64__)
+static int rdrand64(uint64_t* out) {
+    uint8_t ok;
+    asm volatile ("rdrand %0; setc %1" : "=r"(*out), "=qm"(ok) : : "cc");
     return ok;
 }
-static int rdseed(uint32_t* out) {
-    int ok;
-    asm volatile ("rdseed %0; setc %1" : "=r"(*out), "=qm"(ok));
+
+static int rdseed64(uint64_t* out) {
+    uint8_t ok;
+    asm volatile ("rdseed %0; setc %1" : "=r"(*out), "=qm"(ok) : : "cc");
     return ok;
 }
-static uint32_t uefi_random(void) {
-    uint32_t v = 0;
-    if (*(volatile uint32_t*)0x80000000) v = *(volatile uint32_t*)0x80000000;
-    return v;
+#else
+static int rdrand64(uint64_t* out) {
+    uint32_t lo, hi;
+    uint8_t ok1, ok2;
+    asm volatile ("rdrand %0; setc %1" : "=r"(lo), "=qm"(ok1) : : "cc");
+    asm volatile ("rdrand %0; setc %1" : "=r"(hi), "=qm"(ok2) : : "cc");
+    *out = ((uint64_t)hi << 32) | lo;
+    return ok1 & ok2;
+}
+
+static int rdseed64(uint64_t* out) {
+    uint32_t lo, hi;
+    uint8_t ok1, ok2;
+    asm volatile ("rdseed %0; setc %1" : "=r"(lo), "=qm"(ok1) : : "cc");
+    asm volatile ("rdseed %0; setc %1" : "=r"(hi), "=qm"(ok2) : : "cc");
+    *out = ((uint64_t)hi << 32) | lo;
+    return ok1 & ok2;
+}
+#endif
+
+static uint64_t read_timestamp(void) {
+    uint32_t lo, hi;
+    asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+#else
+static void probe_cpu(void) {
+}
+
+static int rdrand64(uint64_t* out) {
+    (void)out;
+    return 0;
+}
+
+static int rdseed64(uint64_t* out) {
+    (void)out;
+    return 0;
+}
+
+static uint64_t read_timestamp(void) {
+    uint64_t t;
+#if defined(__aarch64__)
+    asm volatile ("mrs %0, cntvct_el0" : "=r"(t));
+#elif defined(__riscv) && __riscv_xlen == 64
+    asm volatile ("rdtime %0" : "=r"(t));
+#elif defined(__loongarch64)
+    uint64_t id;
+    asm volatile ("rdtime.d %0, %1" : "=r"(t), "=r"(id));
+#else
+    // No cycle counter; the jitter source will fail its health tests
+    static uint64_t counter;
+    t = ++counter;
+#endif
+    return t;
+}
+#endif
+
+static void entropy_probe(void) {
+    if (g_probed) return;
+    probe_cpu();
+    g_health[ENTROPY_SRC_RDSEED].disabled = !g_have_rdseed;
+    g_health[ENTROPY_SRC_RDRAND].disabled = !g_have_rdrand;
+    g_probed = 1;
+}
+
+static void health_fail(struct entropy_health* h) {
+    h->failures++;
+    h->disabled = 1;
+}
+
+// Repetition count test (SP 800-90B 4.4.1)
+static int health_rct(struct entropy_health* h, uint64_t sample, uint32_t cutoff) {
+    if (h->samples > 0 && sample == h->last) {
+        if (++h->repeats >= cutoff) {
+            health_fail(h);
+            return -1;
+        }
+    } else {
+        h->last = sample;
+        h->repeats = 1;
+    }
+    h->samples++;
+    return 0;
+}
+
+// Adaptive proportion test (SP 800-90B 4.4.2)
+static int health_apt(struct entropy_health* h, uint64_t sample, uint32_t cutoff) {
+    if (h->apt_index == 0) {
+        h->apt_sample = sample;
+        h->apt_count = 1;
+    } else if (sample == h->apt_sample) {
+        if (++h->apt_count >= cutoff) {
+            health_fail(h);
+            return -1;
+        }
+    }
+    if (++h->apt_index == ENTROPY_APT_WINDOW) h->apt_index = 0;
+    return 0;
+}
+
+// 64-bit words from a conditioned hardware or firmware source. All-zero and
+// all-one words are how broken parts usually fail, so they count as stuck.
+static int health_word(enum entropy_source src, uint64_t word) {
+    struct entropy_health* h = &g_health[src];
+    if (word == 0 || word == ~0ull) {
+        health_fail(h);
+        return -1;
+    }
+    return health_rct(h, word, ENTROPY_RCT_CUTOFF_WORD);
 }
-static uint32_t timing_jitter(void) {
-    volatile uint32_t t = 0;
-    for (int i = 0; i < 1000; ++i) t += i * (uintptr_t)&t;
-    return t ^ (uintptr_t)&t;
+
+// Time a short data-dependent walk over a buffer that is too big to stay
+// in L1 alongside everything else; the low bits of the delta vary with
+// cache, TLB and pipeline state.
+static uint8_t jitter_sample(void) {
+    static volatile uint8_t buffer[ENTROPY_JITTER_BUFFER];
+    static uint32_t index;
+
+    uint64_t t0 = read_timestamp();
+    for (int i = 0; i < 64; i++) {
+        index = (index * 1103515245u + 12345u + buffer[index % ENTROPY_JITTER_BUFFER]) & 0x7FFFFFFF;
+        buffer[index % ENTROPY_JITTER_BUFFER] += (uint8_t)t0;
+    }
+    uint64_t delta = read_timestamp() - t0;
+    return (uint8_t)(delta ^ (delta >> 8));
+}
+
+struct entropy_sink {
+    uint8_t* pool;
+    uint32_t cap;
+    uint32_t len;
+    uint32_t credited;
+};
+
+static int sink_put(struct entropy_sink* s, const void* data, uint32_t len, uint32_t bits) {
+    if (s->len + len > s->cap) return -1;
+    memcpy(s->pool + s->len, data, len);
+    s->len += len;
+    s->credited += bits;
+    return 0;
+}
+
+static void gather_rdseed(struct entropy_sink* s, uint32_t want_bits) {
+    struct entropy_health* h = &g_health[ENTROPY_SRC_RDSEED];
+    while (!h->disabled && s->credited < want_bits) {
+        uint64_t word;
+        int tries = 0;
+        while (!rdseed64(&word)) {
+            if (++tries >= ENTROPY_RDSEED_RETRIES) return;
+        }
+        if (health_word(ENTROPY_SRC_RDSEED, word) != 0) return;
+        if (sink_put(s, &word, sizeof(word), 64) != 0) return;
+    }
+}
+
+static void gather_firmware(struct entropy_sink* s, uint32_t want_bits) {
+    struct entropy_health* h = &g_health[ENTROPY_SRC_FIRMWARE];
+    uint64_t words[8];
+
+    if (h->disabled || g_firmware_gone || s->credited >= want_bits) return;
+    uint32_t bytes = (want_bits - s->credited + 7) / 8;
+    bytes = (bytes + 7) & ~7u;
+    if (bytes > sizeof(words)) bytes = sizeof(words);
+    if (firmware_get_rng((uint8_t*)words, bytes) != 0) return;
+
+    for (uint32_t i = 0; i < bytes / 8; i++) {
+        if (health_word(ENTROPY_SRC_FIRMWARE, words[i]) != 0) break;
+        if (sink_put(s, &words[i], sizeof(words[i]), 64) != 0) break;
+    }
+    crypto_memzero_secure(words, sizeof(words));
+}
+
+// RDRAND is itself a DRBG output, so it is mixed in but not credited
+static void gather_rdrand(struct entropy_sink* s) {
+    for (int i = 0; i < 4 && !g_health[ENTROPY_SRC_RDRAND].disabled; i++) {
+        uint64_t word;
+        if (!rdrand64(&word) || health_word(ENTROPY_SRC_RDRAND, word) != 0) return;
+        if (sink_put(s, &word, sizeof(word), 0) != 0) return;
+    }
+}
+
+static void gather_jitter(struct entropy_sink* s, uint32_t want_bits) {
+    struct entropy_health* h = &g_health[ENTROPY_SRC_JITTER];
+    uint32_t halves = 0;
+
+    while (!h->disabled && s->credited < want_bits) {
+        uint8_t sample = jitter_sample();
+        if (health_rct(h, sample, ENTROPY_RCT_CUTOFF_JITTER) != 0 ||
+            health_apt(h, sample, ENTROPY_APT_CUTOFF_JITTER) != 0) {
+            return;
+        }
+        if (sink_put(s, &sample, 1, ++halves & 1 ? 0 : 1) != 0) return;
+    }
 }
+
+int entropy_gather(uint8_t* pool, uint32_t cap, uint32_t want_bits) {
+    struct entropy_sink s = { pool, cap, 0, 0 };
+    if (!pool) return -1;
+
+    entropy_probe();
+    uint64_t t = read_timestamp();
+    sink_put(&s, &t, sizeof(t), 0);
+
+    gather_rdseed(&s, want_bits);
+    gather_firmware(&s, want_bits);
+    gather_rdrand(&s);
+    gather_jitter(&s, want_bits);
+
+    return s.credited >= want_bits ? (int)s.len : -1;
+}
+
+int entropy_source_available(enum entropy_source src) {
+    if (src >= ENTROPY_SRC_COUNT) return 0;
+    entropy_probe();
+    if (src == ENTROPY_SRC_FIRMWARE && g_firmware_gone) return 0;
+    return !g_health[src].disabled;
+}
+
+const struct entropy_health* entropy_source_health(enum entropy_source src) {
+    return src < ENTROPY_SRC_COUNT ? &g_health[src] : NULL;
+}
+
+void entropy_exit_boot_services(void) {
+    g_firmware_gone = 1;
+}
+
 uint32_t entropy_get(void) {
-    uint8_t pool[32];
-    uint32_t v = 0, ok = 0;
-    if (rdrand(&v)) ok = 1;
-    else if (rdseed(&v)) ok = 1;
-    else v = 0;
-    *(uint32_t*)pool = v;
-    *(uint32_t*)(pool+4) = uefi_random();
-    *(uint32_t*)(pool+8) = timing_jitter();
-    uint32_t t;
-    asm volatile ("rdtsc" : "=a"(t));
-    *(uint32_t*)(pool+12) = t;
-    for (int i = 16; i < 32; i += 4) *(uint32_t*)(pool+i) = (uintptr_t)&pool[i];
-    uint8_t hash[32];
-    sha256_hash(pool, 32, hash);
-    return *(uint32_t*)hash;
-} 
\ No newline at end of file
+    uint32_t v = 0;
+    crypto_random_uint32(&v);
+    return v;
+}
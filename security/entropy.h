@@ -9,5 +9,52 @@
 #define BLOODHORN_ENTROPY_H
 #include <stdint.h>
 #include "compat.h"
+
+// Raw noise sources. Their samples only ever seed the DRBG in crypto.c;
+// nothing hands them out directly.
+enum entropy_source {
+    ENTROPY_SRC_RDSEED = 0,         // Credited at 64 bits per word
+    ENTROPY_SRC_FIRMWARE,           // EFI_RNG_PROTOCOL, 8 bits per byte
+    ENTROPY_SRC_RDRAND,             // DRBG output; mixed in, never credited
+    ENTROPY_SRC_JITTER,             // Timer jitter, 0.5 bits per sample
+    ENTROPY_SRC_COUNT
+};
+
+#define ENTROPY_POOL_MAX            2048    // Raw bytes gathered for one seed
+#define ENTROPY_RDSEED_RETRIES      64      // RDSEED underflows while the conditioner refills
+#define ENTROPY_JITTER_BUFFER       4096
+
+// SP 800-90B 4.4 continuous health tests, cutoffs for a false positive
+// rate of 2^-20. Hardware words are 64-bit samples, so a single repeat
+// (cutoff 2) already means a stuck source; they get no proportion test.
+#define ENTROPY_RCT_CUTOFF_WORD     2
+#define ENTROPY_RCT_CUTOFF_JITTER   41      // 1 + ceil(20 / 0.5)
+#define ENTROPY_APT_WINDOW          512
+#define ENTROPY_APT_CUTOFF_JITTER   479     // Table 2, H = 0.5, W = 512
+
+struct entropy_health {
+    uint64_t last;                  // Repetition count test
+    uint32_t repeats;
+    uint64_t apt_sample;            // Adaptive proportion test, current window
+    uint32_t apt_count;
+    uint32_t apt_index;
+    uint32_t samples;
+    uint32_t failures;
+    int disabled;                   // Failed a test; ignored for the rest of boot
+};
+
+// Append health-tested raw samples to pool until at least want_bits are
+// credited. Returns the bytes written, or -1 if the sources can't supply
+// that much. The pool is unconditioned and must go through the DRBG.
+int entropy_gather(uint8_t* pool, uint32_t cap, uint32_t want_bits);
+
+int entropy_source_available(enum entropy_source src);
+const struct entropy_health* entropy_source_health(enum entropy_source src);
+
+// Boot services are going away; stop calling into firmware
+void entropy_exit_boot_services(void);
+
+// Kept for old callers: 32 bits from crypto_random_uint32()
 uint32_t entropy_get(void);
-#endif 
\ No newline at end of file
+
+#endif
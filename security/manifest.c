@@ -0,0 +1,340 @@
+/*
+ * manifest.c
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#include "manifest.h"
+#include "crypto.h"
+#include "compat.h"
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+// Run fn(arg) on the BSP and every enabled AP at once and return when all
+// are done; just the BSP without EFI_MP_SERVICES_PROTOCOL. Provided by main.c.
+extern void firmware_run_on_all_cpus(void (*fn)(void* arg), void* arg);
+
+static uint16_t get_le16(const uint8_t* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get_le32(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_le64(const uint8_t* p) {
+    return (uint64_t)get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+static const uint8_t leaf_prefix = 0x00;
+static const uint8_t node_prefix = 0x01;
+
+static uint8_t g_trusted[MANIFEST_MAX_TRUSTED][MANIFEST_DIGEST_SIZE];
+static int g_trusted_count = 0;
+static uint8_t g_keys[MANIFEST_MAX_KEYS][MANIFEST_KEY_SIZE];
+static int g_key_count = 0;
+static int g_trust_pinned = 0;
+
+static void hash_node(const uint8_t* left, const uint8_t* right, uint8_t* out) {
+    crypto_sha256_ctx_t ctx;
+    crypto_sha256_init(&ctx);
+    crypto_sha256_update(&ctx, &node_prefix, 1);
+    crypto_sha256_update(&ctx, left, MANIFEST_CHUNK_DIGEST_SIZE);
+    crypto_sha256_update(&ctx, right, MANIFEST_CHUNK_DIGEST_SIZE);
+    crypto_sha256_final(&ctx, out);
+}
+
+// Fold the leaves level by level in a scratch copy; 0 if they give root
+static int merkle_check(const uint8_t* leaves, uint32_t count, const uint8_t* root) {
+    uint8_t top[MANIFEST_CHUNK_DIGEST_SIZE];
+
+    if (count == 0) {
+        crypto_sha256_ctx_t ctx;
+        crypto_sha256_init(&ctx);
+        crypto_sha256_final(&ctx, top);
+        return crypto_memcmp_constant_time(top, root, sizeof(top)) == 0 ? 0 : -1;
+    }
+
+    uint8_t* level = (uint8_t*)malloc((size_t)count * MANIFEST_CHUNK_DIGEST_SIZE);
+    if (!level) return -1;
+    memcpy(level, leaves, (size_t)count * MANIFEST_CHUNK_DIGEST_SIZE);
+
+    while (count > 1) {
+        uint32_t next = 0;
+        for (uint32_t i = 0; i < count; i += 2, next++) {
+            uint8_t* out = level + (size_t)next * MANIFEST_CHUNK_DIGEST_SIZE;
+            const uint8_t* left = level + (size_t)i * MANIFEST_CHUNK_DIGEST_SIZE;
+            if (i + 1 < count) hash_node(left, left + MANIFEST_CHUNK_DIGEST_SIZE, out);
+            else memmove(out, left, MANIFEST_CHUNK_DIGEST_SIZE);
+        }
+        count = next;
+    }
+    int r = crypto_memcmp_constant_time(level, root, MANIFEST_CHUNK_DIGEST_SIZE) == 0 ? 0 : -1;
+    free(level);
+    return r;
+}
+
+int manifest_parse(const uint8_t* data, uint32_t len, struct manifest* m) {
+    if (!data || !m || len < MANIFEST_HEADER_SIZE) return -1;
+
+    struct manifest_header* h = &m->hdr;
+    h->magic = get_le32(data);
+    h->version = get_le16(data + 4);
+    h->hash_alg = get_le16(data + 6);
+    h->chunk_size = get_le32(data + 8);
+    h->chunk_count = get_le32(data + 12);
+    h->image_size = get_le64(data + 16);
+    h->sig_len = get_le32(data + 24);
+    h->reserved = get_le32(data + 28);
+
+    if (h->magic != MANIFEST_MAGIC) return -1;
+    if (h->version != MANIFEST_VERSION && h->version != MANIFEST_VERSION_MERKLE) return -1;
+    if (h->hash_alg != MANIFEST_HASH_SHA256 || h->reserved != 0) return -1;
+    if (h->chunk_size < MANIFEST_MIN_CHUNK || h->chunk_size > MANIFEST_MAX_CHUNK) return -1;
+    if (h->sig_len != 0 && h->sig_len != MANIFEST_SIG_RSA2048) return -1;
+    if (h->chunk_count != (h->image_size + h->chunk_size - 1) / h->chunk_size) return -1;
+
+    int merkle = h->version == MANIFEST_VERSION_MERKLE;
+    uint64_t table_at = MANIFEST_HEADER_SIZE + (merkle ? MANIFEST_CHUNK_DIGEST_SIZE : 0);
+    uint64_t table_end = table_at + (uint64_t)h->chunk_count * MANIFEST_CHUNK_DIGEST_SIZE;
+    if (table_end + h->sig_len != len) return -1;
+
+    m->root = merkle ? data + MANIFEST_HEADER_SIZE : NULL;
+    m->digests = data + table_at;
+    m->signed_data = data;
+    m->signed_len = (uint32_t)(merkle ? table_at : table_end);
+    m->signature = h->sig_len ? data + table_end : NULL;
+
+    // The leaves aren't signed themselves; they are only good if they add up to the root
+    if (merkle && merkle_check(m->digests, h->chunk_count, m->root) != 0) return -1;
+    return 0;
+}
+
+void manifest_digest(const struct manifest* m, uint8_t digest[MANIFEST_DIGEST_SIZE]) {
+    sha512_hash(m->signed_data, m->signed_len, digest);
+}
+
+int manifest_verify_signature(const struct manifest* m, const uint8_t* public_key) {
+    if (!m || !m->signature || !public_key) return -1;
+    return verify_signature(m->signed_data, m->signed_len, m->signature, public_key) ? 0 : -1;
+}
+
+int manifest_add_trusted(const uint8_t digest[MANIFEST_DIGEST_SIZE]) {
+    if (!digest || g_trusted_count >= MANIFEST_MAX_TRUSTED) return -1;
+    memcpy(g_trusted[g_trusted_count++], digest, MANIFEST_DIGEST_SIZE);
+    return 0;
+}
+
+int manifest_add_key(const uint8_t* public_key, uint32_t len) {
+    if (!public_key || len != MANIFEST_KEY_SIZE || g_key_count >= MANIFEST_MAX_KEYS) return -1;
+    memcpy(g_keys[g_key_count++], public_key, MANIFEST_KEY_SIZE);
+    return 0;
+}
+
+void manifest_pin_trust(void) {
+    g_trust_pinned = 1;
+}
+
+void manifest_clear_trusted(void) {
+    crypto_memzero_secure(g_trusted, sizeof(g_trusted));
+    crypto_memzero_secure(g_keys, sizeof(g_keys));
+    g_trusted_count = 0;
+    g_key_count = 0;
+    g_trust_pinned = 0;
+}
+
+// Signed by a pinned key, when there are any, and pinned by digest, when
+// there are any; pinned with neither loaded trusts nothing
+int manifest_check_trust(const struct manifest* m) {
+    uint8_t digest[MANIFEST_DIGEST_SIZE];
+    if (!m) return -1;
+    if (!manifest_trust_required()) return 0;
+    if (g_trusted_count == 0 && g_key_count == 0) return -1;
+
+    if (g_key_count > 0) {
+        int signed_ok = 0;
+        for (int i = 0; i < g_key_count && !signed_ok; i++) {
+            signed_ok = manifest_verify_signature(m, g_keys[i]) == 0;
+        }
+        if (!signed_ok) return -1;
+    }
+    if (g_trusted_count == 0) return 0;
+
+    manifest_digest(m, digest);
+    for (int i = 0; i < g_trusted_count; i++) {
+        if (crypto_memcmp_constant_time(digest, g_trusted[i], MANIFEST_DIGEST_SIZE) == 0) return 0;
+    }
+    return -1;
+}
+
+int manifest_trust_required(void) {
+    return g_trust_pinned || g_trusted_count > 0 || g_key_count > 0;
+}
+
+static uint32_t chunk_len(const struct manifest* m, uint32_t index) {
+    uint64_t left = m->hdr.image_size - (uint64_t)index * m->hdr.chunk_size;
+    return left < m->hdr.chunk_size ? (uint32_t)left : m->hdr.chunk_size;
+}
+
+static void chunk_hash_init(crypto_sha256_ctx_t* ctx, int merkle) {
+    crypto_sha256_init(ctx);
+    if (merkle) crypto_sha256_update(ctx, &leaf_prefix, 1);
+}
+
+struct manifest_work {
+    const uint8_t* image;
+    uint64_t size;
+    uint32_t chunk_size;
+    uint32_t chunk_count;
+    int merkle;
+    uint8_t* digests;
+    uint32_t next;                  // Next chunk to claim, atomically
+};
+
+// Every CPU claims chunks until none are left, so fast and slow cores (and
+// the BSP, which also services firmware) balance out by themselves
+static void manifest_worker(void* arg) {
+    struct manifest_work* w = (struct manifest_work*)arg;
+    crypto_sha256_ctx_t ctx;
+
+    for (;;) {
+        uint32_t i = __atomic_fetch_add(&w->next, 1, __ATOMIC_RELAXED);
+        if (i >= w->chunk_count) break;
+
+        uint64_t start = (uint64_t)i * w->chunk_size;
+        uint64_t left = w->size - start;
+        uint32_t len = left < w->chunk_size ? (uint32_t)left : w->chunk_size;
+
+        chunk_hash_init(&ctx, w->merkle);
+        crypto_sha256_update(&ctx, w->image + start, len);
+        crypto_sha256_final(&ctx, w->digests + (uint64_t)i * MANIFEST_CHUNK_DIGEST_SIZE);
+    }
+}
+
+int manifest_hash_chunks(const uint8_t* image, uint64_t size, uint32_t chunk_size, int merkle, uint8_t* digests) {
+    if ((!image && size) || !digests || chunk_size == 0) return -1;
+
+    uint64_t count = (size + chunk_size - 1) / chunk_size;
+    if (count > 0xFFFFFFFFull) return -1;
+
+    struct manifest_work w = { image, size, chunk_size, (uint32_t)count, merkle, digests, 0 };
+    firmware_run_on_all_cpus(manifest_worker, &w);
+
+    // Firmware without MP services, or an AP that never ran: finish here
+    manifest_worker(&w);
+    return 0;
+}
+
+int manifest_verify_image(const struct manifest* m, const uint8_t* image, uint64_t size) {
+    if (!m || size != m->hdr.image_size) return -1;
+
+    uint32_t table = m->hdr.chunk_count * MANIFEST_CHUNK_DIGEST_SIZE;
+    uint8_t* digests = (uint8_t*)malloc(table ? table : 1);
+    if (!digests) return -1;
+
+    int r = manifest_hash_chunks(image, size, m->hdr.chunk_size, m->root != NULL, digests);
+    if (r == 0 && crypto_memcmp_constant_time(digests, m->digests, table) != 0) r = -1;
+    free(digests);
+    return r;
+}
+
+int manifest_verify_chunk(const struct manifest* m, uint32_t index, const uint8_t* data, uint32_t len) {
+    crypto_sha256_ctx_t ctx;
+    uint8_t digest[MANIFEST_CHUNK_DIGEST_SIZE];
+
+    if (!m || !data || index >= m->hdr.chunk_count || len != chunk_len(m, index)) return -1;
+    chunk_hash_init(&ctx, m->root != NULL);
+    crypto_sha256_update(&ctx, data, len);
+    crypto_sha256_final(&ctx, digest);
+    return crypto_memcmp_constant_time(digest, m->digests + (uint64_t)index * MANIFEST_CHUNK_DIGEST_SIZE,
+                                       MANIFEST_CHUNK_DIGEST_SIZE) == 0 ? 0 : -1;
+}
+
+int manifest_stream_init(struct manifest_stream* s, const struct manifest* m, manifest_sink_fn sink, void* ctx) {
+    if (!s || !m) return -1;
+    memset(s, 0, sizeof(*s));
+    s->m = m;
+    s->sink = sink;
+    s->ctx = ctx;
+
+    s->verified = (uint8_t*)calloc(m->hdr.chunk_count / 8 + 1, 1);
+    if (!s->verified) return -1;
+    if (sink) {
+        s->chunk = (uint8_t*)malloc(m->hdr.chunk_size);
+        if (!s->chunk) {
+            manifest_stream_free(s);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int manifest_stream_verified(const struct manifest_stream* s, uint32_t index) {
+    if (!s || !s->verified || index >= s->m->hdr.chunk_count) return 0;
+    return (s->verified[index / 8] >> (index % 8)) & 1;
+}
+
+int manifest_stream_feed(struct manifest_stream* s, const uint8_t* data, uint32_t len) {
+    if (!s || !s->verified || (!data && len)) return -1;
+    const struct manifest* m = s->m;
+
+    while (len > 0) {
+        if (s->pos >= m->hdr.image_size) return -1;      // Longer than the manifest says
+
+        uint32_t index = (uint32_t)(s->pos / m->hdr.chunk_size);
+        uint64_t start = (uint64_t)index * m->hdr.chunk_size;
+        uint32_t clen = chunk_len(m, index);
+        uint32_t at = (uint32_t)(s->pos - start);
+        uint32_t n = clen - at < len ? clen - at : len;
+
+        // Already verified on an earlier attempt: the bytes are only skipped
+        if (!manifest_stream_verified(s, index)) {
+            if (at == 0) chunk_hash_init(&s->hash, m->root != NULL);
+            crypto_sha256_update(&s->hash, data, n);
+            if (s->chunk) memcpy(s->chunk + at, data, n);
+
+            if (at + n == clen) {
+                uint8_t digest[MANIFEST_CHUNK_DIGEST_SIZE];
+                crypto_sha256_final(&s->hash, digest);
+                if (crypto_memcmp_constant_time(digest, m->digests + (uint64_t)index * MANIFEST_CHUNK_DIGEST_SIZE,
+                                                MANIFEST_CHUNK_DIGEST_SIZE) != 0) {
+                    return -1;
+                }
+                if (s->sink && s->sink(s->ctx, start, s->chunk, clen) != 0) return -1;
+                s->verified[index / 8] |= (uint8_t)(1u << (index % 8));
+                s->verified_count++;
+            }
+        }
+        s->pos += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+void manifest_stream_restart(struct manifest_stream* s) {
+    if (s) s->pos = 0;
+}
+
+uint64_t manifest_stream_resume_offset(const struct manifest_stream* s) {
+    const struct manifest* m = s->m;
+    for (uint32_t i = 0; i < m->hdr.chunk_count; i++) {
+        if (!manifest_stream_verified(s, i)) return (uint64_t)i * m->hdr.chunk_size;
+    }
+    return m->hdr.image_size;
+}
+
+int manifest_stream_finish(const struct manifest_stream* s) {
+    if (!s || !s->verified) return -1;
+    return s->verified_count == s->m->hdr.chunk_count ? 0 : -1;
+}
+
+void manifest_stream_free(struct manifest_stream* s) {
+    if (!s) return;
+    free(s->chunk);
+    free(s->verified);
+    s->chunk = NULL;
+    s->verified = NULL;
+}
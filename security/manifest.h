@@ -0,0 +1,131 @@
+/*
+ * manifest.h
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#ifndef BLOODHORN_MANIFEST_H
+#define BLOODHORN_MANIFEST_H
+#include <stdint.h>
+#include "compat.h"
+#include "crypto.h"
+
+// Chunked image manifest, as written by manifest_gen.py:
+//
+//   v1: header (32 bytes) | chunk digests (chunk_count x 32) | signature
+//   v2: header (32 bytes) | Merkle root (32) | leaves (chunk_count x 32) | signature
+//
+// The image is cut into chunk_size pieces (the last may be short) and each
+// is hashed with SHA-256 on its own, so verification spreads over every
+// CPU, or happens chunk by chunk while the image is still arriving. The
+// signature, if any, covers the signed part, and so does the SHA-512
+// "manifest digest" that allow-lists pin in place of a hash of the whole
+// image: header and digests in v1, just header and root in v2, so a v2
+// signature stays the same size whatever the image. All fields are
+// little-endian.
+//
+// v2 leaves are SHA-256(0x00 | chunk) and inner nodes SHA-256(0x01 | left |
+// right), an odd node moving up a level unchanged (RFC 6962 tree shape).
+// manifest_parse() checks the leaves against the root, so after that a
+// single chunk can be trusted on its own.
+
+#define MANIFEST_MAGIC              0x464D4842  // "BHMF"
+#define MANIFEST_VERSION            1
+#define MANIFEST_VERSION_MERKLE     2
+#define MANIFEST_HASH_SHA256        1
+#define MANIFEST_HEADER_SIZE        32
+#define MANIFEST_CHUNK_DIGEST_SIZE  32
+#define MANIFEST_DIGEST_SIZE        64          // SHA-512 of the signed part
+#define MANIFEST_SIG_RSA2048        256
+#define MANIFEST_MIN_CHUNK          (64 * 1024)
+#define MANIFEST_MAX_CHUNK          (64 * 1024 * 1024)
+#define MANIFEST_MAX_TRUSTED        8
+#define MANIFEST_MAX_KEYS           4
+#define MANIFEST_KEY_SIZE           CRYPTO_RSA2048_PUBKEY_SIZE  // LE bit count, then exponent and modulus (BE)
+#define MANIFEST_SUFFIX             ".bhm"      // Manifest file next to its image
+
+struct manifest_header {
+    uint32_t magic;
+    uint16_t version;               // MANIFEST_VERSION or MANIFEST_VERSION_MERKLE
+    uint16_t hash_alg;              // MANIFEST_HASH_*
+    uint32_t chunk_size;
+    uint32_t chunk_count;
+    uint64_t image_size;
+    uint32_t sig_len;               // 0 (unsigned) or MANIFEST_SIG_RSA2048
+    uint32_t reserved;              // Zero
+} __attribute__((packed));
+
+// Points into the buffer given to manifest_parse(), which must outlive it
+struct manifest {
+    struct manifest_header hdr;
+    const uint8_t* root;            // v2 only, NULL for v1
+    const uint8_t* digests;         // chunk_count SHA-256 digests (v2: leaf hashes)
+    const uint8_t* signed_data;     // Header and digests (v2: header and root)
+    uint32_t signed_len;
+    const uint8_t* signature;       // NULL if unsigned
+};
+
+int manifest_parse(const uint8_t* data, uint32_t len, struct manifest* m);
+void manifest_digest(const struct manifest* m, uint8_t digest[MANIFEST_DIGEST_SIZE]);
+// RSA-2048 PKCS#1 v1.5 over SHA-256 of the signed data; 0 if valid
+int manifest_verify_signature(const struct manifest* m, const uint8_t* public_key);
+
+// Trust roots the platform pins, from the allow-list and configuration:
+// manifest digests, and RSA keys a manifest must be signed with. Once any
+// are registered, or manifest_pin_trust() says some were configured (even
+// if none could be loaded), manifest_trust_required() is set and
+// manifest_check_trust() only passes a manifest that is signed by one of
+// the keys (if there are keys) and has one of the digests (if there are
+// digests). With nothing pinned every well-formed manifest passes.
+int manifest_add_trusted(const uint8_t digest[MANIFEST_DIGEST_SIZE]);
+int manifest_add_key(const uint8_t* public_key, uint32_t len);
+void manifest_pin_trust(void);
+void manifest_clear_trusted(void);
+int manifest_check_trust(const struct manifest* m);
+int manifest_trust_required(void);
+
+// SHA-256 of every chunk_size piece of image into digests, spread over all
+// CPUs through firmware_run_on_all_cpus(); merkle selects the leaf prefix
+int manifest_hash_chunks(const uint8_t* image, uint64_t size, uint32_t chunk_size, int merkle, uint8_t* digests);
+// 0 if image is exactly what the manifest describes
+int manifest_verify_image(const struct manifest* m, const uint8_t* image, uint64_t size);
+// 0 if data is chunk index; needs nothing but m, so any CPU may call it
+int manifest_verify_chunk(const struct manifest* m, uint32_t index, const uint8_t* data, uint32_t len);
+
+// Incremental verification of an image arriving in order, e.g. over TFTP.
+// Each chunk is hashed as its bytes come in and checked when its last byte
+// does. With a sink, bytes are held back in a chunk buffer and handed on
+// only once their chunk verified, so nothing downstream (a decompressor,
+// say) ever sees unverified data; without one the caller keeps the bytes
+// and just learns whether they are good.
+//
+// A failed or broken transfer is picked up with manifest_stream_restart()
+// and fed again from offset 0: chunks that already verified are skipped
+// without being hashed or passed to the sink again, so the sink sees every
+// byte exactly once, in order, across any number of attempts.
+typedef int (*manifest_sink_fn)(void* ctx, uint64_t offset, const uint8_t* data, uint32_t len);
+
+struct manifest_stream {
+    const struct manifest* m;
+    manifest_sink_fn sink;
+    void* ctx;
+    uint8_t* chunk;                 // Current chunk, sink mode only
+    crypto_sha256_ctx_t hash;       // Running hash of the current chunk
+    uint64_t pos;                   // Image offset of the next byte fed
+    uint8_t* verified;              // One bit per chunk
+    uint32_t verified_count;
+};
+
+int manifest_stream_init(struct manifest_stream* s, const struct manifest* m, manifest_sink_fn sink, void* ctx);
+// 0, or -1 once a chunk fails (the stream then wants a restart)
+int manifest_stream_feed(struct manifest_stream* s, const uint8_t* data, uint32_t len);
+void manifest_stream_restart(struct manifest_stream* s);
+// Start of the first chunk still missing, for transports that can seek
+uint64_t manifest_stream_resume_offset(const struct manifest_stream* s);
+int manifest_stream_verified(const struct manifest_stream* s, uint32_t index);
+// 0 once every chunk verified
+int manifest_stream_finish(const struct manifest_stream* s);
+void manifest_stream_free(struct manifest_stream* s);
+
+#endif
@@ -0,0 +1,310 @@
+/*
+ * payload.c
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#include "payload.h"
+#include "crypto.h"
+#include "compat.h"
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+struct payload_key {
+    int used;
+    uint8_t id[PAYLOAD_KEY_ID_SIZE];
+    uint8_t key[PAYLOAD_KEY_SIZE];
+};
+
+static struct payload_key g_payload_keys[PAYLOAD_MAX_KEYS];
+
+static uint16_t get_le16(const uint8_t* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get_le32(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_le64(const uint8_t* p) {
+    return (uint64_t)get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+int payload_add_key(const uint8_t key_id[PAYLOAD_KEY_ID_SIZE], const uint8_t key[PAYLOAD_KEY_SIZE]) {
+    struct payload_key* slot = NULL;
+
+    if (!key_id || !key) return -1;
+    for (int i = 0; i < PAYLOAD_MAX_KEYS; i++) {
+        struct payload_key* k = &g_payload_keys[i];
+        if (k->used && memcmp(k->id, key_id, PAYLOAD_KEY_ID_SIZE) == 0) {
+            slot = k;   // Replace
+            break;
+        }
+        if (!k->used && !slot) slot = k;
+    }
+    if (!slot) return -1;
+
+    slot->used = 1;
+    memcpy(slot->id, key_id, PAYLOAD_KEY_ID_SIZE);
+    memcpy(slot->key, key, PAYLOAD_KEY_SIZE);
+    return 0;
+}
+
+void payload_clear_keys(void) {
+    crypto_memzero_secure(g_payload_keys, sizeof(g_payload_keys));
+}
+
+static void payload_drop_key(const uint8_t key_id[PAYLOAD_KEY_ID_SIZE]) {
+    for (int i = 0; i < PAYLOAD_MAX_KEYS; i++) {
+        if (g_payload_keys[i].used && memcmp(g_payload_keys[i].id, key_id, PAYLOAD_KEY_ID_SIZE) == 0) {
+            crypto_memzero_secure(&g_payload_keys[i], sizeof(g_payload_keys[i]));
+        }
+    }
+}
+
+static int hex_nibble(uint8_t c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static int is_space(uint8_t c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+int payload_add_key_file(const uint8_t* data, uint32_t len) {
+    uint8_t key[PAYLOAD_KEY_SIZE];
+    uint8_t digest[32];
+    const uint8_t* text = data;
+    uint32_t text_len = len;
+    int r = -1;
+
+    if (!data) return -1;
+
+    // Hex when it is exactly 64 digits once trimmed, raw 32 bytes otherwise,
+    // the same test payload_pack.py makes
+    while (text_len && is_space(text[0])) { text++; text_len--; }
+    while (text_len && is_space(text[text_len - 1])) text_len--;
+    int hex = text_len == 2 * PAYLOAD_KEY_SIZE;
+    for (uint32_t i = 0; hex && i < PAYLOAD_KEY_SIZE; i++) {
+        int hi = hex_nibble(text[2 * i]), lo = hex_nibble(text[2 * i + 1]);
+        if (hi < 0 || lo < 0) hex = 0;
+        else key[i] = (uint8_t)(hi << 4 | lo);
+    }
+    if (!hex) {
+        if (len != PAYLOAD_KEY_SIZE) goto out;
+        memcpy(key, data, PAYLOAD_KEY_SIZE);
+    }
+
+    sha256_hash(key, PAYLOAD_KEY_SIZE, digest);
+    r = payload_add_key(digest, key);
+out:
+    crypto_memzero_secure(key, sizeof(key));
+    return r;
+}
+
+static const uint8_t* payload_find_key(const uint8_t key_id[PAYLOAD_KEY_ID_SIZE]) {
+    for (int i = 0; i < PAYLOAD_MAX_KEYS; i++) {
+        if (g_payload_keys[i].used && memcmp(g_payload_keys[i].id, key_id, PAYLOAD_KEY_ID_SIZE) == 0) {
+            return g_payload_keys[i].key;
+        }
+    }
+    return NULL;
+}
+
+int payload_detect(const uint8_t* data, uint32_t len) {
+    return data && len >= 4 && get_le32(data) == PAYLOAD_MAGIC;
+}
+
+int payload_parse_header(const uint8_t* data, uint32_t len, struct payload_header* hdr) {
+    if (!data || !hdr || len < PAYLOAD_HEADER_SIZE) return -1;
+
+    hdr->magic = get_le32(data);
+    hdr->version = get_le16(data + 4);
+    hdr->alg = data[6];
+    hdr->reserved0 = data[7];
+    hdr->chunk_size = get_le32(data + 8);
+    hdr->chunk_count = get_le32(data + 12);
+    hdr->payload_size = get_le64(data + 16);
+    memcpy(hdr->key_id, data + 24, PAYLOAD_KEY_ID_SIZE);
+    memcpy(hdr->nonce, data + 40, PAYLOAD_NONCE_SIZE);
+    memcpy(hdr->reserved1, data + 52, sizeof(hdr->reserved1));
+
+    if (hdr->magic != PAYLOAD_MAGIC || hdr->version != PAYLOAD_VERSION) return -1;
+    if (hdr->alg != PAYLOAD_ALG_AES256_GCM && hdr->alg != PAYLOAD_ALG_CHACHA20_POLY1305) return -1;
+    if (hdr->chunk_size < PAYLOAD_MIN_CHUNK || hdr->chunk_size > PAYLOAD_MAX_CHUNK) return -1;
+
+    // Loaders hand out 32-bit sizes, and the layout must match exactly
+    if (hdr->payload_size == 0 || hdr->payload_size > 0xFFFFFFFFull) return -1;
+    if (hdr->chunk_count != (hdr->payload_size + hdr->chunk_size - 1) / hdr->chunk_size) return -1;
+
+    if (hdr->reserved0) return -1;
+    for (uint32_t i = 0; i < sizeof(hdr->reserved1); i++) {
+        if (hdr->reserved1[i]) return -1;
+    }
+    return 0;
+}
+
+uint64_t payload_container_size(const struct payload_header* hdr) {
+    return PAYLOAD_HEADER_SIZE + (uint64_t)hdr->chunk_count * PAYLOAD_TAG_SIZE + hdr->payload_size;
+}
+
+uint32_t payload_chunk_len(const struct payload_header* hdr, uint32_t index) {
+    uint64_t start = (uint64_t)index * hdr->chunk_size;
+    uint64_t left = hdr->payload_size - start;
+    return left < hdr->chunk_size ? (uint32_t)left : hdr->chunk_size;
+}
+
+int payload_stream_init(struct payload_stream* s, const uint8_t* header, uint32_t header_len, uint8_t* out) {
+    if (!s || !out) return -1;
+    memset(s, 0, sizeof(*s));
+    if (payload_parse_header(header, header_len, &s->hdr) != 0) return -1;
+
+    const uint8_t* key = payload_find_key(s->hdr.key_id);
+    if (!key) return -1;
+    memcpy(s->key, key, PAYLOAD_KEY_SIZE);
+    if (s->hdr.alg == PAYLOAD_ALG_AES256_GCM && crypto_aes_init(&s->aes, s->key, 256) != CRYPTO_SUCCESS) {
+        payload_stream_free(s);
+        return -1;
+    }
+
+    s->tags = (uint8_t*)malloc((size_t)s->hdr.chunk_count * PAYLOAD_TAG_SIZE);
+    if (!s->tags) {
+        payload_stream_free(s);
+        return -1;
+    }
+    memcpy(s->raw_header, header, PAYLOAD_HEADER_SIZE);
+    s->out = out;
+    s->data_start = PAYLOAD_HEADER_SIZE + (uint64_t)s->hdr.chunk_count * PAYLOAD_TAG_SIZE;
+    return 0;
+}
+
+int payload_decrypt_chunk(const struct payload_stream* s, uint32_t index, uint8_t* chunk) {
+    if (!s || !chunk || index >= s->hdr.chunk_count) return -1;
+
+    uint32_t len = payload_chunk_len(&s->hdr, index);
+    const uint8_t* tag = s->tags + (size_t)index * PAYLOAD_TAG_SIZE;
+    uint8_t nonce[PAYLOAD_NONCE_SIZE];
+    int r;
+
+    memcpy(nonce, s->hdr.nonce, PAYLOAD_NONCE_SIZE);
+    nonce[8] ^= (uint8_t)(index >> 24);
+    nonce[9] ^= (uint8_t)(index >> 16);
+    nonce[10] ^= (uint8_t)(index >> 8);
+    nonce[11] ^= (uint8_t)index;
+
+    if (s->hdr.alg == PAYLOAD_ALG_AES256_GCM) {
+        r = crypto_aes_gcm_decrypt(&s->aes, nonce, PAYLOAD_NONCE_SIZE, s->raw_header, PAYLOAD_HEADER_SIZE,
+                                   chunk, len, tag, chunk);
+    } else {
+        r = crypto_chacha20_poly1305_decrypt(s->key, nonce, s->raw_header, PAYLOAD_HEADER_SIZE,
+                                             chunk, len, tag, chunk);
+    }
+    if (r != CRYPTO_SUCCESS) {
+        // Never leave unauthenticated bytes where a loader could pick them up
+        crypto_memzero_secure(chunk, len);
+        return -1;
+    }
+    return 0;
+}
+
+int payload_stream_feed(struct payload_stream* s, const uint8_t* data, uint32_t len) {
+    if (!s || !s->tags || (!data && len)) return -1;
+
+    while (len > 0) {
+        uint32_t n;
+
+        if (s->pos < PAYLOAD_HEADER_SIZE) {
+            // Already parsed in init; it has to be the same header
+            n = PAYLOAD_HEADER_SIZE - (uint32_t)s->pos;
+            if (n > len) n = len;
+            if (memcmp(s->raw_header + s->pos, data, n) != 0) return -1;
+        } else if (s->pos < s->data_start) {
+            uint64_t left = s->data_start - s->pos;
+            n = left < len ? (uint32_t)left : len;
+            memcpy(s->tags + (s->pos - PAYLOAD_HEADER_SIZE), data, n);
+        } else {
+            // Ciphertext goes where its plaintext belongs, then is decrypted
+            // in place as each chunk completes
+            uint64_t off = s->pos - s->data_start;
+            uint64_t left = s->hdr.payload_size - off;
+            if (left == 0) return -1;   // Longer than the header says
+            n = left < len ? (uint32_t)left : len;
+            memcpy(s->out + off, data, n);
+
+            while (s->chunks_done < s->hdr.chunk_count) {
+                uint64_t start = (uint64_t)s->chunks_done * s->hdr.chunk_size;
+                if (start + payload_chunk_len(&s->hdr, s->chunks_done) > off + n) break;
+                if (payload_decrypt_chunk(s, s->chunks_done, s->out + start) != 0) return -1;
+                s->chunks_done++;
+            }
+        }
+        s->pos += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int payload_stream_finish(struct payload_stream* s) {
+    if (!s || !s->tags) return -1;
+    if (s->chunks_done != s->hdr.chunk_count) return -1;
+    return s->pos == payload_container_size(&s->hdr) ? 0 : -1;
+}
+
+void payload_stream_free(struct payload_stream* s) {
+    if (!s) return;
+    if (s->tags) free(s->tags);
+    s->tags = NULL;
+    crypto_memzero_secure(s->key, sizeof(s->key));
+    crypto_zeroize_context(&s->aes, sizeof(s->aes));
+}
+
+int payload_self_test(void) {
+    // Key bytes 00..1f as a hex key file, and a one-chunk AES-256-GCM
+    // container of the plaintext below from payload_pack.py
+    static const char key_file[] = "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f\n";
+    static const char plaintext[] = "BloodHorn payload key self-test, chunk 0";
+    static const uint8_t container[] = {
+        0x42,0x48,0x50,0x4b,0x01,0x00,0x01,0x00,0x00,0x10,0x00,0x00,
+        0x01,0x00,0x00,0x00,0x28,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+        0x63,0x0d,0xcd,0x29,0x66,0xc4,0x33,0x66,0x91,0x12,0x54,0x48,
+        0xbb,0xb2,0x5b,0x4f,0xbb,0xfe,0x1e,0xdf,0xaa,0x17,0x9f,0xca,
+        0xcd,0x45,0xba,0xb3,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+        0x00,0x00,0x00,0x00,0x5a,0x47,0xab,0xe9,0xec,0xaa,0xe0,0x11,
+        0x8e,0xf2,0x42,0xde,0xa0,0x0c,0x0b,0x6c,0xdd,0x8a,0xcf,0xc9,
+        0xc0,0x1d,0x60,0x01,0x1e,0xf5,0x47,0xc8,0x14,0x31,0xba,0xcb,
+        0xa9,0xa4,0x35,0x58,0x62,0x1c,0xb1,0xa2,0x6f,0x30,0xa7,0x50,
+        0x42,0x88,0x89,0xc0,0x4a,0x4b,0xb1,0xb2,0x92,0xc9,0x25,0xac,
+    };
+    uint8_t out[sizeof(plaintext) - 1];
+    uint8_t tampered[sizeof(container)];
+    struct payload_stream s;
+    int result = CRYPTO_ERROR_VERIFICATION_FAILED;
+
+    if (payload_add_key_file((const uint8_t*)key_file, sizeof(key_file) - 1) != 0) return result;
+
+    // The container must decrypt under the ID the key file was given, and
+    // a flipped ciphertext bit must not
+    if (payload_stream_init(&s, container, sizeof(container), out) == 0) {
+        if (payload_stream_feed(&s, container, sizeof(container)) == 0 && payload_stream_finish(&s) == 0 &&
+            memcmp(out, plaintext, sizeof(out)) == 0) {
+            result = CRYPTO_SUCCESS;
+        }
+        payload_stream_free(&s);
+    }
+    memcpy(tampered, container, sizeof(container));
+    tampered[sizeof(tampered) - 1] ^= 1;
+    if (result == CRYPTO_SUCCESS && payload_stream_init(&s, tampered, sizeof(tampered), out) == 0) {
+        if (payload_stream_feed(&s, tampered, sizeof(tampered)) == 0) result = CRYPTO_ERROR_VERIFICATION_FAILED;
+        payload_stream_free(&s);
+    }
+
+    // The test key is public, so it must never stay registered
+    payload_drop_key(container + 24);
+    crypto_memzero_secure(out, sizeof(out));
+    return result;
+}
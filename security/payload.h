@@ -0,0 +1,100 @@
+/*
+ * payload.h
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#ifndef BLOODHORN_PAYLOAD_H
+#define BLOODHORN_PAYLOAD_H
+#include <stdint.h>
+#include "compat.h"
+#include "crypto.h"
+
+// Encrypted payload container, as written by payload_pack.py:
+//
+//   header (64 bytes) | tag table (chunk_count x 16) | chunk 0 | chunk 1 | ...
+//
+// Every chunk is chunk_size bytes of ciphertext except the last, and is an
+// independent AEAD message: the nonce is the header nonce with its last
+// four bytes XORed with the big-endian chunk index, the AAD is the 64-byte
+// header, and the tag is the chunk's entry in the table. The header is thus
+// checked by every chunk, and chunks can't be reordered, dropped or moved
+// between containers. All fields are little-endian.
+
+#define PAYLOAD_MAGIC               0x4B504842  // "BHPK"
+#define PAYLOAD_VERSION             1
+#define PAYLOAD_HEADER_SIZE         64
+#define PAYLOAD_TAG_SIZE            16
+#define PAYLOAD_KEY_ID_SIZE         16
+#define PAYLOAD_KEY_SIZE            32
+#define PAYLOAD_NONCE_SIZE          12
+#define PAYLOAD_MIN_CHUNK           4096
+#define PAYLOAD_MAX_CHUNK           (16 * 1024 * 1024)
+#define PAYLOAD_MAX_KEYS            8
+
+#define PAYLOAD_ALG_AES256_GCM          1
+#define PAYLOAD_ALG_CHACHA20_POLY1305   2
+
+struct payload_header {
+    uint32_t magic;
+    uint16_t version;
+    uint8_t alg;                    // PAYLOAD_ALG_*
+    uint8_t reserved0;
+    uint32_t chunk_size;            // Plaintext bytes per chunk, last may be short
+    uint32_t chunk_count;
+    uint64_t payload_size;          // Plaintext bytes in total
+    uint8_t key_id[PAYLOAD_KEY_ID_SIZE];
+    uint8_t nonce[PAYLOAD_NONCE_SIZE];
+    uint8_t reserved1[12];          // Zero
+} __attribute__((packed));
+
+// Decrypts a container fed in arbitrary pieces, straight into one flat
+// buffer. Ciphertext is copied to where its plaintext belongs and decrypted
+// in place once the chunk is complete, so nothing but the tag table is
+// buffered on the side.
+struct payload_stream {
+    struct payload_header hdr;
+    uint8_t raw_header[PAYLOAD_HEADER_SIZE];    // Exact bytes, the AAD
+    uint8_t key[PAYLOAD_KEY_SIZE];
+    crypto_aes_ctx_t aes;           // Expanded once for AES-256-GCM
+    uint8_t* tags;                  // chunk_count tags
+    uint8_t* out;                   // payload_size bytes, owned by the caller
+    uint64_t pos;                   // Container bytes consumed
+    uint64_t data_start;            // Container offset of chunk 0
+    uint32_t chunks_done;           // Chunks verified so far, in order
+};
+
+// Keys are registered by platform code (sealed TPM blobs, provisioning)
+// under the ID the packer wrote; nothing in the container is a key
+int payload_add_key(const uint8_t key_id[PAYLOAD_KEY_ID_SIZE], const uint8_t key[PAYLOAD_KEY_SIZE]);
+// A key file as payload_pack.py reads it (32 raw bytes or 64 hex digits),
+// registered under the packer's default ID: the key's SHA-256, first 16 bytes
+int payload_add_key_file(const uint8_t* data, uint32_t len);
+void payload_clear_keys(void);
+
+int payload_detect(const uint8_t* data, uint32_t len);
+// Validate the header; fails on unknown versions, algorithms or layouts
+int payload_parse_header(const uint8_t* data, uint32_t len, struct payload_header* hdr);
+uint64_t payload_container_size(const struct payload_header* hdr);
+// Plaintext bytes in chunk index; the last chunk may be short
+uint32_t payload_chunk_len(const struct payload_header* hdr, uint32_t index);
+
+// out must hold hdr.payload_size bytes. Fails if no key has the header's ID.
+int payload_stream_init(struct payload_stream* s, const uint8_t* header, uint32_t header_len, uint8_t* out);
+// Feed the container from byte 0. Returns 0, or -1 on a bad chunk; a chunk
+// that fails is wiped from out.
+int payload_stream_feed(struct payload_stream* s, const uint8_t* data, uint32_t len);
+// 0 once every chunk arrived and verified
+int payload_stream_finish(struct payload_stream* s);
+void payload_stream_free(struct payload_stream* s);
+
+// Verify and decrypt chunk 'index' in place. Chunks don't depend on each
+// other and the stream isn't modified, so APs may each take some.
+int payload_decrypt_chunk(const struct payload_stream* s, uint32_t index, uint8_t* chunk);
+
+// Known-answer test of the key file path and a decrypt; CRYPTO_SUCCESS if
+// it passed. Leaves the registered keys as they were.
+int payload_self_test(void);
+
+#endif
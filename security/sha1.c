@@ -0,0 +1,93 @@
+/*
+ * sha1.c
+ *
+ * This file is part of BloodHorn and is licensed under the BSD License.
+ * See the root of the repository for license details.
+ */
+
+#include <stdint.h>
+#include "compat.h"
+#include <string.h>
+#include "crypto.h"
+
+// SHA-1 is broken for signatures and is here only because TPMs still ship
+// with the SHA-1 PCR bank active, and every active bank must be extended.
+
+static uint32_t rotl32(uint32_t x, int n) {
+    return (x << n) | (x >> (32 - n));
+}
+
+static uint32_t sha1_load_be32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void sha1_store_be32(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static void sha1_compress(uint32_t state[5], const uint8_t block[64]) {
+    uint32_t w[80];
+
+    for (int i = 0; i < 16; i++) {
+        w[i] = sha1_load_be32(block + i * 4);
+    }
+    for (int i = 16; i < 80; i++) {
+        w[i] = rotl32(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+
+    for (int i = 0; i < 80; i++) {
+        uint32_t f, k;
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+        uint32_t temp = rotl32(a, 5) + f + e + k + w[i];
+        e = d; d = c; c = rotl32(b, 30); b = a; a = temp;
+    }
+
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d; state[4] += e;
+}
+
+void sha1_hash(const uint8_t* data, uint32_t len, uint8_t* hash) {
+    uint32_t state[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+    uint8_t block[64];
+    uint64_t bit_len = (uint64_t)len * 8;
+
+    while (len >= 64) {
+        sha1_compress(state, data);
+        data += 64;
+        len -= 64;
+    }
+
+    // The tail, the '1' bit and the 64-bit big-endian length
+    memset(block, 0, sizeof(block));
+    if (len) memcpy(block, data, len);
+    block[len] = 0x80;
+    if (len >= 56) {
+        sha1_compress(state, block);
+        memset(block, 0, sizeof(block));
+    }
+    sha1_store_be32(block + 56, (uint32_t)(bit_len >> 32));
+    sha1_store_be32(block + 60, (uint32_t)bit_len);
+    sha1_compress(state, block);
+
+    for (int i = 0; i < 5; i++) {
+        sha1_store_be32(hash + i * 4, state[i]);
+    }
+    crypto_zeroize_context(state, sizeof(state));
+    crypto_zeroize_context(block, sizeof(block));
+}
@@ -9,6 +9,16 @@
 #include "crypto.h"
 #include "compat.h"
 #include <string.h>
+#include <stdlib.h>
+
+// Firmware hooks: busy-wait for the given time (gBS->Stall() under UEFI),
+// and whole pages that stay valid after ExitBootServices() (EfiLoaderData)
+extern void firmware_stall(uint32_t microseconds);
+extern void* firmware_allocate_pages(uint32_t pages);
+extern void firmware_free_pages(void* base, uint32_t pages);
+
+// Locality 0 register window, shared by the TIS/FIFO and CRB interfaces
+#define TPM_BASE_ADDRESS        0xFED40000
 
 // TPM Interface Registers (for TIS)
 #define TPM_ACCESS_REG          0x0000
@@ -18,6 +28,7 @@
 #define TPM_INTF_CAPS_REG       0x0014
 #define TPM_STS_REG             0x0018
 #define TPM_DATA_FIFO_REG       0x0024
+#define TPM_INTERFACE_ID_REG    0x0030
 #define TPM_DID_VID_REG         0x0F00
 #define TPM_RID_REG             0x0F04
 
@@ -35,20 +46,79 @@
 #define TPM_STS_DATA_AVAIL          (1 << 4)
 #define TPM_STS_EXPECT              (1 << 3)
 #define TPM_STS_RESPONSE_RETRY      (1 << 1)
+#define TPM_STS_BURST_COUNT(sts)    (((sts) >> 8) & 0xFFFF)
+
+// Interface ID (PC Client PTP), InterfaceType field
+#define TPM_INTERFACE_TYPE_MASK     0xF
+#define TPM_INTERFACE_TYPE_FIFO     0x0
+#define TPM_INTERFACE_TYPE_CRB      0x1
+#define TPM_INTERFACE_TYPE_TIS      0xF
+
+// CRB Registers (Command Response Buffer, used by most fTPMs)
+#define TPM_LOC_STATE_REG           0x0000
+#define TPM_LOC_CTRL_REG            0x0008
+#define TPM_LOC_STS_REG             0x000C
+#define TPM_CRB_CTRL_REQ_REG        0x0040
+#define TPM_CRB_CTRL_STS_REG        0x0044
+#define TPM_CRB_CTRL_CANCEL_REG     0x0048
+#define TPM_CRB_CTRL_START_REG      0x004C
+#define TPM_CRB_CMD_SIZE_REG        0x0058
+#define TPM_CRB_CMD_LADDR_REG       0x005C
+#define TPM_CRB_CMD_HADDR_REG       0x0060
+#define TPM_CRB_RSP_SIZE_REG        0x0064
+#define TPM_CRB_RSP_ADDR_REG        0x0068
+
+// CRB Register Bits
+#define TPM_LOC_CTRL_REQUEST_ACCESS (1 << 0)
+#define TPM_LOC_CTRL_RELINQUISH     (1 << 1)
+#define TPM_LOC_STS_GRANTED         (1 << 0)
+#define TPM_CRB_REQ_CMD_READY       (1 << 0)
+#define TPM_CRB_REQ_GO_IDLE         (1 << 1)
+#define TPM_CRB_STS_ERROR           (1 << 0)
+#define TPM_CRB_STS_IDLE            (1 << 1)
+#define TPM_CRB_START               (1 << 0)
+#define TPM_CRB_CANCEL              (1 << 0)
+
+// Timeouts (TCG PC Client PTP), in microseconds
+#define TPM_TIMEOUT_A_US            750000
+#define TPM_TIMEOUT_B_US            2000000
+#define TPM_TIMEOUT_C_US            750000
+#define TPM_TIMEOUT_D_US            750000
+#define TPM_TIMEOUT_COMMAND_US      90000000    // Longest command (full self-test)
+
+// Polling starts fast, since most commands finish in well under a
+// millisecond, and backs off so long commands don't hammer the bus
+#define TPM_POLL_MIN_US             10
+#define TPM_POLL_MAX_US             1000
+
+#define TPM2_HEADER_SIZE            10
+#define TPM2_ST_NO_SESSIONS         0x8001
+#define TPM2_ST_SESSIONS            0x8002
+#define TPM2_RS_PW                  0x40000009
+#define TPM2_CAP_PCRS               0x00000005
 
 // Global TPM state
 static TPM2_INTERFACE_TYPE g_tpm_interface = TPM2_INTERFACE_NONE;
-static uint32_t g_tpm_base_address = 0;
+static uintptr_t g_tpm_base_address = 0;
 static int g_tpm_initialized = 0;
+static int g_crb_ready = 0;             // CRB is in the Ready state
 static TPM2_EVENT_LOG g_global_event_log;
 
+// Measurements made but not yet extended, oldest first
+static struct {
+    TPM2_MEASUREMENT* entries;
+    uint32_t count;
+    uint32_t capacity;
+    int deferred;
+} g_measure_queue;
+
 // Hardware interface functions
 static uint8_t tpm_read8(uint32_t offset) {
     return *(volatile uint8_t*)(g_tpm_base_address + offset);
 }
 
 static void tpm_write8(uint32_t offset, uint8_t value) {
-    *(volatile uint8_t*)(g_tmp_base_address + offset) = value;
+    *(volatile uint8_t*)(g_tpm_base_address + offset) = value;
 }
 
 static uint32_t tpm_read32(uint32_t offset) {
@@ -59,117 +129,243 @@ static void tpm_write32(uint32_t offset, uint32_t value) {
     *(volatile uint32_t*)(g_tpm_base_address + offset) = value;
 }
 
+static void put_be16(uint8_t* p, uint16_t v) {
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+static void put_be32(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+// The event log is little-endian, unlike TPM commands
+static void put_le16(uint8_t* p, uint16_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static void put_le32(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static uint16_t get_be16(const uint8_t* p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static uint32_t get_be32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// Wait until (register & mask) == value, or fail after timeout_us
+static int tpm_wait32(uint32_t offset, uint32_t mask, uint32_t value, uint32_t timeout_us) {
+    uint32_t waited = 0;
+    uint32_t step = TPM_POLL_MIN_US;
+
+    while ((tpm_read32(offset) & mask) != value) {
+        if (waited >= timeout_us) return -1;
+        firmware_stall(step);
+        waited += step;
+        if (step < TPM_POLL_MAX_US) step *= 2;
+    }
+    return 0;
+}
+
+static int tpm_wait8(uint32_t offset, uint8_t mask, uint8_t value, uint32_t timeout_us) {
+    uint32_t waited = 0;
+    uint32_t step = TPM_POLL_MIN_US;
+
+    while ((tpm_read8(offset) & mask) != value) {
+        if (waited >= timeout_us) return -1;
+        firmware_stall(step);
+        waited += step;
+        if (step < TPM_POLL_MAX_US) step *= 2;
+    }
+    return 0;
+}
+
 TPM2_INTERFACE_TYPE tpm2_detect_interface(void) {
-    // Check for TPM at standard addresses
-    uint32_t tpm_addresses[] = {0xFED40000, 0xFED41000, 0};
-    
-    for (int i = 0; tpm_addresses[i] != 0; i++) {
-        g_tpm_base_address = tpm_addresses[i];
-        
-        // Try to read DID/VID register
-        uint32_t did_vid = tpm_read32(TPM_DID_VID_REG);
-        if (did_vid != 0xFFFFFFFF && did_vid != 0x00000000) {
-            // Found a TPM, check interface type
-            uint32_t intf_caps = tpm_read32(TPM_INTF_CAPS_REG);
-            
-            if (intf_caps & (1 << 2)) {
-                return TPM2_INTERFACE_CRB;  // Command Response Buffer
-            } else {
-                return TPM2_INTERFACE_TIS;  // TPM Interface Specification
-            }
-        }
+    g_tpm_base_address = TPM_BASE_ADDRESS;
+
+    // Nothing decodes the window: reads float high
+    if (tpm_read8(TPM_ACCESS_REG) == 0xFF) {
+        return TPM2_INTERFACE_NONE;
+    }
+
+    // TIS 1.3 parts have no Interface ID register and read all ones there
+    switch (tpm_read32(TPM_INTERFACE_ID_REG) & TPM_INTERFACE_TYPE_MASK) {
+        case TPM_INTERFACE_TYPE_CRB:
+            return TPM2_INTERFACE_CRB;
+        case TPM_INTERFACE_TYPE_FIFO:
+        case TPM_INTERFACE_TYPE_TIS:
+            return TPM2_INTERFACE_TIS;
+        default:
+            return TPM2_INTERFACE_NONE;
     }
-    
-    return TPM2_INTERFACE_NONE;
 }
 
 int tpm2_init_interface(TPM2_INTERFACE_TYPE interface_type) {
     g_tpm_interface = interface_type;
-    
-    if (interface_type == TPM2_INTERFACE_NONE) {
-        return -1;
-    }
-    
+    g_crb_ready = 0;
+
     // Request locality 0
-    if (interface_type == TPM2_INTERFACE_TIS) {
-        tpm_write8(TPM_ACCESS_REG, TPM_ACCESS_REQUEST_USE);
-        
-        // Wait for locality to be granted
-        int timeout = 1000;
-        while (timeout-- > 0) {
-            uint8_t access = tmp_read8(TPM_ACCESS_REG);
-            if (access & TPM_ACCESS_ACTIVE_LOCALITY) {
-                break;
-            }
-            // Simple delay
-            for (volatile int i = 0; i < 1000; i++);
+    switch (interface_type) {
+        case TPM2_INTERFACE_TIS:
+            tpm_write8(TPM_ACCESS_REG, TPM_ACCESS_REQUEST_USE);
+            return tpm_wait8(TPM_ACCESS_REG, TPM_ACCESS_VALID | TPM_ACCESS_ACTIVE_LOCALITY,
+                             TPM_ACCESS_VALID | TPM_ACCESS_ACTIVE_LOCALITY, TPM_TIMEOUT_A_US);
+
+        case TPM2_INTERFACE_CRB:
+        case TPM2_INTERFACE_FTPM:
+            tpm_write32(TPM_LOC_CTRL_REG, TPM_LOC_CTRL_REQUEST_ACCESS);
+            return tpm_wait32(TPM_LOC_STS_REG, TPM_LOC_STS_GRANTED, TPM_LOC_STS_GRANTED, TPM_TIMEOUT_A_US);
+
+        default:
+            return -1;
+    }
+}
+
+// burstCount is how many bytes the FIFO takes or gives without further
+// status checks; it reads 0 while the TPM is busy
+static uint32_t tis_burst_count(void) {
+    uint32_t waited = 0;
+    uint32_t step = TPM_POLL_MIN_US;
+
+    for (;;) {
+        uint32_t burst = TPM_STS_BURST_COUNT(tpm_read32(TPM_STS_REG));
+        if (burst) return burst;
+        if (waited >= TPM_TIMEOUT_D_US) return 0;
+        firmware_stall(step);
+        waited += step;
+        if (step < TPM_POLL_MAX_US) step *= 2;
+    }
+}
+
+static int tis_read_fifo(uint8_t* buf, uint32_t len) {
+    uint32_t done = 0;
+    while (done < len) {
+        uint32_t burst = tis_burst_count();
+        if (!burst) return -1;
+        while (burst-- && done < len) {
+            buf[done++] = tpm_read8(TPM_DATA_FIFO_REG);
         }
-        
-        if (timeout <= 0) {
-            return -1; // Failed to acquire locality
+    }
+    return 0;
+}
+
+static int tis_transfer(const uint8_t* cmd, uint32_t cmd_size, uint8_t* rsp, uint32_t* rsp_size) {
+    // Move to Ready; this also discards whatever a previous command left behind
+    tpm_write8(TPM_STS_REG, TPM_STS_COMMAND_READY);
+    if (tpm_wait8(TPM_STS_REG, TPM_STS_COMMAND_READY, TPM_STS_COMMAND_READY, TPM_TIMEOUT_B_US) != 0) {
+        return -1;
+    }
+
+    uint32_t sent = 0;
+    while (sent < cmd_size) {
+        uint32_t burst = tis_burst_count();
+        if (!burst) return -1;
+        while (burst-- && sent < cmd_size) {
+            tpm_write8(TPM_DATA_FIFO_REG, cmd[sent++]);
         }
     }
-    
+
+    // Expect drops once the TPM has seen the whole command
+    if (tpm_wait8(TPM_STS_REG, TPM_STS_VALID | TPM_STS_EXPECT, TPM_STS_VALID, TPM_TIMEOUT_C_US) != 0) {
+        return -1;
+    }
+
+    tpm_write8(TPM_STS_REG, TPM_STS_GO);
+    if (tpm_wait8(TPM_STS_REG, TPM_STS_VALID | TPM_STS_DATA_AVAIL, TPM_STS_VALID | TPM_STS_DATA_AVAIL,
+                  TPM_TIMEOUT_COMMAND_US) != 0) {
+        return -1;
+    }
+
+    // Header first, for the length of the rest
+    if (*rsp_size < TPM2_HEADER_SIZE || tis_read_fifo(rsp, TPM2_HEADER_SIZE) != 0) return -1;
+    uint32_t length = get_be32(rsp + 2);
+    if (length < TPM2_HEADER_SIZE || length > *rsp_size) return -1;
+    if (tis_read_fifo(rsp + TPM2_HEADER_SIZE, length - TPM2_HEADER_SIZE) != 0) return -1;
+
+    *rsp_size = length;
+    return 0;
+}
+
+static int tis_send_command(const uint8_t* cmd, uint32_t cmd_size, uint8_t* rsp, uint32_t* rsp_size) {
+    int result = tis_transfer(cmd, cmd_size, rsp, rsp_size);
+    // Back to Ready whether or not it worked, which also aborts a failed command
+    tpm_write8(TPM_STS_REG, TPM_STS_COMMAND_READY);
+    return result;
+}
+
+static int crb_send_command(const uint8_t* cmd, uint32_t cmd_size, uint8_t* rsp, uint32_t* rsp_size) {
+    // The TPM stays Ready between commands, so this is only paid once
+    if (!g_crb_ready) {
+        tpm_write32(TPM_CRB_CTRL_REQ_REG, TPM_CRB_REQ_CMD_READY);
+        if (tpm_wait32(TPM_CRB_CTRL_REQ_REG, TPM_CRB_REQ_CMD_READY, 0, TPM_TIMEOUT_C_US) != 0) return -1;
+        if (tpm_read32(TPM_CRB_CTRL_STS_REG) & (TPM_CRB_STS_ERROR | TPM_CRB_STS_IDLE)) return -1;
+        g_crb_ready = 1;
+    }
+
+    uint32_t cmd_cap = tpm_read32(TPM_CRB_CMD_SIZE_REG);
+    uint32_t rsp_cap = tpm_read32(TPM_CRB_RSP_SIZE_REG);
+    uint64_t cmd_addr = tpm_read32(TPM_CRB_CMD_LADDR_REG) |
+                        ((uint64_t)tpm_read32(TPM_CRB_CMD_HADDR_REG) << 32);
+    uint64_t rsp_addr = tpm_read32(TPM_CRB_RSP_ADDR_REG) |
+                        ((uint64_t)tpm_read32(TPM_CRB_RSP_ADDR_REG + 4) << 32);
+    if (cmd_size > cmd_cap || rsp_cap < TPM2_HEADER_SIZE) return -1;
+
+    // One copy each way instead of a register access per byte
+    memcpy((void*)(uintptr_t)cmd_addr, cmd, cmd_size);
+    tpm_write32(TPM_CRB_CTRL_START_REG, TPM_CRB_START);
+
+    if (tpm_wait32(TPM_CRB_CTRL_START_REG, TPM_CRB_START, 0, TPM_TIMEOUT_COMMAND_US) != 0) {
+        tpm_write32(TPM_CRB_CTRL_CANCEL_REG, TPM_CRB_CANCEL);
+        tpm_wait32(TPM_CRB_CTRL_START_REG, TPM_CRB_START, 0, TPM_TIMEOUT_B_US);
+        tpm_write32(TPM_CRB_CTRL_CANCEL_REG, 0);
+        g_crb_ready = 0;
+        return -1;
+    }
+    if (tpm_read32(TPM_CRB_CTRL_STS_REG) & TPM_CRB_STS_ERROR) {
+        g_crb_ready = 0;
+        return -1;
+    }
+
+    const uint8_t* rsp_buf = (const uint8_t*)(uintptr_t)rsp_addr;
+    if (*rsp_size < TPM2_HEADER_SIZE) return -1;
+    memcpy(rsp, rsp_buf, TPM2_HEADER_SIZE);
+    uint32_t length = get_be32(rsp + 2);
+    if (length < TPM2_HEADER_SIZE || length > *rsp_size || length > rsp_cap) return -1;
+    memcpy(rsp + TPM2_HEADER_SIZE, rsp_buf + TPM2_HEADER_SIZE, length - TPM2_HEADER_SIZE);
+
+    *rsp_size = length;
     return 0;
 }
 
 int tpm2_send_command(const void* command, uint32_t command_size, void* response, uint32_t* response_size) {
-    if (!command || !response || !response_size || g_tpm_interface == TPM2_INTERFACE_NONE) {
+    if (!command || !response || !response_size || command_size < TPM2_HEADER_SIZE) {
         return -1;
     }
-    
-    if (g_tpm_interface == TPM2_INTERFACE_TIS) {
-        const uint8_t* cmd_bytes = (const uint8_t*)command;
-        
-        // Wait for TPM to be ready
-        int timeout = 1000;
-        while (timeout-- > 0) {
-            uint32_t status = tpm_read32(TPM_STS_REG);
-            if (status & TPM_STS_COMMAND_READY) {
-                break;
-            }
-            for (volatile int i = 0; i < 1000; i++);
-        }
-        
-        if (timeout <= 0) return -1;
-        
-        // Send command
-        for (uint32_t i = 0; i < command_size; i++) {
-            tpm_write8(TPM_DATA_FIFO_REG, cmd_bytes[i]);
-        }
-        
-        // Execute command
-        tpm_write32(TPM_STS_REG, TPM_STS_GO);
-        
-        // Wait for response
-        timeout = 5000;
-        while (timeout-- > 0) {
-            uint32_t status = tpm_read32(TPM_STS_REG);
-            if (status & TPM_STS_DATA_AVAIL) {
-                break;
-            }
-            for (volatile int i = 0; i < 1000; i++);
-        }
-        
-        if (timeout <= 0) return -1;
-        
-        // Read response
-        uint8_t* resp_bytes = (uint8_t*)response;
-        uint32_t bytes_read = 0;
-        
-        while (bytes_read < *response_size) {
-            uint32_t status = tpm_read32(TPM_STS_REG);
-            if (!(status & TPM_STS_DATA_AVAIL)) {
-                break;
-            }
-            resp_bytes[bytes_read++] = tpm_read8(TPM_DATA_FIFO_REG);
-        }
-        
-        *response_size = bytes_read;
-        return 0;
+
+    switch (g_tpm_interface) {
+        case TPM2_INTERFACE_TIS:
+            return tis_send_command((const uint8_t*)command, command_size, (uint8_t*)response, response_size);
+        case TPM2_INTERFACE_CRB:
+        case TPM2_INTERFACE_FTPM:
+            return crb_send_command((const uint8_t*)command, command_size, (uint8_t*)response, response_size);
+        default:
+            return -1; // Unsupported interface
     }
-    
-    return -1; // Unsupported interface
+}
+
+// Response code of a complete response, or TPM2_RC_FAILURE if it is too short
+static uint32_t tpm2_response_code(const uint8_t* response, uint32_t response_size) {
+    if (response_size < TPM2_HEADER_SIZE) return TPM2_RC_FAILURE;
+    return get_be32(response + 6);
 }
 
 int tpm2_initialize(void) {
@@ -185,7 +381,7 @@ int tpm2_initialize(void) {
     }
     
     // Initialize event log
-    if (tpm2_event_log_init(&g_global_event_log, 1000, 64 * 1024) != 0) {
+    if (tpm2_event_log_init(&g_global_event_log, TPM2_LOG_MAX_SIZE) != 0) {
         return -1;
     }
     
@@ -209,13 +405,7 @@ int tpm2_startup(uint16_t startup_type) {
     int result = tpm2_send_command(command, sizeof(command), response, &response_size);
     if (result != 0) return result;
     
-    // Check response code
-    if (response_size >= 10) {
-        uint32_t response_code = (response[6] << 24) | (response[7] << 16) | (response[8] << 8) | response[9];
-        return (response_code == TPM2_RC_SUCCESS) ? 0 : -1;
-    }
-    
-    return -1;
+    return tpm2_response_code(response, response_size) == TPM2_RC_SUCCESS ? 0 : -1;
 }
 
 int tpm2_self_test(void) {
@@ -234,55 +424,112 @@ int tpm2_self_test(void) {
     int result = tpm2_send_command(command, sizeof(command), response, &response_size);
     if (result != 0) return result;
     
-    if (response_size >= 10) {
-        uint32_t response_code = (response[6] << 24) | (response[7] << 16) | (response[8] << 8) | response[9];
-        return (response_code == TPM2_RC_SUCCESS) ? 0 : -1;
+    return tpm2_response_code(response, response_size) == TPM2_RC_SUCCESS ? 0 : -1;
+}
+
+int tpm2_get_capability(uint32_t capability, uint32_t property, uint32_t property_count, void* response, uint32_t* response_size) {
+    if (!g_tpm_initialized || !response || !response_size) return -1;
+
+    uint8_t command[22];
+    put_be16(command, TPM2_ST_NO_SESSIONS);
+    put_be32(command + 2, sizeof(command));
+    put_be32(command + 6, TPM2_CC_GetCapability);
+    put_be32(command + 10, capability);
+    put_be32(command + 14, property);
+    put_be32(command + 18, property_count);
+
+    uint8_t reply[512];
+    uint32_t reply_size = sizeof(reply);
+    if (tpm2_send_command(command, sizeof(command), reply, &reply_size) != 0) return -1;
+    if (tpm2_response_code(reply, reply_size) != TPM2_RC_SUCCESS) return -1;
+
+    // Hand back the parameters: moreData followed by TPMS_CAPABILITY_DATA
+    uint32_t params = reply_size - TPM2_HEADER_SIZE;
+    if (params > *response_size) return -1;
+    memcpy(response, reply + TPM2_HEADER_SIZE, params);
+    *response_size = params;
+    return 0;
+}
+
+uint32_t tpm2_digest_size(uint16_t hash_alg) {
+    switch (hash_alg) {
+        case TPM2_ALG_SHA1: return 20;
+        case TPM2_ALG_SHA256: return 32;
+        case TPM2_ALG_SHA384: return 48;
+        case TPM2_ALG_SHA512: return 64;
+        case TPM2_ALG_SM3_256: return 32;
+        default: return 0;
     }
-    
-    return -1;
 }
 
-int tpm2_pcr_extend(uint32_t pcr_index, uint16_t hash_alg, const uint8_t* digest) {
-    if (!g_tpm_initialized || !digest || pcr_index > 23) return -1;
-    
-    uint32_t digest_size = (hash_alg == TPM2_ALG_SHA256) ? 32 : 20;
-    
-    uint8_t command[1024];
-    uint32_t cmd_size = 0;
-    
-    // Command header
-    command[cmd_size++] = 0x80; command[cmd_size++] = 0x01; // TPM_ST_NO_SESSIONS
-    cmd_size += 4; // Length (filled later)
-    command[cmd_size++] = 0x00; command[cmd_size++] = 0x00;
-    command[cmd_size++] = 0x01; command[cmd_size++] = 0x82; // TPM2_CC_PCR_Extend
-    
-    // PCR handle
-    command[cmd_size++] = (pcr_index >> 24) & 0xFF;
-    command[cmd_size++] = (pcr_index >> 16) & 0xFF;
-    command[cmd_size++] = (pcr_index >> 8) & 0xFF;
-    command[cmd_size++] = pcr_index & 0xFF;
-    
-    // Authorization area size (0 for no auth)
-    command[cmd_size++] = 0x00; command[cmd_size++] = 0x00;
-    command[cmd_size++] = 0x00; command[cmd_size++] = 0x00;
-    
-    // Digest count (1)
-    command[cmd_size++] = 0x00; command[cmd_size++] = 0x00;
-    command[cmd_size++] = 0x00; command[cmd_size++] = 0x01;
-    
-    // Hash algorithm
-    command[cmd_size++] = (hash_alg >> 8) & 0xFF;
-    command[cmd_size++] = hash_alg & 0xFF;
-    
-    // Digest
-    memcpy(&command[cmd_size], digest, digest_size);
-    cmd_size += digest_size;
-    
-    // Fill in length
-    command[2] = (cmd_size >> 24) & 0xFF;
-    command[3] = (cmd_size >> 16) & 0xFF;
-    command[4] = (cmd_size >> 8) & 0xFF;
-    command[5] = cmd_size & 0xFF;
+// Banks with at least one PCR selected are the ones a measurement must
+// extend. Queried once; the answer can't change until the next reset.
+int tpm2_get_active_banks(uint16_t* algs, uint32_t max_algs) {
+    static uint16_t banks[TPM2_MAX_BANKS];
+    static uint32_t bank_count = 0;
+
+    if (!algs) return -1;
+
+    if (bank_count == 0) {
+        uint8_t caps[256];
+        uint32_t caps_size = sizeof(caps);
+        if (tpm2_get_capability(TPM2_CAP_PCRS, 0, 1, caps, &caps_size) != 0 || caps_size < 9) {
+            return -1;
+        }
+
+        // moreData(1) capability(4) count(4), then TPMS_PCR_SELECTION entries
+        uint32_t count = get_be32(caps + 5);
+        uint32_t pos = 9;
+        for (uint32_t i = 0; i < count && pos + 3 <= caps_size; i++) {
+            uint16_t alg = get_be16(caps + pos);
+            uint8_t select_size = caps[pos + 2];
+            pos += 3;
+            if (pos + select_size > caps_size) return -1;
+
+            int active = 0;
+            for (uint32_t b = 0; b < select_size; b++) active |= caps[pos + b];
+            pos += select_size;
+
+            if (active && tpm2_digest_size(alg) && bank_count < TPM2_MAX_BANKS) {
+                banks[bank_count++] = alg;
+            }
+        }
+        if (bank_count == 0) return -1;
+    }
+
+    uint32_t n = bank_count < max_algs ? bank_count : max_algs;
+    memcpy(algs, banks, n * sizeof(uint16_t));
+    return (int)n;
+}
+
+int tpm2_pcr_extend_banks(uint32_t pcr_index, const TPM2_PCR_VALUE* digests, uint32_t digest_count) {
+    if (!g_tpm_initialized || !digests || digest_count == 0 || digest_count > TPM2_MAX_BANKS || pcr_index > 23) {
+        return -1;
+    }
+
+    uint8_t command[64 + TPM2_MAX_BANKS * (2 + 64)];
+    uint32_t cmd_size = TPM2_HEADER_SIZE;
+
+    // PCR handle, then a password session with an empty password
+    put_be32(command + cmd_size, pcr_index); cmd_size += 4;
+    put_be32(command + cmd_size, 9); cmd_size += 4;                 // Authorization area size
+    put_be32(command + cmd_size, TPM2_RS_PW); cmd_size += 4;
+    put_be16(command + cmd_size, 0); cmd_size += 2;                 // Nonce
+    command[cmd_size++] = 0;                                        // Session attributes
+    put_be16(command + cmd_size, 0); cmd_size += 2;                 // HMAC
+
+    // TPML_DIGEST_VALUES: every bank in one command
+    put_be32(command + cmd_size, digest_count); cmd_size += 4;
+    for (uint32_t i = 0; i < digest_count; i++) {
+        uint32_t digest_size = tpm2_digest_size(digests[i].hash_alg);
+        if (digest_size == 0 || digests[i].digest_size != digest_size) return -1;
+        put_be16(command + cmd_size, digests[i].hash_alg); cmd_size += 2;
+        memcpy(command + cmd_size, digests[i].digest, digest_size); cmd_size += digest_size;
+    }
+
+    put_be16(command, TPM2_ST_SESSIONS);
+    put_be32(command + 2, cmd_size);
+    put_be32(command + 6, TPM2_CC_PCR_Extend);
     
     uint8_t response[64];
     uint32_t response_size = sizeof(response);
@@ -290,90 +537,305 @@ int tpm2_pcr_extend(uint32_t pcr_index, uint16_t hash_alg, const uint8_t* digest
     int result = tpm2_send_command(command, cmd_size, response, &response_size);
     if (result != 0) return result;
     
-    if (response_size >= 10) {
-        uint32_t response_code = (response[6] << 24) | (response[7] << 16) | (response[8] << 8) | response[9];
-        return (response_code == TPM2_RC_SUCCESS) ? 0 : -1;
+    return tpm2_response_code(response, response_size) == TPM2_RC_SUCCESS ? 0 : -1;
+}
+
+int tpm2_pcr_extend(uint32_t pcr_index, uint16_t hash_alg, const uint8_t* digest) {
+    if (!digest) return -1;
+
+    TPM2_PCR_VALUE value;
+    memset(&value, 0, sizeof(value));
+    value.hash_alg = hash_alg;
+    value.digest_size = (uint16_t)tpm2_digest_size(hash_alg);
+    if (value.digest_size == 0) return -1;
+    memcpy(value.digest, digest, value.digest_size);
+
+    return tpm2_pcr_extend_banks(pcr_index, &value, 1);
+}
+
+// Hashes available for PCR banks. An active bank without one here is
+// capped at flush time (see tpm2_bank_digest()), so add an entry when a new
+// hash lands in security/.
+static const struct {
+    uint16_t hash_alg;
+    void (*hash)(const uint8_t* data, uint32_t len, uint8_t* digest);
+} tpm2_bank_hashes[] = {
+    { TPM2_ALG_SHA1, sha1_hash },
+    { TPM2_ALG_SHA256, sha256_hash },
+    { TPM2_ALG_SHA384, sha384_hash },
+    { TPM2_ALG_SHA512, sha512_hash },
+};
+
+// Digests for every bank we can hash. Which of them the TPM actually has
+// active is only settled at flush time, so queueing needs no TPM access.
+static uint32_t tpm2_hash_banks(const void* data, uint32_t data_size, TPM2_PCR_VALUE* digests) {
+    uint32_t count = 0;
+    for (uint32_t h = 0; h < sizeof(tpm2_bank_hashes) / sizeof(tpm2_bank_hashes[0]); h++) {
+        TPM2_PCR_VALUE* value = &digests[count++];
+        value->hash_alg = tpm2_bank_hashes[h].hash_alg;
+        value->digest_size = (uint16_t)tpm2_digest_size(value->hash_alg);
+        tpm2_bank_hashes[h].hash((const uint8_t*)data, data_size, value->digest);
     }
-    
+    return count;
+}
+
+// Append to the queue; the event data is copied from up to two pieces
+static int tpm2_queue_push(uint32_t pcr_index, uint32_t event_type, const TPM2_PCR_VALUE* digests, uint32_t digest_count,
+                           const void* event, uint32_t event_size, const void* extra, uint32_t extra_size) {
+    if (!g_tpm_initialized || pcr_index > 23 || digest_count == 0 || digest_count > TPM2_MAX_BANKS) return -1;
+
+    if (g_measure_queue.count == g_measure_queue.capacity) {
+        uint32_t capacity = g_measure_queue.capacity ? g_measure_queue.capacity * 2 : 16;
+        TPM2_MEASUREMENT* grown = (TPM2_MEASUREMENT*)realloc(g_measure_queue.entries, capacity * sizeof(TPM2_MEASUREMENT));
+        if (!grown) return -1;
+        g_measure_queue.entries = grown;
+        g_measure_queue.capacity = capacity;
+    }
+
+    // Only a descriptor goes in the log, so anything long is cut short
+    if (event_size > TPM2_LOG_EVENT_MAX) event_size = TPM2_LOG_EVENT_MAX;
+    if (extra_size > TPM2_LOG_EVENT_MAX - event_size) extra_size = TPM2_LOG_EVENT_MAX - event_size;
+
+    TPM2_MEASUREMENT* m = &g_measure_queue.entries[g_measure_queue.count];
+    m->event_size = event_size + extra_size;
+    m->event = m->event_size ? (uint8_t*)malloc(m->event_size) : NULL;
+    if (m->event_size && !m->event) return -1;
+    if (event_size) memcpy(m->event, event, event_size);
+    if (extra_size) memcpy(m->event + event_size, extra, extra_size);
+
+    m->pcr_index = pcr_index;
+    m->event_type = event_type;
+    m->digest_count = digest_count;
+    memcpy(m->digests, digests, digest_count * sizeof(TPM2_PCR_VALUE));
+    g_measure_queue.count++;
+
+    return g_measure_queue.deferred ? 0 : tpm2_flush_measurements();
+}
+
+int tpm2_queue_measurement(uint32_t pcr_index, uint32_t event_type, const TPM2_PCR_VALUE* digests, uint32_t digest_count, const void* event, uint32_t event_size) {
+    if (!digests || (!event && event_size)) return -1;
+    return tpm2_queue_push(pcr_index, event_type, digests, digest_count, event, event_size, NULL, 0);
+}
+
+void tpm2_defer_measurements(int enable) {
+    g_measure_queue.deferred = enable;
+}
+
+uint32_t tpm2_pending_measurements(void) {
+    return g_measure_queue.count;
+}
+
+// The measurement's digest for a bank, or for a bank it has none for, the
+// cap: an error digest (all ones) that no real measurement produces, so the
+// PCR can never again match a known-good value. Returns -1 for a cap.
+static int tpm2_bank_digest(const TPM2_MEASUREMENT* m, uint16_t bank, TPM2_PCR_VALUE* out) {
+    for (uint32_t d = 0; d < m->digest_count; d++) {
+        if (m->digests[d].hash_alg == bank) {
+            *out = m->digests[d];
+            return 0;
+        }
+    }
+    memset(out, 0, sizeof(*out));
+    out->hash_alg = bank;
+    out->digest_size = (uint16_t)tpm2_digest_size(bank);
+    memset(out->digest, 0xFF, out->digest_size);
+    printf("TPM: no hash for active bank 0x%04x, PCR %u capped\n", bank, m->pcr_index);
     return -1;
 }
 
+int tpm2_flush_measurements(void) {
+    if (g_measure_queue.count == 0) return 0;
+    if (!g_tpm_initialized) return -1;
+
+    // Without the bank list there is no telling which banks went unextended,
+    // so SHA-256 is extended but the flush still fails
+    int result = 0;
+    uint16_t banks[TPM2_MAX_BANKS];
+    int bank_count = tpm2_get_active_banks(banks, TPM2_MAX_BANKS);
+    if (bank_count <= 0) {
+        printf("TPM: active PCR banks unknown, extending SHA-256 only\n");
+        banks[0] = TPM2_ALG_SHA256;
+        bank_count = 1;
+        result = -1;
+    }
+
+    uint32_t done = 0;
+    for (; done < g_measure_queue.count; done++) {
+        TPM2_MEASUREMENT* m = &g_measure_queue.entries[done];
+
+        // One digest per active bank, so the extend and the log record
+        // both cover every bank the TPM has
+        TPM2_PCR_VALUE extend[TPM2_MAX_BANKS];
+        uint32_t extend_count = 0;
+        int capped = 0;
+        for (int b = 0; b < bank_count; b++) {
+            if (tpm2_bank_digest(m, banks[b], &extend[extend_count++]) != 0) capped = 1;
+        }
+        if (tpm2_pcr_extend_banks(m->pcr_index, extend, extend_count) != 0) {
+            printf("TPM: extend of PCR %u failed, %u measurements left queued\n",
+                   m->pcr_index, g_measure_queue.count - done);
+            result = -1;
+            break;
+        }
+        // Flushed, but a capped bank holds no measurement of this event
+        if (capped) result = -1;
+
+        // The PCR already moved, so a full log doesn't stop the rest
+        if (tpm2_event_log_add(&g_global_event_log, m->pcr_index, m->event_type, extend, extend_count,
+                               m->event, m->event_size) != 0) {
+            result = -1;
+        }
+        free(m->event);
+    }
+
+    // After a failed extend the rest stay queued, in order: extending them
+    // anyway would leave the PCRs with a history that never happened
+    memmove(g_measure_queue.entries, g_measure_queue.entries + done,
+            (g_measure_queue.count - done) * sizeof(TPM2_MEASUREMENT));
+    g_measure_queue.count -= done;
+    return result;
+}
+
 int tpm2_measure_data(uint32_t pcr_index, uint32_t event_type, const void* data, uint32_t data_size, const char* description) {
     if (!data || data_size == 0) return -1;
-    
-    // Calculate digest
-    uint8_t digest[32];
-    sha256_hash((const uint8_t*)data, data_size, digest);
-    
-    // Extend PCR
-    int result = tpm2_pcr_extend(pcr_index, TPM2_ALG_SHA256, digest);
-    if (result != 0) return result;
-    
-    // Add to event log
-    return tpm2_event_log_add(&g_global_event_log, pcr_index, event_type, data, data_size, description);
+
+    TPM2_PCR_VALUE digests[TPM2_MAX_BANKS];
+    uint32_t digest_count = tpm2_hash_banks(data, data_size, digests);
+
+    // The log gets the description, or the data itself when it is small
+    // enough to be its own descriptor (separators, version strings)
+    if (description) {
+        return tpm2_queue_push(pcr_index, event_type, digests, digest_count, description, strlen(description) + 1, NULL, 0);
+    }
+    uint32_t event_size = data_size <= TPM2_LOG_EVENT_MAX ? data_size : 0;
+    return tpm2_queue_push(pcr_index, event_type, digests, digest_count, data, event_size, NULL, 0);
 }
 
 int tpm2_measure_string(uint32_t pcr_index, uint32_t event_type, const char* string) {
     if (!string) return -1;
-    return tpm2_measure_data(pcr_index, event_type, string, strlen(string), string);
+    return tpm2_measure_data(pcr_index, event_type, string, strlen(string), NULL);
 }
 
-int tpm2_event_log_init(TPM2_EVENT_LOG* log, uint32_t max_events, uint32_t max_log_size) {
+int tpm2_event_log_init(TPM2_EVENT_LOG* log, uint32_t max_log_size) {
     if (!log) return -1;
-    
-    log->events = (TCG_PCR_EVENT*)malloc(max_events * sizeof(TCG_PCR_EVENT));
-    if (!log->events) return -1;
-    
-    log->log_buffer = (uint8_t*)malloc(max_log_size);
-    if (!log->log_buffer) {
-        free(log->events);
-        return -1;
+
+    memset(log, 0, sizeof(TPM2_EVENT_LOG));
+    log->base = (uint8_t*)firmware_allocate_pages(TPM2_LOG_INITIAL_PAGES);
+    if (!log->base) return -1;
+
+    log->capacity = TPM2_LOG_INITIAL_PAGES * TPM2_LOG_PAGE_SIZE;
+    log->max_size = max_log_size;
+    return 0;
+}
+
+// Make room for 'extra' more bytes. Growing copies into fresh pages, which
+// is cheap: the log only ever holds digests and descriptors.
+static int tpm2_event_log_reserve(TPM2_EVENT_LOG* log, uint32_t extra) {
+    if (extra > log->max_size || log->size > log->max_size - extra) return -1;
+    uint32_t need = log->size + extra;
+    if (need <= log->capacity) return 0;
+
+    uint32_t capacity = log->capacity;
+    while (capacity < need) capacity *= 2;
+    uint32_t pages = (capacity + TPM2_LOG_PAGE_SIZE - 1) / TPM2_LOG_PAGE_SIZE;
+
+    uint8_t* grown = (uint8_t*)firmware_allocate_pages(pages);
+    if (!grown) return -1;
+    memcpy(grown, log->base, log->size);
+    firmware_free_pages(log->base, log->capacity / TPM2_LOG_PAGE_SIZE);
+    log->base = grown;
+    log->capacity = pages * TPM2_LOG_PAGE_SIZE;
+    return 0;
+}
+
+// The first record: a legacy TCG_PCR_EVENT of type EV_NO_ACTION whose data
+// is TCG_EfiSpecIDEvent, telling parsers which digests every later record
+// carries and how big they are
+static int tpm2_event_log_header(TPM2_EVENT_LOG* log) {
+    static const char signature[16] = "Spec ID Event03";
+    // signature, platformClass, version and uintnSize, algorithm count,
+    // one {algId, digestSize} pair per bank, vendorInfoSize
+    uint32_t spec_size = 16 + 4 + 4 + 4 + 4 * log->alg_count + 1;
+    uint32_t record_size = sizeof(TCG_PCR_EVENT) + spec_size;
+    if (tpm2_event_log_reserve(log, record_size) != 0) return -1;
+
+    uint8_t* p = log->base + log->size;
+    memset(p, 0, record_size);
+    put_le32(p + 4, EV_NO_ACTION);                  // PCR 0, all-zero SHA-1 digest
+    put_le32(p + 28, spec_size);
+    p += sizeof(TCG_PCR_EVENT);
+
+    memcpy(p, signature, sizeof(signature));
+    p += 16;
+    put_le32(p, 0);                                 // platformClass: client
+    p[4] = 0;                                       // specVersionMinor
+    p[5] = 2;                                       // specVersionMajor
+    p[6] = 0;                                       // specErrata
+    p[7] = sizeof(uintptr_t) == 8 ? 2 : 1;          // uintnSize, in UINT32s
+    put_le32(p + 8, log->alg_count);
+    p += 12;
+    for (uint32_t i = 0; i < log->alg_count; i++, p += 4) {
+        put_le16(p, log->algs[i]);
+        put_le16(p + 2, (uint16_t)tpm2_digest_size(log->algs[i]));
     }
-    
-    log->event_count = 0;
-    log->max_events = max_events;
-    log->log_size = 0;
-    log->max_log_size = max_log_size;
-    
+    *p = 0;                                         // vendorInfoSize
+
+    log->size += record_size;
     return 0;
 }
 
-int tpm2_event_log_add(TPM2_EVENT_LOG* log, uint32_t pcr_index, uint32_t event_type, const void* data, uint32_t data_size, const char* description) {
-    if (!log || !data || log->event_count >= log->max_events) return -1;
-    
-    // Calculate required space
-    uint32_t desc_len = description ? strlen(description) + 1 : 0;
-    uint32_t total_event_size = sizeof(TCG_PCR_EVENT) + data_size + desc_len;
-    
-    if (log->log_size + total_event_size > log->max_log_size) {
-        return -1; // Not enough space
+int tpm2_event_log_add(TPM2_EVENT_LOG* log, uint32_t pcr_index, uint32_t event_type, const TPM2_PCR_VALUE* digests, uint32_t digest_count, const void* event, uint32_t event_size) {
+    if (!log || !log->base || !digests || digest_count == 0 || digest_count > TPM2_MAX_BANKS || (!event && event_size)) {
+        return -1;
     }
-    
-    // Create event entry
-    TCG_PCR_EVENT* event = &log->events[log->event_count];
-    event->pcr_index = pcr_index;
-    event->event_type = event_type;
-    event->event_data_size = data_size + desc_len;
-    
-    // Calculate SHA-1 digest for legacy compatibility
-    uint8_t combined_data[data_size + desc_len];
-    memcpy(combined_data, data, data_size);
-    if (description) {
-        memcpy(combined_data + data_size, description, desc_len);
+
+    // The header fixes the bank list, so it is written with the first record
+    if (log->alg_count == 0) {
+        for (uint32_t d = 0; d < digest_count; d++) {
+            log->algs[d] = digests[d].hash_alg;
+        }
+        log->alg_count = digest_count;
+        if (tpm2_event_log_header(log) != 0) {
+            log->alg_count = 0;
+            return -1;
+        }
     }
-    
-    // For now, use SHA-256 and truncate to 20 bytes (proper implementation would use SHA-1)
-    uint8_t sha256_digest[32];
-    sha256_hash(combined_data, data_size + desc_len, sha256_digest);
-    memcpy(event->digest, sha256_digest, 20);
-    
-    // Copy event data to log buffer
-    uint8_t* event_data_ptr = log->log_buffer + log->log_size;
-    memcpy(event_data_ptr, combined_data, data_size + desc_len);
-    
-    log->log_size += total_event_size;
+
+    // Every record carries the header's banks, in the header's order
+    const TPM2_PCR_VALUE* ordered[TPM2_MAX_BANKS];
+    uint32_t record_size = sizeof(TCG_PCR_EVENT2) + 4 + event_size;
+    for (uint32_t a = 0; a < log->alg_count; a++) {
+        ordered[a] = NULL;
+        for (uint32_t d = 0; d < digest_count; d++) {
+            if (digests[d].hash_alg == log->algs[a]) ordered[a] = &digests[d];
+        }
+        if (!ordered[a] || ordered[a]->digest_size != tpm2_digest_size(log->algs[a])) return -1;
+        record_size += 2 + ordered[a]->digest_size;
+    }
+    if (tpm2_event_log_reserve(log, record_size) != 0) return -1;
+
+    uint8_t* p = log->base + log->size;
+    put_le32(p, pcr_index);
+    put_le32(p + 4, event_type);
+    put_le32(p + 8, log->alg_count);
+    p += sizeof(TCG_PCR_EVENT2);
+    for (uint32_t a = 0; a < log->alg_count; a++) {
+        put_le16(p, ordered[a]->hash_alg);
+        memcpy(p + 2, ordered[a]->digest, ordered[a]->digest_size);
+        p += 2 + ordered[a]->digest_size;
+    }
+    put_le32(p, event_size);
+    if (event_size) memcpy(p + 4, event, event_size);
+
+    log->size += record_size;
     log->event_count++;
-    
+    return 0;
+}
+
+int tpm2_event_log_get(const void** log_base, uint32_t* log_size) {
+    if (!log_base || !log_size || !g_global_event_log.base) return -1;
+    *log_base = g_global_event_log.base;
+    *log_size = g_global_event_log.size;
     return 0;
 }
 
@@ -399,10 +861,9 @@ int measured_boot_init(MeasuredBootContext* context) {
         }
     }
     
-    // Initialize event log
-    if (tpm2_event_log_init(&context->event_log, 500, 32 * 1024) != 0) {
-        return -1;
-    }
+    // Keep TPM round trips off the load path; measured_boot_finalize()
+    // extends everything before the kernel starts
+    tpm2_defer_measurements(1);
     
     // Measure separator in PCR 0-7 (standard practice)
     for (int pcr = 0; pcr <= 7; pcr++) {
@@ -416,7 +877,7 @@ int measured_boot_init(MeasuredBootContext* context) {
 int tpm2_measure_separator(uint32_t pcr_index) {
     // Standard separator is 4 bytes of 0xFF
     uint8_t separator[4] = {0xFF, 0xFF, 0xFF, 0xFF};
-    return tpm2_measure_data(pcr_index, EV_SEPARATOR, separator, sizeof(separator), "Separator");
+    return tpm2_measure_data(pcr_index, EV_SEPARATOR, separator, sizeof(separator), NULL);
 }
 
 int measured_boot_measure_bootloader(MeasuredBootContext* context) {
@@ -436,7 +897,7 @@ int measured_boot_measure_bootloader(MeasuredBootContext* context) {
 int measured_boot_measure_kernel(MeasuredBootContext* context, const void* kernel_data, uint32_t kernel_size, const char* kernel_path) {
     if (!context || !kernel_data || !kernel_path) return -1;
     
-    int result = tmp2_measure_file(TPM2_PCR_KERNEL, EV_IPL, kernel_path, kernel_data, kernel_size);
+    int result = tpm2_measure_file(TPM2_PCR_KERNEL, EV_IPL, kernel_path, kernel_data, kernel_size);
     if (result == 0) {
         context->measurement_count++;
         context->pcr_mask |= (1 << TPM2_PCR_KERNEL);
@@ -446,23 +907,22 @@ int measured_boot_measure_kernel(MeasuredBootContext* context, const void* kerne
     return result;
 }
 
+int measured_boot_finalize(MeasuredBootContext* context) {
+    if (!context) return -1;
+    
+    tpm2_defer_measurements(0);
+    return tpm2_flush_measurements();
+}
+
+// The digest covers the image and the log records its path (TCG EV_IPL
+// convention), so the image is hashed in place instead of copied
 int tpm2_measure_file(uint32_t pcr_index, uint32_t event_type, const char* filename, const void* file_data, uint32_t file_size) {
     if (!filename || !file_data) return -1;
     
-    // Create event data with filename + file hash
-    uint32_t filename_len = strlen(filename) + 1;
-    uint32_t total_size = filename_len + file_size;
-    
-    uint8_t* event_data = (uint8_t*)malloc(total_size);
-    if (!event_data) return -1;
-    
-    memcpy(event_data, filename, filename_len);
-    memcpy(event_data + filename_len, file_data, file_size);
+    TPM2_PCR_VALUE digests[TPM2_MAX_BANKS];
+    uint32_t digest_count = tpm2_hash_banks(file_data, file_size, digests);
     
-    int result = tpm2_measure_data(pcr_index, event_type, event_data, total_size, filename);
-    
-    free(event_data);
-    return result;
+    return tpm2_queue_push(pcr_index, event_type, digests, digest_count, filename, strlen(filename) + 1, NULL, 0);
 }
 
 int tpm2_is_available(void) {
@@ -486,7 +946,7 @@ const char* tpm2_get_error_string(uint32_t error_code) {
 }
 
 int tpm2_run_diagnostics(void) {
-    if (!g_tmp_initialized) {
+    if (!g_tpm_initialized) {
         return -1;
     }
     
@@ -502,24 +962,32 @@ int tpm2_run_diagnostics(void) {
 }
 
 void tpm2_cleanup(void) {
-    if (g_tmp_initialized) {
+    if (g_tpm_initialized) {
         tpm2_event_log_cleanup(&g_global_event_log);
+
+        for (uint32_t i = 0; i < g_measure_queue.count; i++) {
+            free(g_measure_queue.entries[i].event);
+        }
+        free(g_measure_queue.entries);
+        memset(&g_measure_queue, 0, sizeof(g_measure_queue));
+
+        // Leave the TPM idle and free locality 0 for the OS driver
+        if (g_tpm_interface == TPM2_INTERFACE_TIS) {
+            tpm_write8(TPM_ACCESS_REG, TPM_ACCESS_ACTIVE_LOCALITY);
+        } else if (g_tpm_interface != TPM2_INTERFACE_NONE) {
+            tpm_write32(TPM_CRB_CTRL_REQ_REG, TPM_CRB_REQ_GO_IDLE);
+            tpm_write32(TPM_LOC_CTRL_REG, TPM_LOC_CTRL_RELINQUISH);
+            g_crb_ready = 0;
+        }
         g_tpm_initialized = 0;
     }
 }
 
 void tpm2_event_log_cleanup(TPM2_EVENT_LOG* log) {
     if (!log) return;
-    
-    if (log->events) {
-        free(log->events);
-        log->events = NULL;
-    }
-    
-    if (log->log_buffer) {
-        free(log->log_buffer);
-        log->log_buffer = NULL;
+
+    if (log->base) {
+        firmware_free_pages(log->base, log->capacity / TPM2_LOG_PAGE_SIZE);
     }
-    
     memset(log, 0, sizeof(TPM2_EVENT_LOG));
 }
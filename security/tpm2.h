@@ -57,6 +57,7 @@
 #define TPM2_ALG_SHA384             0x000C
 #define TPM2_ALG_SHA512             0x000D
 #define TPM2_ALG_SM3_256            0x0012
+#define TPM2_MAX_BANKS              5   // One per algorithm above
 
 // PCR Numbers (TCG PC Client Platform Firmware Profile)
 #define TPM2_PCR_CRTM               0  // Core Root of Trust Measurement
@@ -158,15 +159,25 @@ typedef struct {
 } __attribute__((packed)) TPMT_HA;
 
 // TPM Event Log
+// Crypto-agile layout (TCG PC Client PFP): a TCG_PCR_EVENT carrying the
+// Spec ID Event03 header, then one TCG_PCR_EVENT2 per measurement, all
+// little-endian. Records hold digests and a short descriptor, never the
+// measured data, so the log stays a few pages however large the images are.
 typedef struct {
-    TCG_PCR_EVENT* events;      // Array of events
-    uint32_t event_count;       // Number of events
-    uint32_t max_events;        // Maximum events capacity
-    uint8_t* log_buffer;        // Raw log buffer
-    uint32_t log_size;          // Current log size
-    uint32_t max_log_size;      // Maximum log size
+    uint8_t* base;              // Page-backed arena holding the raw log
+    uint32_t size;              // Bytes written
+    uint32_t capacity;          // Bytes allocated, whole pages
+    uint32_t max_size;          // Growth limit
+    uint32_t event_count;       // Records after the Spec ID event
+    uint16_t algs[TPM2_MAX_BANKS];  // Banks in every record, fixed by the header
+    uint32_t alg_count;         // 0 until the first record writes the header
 } TPM2_EVENT_LOG;
 
+#define TPM2_LOG_PAGE_SIZE          4096
+#define TPM2_LOG_INITIAL_PAGES      4       // Room for ~150 two-bank events
+#define TPM2_LOG_MAX_SIZE           (1024 * 1024)
+#define TPM2_LOG_EVENT_MAX          512     // Longer descriptors are cut
+
 // TPM Interface Functions
 
 // TPM Initialization and Management
@@ -185,8 +196,34 @@ int tpm2_get_version(uint32_t* family, uint32_t* level, uint32_t* revision);
 // PCR Operations
 int tpm2_pcr_read(uint32_t pcr_index, uint16_t hash_alg, TPM2_PCR_VALUE* pcr_value);
 int tpm2_pcr_extend(uint32_t pcr_index, uint16_t hash_alg, const uint8_t* digest);
+// Extend several banks of one PCR with a single TPM2_PCR_Extend
+int tpm2_pcr_extend_banks(uint32_t pcr_index, const TPM2_PCR_VALUE* digests, uint32_t digest_count);
+int tpm2_get_active_banks(uint16_t* algs, uint32_t max_algs);
+uint32_t tpm2_digest_size(uint16_t hash_alg);
 int tpm2_pcr_reset(uint32_t pcr_index);
 
+// A measurement waiting to be extended
+typedef struct {
+    uint32_t pcr_index;
+    uint32_t event_type;
+    uint32_t digest_count;
+    TPM2_PCR_VALUE digests[TPM2_MAX_BANKS];
+    uint8_t* event;             // Event data for the log, owned by the queue
+    uint32_t event_size;
+} TPM2_MEASUREMENT;
+
+// Measurement Queue
+// Every measurement is hashed and queued. With deferral on, nothing reaches
+// the TPM until tpm2_flush_measurements(), which extends the queue in order
+// and must run before ExitBootServices(); with it off, each measurement
+// flushes the queue right away. The flush returns -1 if any active bank
+// was left without a real measurement (capped, or the bank list unknown),
+// even though the queue itself was drained.
+void tpm2_defer_measurements(int enable);
+int tpm2_queue_measurement(uint32_t pcr_index, uint32_t event_type, const TPM2_PCR_VALUE* digests, uint32_t digest_count, const void* event, uint32_t event_size);
+int tpm2_flush_measurements(void);
+uint32_t tpm2_pending_measurements(void);
+
 // Measured Boot
 int tpm2_measure_separator(uint32_t pcr_index);
 int tpm2_measure_data(uint32_t pcr_index, uint32_t event_type, const void* data, uint32_t data_size, const char* description);
@@ -194,14 +231,18 @@ int tpm2_measure_file(uint32_t pcr_index, uint32_t event_type, const char* filen
 int tpm2_measure_string(uint32_t pcr_index, uint32_t event_type, const char* string);
 
 // Event Log Management
-int tpm2_event_log_init(TPM2_EVENT_LOG* log, uint32_t max_events, uint32_t max_log_size);
-int tpm2_event_log_add(TPM2_EVENT_LOG* log, uint32_t pcr_index, uint32_t event_type, const void* data, uint32_t data_size, const char* description);
+int tpm2_event_log_init(TPM2_EVENT_LOG* log, uint32_t max_log_size);
+// Append a record for digests that are already known; event is the descriptor
+int tpm2_event_log_add(TPM2_EVENT_LOG* log, uint32_t pcr_index, uint32_t event_type, const TPM2_PCR_VALUE* digests, uint32_t digest_count, const void* event, uint32_t event_size);
 int tpm2_event_log_finalize(TPM2_EVENT_LOG* log);
 void tpm2_event_log_cleanup(TPM2_EVENT_LOG* log);
+// The log of everything extended so far, for handing to the OS. It lives in
+// loader pages that survive ExitBootServices(), but moves when it grows.
+int tpm2_event_log_get(const void** log_base, uint32_t* log_size);
 
 // Attestation and Quotes
 int tpm2_quote_pcrs(const uint32_t* pcr_list, uint32_t pcr_count, const uint8_t* nonce, uint32_t nonce_size, uint8_t* quote, uint32_t* quote_size);
-int tmp2_verify_quote(const uint8_t* quote, uint32_t quote_size, const uint8_t* public_key, uint32_t key_size);
+int tpm2_verify_quote(const uint8_t* quote, uint32_t quote_size, const uint8_t* public_key, uint32_t key_size);
 
 // Random Number Generation
 int tpm2_get_random(uint8_t* buffer, uint32_t num_bytes);
@@ -230,7 +271,6 @@ typedef struct {
     uint32_t measurement_count;
     uint32_t pcr_mask;          // Bitmask of used PCRs
     char boot_path[256];        // Boot path being measured
-    TPM2_EVENT_LOG event_log;   // Event log
 } MeasuredBootContext;
 
 // Measured Boot Functions